@@ -0,0 +1,98 @@
+#include "background_compiler.h"
+#include <algorithm>
+#include <cstdlib>
+#include "logger.h"
+#include "metrics.h"
+#include "trace.h"
+
+namespace rplus {
+
+BackgroundCompiler& BackgroundCompiler::shared() {
+    static BackgroundCompiler* compiler = []() {
+        // Constructed first, so destroyed only after the exit handler
+        // below has stopped the workers using them
+        Tracer::global();
+        runtime_metrics();
+        Logger::instance();
+        // Leave most cores to the threads running bytecode
+        auto* pool = new BackgroundCompiler(std::max(1u, std::thread::hardware_concurrency() / 4));
+        std::atexit([]() { shared().shutdown(); });
+        return pool;
+    }();
+    return *compiler;
+}
+
+BackgroundCompiler::BackgroundCompiler(size_t threads) {
+    for (size_t i = 0; i < std::max<size_t>(threads, 1); ++i) {
+        threads_.emplace_back([this]() { worker(); });
+    }
+}
+
+BackgroundCompiler::~BackgroundCompiler() {
+    shutdown();
+}
+
+void BackgroundCompiler::shutdown() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+        queue_.clear();
+    }
+    work_.notify_all();
+    for (std::thread& thread : threads_) {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+}
+
+void BackgroundCompiler::submit(std::shared_ptr<CompileJob> job) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!stopping_) {
+            queue_.push_back(std::move(job));
+            work_.notify_one();
+            return;
+        }
+    }
+    job->done_.store(true, std::memory_order_release);
+}
+
+void BackgroundCompiler::cancel(const std::shared_ptr<CompileJob>& job) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = std::find(queue_.begin(), queue_.end(), job);
+    if (it != queue_.end()) {
+        queue_.erase(it);
+    }
+}
+
+size_t BackgroundCompiler::queued() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return queue_.size();
+}
+
+void BackgroundCompiler::worker() {
+    Tracer::global().set_thread_name("rplus compiler");
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        work_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+        if (stopping_) {
+            return;
+        }
+        std::shared_ptr<CompileJob> job = std::move(queue_.front());
+        queue_.pop_front();
+        lock.unlock();
+
+        {
+            ScopedTimer timer(runtime_metrics().optimize_seconds);
+            job->result_ = Optimizer(job->snapshot_).optimize();
+        }
+        RPLUS_LOG(LogLevel::DEBUG, "Background compile of function at {} {}",
+                  reinterpret_cast<uintptr_t>(job->snapshot_.baseline),
+                  job->result_ ? "succeeded" : "produced no code");
+        job->done_.store(true, std::memory_order_release);
+        lock.lock();
+    }
+}
+
+} // namespace rplus
@@ -0,0 +1,91 @@
+#ifndef BACKGROUND_COMPILER_H
+#define BACKGROUND_COMPILER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "optimizer.h"
+
+namespace rplus {
+
+/**
+ * Background compilation
+ *
+ * Optimising a function takes far longer than the call that triggered it,
+ * so tier-up hands the work to a pool of compiler threads instead of
+ * stalling the request that happened to cross the threshold. The VM
+ * captures a CompilationSnapshot, submits a CompileJob and carries on in
+ * baseline code. At its next safepoint (a function entry or loop back
+ * edge) it polls its outstanding jobs and installs any finished code.
+ * Nothing on the executing thread ever waits for a compile.
+ *
+ * A job compiles from the bytecode and feedback copied into its snapshot,
+ * never from the VM's own chunks, so it may outlive the VM that submitted
+ * it; the live chunk pointers only name the function the result belongs to.
+ */
+
+class CompileJob {
+public:
+    explicit CompileJob(CompilationSnapshot snapshot) : snapshot_(std::move(snapshot)) {}
+
+    const CompilationSnapshot& snapshot() const { return snapshot_; }
+
+    // Set by the compiler thread; result() may be read once done() is true
+    bool done() const { return done_.load(std::memory_order_acquire); }
+    // Optimised code, or nullptr if the function could not be optimised
+    const std::shared_ptr<OptimizedFunction>& result() const { return result_; }
+
+private:
+    friend class BackgroundCompiler;
+
+    CompilationSnapshot snapshot_;
+    std::shared_ptr<OptimizedFunction> result_;
+    std::atomic<bool> done_{false};
+};
+
+class BackgroundCompiler {
+public:
+    // Process-wide pool shared by all VMs, sized from the hardware. It is
+    // never destroyed, so VMs torn down during static destruction can still
+    // cancel through it; its threads are shut down at exit, before the
+    // tracer, metrics and logger they use.
+    static BackgroundCompiler& shared();
+
+    explicit BackgroundCompiler(size_t threads);
+    ~BackgroundCompiler();
+
+    BackgroundCompiler(const BackgroundCompiler&) = delete;
+    BackgroundCompiler& operator=(const BackgroundCompiler&) = delete;
+
+    // Jobs submitted after shutdown() complete at once with no code
+    void submit(std::shared_ptr<CompileJob> job);
+
+    // Drops job if it has not started. A running job is left to finish on
+    // its own copies; its result is simply never installed.
+    void cancel(const std::shared_ptr<CompileJob>& job);
+
+    // Discards queued jobs and joins the threads once running ones finish.
+    // Idempotent; called by the destructor.
+    void shutdown();
+
+    size_t thread_count() const { return threads_.size(); }
+    size_t queued() const;
+
+private:
+    mutable std::mutex mutex_;
+    std::condition_variable work_;  // jobs queued or stopping
+    std::deque<std::shared_ptr<CompileJob>> queue_;
+    std::vector<std::thread> threads_;
+    bool stopping_ = false;
+
+    void worker();
+};
+
+} // namespace rplus
+
+#endif // BACKGROUND_COMPILER_H
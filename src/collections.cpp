@@ -0,0 +1,195 @@
+#include "collections.h"
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include "native.h"
+#include "rstring.h"
+
+namespace rplus {
+
+// ============================================================================
+// Key Hashing and Equality
+// ============================================================================
+
+uint64_t ValueKeyHash::operator()(const Value& key) const {
+    switch (key.type()) {
+        case Value::Type::NIL:
+            return mix_hash(0x6e696c);
+        case Value::Type::BOOL:
+            return mix_hash(key.as_bool() ? 2 : 1);
+        case Value::Type::NUMBER: {
+            double n = key.as_number();
+            if (n == 0.0) {
+                n = 0.0;  // -0 and +0 are the same key
+            } else if (std::isnan(n)) {
+                return mix_hash(0x7ff8000000000000ULL);
+            }
+            uint64_t bits;
+            std::memcpy(&bits, &n, sizeof(bits));
+            return mix_hash(bits);
+        }
+        case Value::Type::STRING:
+            return key.as_string_object().hash();
+        case Value::Type::OBJECT:
+            return mix_hash(reinterpret_cast<uintptr_t>(key.as_object()));
+    }
+    return 0;
+}
+
+bool ValueKeyEq::operator()(const Value& a, const Value& b) const {
+    if (a.type() != b.type()) {
+        return false;
+    }
+    switch (a.type()) {
+        case Value::Type::NIL:
+            return true;
+        case Value::Type::BOOL:
+            return a.as_bool() == b.as_bool();
+        case Value::Type::NUMBER: {
+            double x = a.as_number();
+            double y = b.as_number();
+            return x == y || (std::isnan(x) && std::isnan(y));
+        }
+        case Value::Type::STRING: {
+            // The table has already matched the full hash
+            const StringObject& x = a.as_string_object();
+            const StringObject& y = b.as_string_object();
+            if (&x == &y) {
+                return true;
+            }
+            return !(x.is_interned() && y.is_interned()) && a.as_string() == b.as_string();
+        }
+        case Value::Type::OBJECT:
+            return a.as_object() == b.as_object();
+    }
+    return false;
+}
+
+// ============================================================================
+// Builtins
+// ============================================================================
+
+namespace {
+
+MapObject& expect_map(const Value& v, const char* builtin) {
+    if (!v.is_object() || v.as_object()->kind() != ObjectKind::MAP) {
+        throw VMException(std::string(builtin) + ": expected a Map");
+    }
+    return static_cast<MapObject&>(*v.as_object());
+}
+
+SetObject& expect_set(const Value& v, const char* builtin) {
+    if (!v.is_object() || v.as_object()->kind() != ObjectKind::SET) {
+        throw VMException(std::string(builtin) + ": expected a Set");
+    }
+    return static_cast<SetObject&>(*v.as_object());
+}
+
+ArrayObject& expect_array(const Value& v, const char* builtin) {
+    if (!v.is_object() || v.as_object()->kind() != ObjectKind::ARRAY) {
+        throw VMException(std::string(builtin) + ": expected an Array");
+    }
+    return static_cast<ArrayObject&>(*v.as_object());
+}
+
+// New string keys are stored interned, so keys equal to a constant share
+// its characters, and interned lookups compare by address
+Value stored_key(const Value& key) {
+    if (!key.is_string() || key.as_string_object().is_interned()) {
+        return key;
+    }
+    return Value(StringTable::global().intern(key.string_ref()));
+}
+
+Value map_new() {
+    return Value(std::shared_ptr<Object>(std::make_shared<MapObject>()));
+}
+
+Value map_get(const Value& map, const Value& key) {
+    const Value* value = expect_map(map, "mapGet").entries.find(key);
+    return value ? *value : Value();
+}
+
+Value map_set(const Value& map, const Value& key, const Value& value) {
+    MapObject& target = expect_map(map, "mapSet");
+    *target.entries.find_or_insert(key, [&key]() { return stored_key(key); }).first = value;
+    return map;
+}
+
+bool map_has(const Value& map, const Value& key) {
+    return expect_map(map, "mapHas").entries.contains(key);
+}
+
+bool map_delete(const Value& map, const Value& key) {
+    return expect_map(map, "mapDelete").entries.erase(key);
+}
+
+double map_size(const Value& map) {
+    return static_cast<double>(expect_map(map, "mapSize").entries.size());
+}
+
+Value set_new() {
+    return Value(std::shared_ptr<Object>(std::make_shared<SetObject>()));
+}
+
+Value set_add(const Value& set, const Value& value) {
+    expect_set(set, "setAdd").members.find_or_insert(value, [&value]() { return stored_key(value); });
+    return set;
+}
+
+bool set_has(const Value& set, const Value& value) {
+    return expect_set(set, "setHas").members.contains(value);
+}
+
+bool set_delete(const Value& set, const Value& value) {
+    return expect_set(set, "setDelete").members.erase(value);
+}
+
+double set_size(const Value& set) {
+    return static_cast<double>(expect_set(set, "setSize").members.size());
+}
+
+Value array_new() {
+    return Value(std::shared_ptr<Object>(std::make_shared<ArrayObject>()));
+}
+
+Value array_push(const Value& array, const Value& value) {
+    expect_array(array, "arrayPush").elements.push_back(value);
+    return array;
+}
+
+Value array_get(const Value& array, double index) {
+    const std::vector<Value>& elements = expect_array(array, "arrayGet").elements;
+    if (!(index >= 0) || index >= static_cast<double>(elements.size())) {
+        return Value();
+    }
+    return elements[static_cast<size_t>(index)];
+}
+
+double array_length(const Value& array) {
+    return static_cast<double>(expect_array(array, "arrayLength").elements.size());
+}
+
+} // namespace
+
+void register_collection_builtins(VirtualMachine& vm) {
+    bind_native<&map_new>(vm, "Map");
+    bind_native<&map_get>(vm, "mapGet");
+    bind_native<&map_set>(vm, "mapSet");
+    bind_native<&map_has>(vm, "mapHas");
+    bind_native<&map_delete>(vm, "mapDelete");
+    bind_native<&map_size>(vm, "mapSize");
+    
+    bind_native<&set_new>(vm, "Set");
+    bind_native<&set_add>(vm, "setAdd");
+    bind_native<&set_has>(vm, "setHas");
+    bind_native<&set_delete>(vm, "setDelete");
+    bind_native<&set_size>(vm, "setSize");
+    
+    bind_native<&array_new>(vm, "Array");
+    bind_native<&array_push>(vm, "arrayPush");
+    bind_native<&array_get>(vm, "arrayGet");
+    bind_native<&array_length>(vm, "arrayLength");
+}
+
+} // namespace rplus
@@ -0,0 +1,56 @@
+#ifndef COLLECTIONS_H
+#define COLLECTIONS_H
+
+#include <cstdint>
+#include <vector>
+#include "object.h"
+#include "swiss_table.h"
+#include "vm.h"
+
+namespace rplus {
+
+// Key hashing for Map and Set. Strings use the hash cached in their
+// StringObject; objects hash by identity.
+struct ValueKeyHash {
+    uint64_t operator()(const Value& key) const;
+};
+
+// SameValueZero key equality: NaN equals NaN, objects compare by identity
+struct ValueKeyEq {
+    bool operator()(const Value& a, const Value& b) const;
+};
+
+struct SetMember {};
+
+// R+ Map: key/value pairs iterated in insertion order
+class MapObject : public Object {
+public:
+    MapObject() : Object(ObjectKind::MAP) {}
+    
+    SwissTable<Value, Value, ValueKeyHash, ValueKeyEq> entries;
+};
+
+// R+ Set: unique values iterated in insertion order
+class SetObject : public Object {
+public:
+    SetObject() : Object(ObjectKind::SET) {}
+    
+    SwissTable<Value, SetMember, ValueKeyHash, ValueKeyEq> members;
+};
+
+// R+ Array: dense sequence of values
+class ArrayObject : public Object {
+public:
+    ArrayObject() : Object(ObjectKind::ARRAY) {}
+    
+    std::vector<Value> elements;
+};
+
+// Register Map, mapGet, mapSet, mapHas, mapDelete, mapSize,
+// Set, setAdd, setHas, setDelete, setSize and
+// Array, arrayPush, arrayGet, arrayLength as native functions
+void register_collection_builtins(VirtualMachine& vm);
+
+} // namespace rplus
+
+#endif // COLLECTIONS_H
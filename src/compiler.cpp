@@ -1,4 +1,7 @@
 #include "compiler.h"
+#include "metrics.h"
+#include "probes.h"
+#include "time_report.h"
 #include <algorithm>
 #include <sstream>
 #include <stdexcept>
@@ -15,19 +18,28 @@ Compiler::Compiler()
 
 // Compile AST to bytecode
 BytecodeModule Compiler::compile(const ASTNode& root) {
+    ScopedTimer timer(runtime_metrics().compile_seconds);
+    PassTimer pass("compile");
     BytecodeModule module;
     current_module_ = &module;
+    RPLUS_PROBE1(compile__start, &root);
     
     try {
         // Process main program
-        visitNode(root);
+        {
+            PassTimer phase("codegen");
+            visitNode(root);
+        }
         
         // Finalize module
+        PassTimer phase("finalize");
         module.finalize();
     } catch (const std::exception& e) {
+        RPLUS_PROBE2(compile__done, &root, 0);
         throw std::runtime_error("Compilation error: " + std::string(e.what()));
     }
     
+    RPLUS_PROBE2(compile__done, &root, 1);
     return module;
 }
 
@@ -86,6 +98,7 @@ void Compiler::visitNode(const ASTNode& node) {
 
 // Visit Program node
 void Compiler::visitProgram(const ProgramNode& node) {
+    PassTimer timer("visitProgram", PassTimer::FLAT);
     for (const auto& stmt : node.statements()) {
         visitNode(*stmt);
     }
@@ -93,6 +106,7 @@ void Compiler::visitProgram(const ProgramNode& node) {
 
 // Visit Function Definition
 void Compiler::visitFunctionDef(const FunctionDefNode& node) {
+    PassTimer timer("visitFunctionDef", PassTimer::FLAT);
     // Create new function
     Function func(node.name(), node.parameters().size());
     func.setParameters(node.parameters());
@@ -126,6 +140,7 @@ void Compiler::visitFunctionDef(const FunctionDefNode& node) {
 
 // Visit Block
 void Compiler::visitBlock(const BlockNode& node) {
+    PassTimer timer("visitBlock", PassTimer::FLAT);
     for (const auto& stmt : node.statements()) {
         visitNode(*stmt);
     }
@@ -133,6 +148,7 @@ void Compiler::visitBlock(const BlockNode& node) {
 
 // Visit Binary Operation
 void Compiler::visitBinaryOp(const BinaryOpNode& node) {
+    PassTimer timer("visitBinaryOp", PassTimer::FLAT);
     // Compile left operand
     visitNode(node.left());
     uint32_t left_reg = current_register_ - 1;
@@ -148,6 +164,7 @@ void Compiler::visitBinaryOp(const BinaryOpNode& node) {
 
 // Visit Unary Operation
 void Compiler::visitUnaryOp(const UnaryOpNode& node) {
+    PassTimer timer("visitUnaryOp", PassTimer::FLAT);
     // Compile operand
     visitNode(node.operand());
     uint32_t reg = current_register_ - 1;
@@ -159,6 +176,7 @@ void Compiler::visitUnaryOp(const UnaryOpNode& node) {
 
 // Visit Literal
 void Compiler::visitLiteral(const LiteralNode& node) {
+    PassTimer timer("visitLiteral", PassTimer::FLAT);
     uint32_t const_index = current_module_->addConstant(node.value());
     emit(OpCode::LoadConst, {const_index});
     allocateRegister();
@@ -166,6 +184,7 @@ void Compiler::visitLiteral(const LiteralNode& node) {
 
 // Visit Identifier
 void Compiler::visitIdentifier(const IdentifierNode& node) {
+    PassTimer timer("visitIdentifier", PassTimer::FLAT);
     // Check if variable exists in current scope
     uint32_t var_index = lookupVariable(node.name());
     if (var_index != UINT32_MAX) {
@@ -178,6 +197,7 @@ void Compiler::visitIdentifier(const IdentifierNode& node) {
 
 // Visit Assignment
 void Compiler::visitAssignment(const AssignmentNode& node) {
+    PassTimer timer("visitAssignment", PassTimer::FLAT);
     // Compile right-hand side
     visitNode(node.value());
     uint32_t value_reg = current_register_ - 1;
@@ -194,6 +214,7 @@ void Compiler::visitAssignment(const AssignmentNode& node) {
 
 // Visit If Statement
 void Compiler::visitIfStatement(const IfStatementNode& node) {
+    PassTimer timer("visitIfStatement", PassTimer::FLAT);
     // Compile condition
     visitNode(node.condition());
     uint32_t cond_reg = current_register_ - 1;
@@ -223,6 +244,7 @@ void Compiler::visitIfStatement(const IfStatementNode& node) {
 
 // Visit While Loop
 void Compiler::visitWhileLoop(const WhileLoopNode& node) {
+    PassTimer timer("visitWhileLoop", PassTimer::FLAT);
     // Mark loop start
     uint32_t loop_label = genLabel();
     markLabel(loop_label);
@@ -247,6 +269,7 @@ void Compiler::visitWhileLoop(const WhileLoopNode& node) {
 
 // Visit For Loop
 void Compiler::visitForLoop(const ForLoopNode& node) {
+    PassTimer timer("visitForLoop", PassTimer::FLAT);
     FunctionScope loop_scope("for_loop", {});
     pushScope(loop_scope);
     
@@ -282,6 +305,7 @@ void Compiler::visitForLoop(const ForLoopNode& node) {
 
 // Visit Function Call
 void Compiler::visitFunctionCall(const FunctionCallNode& node) {
+    PassTimer timer("visitFunctionCall", PassTimer::FLAT);
     // Load arguments
     std::vector<uint32_t> arg_regs;
     for (const auto& arg : node.arguments()) {
@@ -302,6 +326,7 @@ void Compiler::visitFunctionCall(const FunctionCallNode& node) {
 
 // Visit Return Statement
 void Compiler::visitReturnStatement(const ReturnStatementNode& node) {
+    PassTimer timer("visitReturnStatement", PassTimer::FLAT);
     if (node.hasValue()) {
         visitNode(node.value());
         uint32_t ret_reg = current_register_ - 1;
@@ -314,6 +339,7 @@ void Compiler::visitReturnStatement(const ReturnStatementNode& node) {
 
 // Visit Array Literal
 void Compiler::visitArrayLiteral(const ArrayLiteralNode& node) {
+    PassTimer timer("visitArrayLiteral", PassTimer::FLAT);
     // Load each element
     for (const auto& elem : node.elements()) {
         visitNode(*elem);
@@ -326,6 +352,7 @@ void Compiler::visitArrayLiteral(const ArrayLiteralNode& node) {
 
 // Visit Index Access
 void Compiler::visitIndexAccess(const IndexAccessNode& node) {
+    PassTimer timer("visitIndexAccess", PassTimer::FLAT);
     // Compile array expression
     visitNode(node.array());
     uint32_t array_reg = current_register_ - 1;
@@ -538,6 +565,8 @@ std::string Compiler::opcodeToString(OpCode opcode) {
 
 // Optimize bytecode
 void Compiler::optimizeBytecode(BytecodeModule& module) {
+    PassTimer timer("optimize");
+    
     // Perform constant folding
     performConstantFolding(module);
     
@@ -550,18 +579,24 @@ void Compiler::optimizeBytecode(BytecodeModule& module) {
 
 // Perform constant folding optimization
 void Compiler::performConstantFolding(BytecodeModule& module) {
+    PassTimer timer("performConstantFolding");
+    
     // Implementation for constant folding
     // This would analyze bytecode and combine constant operations
 }
 
 // Remove unreachable code
 void Compiler::removeDeadCode(BytecodeModule& module) {
+    PassTimer timer("removeDeadCode");
+    
     // Implementation for dead code elimination
     // This would remove instructions that are never reached
 }
 
 // Inline simple function calls
 void Compiler::inlineSimpleFunctions(BytecodeModule& module) {
+    PassTimer timer("inlineSimpleFunctions");
+    
     // Implementation for function inlining
     // This would replace calls to small functions with inline code
 }
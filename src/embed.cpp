@@ -0,0 +1,329 @@
+#include "embed.h"
+#include <algorithm>
+#include "logger.h"
+#include "metrics.h"
+#include "trace.h"
+
+namespace rplus {
+
+namespace {
+
+std::unordered_map<std::string, size_t> build_export_table(const std::vector<std::string>& names) {
+    std::unordered_map<std::string, size_t> exports;
+    exports.reserve(names.size());
+    for (size_t i = 0; i < names.size(); ++i) {
+        exports.emplace(names[i], i);
+    }
+    return exports;
+}
+
+// The given order if it is a permutation of [0, count), otherwise module order
+std::vector<size_t> checked_layout_order(std::vector<size_t> order, size_t count) {
+    std::vector<uint8_t> seen(count, 0);
+    bool valid = order.size() == count;
+    for (size_t i = 0; valid && i < order.size(); ++i) {
+        valid = order[i] < count && !seen[order[i]];
+        if (valid) {
+            seen[order[i]] = 1;
+        }
+    }
+    if (!order.empty() && !valid) {
+        throw VMException("Layout order is not a permutation of the functions");
+    }
+    if (order.empty()) {
+        order.resize(count);
+        for (size_t i = 0; i < count; ++i) {
+            order[i] = i;
+        }
+    }
+    return order;
+}
+
+} // namespace
+
+// ============================================================================
+// CompiledModule
+// ============================================================================
+
+size_t CompiledModule::Builder::add_function(const std::string& name, Chunk chunk) {
+    return add_function(name, std::make_shared<const Chunk>(std::move(chunk)));
+}
+
+size_t CompiledModule::Builder::add_function(const std::string& name,
+                                             std::shared_ptr<const Chunk> chunk) {
+    if (!chunk) {
+        throw VMException("Function '" + name + "' has no body");
+    }
+    names_.push_back(name);
+    functions_.push_back(std::move(chunk));
+    return functions_.size() - 1;
+}
+
+std::shared_ptr<const CompiledModule> CompiledModule::Builder::build() {
+    std::shared_ptr<const CompiledModule> module(
+        new CompiledModule(std::move(names_), std::move(functions_), std::move(layout_order_)));
+    names_.clear();
+    functions_.clear();
+    layout_order_.clear();
+    return module;
+}
+
+CompiledModule::CompiledModule(std::vector<std::string> names,
+                               std::vector<std::shared_ptr<const Chunk>> functions,
+                               std::vector<size_t> layout_order)
+    : names_(std::move(names)),
+      functions_(std::move(functions)),
+      exports_(build_export_table(names_)),
+      layout_order_(checked_layout_order(std::move(layout_order), names_.size())) {
+}
+
+CompiledModule::CompiledModule(std::vector<std::string> names, std::unique_ptr<FunctionSource> source)
+    : names_(std::move(names)),
+      exports_(build_export_table(names_)),
+      layout_order_(checked_layout_order({}, names_.size())),
+      source_(std::move(source)),
+      lazy_(new LazyFunction[names_.size()]) {
+}
+
+std::shared_ptr<const CompiledModule> CompiledModule::lazy(std::vector<std::string> names,
+                                                           std::unique_ptr<FunctionSource> source) {
+    return std::shared_ptr<const CompiledModule>(
+        new CompiledModule(std::move(names), std::move(source)));
+}
+
+const Chunk& CompiledModule::load(size_t index) const {
+    LazyFunction& function = lazy_[index];
+    function.last_used.store(epoch(), std::memory_order_relaxed);
+    if (function.loaded.load(std::memory_order_acquire)) {
+        return function.chunk;
+    }
+    
+    std::lock_guard<std::mutex> lock(function.mutex);
+    if (!function.loaded.load(std::memory_order_relaxed)) {
+        function.chunk = source_->load(index);
+        function.bytes = function.chunk.memory_bytes();
+        function.loaded.store(true, std::memory_order_release);
+        
+        size_t total = loaded_bytes_.fetch_add(function.bytes, std::memory_order_relaxed) +
+                       function.bytes;
+        size_t budget = memory_budget();
+        if (budget != 0 && total > budget) {
+            over_budget_.store(true, std::memory_order_relaxed);
+        }
+    }
+    return function.chunk;
+}
+
+/**
+ * Flushes cold function bodies until the module is within its budget.
+ * Runs only while no context is executing the module; otherwise the
+ * request is left pending and retried by the next invoke() to finish.
+ * Contexts drop what they derived from the flushed bodies at their next
+ * invoke().
+ * @param min_idle_epochs Collections a function must have gone unused
+ * @return Number of functions flushed
+ */
+size_t CompiledModule::collect(uint32_t min_idle_epochs) const {
+    std::unique_lock<std::shared_mutex> lock(execution_mutex_, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        // Keep the most aggressive of the deferred requests
+        uint32_t pending = pending_collect_.load(std::memory_order_relaxed);
+        while (min_idle_epochs < pending &&
+               !pending_collect_.compare_exchange_weak(pending, min_idle_epochs,
+                                                       std::memory_order_relaxed)) {
+        }
+        return 0;
+    }
+    TraceSpan span("gc", "flush bytecode");
+    pending_collect_.store(NO_PENDING_COLLECT, std::memory_order_relaxed);
+    over_budget_.store(false, std::memory_order_relaxed);
+    uint64_t now = epoch_.load(std::memory_order_relaxed);
+    
+    size_t budget = memory_budget();
+    if (!source_ || budget == 0 || loaded_bytes() <= budget) {
+        epoch_.store(now + 1, std::memory_order_release);
+        return 0;
+    }
+    
+    // Least recently used first
+    std::vector<size_t> candidates;
+    for (size_t i = 0; i < names_.size(); ++i) {
+        const LazyFunction& function = lazy_[i];
+        if (function.loaded.load(std::memory_order_relaxed) &&
+            now - function.last_used.load(std::memory_order_relaxed) >= min_idle_epochs) {
+            candidates.push_back(i);
+        }
+    }
+    std::sort(candidates.begin(), candidates.end(), [this](size_t a, size_t b) {
+        return lazy_[a].last_used.load(std::memory_order_relaxed) <
+               lazy_[b].last_used.load(std::memory_order_relaxed);
+    });
+    
+    size_t flushed = 0;
+    size_t freed = 0;
+    for (size_t index : candidates) {
+        if (loaded_bytes() <= budget) {
+            break;
+        }
+        LazyFunction& function = lazy_[index];
+        std::lock_guard<std::mutex> function_lock(function.mutex);
+        function.loaded.store(false, std::memory_order_relaxed);
+        function.chunk = Chunk();
+        loaded_bytes_.fetch_sub(function.bytes, std::memory_order_relaxed);
+        freed += function.bytes;
+        function.bytes = 0;
+        ++flushed;
+    }
+    
+    // Functions still in use can keep the module over budget; the next
+    // invoke() to finish tries again
+    if (loaded_bytes() > budget) {
+        over_budget_.store(true, std::memory_order_relaxed);
+    }
+    
+    // Published last, so a context that sees the new epoch sees the flushes
+    epoch_.store(now + 1, std::memory_order_release);
+    if (flushed > 0) {
+        RPLUS_LOG(LogLevel::DEBUG, "Flushed {} cold functions ({} bytes), {} of {} bytes loaded",
+                  flushed, freed, loaded_bytes(), budget);
+    }
+    return flushed;
+}
+
+FunctionHandle CompiledModule::lookup(const std::string& name) const {
+    auto it = exports_.find(name);
+    if (it == exports_.end()) {
+        return FunctionHandle{};
+    }
+    return FunctionHandle{it->second};
+}
+
+// ============================================================================
+// ExecutionContext
+// ============================================================================
+
+ExecutionContext::ExecutionContext(std::shared_ptr<const CompiledModule> module)
+    : module_(std::move(module)) {
+    if (!module_) {
+        throw VMException("ExecutionContext requires a module");
+    }
+    
+    // OP_CALL indexes the module's functions in export order. Functions a
+    // lazy module has not loaded yet are resolved on their first call.
+    epoch_ = module_->epoch();
+    std::vector<const Chunk*> functions;
+    functions.reserve(module_->function_count());
+    for (size_t i = 0; i < module_->function_count(); ++i) {
+        FunctionHandle fn{i};
+        functions.push_back(module_->is_loaded(fn) ? &module_->function(fn) : nullptr);
+    }
+    vm_.set_function_table(std::move(functions));
+    const CompiledModule* module_ptr = module_.get();
+    vm_.set_function_resolver([module_ptr](size_t index) {
+        return &module_ptr->function(FunctionHandle{index});
+    });
+    // Host calls by index (timer callbacks) go through invoke() so they
+    // see the module's current bodies
+    vm_.set_function_caller([this](size_t index, const Value* args, size_t argc) {
+        return invoke(FunctionHandle{index}, args, argc);
+    });
+}
+
+/**
+ * Runs an exported function on this context's VM. Arguments occupy the
+ * first stack slots, where the function body reads them as locals. From
+ * a native inside another invoke(), the call runs on top of the caller's
+ * stack and frames instead, which are left as they were.
+ * @param fn Handle obtained from lookup()
+ * @param args Argument values
+ * @param argc Number of arguments
+ * @return The value left on top of the stack, or nil
+ */
+Value ExecutionContext::invoke(FunctionHandle fn, const Value* args, size_t argc) {
+    if (!fn.valid() || fn.index >= module_->function_count()) {
+        throw VMException("Invalid function handle");
+    }
+    
+    // A collection cannot flush bodies while any context is inside
+    // invoke(); natives re-entering this context already hold the lock
+    std::shared_lock<std::shared_mutex> execution;
+    if (module_->source_ && depth_ == 0) {
+        execution = std::shared_lock<std::shared_mutex>(module_->execution_mutex_);
+        if (module_->epoch() != epoch_) {
+            sync_flushed();
+        }
+    }
+    struct Depth {
+        size_t& depth;
+        explicit Depth(size_t& d) : depth(d) { ++depth; }
+        ~Depth() { --depth; }
+    } depth(depth_);
+    
+    ScopedTimer timer(runtime_metrics().invoke_seconds);
+    TraceSpan span("vm", "invoke");
+    if (span.active()) {
+        span.set_detail(module_->function_name(fn));
+    }
+    if (depth_ > 1) {
+        if (argc > UINT8_MAX) {
+            throw VMException("Too many call arguments");
+        }
+        const Chunk& function = module_->function(fn);
+        size_t base = vm_.stack_size();
+        try {
+            for (size_t i = 0; i < argc; ++i) {
+                vm_.push(args[i]);
+            }
+        } catch (...) {
+            while (vm_.stack_size() > base) {
+                vm_.pop();
+            }
+            throw;
+        }
+        return vm_.call_function(function, static_cast<uint8_t>(argc));
+    }
+    
+    vm_.clear_stack();
+    vm_.set_error("");
+    for (size_t i = 0; i < argc; ++i) {
+        vm_.push(args[i]);
+    }
+    
+    vm_.execute(module_->function(fn));
+    if (vm_.has_error()) {
+        throw VMException(vm_.get_error());
+    }
+    
+    Value result = vm_.stack_size() > 0 ? vm_.pop() : Value();
+    if (execution.owns_lock()) {
+        uint32_t pending = module_->pending_collect_.exchange(CompiledModule::NO_PENDING_COLLECT,
+                                                              std::memory_order_relaxed);
+        if (pending != CompiledModule::NO_PENDING_COLLECT) {
+            execution.unlock();
+            module_->collect(pending);
+        } else if (module_->over_budget_.load(std::memory_order_relaxed)) {
+            execution.unlock();
+            module_->collect();
+        }
+    }
+    return result;
+}
+
+/**
+ * Catches up with collections since the last invoke(): forgets what the
+ * VM derived from flushed bodies, and empties the function table so each
+ * function is resolved again on its next call, which marks it as used in
+ * the current epoch.
+ */
+void ExecutionContext::sync_flushed() {
+    for (size_t i = 0; i < module_->function_count(); ++i) {
+        FunctionHandle fn{i};
+        if (!module_->is_loaded(fn)) {
+            vm_.discard_function(*module_->function_address(fn));
+        }
+    }
+    vm_.set_function_table(std::vector<const Chunk*>(module_->function_count(), nullptr));
+    epoch_ = module_->epoch();
+}
+
+} // namespace rplus
@@ -0,0 +1,190 @@
+#ifndef EMBED_H
+#define EMBED_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <type_traits>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "native.h"
+#include "vm.h"
+
+namespace rplus {
+
+/**
+ * Embedding API
+ *
+ * A CompiledModule is built once and is immutable afterwards, so a single
+ * instance can be shared by any number of threads. Each thread runs it
+ * through its own ExecutionContext, which owns the mutable VM state.
+ *
+ *     auto module = builder.build();                 // once
+ *     ExecutionContext ctx(module);                  // per thread
+ *     FunctionHandle fn = ctx.lookup("handle");      // once per context
+ *     Value result = ctx.invoke(fn, Value(1.0));     // many times
+ *
+ * A module loaded lazily (see image.h) can also bound the memory its
+ * function bodies use. With a budget set, collect() flushes functions
+ * that went unused for COLD_EPOCHS collections, least recently used
+ * first, until the module is back under budget. A flushed function is
+ * decoded again from its source on its next call. Contexts pick up
+ * flushes at their next invoke(), dropping feedback and optimised code
+ * derived from the old bytecode.
+ */
+
+// Collections a function must go unused before it can be flushed
+constexpr uint32_t COLD_EPOCHS = 2;
+
+// Resolved exported function; cheap to copy and valid for the module's lifetime
+struct FunctionHandle {
+    size_t index = SIZE_MAX;
+    bool valid() const { return index != SIZE_MAX; }
+};
+
+class CompiledModule {
+public:
+    // Supplies function bodies on first use, for modules loaded lazily
+    // (see image.h). load() may be called from any thread, once per
+    // function unless it throws, and again each time it is flushed.
+    class FunctionSource {
+    public:
+        virtual ~FunctionSource() = default;
+        virtual Chunk load(size_t index) const = 0;
+    };
+    
+    class Builder {
+    public:
+        // Add an exported function; returns its index
+        size_t add_function(const std::string& name, Chunk chunk);
+        // Add an exported function whose body may be shared with other
+        // exports or modules (see linker.h)
+        size_t add_function(const std::string& name, std::shared_ptr<const Chunk> chunk);
+        // Order to store the bodies in, as a permutation of the function
+        // indexes; module order by default (see layout_order())
+        void set_layout_order(std::vector<size_t> order) { layout_order_ = std::move(order); }
+        std::shared_ptr<const CompiledModule> build();
+        
+    private:
+        std::vector<std::string> names_;
+        std::vector<std::shared_ptr<const Chunk>> functions_;
+        std::vector<size_t> layout_order_;
+    };
+    
+    // Function bodies are decoded on first use
+    static std::shared_ptr<const CompiledModule> lazy(std::vector<std::string> names,
+                                                      std::unique_ptr<FunctionSource> source);
+    
+    FunctionHandle lookup(const std::string& name) const;
+    
+    // Loads the function first if the module is lazy. The body stays
+    // valid until the next collect() that flushes it.
+    const Chunk& function(FunctionHandle fn) const {
+        return source_ ? load(fn.index) : *functions_[fn.index];
+    }
+    // Where function(fn) is or will be, without loading it
+    const Chunk* function_address(FunctionHandle fn) const {
+        return source_ ? &lazy_[fn.index].chunk : functions_[fn.index].get();
+    }
+    bool is_loaded(FunctionHandle fn) const {
+        return !source_ || lazy_[fn.index].loaded.load(std::memory_order_acquire);
+    }
+    const std::string& function_name(FunctionHandle fn) const { return names_[fn.index]; }
+    size_t function_count() const { return names_.size(); }
+    // Function indexes in the order their bodies are stored (and written
+    // to images), hottest first after layout (see layout.h). Indexes
+    // themselves never change.
+    const std::vector<size_t>& layout_order() const { return layout_order_; }
+    
+    // Bytes of loaded function bodies a lazy module may keep; 0 (the
+    // default) means unlimited. Exceeding it makes the next invoke() on
+    // any context collect.
+    void set_memory_budget(size_t bytes) const { budget_.store(bytes, std::memory_order_relaxed); }
+    size_t memory_budget() const { return budget_.load(std::memory_order_relaxed); }
+    size_t loaded_bytes() const { return loaded_bytes_.load(std::memory_order_relaxed); }
+    // Collections so far
+    uint64_t epoch() const { return epoch_.load(std::memory_order_acquire); }
+    
+    // Starts a new epoch and, if over budget, flushes functions idle for
+    // at least min_idle_epochs. While any context is running the module
+    // the collection is deferred to the next invoke() that finishes.
+    // Returns the number of functions flushed.
+    size_t collect(uint32_t min_idle_epochs = COLD_EPOCHS) const;
+    
+private:
+    friend class ExecutionContext;
+    
+    CompiledModule(std::vector<std::string> names, std::vector<std::shared_ptr<const Chunk>> functions,
+                   std::vector<size_t> layout_order);
+    CompiledModule(std::vector<std::string> names, std::unique_ptr<FunctionSource> source);
+    
+    struct LazyFunction {
+        std::mutex mutex;
+        std::atomic<bool> loaded{false};
+        std::atomic<uint64_t> last_used{0};  // epoch of the last load or resolve
+        size_t bytes = 0;
+        Chunk chunk;
+    };
+    
+    const Chunk& load(size_t index) const;
+    
+    const std::vector<std::string> names_;
+    const std::vector<std::shared_ptr<const Chunk>> functions_;
+    const std::unordered_map<std::string, size_t> exports_;
+    const std::vector<size_t> layout_order_;
+    const std::unique_ptr<FunctionSource> source_;
+    const std::unique_ptr<LazyFunction[]> lazy_;
+    
+    // Shared by running contexts, exclusive while collecting
+    mutable std::shared_mutex execution_mutex_;
+    mutable std::atomic<uint64_t> epoch_{0};
+    mutable std::atomic<size_t> loaded_bytes_{0};
+    mutable std::atomic<size_t> budget_{0};
+    mutable std::atomic<bool> over_budget_{false};
+    // Smallest min_idle_epochs of collections deferred because the module
+    // was running; NO_PENDING_COLLECT if none
+    static constexpr uint32_t NO_PENDING_COLLECT = UINT32_MAX;
+    mutable std::atomic<uint32_t> pending_collect_{NO_PENDING_COLLECT};
+};
+
+// Per-thread execution state for a shared CompiledModule. Not thread-safe:
+// create one context per thread (or guard it externally).
+class ExecutionContext {
+public:
+    explicit ExecutionContext(std::shared_ptr<const CompiledModule> module);
+    
+    ExecutionContext(const ExecutionContext&) = delete;
+    ExecutionContext& operator=(const ExecutionContext&) = delete;
+    
+    FunctionHandle lookup(const std::string& name) const { return module_->lookup(name); }
+    
+    // Run an exported function with the given arguments and return its
+    // result. Natives may call back in while an invoke() is running.
+    Value invoke(FunctionHandle fn, const Value* args, size_t argc);
+    
+    template <typename... Args>
+    Value invoke(FunctionHandle fn, Args&&... args) {
+        const Value values[] = {
+            Value(), ValueTraits<std::decay_t<Args>>::to_value(std::forward<Args>(args))...};
+        return invoke(fn, values + 1, sizeof...(Args));
+    }
+    
+    const CompiledModule& module() const { return *module_; }
+    VirtualMachine& vm() { return vm_; }
+    
+private:
+    void sync_flushed();
+    
+    std::shared_ptr<const CompiledModule> module_;
+    VirtualMachine vm_;
+    uint64_t epoch_ = 0;  // module epoch the function table matches
+    size_t depth_ = 0;    // invoke() calls in progress, from natives re-entering
+};
+
+} // namespace rplus
+
+#endif // EMBED_H
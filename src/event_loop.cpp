@@ -0,0 +1,685 @@
+#include "event_loop.h"
+#include "trace.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <stdexcept>
+#include <unordered_map>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define RPLUS_HAVE_IO_URING 1
+#endif
+
+namespace rplus {
+
+// ============================================================================
+// BufferPool
+// ============================================================================
+
+BufferPool::BufferPool(size_t count, size_t buffer_size)
+    : memory_(nullptr), count_(count), buffer_size_(buffer_size) {
+    if (count_ > 0) {
+        // Page aligned so registered buffers pin whole pages
+        size_t bytes = (count_ * buffer_size_ + 4095) & ~static_cast<size_t>(4095);
+        memory_ = static_cast<char*>(std::aligned_alloc(4096, bytes));
+        if (!memory_) {
+            throw std::bad_alloc();
+        }
+    }
+    free_.reserve(count_);
+    for (size_t i = count_; i > 0; --i) {
+        free_.push_back(static_cast<int32_t>(i - 1));
+    }
+}
+
+BufferPool::~BufferPool() {
+    std::free(memory_);
+}
+
+int32_t BufferPool::acquire() {
+    if (free_.empty()) {
+        return -1;
+    }
+    int32_t index = free_.back();
+    free_.pop_back();
+    return index;
+}
+
+void BufferPool::release(int32_t index) {
+    free_.push_back(index);
+}
+
+std::vector<struct iovec> BufferPool::iovecs() const {
+    std::vector<struct iovec> result(count_);
+    for (size_t i = 0; i < count_; ++i) {
+        result[i].iov_base = data(static_cast<int32_t>(i));
+        result[i].iov_len = buffer_size_;
+    }
+    return result;
+}
+
+namespace {
+
+// ============================================================================
+// io_uring backend
+// ============================================================================
+
+#ifdef RPLUS_HAVE_IO_URING
+
+// Marks the CQE of an internal timeout SQE
+constexpr uint64_t TIMEOUT_USER_DATA = UINT64_MAX;
+
+int io_uring_setup(unsigned entries, struct io_uring_params* params) {
+    return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+}
+
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+                   const void* arg, size_t arg_size) {
+    return static_cast<int>(::syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                                      flags, arg, arg_size));
+}
+
+int io_uring_register(int fd, unsigned opcode, const void* arg, unsigned count) {
+    return static_cast<int>(::syscall(__NR_io_uring_register, fd, opcode, arg, count));
+}
+
+class IoUringBackend : public IoBackend {
+public:
+    ~IoUringBackend() override {
+        if (sqes_) {
+            ::munmap(sqes_, sqes_size_);
+        }
+        if (cq_ring_ && cq_ring_ != sq_ring_) {
+            ::munmap(cq_ring_, cq_ring_size_);
+        }
+        if (sq_ring_) {
+            ::munmap(sq_ring_, sq_ring_size_);
+        }
+        if (ring_fd_ >= 0) {
+            ::close(ring_fd_);
+        }
+    }
+
+    // Returns false if the kernel lacks io_uring or the operations used here
+    bool init(unsigned entries) {
+        struct io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        ring_fd_ = io_uring_setup(entries, &params);
+        if (ring_fd_ < 0) {
+            return false;
+        }
+        // FAST_POLL (5.7) implies READ/WRITE/ACCEPT/SEND/RECV are all present
+        if (!(params.features & IORING_FEAT_FAST_POLL)) {
+            return false;
+        }
+        ext_arg_ = (params.features & IORING_FEAT_EXT_ARG) != 0;
+
+        sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single_mmap) {
+            sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+        }
+
+        sq_ring_ = map(sq_ring_size_, IORING_OFF_SQ_RING);
+        if (!sq_ring_) {
+            return false;
+        }
+        cq_ring_ = single_mmap ? sq_ring_ : map(cq_ring_size_, IORING_OFF_CQ_RING);
+        if (!cq_ring_) {
+            return false;
+        }
+        sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+        sqes_ = static_cast<struct io_uring_sqe*>(map(sqes_size_, IORING_OFF_SQES));
+        if (!sqes_) {
+            return false;
+        }
+
+        char* sq = static_cast<char*>(sq_ring_);
+        sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        sq_entries_ = params.sq_entries;
+
+        char* cq = static_cast<char*>(cq_ring_);
+        cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        sqe_tail_ = *sq_tail_;
+        return true;
+    }
+
+    const char* name() const override { return "io_uring"; }
+
+    void submit(const IoRequest& request) override {
+        struct io_uring_sqe* sqe = next_sqe();
+        bool fixed = buffers_registered_ && request.buffer_index >= 0;
+        sqe->fd = request.fd;
+        sqe->user_data = request.user_data;
+        sqe->addr = reinterpret_cast<uint64_t>(request.buffer);
+        sqe->len = request.length;
+
+        switch (request.op) {
+            case IoOp::READ:
+            case IoOp::WRITE:
+                if (request.op == IoOp::READ) {
+                    sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+                } else {
+                    sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+                }
+                // An offset of -1 means the current file position
+                sqe->off = request.offset < 0 ? static_cast<uint64_t>(-1)
+                                              : static_cast<uint64_t>(request.offset);
+                if (fixed) {
+                    sqe->buf_index = static_cast<uint16_t>(request.buffer_index);
+                }
+                break;
+            case IoOp::ACCEPT:
+                sqe->opcode = IORING_OP_ACCEPT;
+                sqe->addr = 0;
+                sqe->len = 0;
+                sqe->accept_flags = SOCK_CLOEXEC;
+                break;
+            case IoOp::RECV:
+                sqe->opcode = IORING_OP_RECV;
+                break;
+            case IoOp::SEND:
+                sqe->opcode = IORING_OP_SEND;
+                sqe->msg_flags = MSG_NOSIGNAL;
+                break;
+        }
+    }
+
+    void flush() override {
+        unsigned to_submit = publish();
+        if (to_submit > 0) {
+            enter(to_submit, 0, 0, nullptr, 0);
+        }
+    }
+
+    size_t wait(IoCompletion* completions, size_t max, int timeout_ms) override {
+        size_t count = reap(completions, max);
+        if (count > 0 || timeout_ms == 0) {
+            flush();
+            return count > 0 ? count : reap(completions, max);
+        }
+
+        struct __kernel_timespec ts;
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = static_cast<long long>(timeout_ms % 1000) * 1000000;
+
+        unsigned flags = IORING_ENTER_GETEVENTS;
+        const void* arg = nullptr;
+        size_t arg_size = 0;
+        struct io_uring_getevents_arg getevents;
+        if (timeout_ms > 0 && ext_arg_) {
+            std::memset(&getevents, 0, sizeof(getevents));
+            getevents.ts = reinterpret_cast<uint64_t>(&ts);
+            flags |= IORING_ENTER_EXT_ARG;
+            arg = &getevents;
+            arg_size = sizeof(getevents);
+        } else if (timeout_ms > 0) {
+            // Pre-5.11 kernels: a timeout SQE that also completes as soon as
+            // any other operation does
+            timeout_ts_ = ts;
+            struct io_uring_sqe* sqe = next_sqe();
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->fd = -1;
+            sqe->addr = reinterpret_cast<uint64_t>(&timeout_ts_);
+            sqe->len = 1;
+            sqe->off = 1;
+            sqe->user_data = TIMEOUT_USER_DATA;
+        }
+
+        enter(publish(), 1, flags, arg, arg_size);
+        return reap(completions, max);
+    }
+
+    bool register_buffers(const BufferPool& pool) override {
+        if (pool.count() == 0 || pool.count() > UINT16_MAX) {
+            return false;
+        }
+        std::vector<struct iovec> iovecs = pool.iovecs();
+        // Fails with ENOMEM under a low RLIMIT_MEMLOCK; unfixed ops still work
+        buffers_registered_ = io_uring_register(ring_fd_, IORING_REGISTER_BUFFERS, iovecs.data(),
+                                                static_cast<unsigned>(iovecs.size())) == 0;
+        return buffers_registered_;
+    }
+
+private:
+    int ring_fd_ = -1;
+    bool ext_arg_ = false;
+    bool buffers_registered_ = false;
+
+    void* sq_ring_ = nullptr;
+    void* cq_ring_ = nullptr;
+    size_t sq_ring_size_ = 0;
+    size_t cq_ring_size_ = 0;
+    struct io_uring_sqe* sqes_ = nullptr;
+    size_t sqes_size_ = 0;
+
+    unsigned* sq_head_ = nullptr;
+    unsigned* sq_tail_ = nullptr;
+    unsigned* sq_array_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned sq_entries_ = 0;
+    unsigned sqe_tail_ = 0;  // next SQE to hand out; published on flush
+
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned cq_mask_ = 0;
+    struct io_uring_cqe* cqes_ = nullptr;
+
+    struct __kernel_timespec timeout_ts_;
+
+    void* map(size_t size, off_t offset) {
+        void* ptr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           ring_fd_, offset);
+        return ptr == MAP_FAILED ? nullptr : ptr;
+    }
+
+    int enter(unsigned to_submit, unsigned min_complete, unsigned flags,
+              const void* arg, size_t arg_size) {
+        int result;
+        do {
+            result = io_uring_enter(ring_fd_, to_submit, min_complete, flags, arg, arg_size);
+        } while (result < 0 && errno == EINTR && to_submit > 0);
+        return result;
+    }
+
+    struct io_uring_sqe* next_sqe() {
+        // Ring full: submit what is queued so the kernel consumes it
+        while (sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+            flush();
+        }
+        struct io_uring_sqe* sqe = &sqes_[sqe_tail_ & sq_mask_];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe_tail_++;
+        return sqe;
+    }
+
+    // Make SQEs handed out since the last publish visible to the kernel
+    unsigned publish() {
+        unsigned tail = *sq_tail_;
+        unsigned count = sqe_tail_ - tail;
+        for (; tail != sqe_tail_; ++tail) {
+            sq_array_[tail & sq_mask_] = tail & sq_mask_;
+        }
+        __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+        return count;
+    }
+
+    size_t reap(IoCompletion* completions, size_t max) {
+        unsigned head = *cq_head_;
+        unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        size_t count = 0;
+        while (head != tail && count < max) {
+            const struct io_uring_cqe& cqe = cqes_[head & cq_mask_];
+            if (cqe.user_data != TIMEOUT_USER_DATA) {
+                completions[count++] = IoCompletion{cqe.user_data, cqe.res};
+            }
+            head++;
+        }
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+        return count;
+    }
+};
+
+#endif // RPLUS_HAVE_IO_URING
+
+// ============================================================================
+// epoll backend
+// ============================================================================
+
+class EpollBackend : public IoBackend {
+public:
+    EpollBackend() : epoll_fd_(::epoll_create1(EPOLL_CLOEXEC)) {
+        if (epoll_fd_ < 0) {
+            throw std::runtime_error(std::string("epoll_create1: ") + std::strerror(errno));
+        }
+    }
+
+    ~EpollBackend() override {
+        ::close(epoll_fd_);
+    }
+
+    const char* name() const override { return "epoll"; }
+
+    void submit(const IoRequest& request) override {
+        switch (request.op) {
+            case IoOp::READ:
+            case IoOp::WRITE:
+                // Regular files are always "ready" to epoll (and cannot be
+                // registered with it), so file I/O completes synchronously
+                ready_.push_back(IoCompletion{request.user_data, perform(request)});
+                break;
+            case IoOp::ACCEPT:
+            case IoOp::RECV:
+                fds_[request.fd].readers.push_back(request);
+                update_interest(request.fd);
+                break;
+            case IoOp::SEND:
+                fds_[request.fd].writers.push_back(request);
+                update_interest(request.fd);
+                break;
+        }
+    }
+
+    // Operations are registered as they are submitted
+    void flush() override {}
+
+    size_t wait(IoCompletion* completions, size_t max, int timeout_ms) override {
+        // epoll_wait on an empty set still sleeps, which timer waits rely on
+        if (ready_.empty()) {
+            poll(timeout_ms);
+        } else if (!fds_.empty()) {
+            poll(0);
+        }
+
+        size_t count = std::min(max, ready_.size());
+        std::copy(ready_.begin(), ready_.begin() + static_cast<std::ptrdiff_t>(count), completions);
+        ready_.erase(ready_.begin(), ready_.begin() + static_cast<std::ptrdiff_t>(count));
+        return count;
+    }
+
+private:
+    struct FdState {
+        std::deque<IoRequest> readers;
+        std::deque<IoRequest> writers;
+        uint32_t events = 0;  // currently registered interest, 0 if none
+    };
+
+    int epoll_fd_;
+    std::unordered_map<int, FdState> fds_;
+    std::vector<IoCompletion> ready_;
+
+    static int32_t perform(const IoRequest& request) {
+        ssize_t result = -1;
+        switch (request.op) {
+            case IoOp::READ:
+                result = request.offset < 0
+                    ? ::read(request.fd, request.buffer, request.length)
+                    : ::pread(request.fd, request.buffer, request.length, request.offset);
+                break;
+            case IoOp::WRITE:
+                result = request.offset < 0
+                    ? ::write(request.fd, request.buffer, request.length)
+                    : ::pwrite(request.fd, request.buffer, request.length, request.offset);
+                break;
+            case IoOp::ACCEPT:
+                result = ::accept4(request.fd, nullptr, nullptr, SOCK_CLOEXEC);
+                break;
+            case IoOp::RECV:
+                result = ::recv(request.fd, request.buffer, request.length, MSG_DONTWAIT);
+                break;
+            case IoOp::SEND:
+                result = ::send(request.fd, request.buffer, request.length,
+                                MSG_DONTWAIT | MSG_NOSIGNAL);
+                break;
+        }
+        return result < 0 ? -errno : static_cast<int32_t>(result);
+    }
+
+    // Complete queued operations in order until one would block
+    void drain(std::deque<IoRequest>& queue) {
+        while (!queue.empty()) {
+            int32_t result = perform(queue.front());
+            if (result == -EAGAIN || result == -EWOULDBLOCK || result == -EINTR) {
+                return;
+            }
+            ready_.push_back(IoCompletion{queue.front().user_data, result});
+            queue.pop_front();
+        }
+    }
+
+    void update_interest(int fd) {
+        auto it = fds_.find(fd);
+        FdState& state = it->second;
+        uint32_t events = (state.readers.empty() ? 0u : static_cast<uint32_t>(EPOLLIN)) |
+                          (state.writers.empty() ? 0u : static_cast<uint32_t>(EPOLLOUT));
+        if (events == state.events) {
+            return;
+        }
+
+        struct epoll_event event;
+        event.events = events;
+        event.data.fd = fd;
+        int op = state.events == 0 ? EPOLL_CTL_ADD : (events == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD);
+        if (::epoll_ctl(epoll_fd_, op, fd, &event) != 0 && op != EPOLL_CTL_DEL) {
+            // Not pollable (or closed): fail every operation queued on it
+            int32_t error = -errno;
+            for (const IoRequest& request : state.readers) {
+                ready_.push_back(IoCompletion{request.user_data, error});
+            }
+            for (const IoRequest& request : state.writers) {
+                ready_.push_back(IoCompletion{request.user_data, error});
+            }
+            if (state.events != 0) {
+                ::epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+            }
+            fds_.erase(it);
+            return;
+        }
+        if (events == 0) {
+            fds_.erase(it);
+        } else {
+            state.events = events;
+        }
+    }
+
+    void poll(int timeout_ms) {
+        struct epoll_event events[64];
+        int count = ::epoll_wait(epoll_fd_, events, 64, timeout_ms);
+        for (int i = 0; i < count; ++i) {
+            int fd = events[i].data.fd;
+            auto it = fds_.find(fd);
+            if (it == fds_.end()) {
+                continue;
+            }
+            uint32_t flags = events[i].events;
+            if (flags & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                drain(it->second.readers);
+            }
+            if (flags & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+                drain(it->second.writers);
+            }
+            update_interest(fd);
+        }
+    }
+};
+
+} // namespace
+
+std::unique_ptr<IoBackend> make_io_backend(unsigned entries, bool force_epoll) {
+#ifdef RPLUS_HAVE_IO_URING
+    if (!force_epoll) {
+        auto backend = std::make_unique<IoUringBackend>();
+        if (backend->init(entries)) {
+            return backend;
+        }
+    }
+#else
+    (void)entries;
+    (void)force_epoll;
+#endif
+    return std::make_unique<EpollBackend>();
+}
+
+// ============================================================================
+// EventLoop
+// ============================================================================
+
+EventLoop::EventLoop(Options options)
+    : backend_(make_io_backend(options.queue_entries, options.force_epoll)),
+      buffers_(options.buffer_count, options.buffer_size),
+      fixed_buffers_(backend_->register_buffers(buffers_)),
+      completions_(MAX_BATCH),
+      timers_(monotonic_ms()) {
+}
+
+uint64_t EventLoop::monotonic_ms() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+void EventLoop::submit(IoOp op, int fd, void* buffer, uint32_t length, int64_t offset,
+                       int32_t buffer_index, Callback callback) {
+    uint32_t slot;
+    if (!free_slots_.empty()) {
+        slot = free_slots_.back();
+        free_slots_.pop_back();
+        callbacks_[slot] = std::move(callback);
+    } else {
+        slot = static_cast<uint32_t>(callbacks_.size());
+        callbacks_.push_back(std::move(callback));
+    }
+    pending_++;
+    backend_->submit(IoRequest{op, fd, buffer, length, offset, buffer_index, slot});
+}
+
+void EventLoop::read(int fd, void* buffer, uint32_t length, int64_t offset, Callback callback) {
+    submit(IoOp::READ, fd, buffer, length, offset, -1, std::move(callback));
+}
+
+void EventLoop::write(int fd, const void* buffer, uint32_t length, int64_t offset,
+                      Callback callback) {
+    submit(IoOp::WRITE, fd, const_cast<void*>(buffer), length, offset, -1, std::move(callback));
+}
+
+void EventLoop::read_fixed(int fd, int32_t buffer, uint32_t length, int64_t offset,
+                           Callback callback) {
+    submit(IoOp::READ, fd, buffers_.data(buffer), length, offset, buffer, std::move(callback));
+}
+
+void EventLoop::write_fixed(int fd, int32_t buffer, uint32_t length, int64_t offset,
+                            Callback callback) {
+    submit(IoOp::WRITE, fd, buffers_.data(buffer), length, offset, buffer, std::move(callback));
+}
+
+void EventLoop::accept(int listen_fd, Callback callback) {
+    submit(IoOp::ACCEPT, listen_fd, nullptr, 0, 0, -1, std::move(callback));
+}
+
+void EventLoop::recv(int fd, void* buffer, uint32_t length, Callback callback) {
+    submit(IoOp::RECV, fd, buffer, length, 0, -1, std::move(callback));
+}
+
+void EventLoop::send(int fd, const void* buffer, uint32_t length, Callback callback) {
+    submit(IoOp::SEND, fd, const_cast<void*>(buffer), length, 0, -1, std::move(callback));
+}
+
+uint64_t EventLoop::set_timer(uint64_t delay_ms, TimerCallback callback) {
+    // Schedule relative to the current time, not the wheel's last tick
+    uint64_t now = monotonic_ms();
+    if (now > timers_.now()) {
+        delay_ms += now - timers_.now();
+    }
+    uint64_t id = timers_.schedule(delay_ms);
+    uint32_t index = TimerWheel::index_of(id);
+    if (index >= timer_callbacks_.size()) {
+        timer_callbacks_.resize(index + 1);
+    }
+    timer_callbacks_[index] = std::move(callback);
+    return id;
+}
+
+bool EventLoop::cancel_timer(uint64_t id) {
+    if (timers_.cancel(id)) {
+        timer_callbacks_[TimerWheel::index_of(id)] = nullptr;
+        return true;
+    }
+    for (auto& entry : firing_) {
+        if (entry.first == id && entry.second) {
+            entry.second = nullptr;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Advances the timer wheel to the current time and runs everything that
+ * expired. Callbacks are taken out of the table before any of them runs,
+ * since a callback may schedule timers that reuse the freed slots.
+ */
+size_t EventLoop::run_timers() {
+    if (timers_.empty()) {
+        return 0;
+    }
+    TraceSpan span("event_loop", "timers");
+    expired_.clear();
+    if (timers_.advance(monotonic_ms(), expired_) == 0) {
+        return 0;
+    }
+
+    firing_.clear();
+    for (uint64_t id : expired_) {
+        firing_.emplace_back(id, std::move(timer_callbacks_[TimerWheel::index_of(id)]));
+        timer_callbacks_[TimerWheel::index_of(id)] = nullptr;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < firing_.size(); ++i) {
+        if (firing_[i].second) {
+            TimerCallback callback = std::move(firing_[i].second);
+            firing_[i].second = nullptr;
+            callback();
+            count++;
+        }
+    }
+    firing_.clear();
+    return count;
+}
+
+size_t EventLoop::run_once(int timeout_ms) {
+    TraceSpan span("event_loop", "iteration");
+    size_t ran = run_timers();
+    if (pending_ == 0 && timers_.empty()) {
+        backend_->flush();
+        return ran;
+    }
+
+    // Don't sleep past the next timer, or at all if timers just ran
+    int64_t wait = ran > 0 ? 0 : timeout_ms;
+    int64_t next_timer = timers_.next_timeout();
+    if (next_timer >= 0 && (wait < 0 || next_timer < wait)) {
+        wait = next_timer;
+    }
+
+    size_t count;
+    {
+        TraceSpan io_wait("io", "wait");
+        count = backend_->wait(completions_.data(), completions_.size(),
+                               static_cast<int>(std::min<int64_t>(wait, INT32_MAX)));
+    }
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t slot = static_cast<uint32_t>(completions_[i].user_data);
+        // Free the slot first: the callback may queue follow-up operations
+        Callback callback = std::move(callbacks_[slot]);
+        callbacks_[slot] = nullptr;
+        free_slots_.push_back(slot);
+        pending_--;
+        callback(completions_[i].result);
+    }
+    return ran + count + run_timers();
+}
+
+void EventLoop::run() {
+    stopped_ = false;
+    while (!stopped_ && (pending_ > 0 || !timers_.empty())) {
+        run_once(-1);
+    }
+}
+
+} // namespace rplus
@@ -0,0 +1,186 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+#include <sys/uio.h>
+#include "timer_wheel.h"
+
+namespace rplus {
+
+/**
+ * Asynchronous I/O
+ *
+ * All I/O is completion based: an operation is queued, and its callback
+ * runs from EventLoop::run_once with the syscall's result (a byte count,
+ * an accepted fd, or -errno).
+ *
+ * Two backends implement IoBackend. The io_uring backend places queued
+ * operations in the submission ring and hands the whole batch to the
+ * kernel with a single io_uring_enter, which also waits for completions.
+ * The epoll backend is used when io_uring is unavailable (old kernel,
+ * seccomp, or compiled without <linux/io_uring.h>) and emulates
+ * completions by waiting for readiness and then issuing the syscall.
+ *
+ * Timers share the loop: the wait for I/O is bounded by the next timer
+ * deadline, and timers that expire are run as one batch per iteration.
+ */
+
+enum class IoOp : uint8_t {
+    READ,    // pread, or read at the current position when offset < 0
+    WRITE,   // pwrite, or write at the current position when offset < 0
+    ACCEPT,
+    RECV,
+    SEND
+};
+
+struct IoRequest {
+    IoOp op;
+    int fd;
+    void* buffer;
+    uint32_t length;
+    int64_t offset;
+    int32_t buffer_index;  // BufferPool index for READ/WRITE, or -1
+    uint64_t user_data;
+};
+
+struct IoCompletion {
+    uint64_t user_data;
+    int32_t result;
+};
+
+/**
+ * Fixed-size I/O buffers allocated once up front
+ *
+ * The io_uring backend registers the whole pool with the kernel, so reads
+ * and writes into pool buffers skip the per-operation page pinning.
+ */
+class BufferPool {
+public:
+    BufferPool(size_t count, size_t buffer_size);
+    ~BufferPool();
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    // Index of a free buffer, or -1 if all are in use
+    int32_t acquire();
+    void release(int32_t index);
+
+    char* data(int32_t index) const { return memory_ + static_cast<size_t>(index) * buffer_size_; }
+    size_t buffer_size() const { return buffer_size_; }
+    size_t count() const { return count_; }
+    size_t available() const { return free_.size(); }
+
+    std::vector<struct iovec> iovecs() const;
+
+private:
+    char* memory_;
+    size_t count_;
+    size_t buffer_size_;
+    std::vector<int32_t> free_;
+};
+
+class IoBackend {
+public:
+    virtual ~IoBackend() = default;
+
+    virtual const char* name() const = 0;
+
+    // Queue an operation. Nothing reaches the kernel until flush or wait.
+    virtual void submit(const IoRequest& request) = 0;
+
+    // Submit queued operations without waiting
+    virtual void flush() = 0;
+
+    // Submit queued operations and collect up to max completions, waiting
+    // up to timeout_ms for the first one (-1 waits indefinitely)
+    virtual size_t wait(IoCompletion* completions, size_t max, int timeout_ms) = 0;
+
+    // Register pool buffers for fixed-buffer reads and writes. Returns
+    // false if the backend has no use for them or registration failed.
+    virtual bool register_buffers(const BufferPool& /*pool*/) { return false; }
+};
+
+// io_uring when the kernel supports it, epoll otherwise
+std::unique_ptr<IoBackend> make_io_backend(unsigned entries, bool force_epoll = false);
+
+class EventLoop {
+public:
+    using Callback = std::function<void(int32_t result)>;
+    using TimerCallback = std::function<void()>;
+
+    struct Options {
+        unsigned queue_entries = 256;
+        size_t buffer_count = 64;
+        size_t buffer_size = 16 * 1024;
+        bool force_epoll = false;
+    };
+
+    EventLoop() : EventLoop(Options()) {}
+    explicit EventLoop(Options options);
+
+    const char* backend_name() const { return backend_->name(); }
+    bool fixed_buffers() const { return fixed_buffers_; }
+    BufferPool& buffers() { return buffers_; }
+
+    void read(int fd, void* buffer, uint32_t length, int64_t offset, Callback callback);
+    void write(int fd, const void* buffer, uint32_t length, int64_t offset, Callback callback);
+    // Read into / write from a pool buffer
+    void read_fixed(int fd, int32_t buffer, uint32_t length, int64_t offset, Callback callback);
+    void write_fixed(int fd, int32_t buffer, uint32_t length, int64_t offset, Callback callback);
+    void accept(int listen_fd, Callback callback);
+    void recv(int fd, void* buffer, uint32_t length, Callback callback);
+    void send(int fd, const void* buffer, uint32_t length, Callback callback);
+
+    // Run callback once, delay_ms from now. Returns an id for cancel_timer.
+    uint64_t set_timer(uint64_t delay_ms, TimerCallback callback);
+    // Returns false if the timer already ran or was cancelled
+    bool cancel_timer(uint64_t id);
+    size_t timer_count() const { return timers_.size(); }
+
+    // Submit everything queued, wait up to timeout_ms for completions or
+    // the next timer, and run the callbacks of both. Returns the number of
+    // callbacks run.
+    size_t run_once(int timeout_ms);
+
+    // Run until no operations or timers are pending, or stop() is called
+    void run();
+    void stop() { stopped_ = true; }
+
+    size_t pending() const { return pending_; }
+
+private:
+    static constexpr size_t MAX_BATCH = 256;
+
+    std::unique_ptr<IoBackend> backend_;
+    BufferPool buffers_;
+    bool fixed_buffers_;
+    bool stopped_ = false;
+
+    // Callbacks indexed by user_data
+    std::vector<Callback> callbacks_;
+    std::vector<uint32_t> free_slots_;
+    size_t pending_ = 0;
+
+    std::vector<IoCompletion> completions_;
+
+    TimerWheel timers_;
+    std::vector<TimerCallback> timer_callbacks_;  // indexed by TimerWheel::index_of(id)
+    std::vector<uint64_t> expired_;
+    // Batch being run; cancel_timer clears entries that have not run yet
+    std::vector<std::pair<uint64_t, TimerCallback>> firing_;
+
+    static uint64_t monotonic_ms();
+    size_t run_timers();
+    void submit(IoOp op, int fd, void* buffer, uint32_t length, int64_t offset,
+                int32_t buffer_index, Callback callback);
+};
+
+} // namespace rplus
+
+#endif // EVENT_LOOP_H
@@ -0,0 +1,243 @@
+#include "feedback.h"
+#include "object.h"
+#include <algorithm>
+#include <cstdio>
+
+namespace rplus {
+
+FeedbackType feedback_type(const Value& value) {
+    switch (value.type()) {
+        case Value::Type::NIL: return FeedbackType::NIL;
+        case Value::Type::BOOL: return FeedbackType::BOOL;
+        case Value::Type::NUMBER: return FeedbackType::NUMBER;
+        case Value::Type::STRING: return FeedbackType::STRING;
+        case Value::Type::OBJECT:
+            switch (value.as_object()->kind()) {
+                case ObjectKind::MAP: return FeedbackType::MAP;
+                case ObjectKind::SET: return FeedbackType::SET;
+                case ObjectKind::ARRAY: return FeedbackType::ARRAY;
+            }
+            break;
+    }
+    return FeedbackType::NIL;
+}
+
+const char* feedback_type_name(FeedbackType type) {
+    switch (type) {
+        case FeedbackType::NIL: return "nil";
+        case FeedbackType::BOOL: return "bool";
+        case FeedbackType::NUMBER: return "number";
+        case FeedbackType::STRING: return "string";
+        case FeedbackType::MAP: return "map";
+        case FeedbackType::SET: return "set";
+        case FeedbackType::ARRAY: return "array";
+    }
+    return "?";
+}
+
+const char* feedback_state_name(FeedbackState state) {
+    switch (state) {
+        case FeedbackState::UNINITIALIZED: return "uninitialized";
+        case FeedbackState::MONOMORPHIC: return "monomorphic";
+        case FeedbackState::POLYMORPHIC: return "polymorphic";
+        case FeedbackState::MEGAMORPHIC: return "megamorphic";
+    }
+    return "?";
+}
+
+size_t instruction_length(OpCode op) {
+    switch (op) {
+        case OpCode::OP_CONSTANT:
+        case OpCode::OP_DEFINE_GLOBAL:
+        case OpCode::OP_GET_GLOBAL:
+        case OpCode::OP_SET_GLOBAL:
+        case OpCode::OP_GET_LOCAL:
+        case OpCode::OP_SET_LOCAL:
+        case OpCode::OP_GUARD_NUMBERS:
+        case OpCode::OP_INLINE_RETURN:
+            return 2;
+        case OpCode::OP_JUMP:
+        case OpCode::OP_JUMP_IF_FALSE:
+        case OpCode::OP_JUMP_IF_TRUE:
+        case OpCode::OP_LOOP:
+        case OpCode::OP_JUMP_BACK:
+        case OpCode::OP_CALL:
+        case OpCode::OP_CALL_NATIVE:
+            return 3;
+        default:
+            return 1;
+    }
+}
+
+// ============================================================================
+// Feedback Slots
+// ============================================================================
+
+/**
+ * Records a new observation, moving the slot one step down the lattice
+ * when it no longer fits the current state
+ */
+void FeedbackSlot::add(uint64_t key) {
+    if (count < MAX_ENTRIES) {
+        entries[count++] = Entry{key, 1};
+        state = count == 1 ? FeedbackState::MONOMORPHIC : FeedbackState::POLYMORPHIC;
+    } else {
+        state = FeedbackState::MEGAMORPHIC;
+    }
+}
+
+bool FeedbackSlot::monomorphic_types(FeedbackType& left, FeedbackType& right) const {
+    if (state != FeedbackState::MONOMORPHIC ||
+        (kind != FeedbackSiteKind::BINARY && kind != FeedbackSiteKind::COMPARE)) {
+        return false;
+    }
+    left = static_cast<FeedbackType>(entries[0].key >> 8);
+    right = static_cast<FeedbackType>(entries[0].key & 0xff);
+    return true;
+}
+
+// ============================================================================
+// Feedback Vectors
+// ============================================================================
+
+namespace {
+
+bool site_kind(OpCode op, FeedbackSiteKind& kind) {
+    switch (op) {
+        case OpCode::OP_ADD:
+        case OpCode::OP_SUBTRACT:
+        case OpCode::OP_MULTIPLY:
+        case OpCode::OP_DIVIDE:
+        case OpCode::OP_MODULO:
+            kind = FeedbackSiteKind::BINARY;
+            return true;
+        case OpCode::OP_NEGATE:
+            kind = FeedbackSiteKind::UNARY;
+            return true;
+        case OpCode::OP_EQUAL:
+        case OpCode::OP_NOT_EQUAL:
+        case OpCode::OP_LESS:
+        case OpCode::OP_LESS_EQUAL:
+        case OpCode::OP_GREATER:
+        case OpCode::OP_GREATER_EQUAL:
+            kind = FeedbackSiteKind::COMPARE;
+            return true;
+        case OpCode::OP_CALL:
+            kind = FeedbackSiteKind::CALL;
+            return true;
+        case OpCode::OP_CALL_NATIVE:
+            kind = FeedbackSiteKind::CALL_NATIVE;
+            return true;
+        case OpCode::OP_JUMP_IF_FALSE:
+        case OpCode::OP_JUMP_IF_TRUE:
+            kind = FeedbackSiteKind::BRANCH;
+            return true;
+        default:
+            return false;
+    }
+}
+
+const char* opcode_name(OpCode op) {
+    switch (op) {
+        case OpCode::OP_ADD: return "ADD";
+        case OpCode::OP_SUBTRACT: return "SUBTRACT";
+        case OpCode::OP_MULTIPLY: return "MULTIPLY";
+        case OpCode::OP_DIVIDE: return "DIVIDE";
+        case OpCode::OP_MODULO: return "MODULO";
+        case OpCode::OP_NEGATE: return "NEGATE";
+        case OpCode::OP_EQUAL: return "EQUAL";
+        case OpCode::OP_NOT_EQUAL: return "NOT_EQUAL";
+        case OpCode::OP_LESS: return "LESS";
+        case OpCode::OP_LESS_EQUAL: return "LESS_EQUAL";
+        case OpCode::OP_GREATER: return "GREATER";
+        case OpCode::OP_GREATER_EQUAL: return "GREATER_EQUAL";
+        case OpCode::OP_CALL: return "CALL";
+        case OpCode::OP_CALL_NATIVE: return "CALL_NATIVE";
+        case OpCode::OP_JUMP_IF_FALSE: return "JUMP_IF_FALSE";
+        case OpCode::OP_JUMP_IF_TRUE: return "JUMP_IF_TRUE";
+        default: return "?";
+    }
+}
+
+} // anonymous namespace
+
+FeedbackVector::FeedbackVector(const Chunk& chunk)
+    : slot_index_(chunk.size(), NO_SLOT) {
+    const std::vector<uint8_t>& code = chunk.code();
+    for (size_t offset = 0; offset < code.size();) {
+        OpCode op = static_cast<OpCode>(code[offset]);
+        FeedbackSiteKind kind;
+        if (site_kind(op, kind)) {
+            FeedbackSlot slot;
+            slot.offset = static_cast<uint32_t>(offset);
+            slot.kind = kind;
+            slot_index_[offset] = static_cast<uint32_t>(slots_.size());
+            slots_.push_back(slot);
+            opcodes_.push_back(op);
+        }
+        offset += instruction_length(op);
+    }
+}
+
+std::vector<size_t> FeedbackVector::state_counts() const {
+    std::vector<size_t> counts(4, 0);
+    for (const FeedbackSlot& slot : slots_) {
+        ++counts[static_cast<size_t>(slot.state)];
+    }
+    return counts;
+}
+
+std::string FeedbackVector::dump(const std::string& name) const {
+    std::vector<size_t> counts = state_counts();
+    std::string out = "feedback " + name + ": " + std::to_string(slots_.size()) + " sites";
+    for (size_t i = 0; i < counts.size(); ++i) {
+        out += ", " + std::to_string(counts[i]) + " " +
+               feedback_state_name(static_cast<FeedbackState>(i));
+    }
+    out += "\n";
+
+    char line[64];
+    for (size_t i = 0; i < slots_.size(); ++i) {
+        const FeedbackSlot& slot = slots_[i];
+        std::snprintf(line, sizeof(line), "  %04u %-14s %-14s %8llu", slot.offset,
+                      opcode_name(opcodes_[i]), feedback_state_name(slot.state),
+                      static_cast<unsigned long long>(slot.hits));
+        out += line;
+
+        std::vector<FeedbackSlot::Entry> entries(slot.entries, slot.entries + slot.count);
+        std::sort(entries.begin(), entries.end(),
+                  [](const FeedbackSlot::Entry& a, const FeedbackSlot::Entry& b) {
+                      return a.hits > b.hits;
+                  });
+        for (const FeedbackSlot::Entry& entry : entries) {
+            out += "  ";
+            switch (slot.kind) {
+                case FeedbackSiteKind::UNARY:
+                    out += feedback_type_name(static_cast<FeedbackType>(entry.key));
+                    break;
+                case FeedbackSiteKind::BINARY:
+                case FeedbackSiteKind::COMPARE:
+                    out += feedback_type_name(static_cast<FeedbackType>(entry.key >> 8));
+                    out += ",";
+                    out += feedback_type_name(static_cast<FeedbackType>(entry.key & 0xff));
+                    break;
+                case FeedbackSiteKind::CALL:
+                    std::snprintf(line, sizeof(line), "fn@%llx",
+                                  static_cast<unsigned long long>(entry.key));
+                    out += line;
+                    break;
+                case FeedbackSiteKind::CALL_NATIVE:
+                    out += "native#" + std::to_string(entry.key);
+                    break;
+                case FeedbackSiteKind::BRANCH:
+                    out += entry.key == FeedbackSlot::BRANCH_TAKEN ? "taken" : "not-taken";
+                    break;
+            }
+            out += "=" + std::to_string(entry.hits);
+        }
+        out += "\n";
+    }
+    return out;
+}
+
+} // namespace rplus
@@ -0,0 +1,181 @@
+#ifndef FEEDBACK_H
+#define FEEDBACK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "vm.h"
+
+namespace rplus {
+
+class OptimizedFunction;
+
+/**
+ * Type feedback
+ *
+ * A FeedbackVector holds one slot per feedback site in a function's
+ * bytecode: every arithmetic and comparison instruction, every call and
+ * every conditional jump.
+ * While feedback is enabled on a VM, each site records what it actually
+ * sees (the operand types, or the call target) and moves through
+ *
+ *     UNINITIALIZED -> MONOMORPHIC -> POLYMORPHIC -> MEGAMORPHIC
+ *
+ * as the number of distinct observations grows. A slot keeps up to
+ * MAX_ENTRIES observations with hit counts; past that it only counts.
+ * Optimising tiers read the vectors to decide what to specialise and
+ * inline, code layout reads branch directions to find cold blocks; dump()
+ * shows how type-stable a function is.
+ */
+
+// Operand type as seen by feedback. Objects are split by kind, which is
+// the closest thing to a shape the object model has.
+enum class FeedbackType : uint8_t {
+    NIL,
+    BOOL,
+    NUMBER,
+    STRING,
+    MAP,
+    SET,
+    ARRAY
+};
+
+FeedbackType feedback_type(const Value& value);
+const char* feedback_type_name(FeedbackType type);
+
+enum class FeedbackState : uint8_t {
+    UNINITIALIZED,
+    MONOMORPHIC,
+    POLYMORPHIC,
+    MEGAMORPHIC
+};
+
+const char* feedback_state_name(FeedbackState state);
+
+enum class FeedbackSiteKind : uint8_t {
+    UNARY,       // OP_NEGATE
+    BINARY,      // arithmetic
+    COMPARE,     // equality and ordering
+    CALL,        // OP_CALL; targets are Chunk addresses
+    CALL_NATIVE, // OP_CALL_NATIVE; targets are native indexes
+    BRANCH       // conditional jumps; keys are BRANCH_TAKEN and BRANCH_NOT_TAKEN
+};
+
+struct FeedbackSlot {
+    static constexpr size_t MAX_ENTRIES = 4;
+
+    struct Entry {
+        uint64_t key;  // operand types (see type_key) or call target
+        uint64_t hits;
+    };
+
+    uint32_t offset;  // bytecode offset of the instruction
+    FeedbackSiteKind kind;
+    FeedbackState state = FeedbackState::UNINITIALIZED;
+    uint8_t count = 0;  // valid entries
+    Entry entries[MAX_ENTRIES] = {};
+    uint64_t hits = 0;  // all executions, including megamorphic ones
+
+    void record(uint64_t key) {
+        ++hits;
+        for (uint8_t i = 0; i < count; ++i) {
+            if (entries[i].key == key) {
+                ++entries[i].hits;
+                return;
+            }
+        }
+        add(key);
+    }
+
+    // Operand types packed into an entry key
+    static uint64_t type_key(FeedbackType operand) {
+        return static_cast<uint64_t>(operand);
+    }
+    static uint64_t type_key(FeedbackType left, FeedbackType right) {
+        return static_cast<uint64_t>(left) << 8 | static_cast<uint64_t>(right);
+    }
+
+    static constexpr uint64_t BRANCH_NOT_TAKEN = 0;
+    static constexpr uint64_t BRANCH_TAKEN = 1;
+
+    // Hits recorded under key
+    uint64_t hits_for(uint64_t key) const {
+        for (uint8_t i = 0; i < count; ++i) {
+            if (entries[i].key == key) {
+                return entries[i].hits;
+            }
+        }
+        return 0;
+    }
+
+    // Only observation of a monomorphic binary or compare site
+    bool monomorphic_types(FeedbackType& left, FeedbackType& right) const;
+
+private:
+    void add(uint64_t key);
+};
+
+class FeedbackVector {
+public:
+    // Finds the feedback sites in chunk's bytecode
+    explicit FeedbackVector(const Chunk& chunk);
+
+    // Slot for the instruction at offset, or nullptr if it is not a site
+    FeedbackSlot* slot(size_t offset) {
+        if (offset >= slot_index_.size() || slot_index_[offset] == NO_SLOT) {
+            return nullptr;
+        }
+        return &slots_[slot_index_[offset]];
+    }
+    const FeedbackSlot* slot(size_t offset) const {
+        return const_cast<FeedbackVector*>(this)->slot(offset);
+    }
+
+    const std::vector<FeedbackSlot>& slots() const { return slots_; }
+
+    // Number of slots in each state, indexed by FeedbackState
+    std::vector<size_t> state_counts() const;
+
+    // One line per site: offset, opcode, state and observations by hit count
+    std::string dump(const std::string& name) const;
+
+    void note_invocation(uint8_t argc) {
+        ++invocations_;
+        if (arity_ == UNKNOWN_ARITY) {
+            arity_ = argc;
+        } else if (arity_ != argc) {
+            arity_ = VARIABLE_ARITY;
+        }
+    }
+    uint32_t invocations() const { return invocations_; }
+    // Argument count of every call so far, or negative if unknown or varying
+    int arity() const { return arity_; }
+
+    // Tiering state, maintained by VirtualMachine
+    std::shared_ptr<OptimizedFunction> optimized;  // installed optimised code
+    uint32_t next_tier_up = 0;                     // invocation count of the next attempt
+    uint8_t optimizations = 0;                     // attempts so far
+    bool compiling = false;                        // background compile outstanding
+    uint32_t back_edges = 0;                       // OP_LOOP executions in baseline code
+    uint32_t next_osr = 0;                         // back-edge count of the next OSR attempt
+
+private:
+    static constexpr uint32_t NO_SLOT = UINT32_MAX;
+    static constexpr int UNKNOWN_ARITY = -1;
+    static constexpr int VARIABLE_ARITY = -2;
+
+    std::vector<FeedbackSlot> slots_;
+    std::vector<uint32_t> slot_index_;  // by bytecode offset
+    std::vector<OpCode> opcodes_;       // by slot, for dump()
+    uint32_t invocations_ = 0;
+    int arity_ = UNKNOWN_ARITY;
+};
+
+// Size in bytes of the instruction starting with op, operands included
+size_t instruction_length(OpCode op);
+
+} // namespace rplus
+
+#endif // FEEDBACK_H
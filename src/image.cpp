@@ -0,0 +1,524 @@
+#include "image.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+#include "feedback.h"
+#include "logger.h"
+#include "rstring.h"
+
+namespace rplus {
+
+namespace {
+
+constexpr char MAGIC[4] = {'R', 'P', 'X', 'I'};
+constexpr size_t HEADER_SIZE = 40;
+constexpr size_t DIRECTORY_ENTRY_SIZE = 24;
+constexpr size_t POOL_ENTRY_SIZE = 16;
+constexpr size_t BODY_HEADER_SIZE = 12;
+
+enum class ConstantType : uint8_t {
+    NIL,
+    BOOL,
+    NUMBER,
+    STRING
+};
+
+void set_error(std::string* error, const std::string& message) {
+    if (error) {
+        *error = message;
+    }
+}
+
+uint32_t read_u32(const uint8_t* p) {
+    return static_cast<uint32_t>(p[0]) | static_cast<uint32_t>(p[1]) << 8 |
+           static_cast<uint32_t>(p[2]) << 16 | static_cast<uint32_t>(p[3]) << 24;
+}
+
+uint64_t read_u64(const uint8_t* p) {
+    return static_cast<uint64_t>(read_u32(p)) | static_cast<uint64_t>(read_u32(p + 4)) << 32;
+}
+
+// Byte buffer with little-endian appends and back-patching
+class ImageWriter {
+public:
+    std::string out;
+
+    size_t size() const { return out.size(); }
+    void u8(uint8_t value) { out.push_back(static_cast<char>(value)); }
+    void u32(uint32_t value) {
+        for (int i = 0; i < 4; ++i) u8(static_cast<uint8_t>(value >> (8 * i)));
+    }
+    void u64(uint64_t value) {
+        u32(static_cast<uint32_t>(value));
+        u32(static_cast<uint32_t>(value >> 32));
+    }
+    void bytes(const void* data, size_t size) { out.append(static_cast<const char*>(data), size); }
+    void zeros(size_t count) { out.append(count, '\0'); }
+    void align() { zeros((8 - out.size() % 8) % 8); }
+
+    void patch_u32(size_t at, uint32_t value) {
+        for (int i = 0; i < 4; ++i) out[at + i] = static_cast<char>(value >> (8 * i));
+    }
+    void patch_u64(size_t at, uint64_t value) {
+        patch_u32(at, static_cast<uint32_t>(value));
+        patch_u32(at + 4, static_cast<uint32_t>(value >> 32));
+    }
+};
+
+/**
+ * Function source backed by a read-only mapping of the image. Holds the
+ * directory and pool index in place; nothing else is touched until a
+ * function is loaded.
+ */
+class MappedImage : public CompiledModule::FunctionSource {
+public:
+    MappedImage(const uint8_t* data, size_t size) : data_(data), size_(size) {}
+    ~MappedImage() override { munmap(const_cast<uint8_t*>(data_), size_); }
+
+    MappedImage(const MappedImage&) = delete;
+    MappedImage& operator=(const MappedImage&) = delete;
+
+    // Checks the header, directory and pool index; fills in names
+    bool open(std::vector<std::string>& names, std::string* error);
+
+    Chunk load(size_t index) const override;
+
+private:
+    const uint8_t* data_;
+    size_t size_;
+    uint32_t function_count_ = 0;
+    uint32_t constant_count_ = 0;
+    uint64_t directory_ = 0;
+    uint64_t pool_ = 0;
+
+    bool in_bounds(uint64_t offset, uint64_t length) const {
+        return offset <= size_ && length <= size_ - offset;
+    }
+    const uint8_t* directory_entry(size_t index) const {
+        return data_ + directory_ + index * DIRECTORY_ENTRY_SIZE;
+    }
+    const uint8_t* pool_entry(size_t index) const {
+        return data_ + pool_ + index * POOL_ENTRY_SIZE;
+    }
+    Value constant(uint32_t index) const;
+};
+
+bool MappedImage::open(std::vector<std::string>& names, std::string* error) {
+    if (size_ < HEADER_SIZE || std::memcmp(data_, MAGIC, sizeof(MAGIC)) != 0) {
+        set_error(error, "not a bytecode image");
+        return false;
+    }
+    if (read_u32(data_ + 4) != IMAGE_VERSION) {
+        set_error(error, "unsupported image version " + std::to_string(read_u32(data_ + 4)));
+        return false;
+    }
+    function_count_ = read_u32(data_ + 8);
+    constant_count_ = read_u32(data_ + 12);
+    directory_ = read_u64(data_ + 16);
+    pool_ = read_u64(data_ + 24);
+    if (read_u64(data_ + 32) != size_ ||
+        !in_bounds(directory_, uint64_t{function_count_} * DIRECTORY_ENTRY_SIZE) ||
+        !in_bounds(pool_, uint64_t{constant_count_} * POOL_ENTRY_SIZE)) {
+        set_error(error, "truncated or malformed image");
+        return false;
+    }
+
+    names.reserve(function_count_);
+    for (size_t i = 0; i < function_count_; ++i) {
+        const uint8_t* entry = directory_entry(i);
+        uint64_t name_offset = read_u64(entry + 8);
+        uint32_t name_size = read_u32(entry + 20);
+        if (!in_bounds(read_u64(entry), read_u32(entry + 16)) || !in_bounds(name_offset, name_size)) {
+            set_error(error, "function " + std::to_string(i) + " lies outside the image");
+            return false;
+        }
+        names.emplace_back(reinterpret_cast<const char*>(data_ + name_offset), name_size);
+    }
+    for (size_t i = 0; i < constant_count_; ++i) {
+        const uint8_t* entry = pool_entry(i);
+        uint8_t type = entry[0];
+        uint32_t size = read_u32(entry + 4);
+        uint64_t offset = read_u64(entry + 8);
+        bool valid = type <= static_cast<uint8_t>(ConstantType::STRING) &&
+                     (type != static_cast<uint8_t>(ConstantType::NUMBER) || size == sizeof(double)) &&
+                     (type < static_cast<uint8_t>(ConstantType::NUMBER) || in_bounds(offset, size));
+        if (!valid) {
+            set_error(error, "constant " + std::to_string(i) + " is malformed");
+            return false;
+        }
+    }
+    return true;
+}
+
+// Operand layout of the instructions an image may contain. Specialised
+// instructions exist only in optimised code, never in a module.
+enum class OperandKind {
+    INVALID,
+    NONE,
+    CONSTANT,
+    GLOBAL,
+    BYTE,
+    JUMP,
+    LOOP,
+    CALL,
+    CALL_NATIVE
+};
+
+OperandKind operand_kind(uint8_t byte) {
+    switch (static_cast<OpCode>(byte)) {
+        case OpCode::OP_CONSTANT:
+            return OperandKind::CONSTANT;
+        case OpCode::OP_DEFINE_GLOBAL:
+        case OpCode::OP_GET_GLOBAL:
+        case OpCode::OP_SET_GLOBAL:
+            return OperandKind::GLOBAL;
+        case OpCode::OP_GET_LOCAL:
+        case OpCode::OP_SET_LOCAL:
+            return OperandKind::BYTE;
+        case OpCode::OP_JUMP:
+        case OpCode::OP_JUMP_IF_FALSE:
+        case OpCode::OP_JUMP_IF_TRUE:
+            return OperandKind::JUMP;
+        case OpCode::OP_LOOP:
+        case OpCode::OP_JUMP_BACK:
+            return OperandKind::LOOP;
+        case OpCode::OP_CALL:
+            return OperandKind::CALL;
+        case OpCode::OP_CALL_NATIVE:
+            return OperandKind::CALL_NATIVE;
+        case OpCode::OP_ADD:
+        case OpCode::OP_SUBTRACT:
+        case OpCode::OP_MULTIPLY:
+        case OpCode::OP_DIVIDE:
+        case OpCode::OP_MODULO:
+        case OpCode::OP_NEGATE:
+        case OpCode::OP_EQUAL:
+        case OpCode::OP_NOT_EQUAL:
+        case OpCode::OP_LESS:
+        case OpCode::OP_LESS_EQUAL:
+        case OpCode::OP_GREATER:
+        case OpCode::OP_GREATER_EQUAL:
+        case OpCode::OP_AND:
+        case OpCode::OP_OR:
+        case OpCode::OP_NOT:
+        case OpCode::OP_RETURN:
+        case OpCode::OP_POP:
+        case OpCode::OP_DUP:
+        case OpCode::OP_EXIT:
+            return OperandKind::NONE;
+        default:
+            return OperandKind::INVALID;
+    }
+}
+
+/**
+ * Checks that code decodes into whole instructions whose operands refer
+ * to existing constants and functions, and whose jumps land on an
+ * instruction in the same function
+ */
+bool valid_code(const Chunk& chunk, size_t function_count) {
+    const std::vector<uint8_t>& code = chunk.code();
+    std::vector<bool> starts(code.size() + 1, false);
+    std::vector<size_t> targets;
+    for (size_t offset = 0; offset < code.size();) {
+        starts[offset] = true;
+        OperandKind kind = operand_kind(code[offset]);
+        size_t length = instruction_length(static_cast<OpCode>(code[offset]));
+        if (kind == OperandKind::INVALID || length > code.size() - offset) {
+            return false;
+        }
+        size_t next = offset + length;
+        switch (kind) {
+            case OperandKind::CONSTANT:
+                if (code[offset + 1] >= chunk.constants().size()) return false;
+                break;
+            case OperandKind::GLOBAL:
+                if (code[offset + 1] >= chunk.constants().size() ||
+                    !chunk.constants()[code[offset + 1]].is_string()) {
+                    return false;
+                }
+                break;
+            case OperandKind::JUMP:
+                targets.push_back(next + (size_t{code[offset + 1]} << 8 | code[offset + 2]));
+                break;
+            case OperandKind::LOOP: {
+                size_t distance = size_t{code[offset + 1]} << 8 | code[offset + 2];
+                if (distance > next) return false;
+                targets.push_back(next - distance);
+                break;
+            }
+            case OperandKind::CALL:
+                if (code[offset + 1] >= function_count) return false;
+                break;
+            default:
+                break;
+        }
+        offset = next;
+    }
+    // A jump may also land just past the last instruction
+    starts[code.size()] = true;
+    for (size_t target : targets) {
+        if (target > code.size() || !starts[target]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+Value MappedImage::constant(uint32_t index) const {
+    const uint8_t* entry = pool_entry(index);
+    uint32_t size = read_u32(entry + 4);
+    const uint8_t* data = data_ + read_u64(entry + 8);
+    switch (static_cast<ConstantType>(entry[0])) {
+        case ConstantType::NIL:
+            return Value();
+        case ConstantType::BOOL:
+            return Value(size != 0);
+        case ConstantType::NUMBER: {
+            uint64_t bits = read_u64(data);
+            double number;
+            std::memcpy(&number, &bits, sizeof(number));
+            return Value(number);
+        }
+        case ConstantType::STRING:
+            return Value(StringTable::global().intern(
+                std::string_view(reinterpret_cast<const char*>(data), size)));
+    }
+    return Value();
+}
+
+Chunk MappedImage::load(size_t index) const {
+    const uint8_t* entry = directory_entry(index);
+    const uint8_t* body = data_ + read_u64(entry);
+    uint64_t body_size = read_u32(entry + 16);
+    auto corrupt = [&]() {
+        return VMException("Corrupt bytecode image: function " + std::to_string(index));
+    };
+    if (body_size < BODY_HEADER_SIZE) {
+        throw corrupt();
+    }
+    uint64_t code_size = read_u32(body);
+    uint64_t constant_count = read_u32(body + 4);
+    uint64_t run_count = read_u32(body + 8);
+    if (BODY_HEADER_SIZE + code_size + constant_count * 4 + run_count * 8 > body_size) {
+        throw corrupt();
+    }
+    const uint8_t* code = body + BODY_HEADER_SIZE;
+    const uint8_t* constants = code + code_size;
+    const uint8_t* runs = constants + constant_count * 4;
+
+    Chunk chunk;
+    size_t offset = 0;
+    for (size_t r = 0; r < run_count; ++r) {
+        int line = static_cast<int>(read_u32(runs + r * 8));
+        uint32_t length = read_u32(runs + r * 8 + 4);
+        if (length > code_size - offset) {
+            throw corrupt();
+        }
+        for (uint32_t k = 0; k < length; ++k, ++offset) {
+            chunk.write_byte(code[offset], line);
+        }
+    }
+    if (offset != code_size) {
+        throw corrupt();
+    }
+    for (size_t c = 0; c < constant_count; ++c) {
+        uint32_t pool_index = read_u32(constants + c * 4);
+        if (pool_index >= constant_count_) {
+            throw corrupt();
+        }
+        chunk.write_constant(constant(pool_index));
+    }
+    if (!valid_code(chunk, function_count_)) {
+        throw corrupt();
+    }
+    return chunk;
+}
+
+} // anonymous namespace
+
+// ============================================================================
+// Writing
+// ============================================================================
+
+bool write_image(const CompiledModule& module, const std::string& path, std::string* error) {
+    // Pool constants by type and contents
+    struct PoolEntry {
+        ConstantType type;
+        std::string payload;
+    };
+    std::vector<PoolEntry> pool;
+    std::map<std::pair<ConstantType, std::string>, uint32_t> pool_index;
+    std::vector<std::vector<uint32_t>> constant_indexes(module.function_count());
+    for (size_t i = 0; i < module.function_count(); ++i) {
+        for (const Value& value : module.function(FunctionHandle{i}).constants()) {
+            PoolEntry entry;
+            if (value.is_nil()) {
+                entry.type = ConstantType::NIL;
+            } else if (value.is_bool()) {
+                entry.type = ConstantType::BOOL;
+                entry.payload = value.as_bool() ? "1" : "0";
+            } else if (value.is_number()) {
+                entry.type = ConstantType::NUMBER;
+                double number = value.as_number();
+                uint64_t bits;
+                std::memcpy(&bits, &number, sizeof(bits));
+                for (int b = 0; b < 8; ++b) {
+                    entry.payload.push_back(static_cast<char>(bits >> (8 * b)));
+                }
+            } else if (value.is_string()) {
+                entry.type = ConstantType::STRING;
+                entry.payload = std::string(value.as_string());
+            } else {
+                set_error(error, "function '" + module.function_name(FunctionHandle{i}) +
+                                 "' has an object constant, which images cannot store");
+                return false;
+            }
+            auto [it, inserted] = pool_index.emplace(std::make_pair(entry.type, entry.payload),
+                                                     static_cast<uint32_t>(pool.size()));
+            if (inserted) {
+                pool.push_back(std::move(entry));
+            }
+            constant_indexes[i].push_back(it->second);
+        }
+    }
+
+    ImageWriter w;
+    w.bytes(MAGIC, sizeof(MAGIC));
+    w.u32(IMAGE_VERSION);
+    w.u32(static_cast<uint32_t>(module.function_count()));
+    w.u32(static_cast<uint32_t>(pool.size()));
+    w.zeros(HEADER_SIZE - w.size());  // offsets and size, patched below
+
+    size_t directory = w.size();
+    w.zeros(module.function_count() * DIRECTORY_ENTRY_SIZE);
+    w.align();
+    size_t pool_start = w.size();
+    w.zeros(pool.size() * POOL_ENTRY_SIZE);
+    w.align();
+
+    for (size_t i = 0; i < module.function_count(); ++i) {
+        const std::string& name = module.function_name(FunctionHandle{i});
+        size_t entry = directory + i * DIRECTORY_ENTRY_SIZE;
+        w.patch_u64(entry + 8, w.size());
+        w.patch_u32(entry + 20, static_cast<uint32_t>(name.size()));
+        w.bytes(name.data(), name.size());
+    }
+    w.align();
+    for (size_t c = 0; c < pool.size(); ++c) {
+        const PoolEntry& constant = pool[c];
+        size_t entry = pool_start + c * POOL_ENTRY_SIZE;
+        w.out[entry] = static_cast<char>(constant.type);
+        if (constant.type == ConstantType::BOOL) {
+            w.patch_u32(entry + 4, constant.payload == "1");
+        } else if (constant.type != ConstantType::NIL) {
+            w.patch_u32(entry + 4, static_cast<uint32_t>(constant.payload.size()));
+            w.patch_u64(entry + 8, w.size());
+            w.bytes(constant.payload.data(), constant.payload.size());
+        }
+    }
+
+    for (size_t i : module.layout_order()) {
+        w.align();
+        const Chunk& chunk = module.function(FunctionHandle{i});
+        std::vector<std::pair<int, uint32_t>> runs;
+        for (size_t offset = 0; offset < chunk.size(); ++offset) {
+            int line = offset < chunk.lines().size() ? chunk.lines()[offset] : 0;
+            if (runs.empty() || runs.back().first != line) {
+                runs.emplace_back(line, 0);
+            }
+            ++runs.back().second;
+        }
+
+        size_t body = w.size();
+        w.u32(static_cast<uint32_t>(chunk.size()));
+        w.u32(static_cast<uint32_t>(constant_indexes[i].size()));
+        w.u32(static_cast<uint32_t>(runs.size()));
+        w.bytes(chunk.code().data(), chunk.size());
+        for (uint32_t index : constant_indexes[i]) {
+            w.u32(index);
+        }
+        for (const auto& [line, length] : runs) {
+            w.u32(static_cast<uint32_t>(line));
+            w.u32(length);
+        }
+        size_t entry = directory + i * DIRECTORY_ENTRY_SIZE;
+        w.patch_u64(entry, body);
+        w.patch_u32(entry + 16, static_cast<uint32_t>(w.size() - body));
+    }
+
+    w.patch_u64(16, directory);
+    w.patch_u64(24, pool_start);
+    w.patch_u64(32, w.size());
+
+    // Written beside the target and renamed over it, so processes that
+    // have the old image mapped keep reading the old file
+    std::string temp = path + ".tmp";
+    int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        set_error(error, "cannot write " + temp + ": " + std::strerror(errno));
+        return false;
+    }
+    size_t written = 0;
+    while (written < w.out.size()) {
+        ssize_t n = ::write(fd, w.out.data() + written, w.out.size() - written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        written += static_cast<size_t>(n);
+    }
+    bool ok = written == w.out.size() && ::fsync(fd) == 0;
+    ok = ::close(fd) == 0 && ok;
+    if (!ok || ::rename(temp.c_str(), path.c_str()) != 0) {
+        set_error(error, "cannot write " + path + ": " + std::strerror(errno));
+        ::unlink(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// ============================================================================
+// Loading
+// ============================================================================
+
+std::shared_ptr<const CompiledModule> load_image(const std::string& path, std::string* error) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        set_error(error, "cannot open " + path + ": " + std::strerror(errno));
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        set_error(error, "cannot read " + path);
+        return nullptr;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        set_error(error, "cannot map " + path + ": " + std::strerror(errno));
+        return nullptr;
+    }
+
+    auto image = std::make_unique<MappedImage>(static_cast<const uint8_t*>(data), size);
+    std::vector<std::string> names;
+    std::string message;
+    if (!image->open(names, &message)) {
+        set_error(error, path + ": " + message);
+        return nullptr;
+    }
+    RPLUS_LOG(LogLevel::DEBUG, "Mapped image {}: {} functions, {} bytes", path, names.size(), size);
+    return CompiledModule::lazy(std::move(names), std::move(image));
+}
+
+} // namespace rplus
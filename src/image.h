@@ -0,0 +1,58 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "embed.h"
+
+namespace rplus {
+
+/**
+ * Bytecode images (.rpx)
+ *
+ * A CompiledModule serialised so that loading it costs work proportional
+ * to the functions actually called, not to the size of the module. The
+ * file is mapped read-only; load_image() reads and checks only the
+ * header, the function directory and the constant pool index. A
+ * function's code, constants and line table are decoded from the mapping
+ * the first time it is called (see CompiledModule::FunctionSource).
+ *
+ * Layout, all integers little-endian, sections 8-byte aligned:
+ *
+ *   header          magic "RPXI", version, function count, constant count,
+ *                   directory offset, pool index offset, file size
+ *   directory       per function: body offset, name offset, body size,
+ *                   name size
+ *   pool index      per constant: type, size, data offset
+ *   names           function names, back to back
+ *   constant data   numbers and string bytes
+ *   bodies          per function, in layout order: code size, constant
+ *                   count, line run count; code; constant pool indexes;
+ *                   (line, length) runs of the line table
+ *
+ * Constants are pooled across the module, so a string used by many
+ * functions is stored once. Bodies follow the module's layout order,
+ * which layout (see layout.h) makes hottest-first; the directory stays in
+ * function index order. Object constants cannot be stored.
+ */
+
+constexpr uint32_t IMAGE_VERSION = 1;
+
+// Writes module to path, replacing any existing file atomically. Returns
+// false with a message in error if the module holds a constant that
+// cannot be stored or the file cannot be written.
+bool write_image(const CompiledModule& module, const std::string& path,
+                 std::string* error = nullptr);
+
+// Maps the image at path. Returns nullptr with a message in error if the
+// file cannot be mapped or its directories are malformed. A corrupt
+// function body (including code with unknown instructions or operands
+// out of range) is only detected when the function is loaded, which
+// throws VMException.
+std::shared_ptr<const CompiledModule> load_image(const std::string& path,
+                                                 std::string* error = nullptr);
+
+} // namespace rplus
+
+#endif // IMAGE_H
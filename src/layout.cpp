@@ -0,0 +1,421 @@
+#include "layout.h"
+#include <algorithm>
+#include <unordered_map>
+#include "embed.h"
+#include "feedback.h"
+#include "logger.h"
+
+namespace rplus {
+
+namespace {
+
+struct Instruction {
+    uint32_t offset;
+    OpCode op;
+    uint32_t length;
+    int64_t target;  // jump destination, or -1
+};
+
+bool is_jump(OpCode op) {
+    return op == OpCode::OP_JUMP || op == OpCode::OP_JUMP_IF_FALSE ||
+           op == OpCode::OP_JUMP_IF_TRUE || op == OpCode::OP_LOOP || op == OpCode::OP_JUMP_BACK;
+}
+
+bool is_backward(OpCode op) {
+    return op == OpCode::OP_LOOP || op == OpCode::OP_JUMP_BACK;
+}
+
+bool is_conditional(OpCode op) {
+    return op == OpCode::OP_JUMP_IF_FALSE || op == OpCode::OP_JUMP_IF_TRUE;
+}
+
+// Control never continues to the next instruction
+bool ends_flow(OpCode op) {
+    return op == OpCode::OP_JUMP || op == OpCode::OP_LOOP || op == OpCode::OP_JUMP_BACK ||
+           op == OpCode::OP_RETURN || op == OpCode::OP_EXIT;
+}
+
+/**
+ * Splits a chunk into instructions, resolving jump destinations. Fails on
+ * truncated code or a jump into the middle of an instruction.
+ */
+bool decode(const Chunk& chunk, std::vector<Instruction>& code) {
+    const std::vector<uint8_t>& bytes = chunk.code();
+    std::vector<uint8_t> starts(bytes.size() + 1, 0);
+    for (size_t offset = 0; offset < bytes.size();) {
+        OpCode op = static_cast<OpCode>(bytes[offset]);
+        size_t length = instruction_length(op);
+        if (offset + length > bytes.size()) {
+            return false;
+        }
+        int64_t target = -1;
+        if (is_jump(op)) {
+            // Big-endian, matching read_short
+            int64_t jump = bytes[offset + 1] << 8 | bytes[offset + 2];
+            int64_t next = static_cast<int64_t>(offset + length);
+            target = is_backward(op) ? next - jump : next + jump;
+            if (target < 0) {
+                return false;
+            }
+        }
+        code.push_back(Instruction{static_cast<uint32_t>(offset), op,
+                                   static_cast<uint32_t>(length), target});
+        starts[offset] = 1;
+        offset += length;
+    }
+    for (const Instruction& instruction : code) {
+        if (instruction.target >= 0 &&
+            (instruction.target >= static_cast<int64_t>(bytes.size()) || !starts[instruction.target])) {
+            return false;
+        }
+    }
+    return !code.empty();
+}
+
+Chunk rebuild(const std::vector<uint8_t>& code, const std::vector<int>& lines,
+              const std::vector<Value>& constants) {
+    Chunk chunk;
+    for (size_t i = 0; i < code.size(); ++i) {
+        chunk.write_byte(code[i], i < lines.size() ? lines[i] : 0);
+    }
+    for (const Value& constant : constants) {
+        chunk.write_constant(constant);
+    }
+    return chunk;
+}
+
+struct Block {
+    size_t first;          // instruction indexes, inclusive
+    size_t last;
+    int fallthrough = -1;  // block control falls into at the end
+    int target = -1;       // block the final jump goes to
+    bool hot = false;
+    bool expanded = false; // conditional jump back to hot code, see below
+    size_t start = 0;      // new offset
+    size_t size = 0;       // new size
+};
+
+} // anonymous namespace
+
+// ============================================================================
+// Hot/Cold Splitting
+// ============================================================================
+
+bool split_cold_blocks(const Chunk& chunk, const FeedbackVector& profile, Chunk& out,
+                       LayoutStats* stats) {
+    std::vector<Instruction> code;
+    if (!decode(chunk, code)) {
+        return false;
+    }
+
+    // Basic blocks start at offset 0, at jump targets and after jumps and returns
+    std::vector<int> index_of(chunk.size(), -1);
+    for (size_t i = 0; i < code.size(); ++i) {
+        index_of[code[i].offset] = static_cast<int>(i);
+    }
+    std::vector<uint8_t> leader(code.size(), 0);
+    leader[0] = 1;
+    for (size_t i = 0; i < code.size(); ++i) {
+        if (code[i].target >= 0) {
+            leader[index_of[code[i].target]] = 1;
+        }
+        if ((is_jump(code[i].op) || ends_flow(code[i].op)) && i + 1 < code.size()) {
+            leader[i + 1] = 1;
+        }
+    }
+    std::vector<Block> blocks;
+    std::vector<int> block_of(code.size());
+    for (size_t i = 0; i < code.size(); ++i) {
+        if (leader[i]) {
+            blocks.push_back(Block{i, i});
+        }
+        blocks.back().last = i;
+        block_of[i] = static_cast<int>(blocks.size() - 1);
+    }
+    for (size_t b = 0; b < blocks.size(); ++b) {
+        const Instruction& last = code[blocks[b].last];
+        if (last.target >= 0) {
+            blocks[b].target = block_of[index_of[last.target]];
+        }
+        if (!ends_flow(last.op) && b + 1 < blocks.size()) {
+            blocks[b].fallthrough = static_cast<int>(b + 1);
+        }
+    }
+
+    // Hot blocks are reachable from the entry without taking a direction
+    // that was sampled enough and never seen
+    std::vector<int> pending{0};
+    blocks[0].hot = true;
+    while (!pending.empty()) {
+        const Block& block = blocks[pending.back()];
+        pending.pop_back();
+        const Instruction& last = code[block.last];
+        bool taken_warm = true;
+        bool fallthrough_warm = true;
+        const FeedbackSlot* slot = profile.slot(last.offset);
+        if (is_conditional(last.op) && slot && slot->kind == FeedbackSiteKind::BRANCH &&
+            slot->hits >= MIN_BRANCH_HITS) {
+            taken_warm = slot->hits_for(FeedbackSlot::BRANCH_TAKEN) > 0;
+            fallthrough_warm = slot->hits_for(FeedbackSlot::BRANCH_NOT_TAKEN) > 0;
+        }
+        for (auto [next, warm] : {std::make_pair(block.target, taken_warm),
+                                  std::make_pair(block.fallthrough, fallthrough_warm)}) {
+            if (next >= 0 && warm && !blocks[next].hot) {
+                blocks[next].hot = true;
+                pending.push_back(next);
+            }
+        }
+    }
+
+    std::vector<int> order;
+    for (size_t b = 0; b < blocks.size(); ++b) {
+        if (blocks[b].hot) order.push_back(static_cast<int>(b));
+    }
+    size_t hot_count = order.size();
+    for (size_t b = 0; b < blocks.size(); ++b) {
+        if (!blocks[b].hot) order.push_back(static_cast<int>(b));
+    }
+    bool moved = false;
+    for (size_t i = 0; i < order.size(); ++i) {
+        moved = moved || order[i] != static_cast<int>(i);
+    }
+    if (!moved) {
+        return false;
+    }
+
+    // Sizes. A block whose fallthrough no longer follows it gains a jump.
+    // A conditional jump to an earlier block cannot be encoded (conditional
+    // offsets are forward only), so it becomes the inverted condition
+    // jumping over an OP_JUMP_BACK; expanding one jump only moves later
+    // code further away, so this settles in a few rounds.
+    std::vector<uint8_t> needs_jump(blocks.size(), 0);
+    for (size_t i = 0; i < order.size(); ++i) {
+        const Block& block = blocks[order[i]];
+        needs_jump[order[i]] =
+            block.fallthrough >= 0 && (i + 1 == order.size() || order[i + 1] != block.fallthrough);
+    }
+    for (bool changed = true; changed;) {
+        changed = false;
+        size_t offset = 0;
+        for (int b : order) {
+            Block& block = blocks[b];
+            block.start = offset;
+            block.size = code[block.last].offset + code[block.last].length - code[block.first].offset;
+            block.size += block.expanded ? 3 : 0;
+            block.size += needs_jump[b] ? 3 : 0;
+            offset += block.size;
+        }
+        for (int b : order) {
+            Block& block = blocks[b];
+            const Instruction& last = code[block.last];
+            size_t at = block.start + (last.offset - code[block.first].offset);
+            if (is_conditional(last.op) && !block.expanded && blocks[block.target].start <= at) {
+                block.expanded = true;
+                changed = true;
+            }
+        }
+    }
+
+    const std::vector<uint8_t>& bytes = chunk.code();
+    const std::vector<int>& lines = chunk.lines();
+    std::vector<uint8_t> laid;
+    std::vector<int> laid_lines;
+    auto line_at = [&](size_t offset) { return offset < lines.size() ? lines[offset] : 0; };
+    auto emit = [&](uint8_t byte, int line) {
+        laid.push_back(byte);
+        laid_lines.push_back(line);
+    };
+    // Unconditional jumps pick OP_JUMP or OP_JUMP_BACK by direction. Loop
+    // back edges stay OP_LOOP, which the tiers count: hot blocks keep
+    // their order and a loop's header is hot whenever its back edge is,
+    // so they still point backwards.
+    auto emit_jump = [&](OpCode op, size_t target, int line) {
+        size_t at = laid.size();
+        size_t distance;
+        if (op == OpCode::OP_LOOP) {
+            if (target > at + 3) {
+                return false;
+            }
+            distance = at + 3 - target;
+        } else if (target >= at + 3) {
+            op = op == OpCode::OP_JUMP_BACK ? OpCode::OP_JUMP : op;
+            distance = target - (at + 3);
+        } else {
+            op = OpCode::OP_JUMP_BACK;
+            distance = at + 3 - target;
+        }
+        emit(static_cast<uint8_t>(op), line);
+        emit(static_cast<uint8_t>(distance >> 8), line);
+        emit(static_cast<uint8_t>(distance & 0xff), line);
+        return distance <= UINT16_MAX;
+    };
+
+    for (int b : order) {
+        const Block& block = blocks[b];
+        for (size_t i = block.first; i <= block.last; ++i) {
+            const Instruction& instruction = code[i];
+            int line = line_at(instruction.offset);
+            if (instruction.target < 0) {
+                for (size_t k = 0; k < instruction.length; ++k) {
+                    emit(bytes[instruction.offset + k], line);
+                }
+                continue;
+            }
+            size_t target = blocks[block.target].start;
+            bool ok;
+            if (!is_conditional(instruction.op)) {
+                ok = emit_jump(instruction.op, target, line);
+            } else if (!block.expanded) {
+                ok = emit_jump(instruction.op, target, line);
+            } else {
+                OpCode inverse = instruction.op == OpCode::OP_JUMP_IF_FALSE
+                                     ? OpCode::OP_JUMP_IF_TRUE : OpCode::OP_JUMP_IF_FALSE;
+                emit(static_cast<uint8_t>(inverse), line);
+                emit(0, line);
+                emit(3, line);
+                ok = emit_jump(OpCode::OP_JUMP_BACK, target, line);
+            }
+            if (!ok) {
+                return false;
+            }
+        }
+        if (needs_jump[b] &&
+            !emit_jump(OpCode::OP_JUMP, blocks[block.fallthrough].start,
+                       line_at(code[block.last].offset))) {
+            return false;
+        }
+    }
+
+    if (stats) {
+        ++stats->functions_split;
+        for (size_t i = hot_count; i < order.size(); ++i) {
+            const Block& block = blocks[order[i]];
+            ++stats->cold_blocks;
+            stats->cold_bytes += code[block.last].offset + code[block.last].length -
+                                 code[block.first].offset;
+        }
+    }
+    out = rebuild(laid, laid_lines, chunk.constants());
+    return true;
+}
+
+// ============================================================================
+// Function Ordering
+// ============================================================================
+
+/**
+ * Chains functions along call edges, heaviest first: an edge joins two
+ * chains when its caller ends one and its callee starts the other, so
+ * each callee is placed right after its hottest caller that is not
+ * already followed by something else.
+ */
+std::vector<size_t> function_order(const CompiledModule& module, const VirtualMachine& vm) {
+    size_t count = module.function_count();
+    std::unordered_map<uintptr_t, size_t> index;
+    for (size_t i = 0; i < count; ++i) {
+        index.emplace(reinterpret_cast<uintptr_t>(module.function_address(FunctionHandle{i})), i);
+    }
+
+    struct Edge {
+        uint64_t weight;
+        size_t caller;
+        size_t callee;
+    };
+    std::vector<Edge> edges;
+    std::vector<uint64_t> heat(count, 0);
+    for (size_t i = 0; i < count; ++i) {
+        const FeedbackVector* feedback = vm.feedback(*module.function_address(FunctionHandle{i}));
+        if (!feedback) {
+            continue;
+        }
+        heat[i] = feedback->invocations();
+        for (const FeedbackSlot& slot : feedback->slots()) {
+            if (slot.kind != FeedbackSiteKind::CALL) {
+                continue;
+            }
+            for (uint8_t e = 0; e < slot.count; ++e) {
+                auto callee = index.find(slot.entries[e].key);
+                if (callee != index.end() && callee->second != i) {
+                    edges.push_back(Edge{slot.entries[e].hits, i, callee->second});
+                }
+            }
+        }
+    }
+    std::stable_sort(edges.begin(), edges.end(),
+                     [](const Edge& a, const Edge& b) { return a.weight > b.weight; });
+
+    std::vector<std::vector<size_t>> chains(count);
+    std::vector<size_t> chain_of(count);
+    for (size_t i = 0; i < count; ++i) {
+        chains[i].push_back(i);
+        chain_of[i] = i;
+    }
+    for (const Edge& edge : edges) {
+        size_t a = chain_of[edge.caller];
+        size_t b = chain_of[edge.callee];
+        if (a == b || chains[a].back() != edge.caller || chains[b].front() != edge.callee) {
+            continue;
+        }
+        for (size_t function : chains[b]) {
+            chain_of[function] = a;
+            chains[a].push_back(function);
+        }
+        chains[b].clear();
+    }
+
+    std::vector<std::pair<uint64_t, size_t>> ranked;  // (hottest member, chain)
+    for (size_t c = 0; c < count; ++c) {
+        if (chains[c].empty()) continue;
+        uint64_t hottest = 0;
+        for (size_t function : chains[c]) {
+            hottest = std::max(hottest, heat[function]);
+        }
+        ranked.emplace_back(hottest, c);
+    }
+    std::stable_sort(ranked.begin(), ranked.end(),
+                     [](const auto& a, const auto& b) { return a.first > b.first; });
+
+    std::vector<size_t> order;
+    order.reserve(count);
+    for (const auto& [hottest, c] : ranked) {
+        order.insert(order.end(), chains[c].begin(), chains[c].end());
+    }
+    return order;
+}
+
+// ============================================================================
+// Module Layout
+// ============================================================================
+
+std::shared_ptr<const CompiledModule> layout_module(const CompiledModule& module,
+                                                    const VirtualMachine& vm,
+                                                    LayoutStats* stats) {
+    // Function indexes are held outside the module (OP_CALL operands,
+    // timer callbacks, call_function(index)), so they stay as they are;
+    // only the bodies are allocated, and later stored, in layout order
+    std::vector<size_t> order = function_order(module, vm);
+    std::vector<std::shared_ptr<const Chunk>> bodies(order.size());
+    for (size_t index : order) {
+        const Chunk& chunk = module.function(FunctionHandle{index});
+        Chunk laid;
+        const FeedbackVector* feedback = vm.feedback(chunk);
+        if (!feedback || !split_cold_blocks(chunk, *feedback, laid, stats)) {
+            laid = chunk;
+        }
+        bodies[index] = std::make_shared<const Chunk>(std::move(laid));
+    }
+
+    CompiledModule::Builder builder;
+    for (size_t i = 0; i < bodies.size(); ++i) {
+        builder.add_function(module.function_name(FunctionHandle{i}), std::move(bodies[i]));
+    }
+    if (stats) {
+        stats->functions = order.size();
+        RPLUS_LOG(LogLevel::DEBUG, "Laid out {} functions: {} split, {} cold blocks ({} bytes)",
+                  stats->functions, stats->functions_split, stats->cold_blocks, stats->cold_bytes);
+    }
+    builder.set_layout_order(std::move(order));
+    return builder.build();
+}
+
+} // namespace rplus
@@ -0,0 +1,69 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "vm.h"
+
+namespace rplus {
+
+class CompiledModule;
+class FeedbackVector;
+
+/**
+ * Profile-guided code layout
+ *
+ * Rebuilds a module from the feedback a VM collected while running it
+ * (see VirtualMachine::enable_feedback), so that the code the interpreter
+ * actually executes sits together:
+ *
+ *   - Hot/cold splitting. A branch direction never taken across at least
+ *     MIN_BRANCH_HITS executions is cold; so is every block reachable
+ *     only through cold directions (error paths, rare cases, dead code).
+ *     Cold blocks move behind the hot ones, which keep their order, and
+ *     jumps are rewritten to suit. A jump from cold code back to hot code
+ *     becomes OP_JUMP_BACK (a conditional one, the inverted condition
+ *     skipping it), which unlike OP_LOOP is not counted as a loop back
+ *     edge by OSR or the trace JIT.
+ *
+ *   - Function ordering. Functions are chained greedily along their
+ *     heaviest call edges, from OP_CALL feedback, so a callee follows its
+ *     hottest caller; chains are ordered hottest first and functions that
+ *     never ran go last. This sets the module's layout order, in which
+ *     bodies are allocated and written to images (see image.h).
+ *
+ * Function indexes, and so OP_CALL operands, handles and timer callbacks,
+ * are the same in the new module. Apart from jumps that change direction,
+ * every path through a function runs the same instructions as before.
+ */
+
+struct LayoutStats {
+    size_t functions = 0;        // functions in the module
+    size_t functions_split = 0;  // functions with cold blocks moved out
+    size_t cold_blocks = 0;
+    size_t cold_bytes = 0;       // baseline bytecode now behind the hot code
+};
+
+// Branch executions before a direction never taken counts as cold
+constexpr uint64_t MIN_BRANCH_HITS = 100;
+
+// Writes chunk with its cold blocks moved to the end into out. Returns
+// false, leaving out untouched, if nothing is cold or the function cannot
+// be laid out (e.g. a jump would no longer fit its 16-bit offset).
+bool split_cold_blocks(const Chunk& chunk, const FeedbackVector& profile, Chunk& out,
+                       LayoutStats* stats = nullptr);
+
+// Module function indexes in layout order, hottest first
+std::vector<size_t> function_order(const CompiledModule& module, const VirtualMachine& vm);
+
+// The module with both passes applied, using the feedback vm collected
+// while running it
+std::shared_ptr<const CompiledModule> layout_module(const CompiledModule& module,
+                                                    const VirtualMachine& vm,
+                                                    LayoutStats* stats = nullptr);
+
+} // namespace rplus
+
+#endif // LAYOUT_H
@@ -2,6 +2,7 @@
 #include <cctype>
 #include <string>
 #include <unordered_map>
+#include "time_report.h"
 
 // Keywords map for C++ style tokenization
 static const std::unordered_map<std::string, TokenType> keywords = {
@@ -217,6 +218,7 @@ Token Lexer::nextToken() {
 }
 
 std::vector<Token> Lexer::tokenize() {
+    rplus::PassTimer timer("lex");
     std::vector<Token> tokens;
     Token token = nextToken();
     
@@ -0,0 +1,243 @@
+#include "linker.h"
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include "embed.h"
+#include "feedback.h"
+#include "logger.h"
+#include "rstring.h"
+
+namespace rplus {
+
+namespace {
+
+// Instructions whose operand indexes the chunk's constant pool
+bool uses_constant(OpCode op) {
+    return op == OpCode::OP_CONSTANT || op == OpCode::OP_DEFINE_GLOBAL ||
+           op == OpCode::OP_GET_GLOBAL || op == OpCode::OP_SET_GLOBAL;
+}
+
+// Bytes that identify a constant's value: equal keys, equal constants
+std::string constant_key(const Value& value) {
+    std::string key(1, static_cast<char>(value.type()));
+    switch (value.type()) {
+        case Value::Type::NIL:
+            break;
+        case Value::Type::BOOL:
+            key += value.as_bool() ? '1' : '0';
+            break;
+        case Value::Type::NUMBER: {
+            double number = value.as_number();
+            char bits[sizeof(number)];
+            std::memcpy(bits, &number, sizeof(number));
+            key.append(bits, sizeof(bits));
+            break;
+        }
+        case Value::Type::STRING:
+            key += value.as_string();
+            break;
+        case Value::Type::OBJECT: {
+            const Object* object = value.as_object();
+            char bits[sizeof(object)];
+            std::memcpy(bits, &object, sizeof(object));
+            key.append(bits, sizeof(bits));
+            break;
+        }
+    }
+    return key;
+}
+
+// A function's bytecode with its constant pool in canonical form
+struct Function {
+    std::vector<uint8_t> code;
+    std::vector<Value> constants;    // interned
+    std::vector<uint8_t> calls;      // OP_CALL operands, in code order
+    std::string key;                 // structural hash input
+    const Chunk* source = nullptr;
+};
+
+class Interner {
+public:
+    const Value& intern(const Value& value, const std::string& key) {
+        auto it = pool_.find(key);
+        if (it == pool_.end()) {
+            // Strings also go through the process-wide table, so they are
+            // shared with other linked and loaded modules
+            Value stored = value.is_string() && !value.as_string_object().is_interned()
+                               ? Value(StringTable::global().intern(value.string_ref()))
+                               : value;
+            it = pool_.emplace(key, std::move(stored)).first;
+        }
+        return it->second;
+    }
+    size_t size() const { return pool_.size(); }
+
+private:
+    std::unordered_map<std::string, Value> pool_;
+};
+
+/**
+ * Renumbers a function's constants in order of first use, dropping unused
+ * ones, and builds its structural key. Code with a malformed constant
+ * operand is kept as it is, under a key no other function can share.
+ */
+Function canonicalize(const Chunk& chunk, size_t id, Interner& interner) {
+    Function function;
+    function.source = &chunk;
+    function.code = chunk.code();
+    const std::vector<Value>& constants = chunk.constants();
+
+    std::vector<int> renumbered(constants.size(), -1);
+    std::vector<std::string> keys;
+    bool malformed = false;
+    for (size_t offset = 0; offset < function.code.size();) {
+        OpCode op = static_cast<OpCode>(function.code[offset]);
+        size_t length = instruction_length(op);
+        if (offset + length > function.code.size()) {
+            break;
+        }
+        uint8_t& operand = function.code[offset + 1];
+        if (uses_constant(op)) {
+            if (operand >= constants.size()) {
+                malformed = true;
+                break;
+            }
+            if (renumbered[operand] < 0) {
+                renumbered[operand] = static_cast<int>(keys.size());
+                keys.push_back(constant_key(constants[operand]));
+                function.constants.push_back(interner.intern(constants[operand], keys.back()));
+            }
+            operand = static_cast<uint8_t>(renumbered[operand]);
+        } else if (op == OpCode::OP_CALL) {
+            function.calls.push_back(operand);
+        }
+        offset += length;
+    }
+
+    if (malformed) {
+        function.code = chunk.code();
+        function.constants = constants;
+        function.calls.clear();
+        function.key = "!" + std::to_string(id);
+        return function;
+    }
+
+    function.key = std::to_string(function.code.size()) + ':';
+    function.key.append(function.code.begin(), function.code.end());
+    for (const std::string& key : keys) {
+        function.key += '\0';
+        function.key += std::to_string(key.size());
+        function.key += ':';
+        function.key += key;
+    }
+    return function;
+}
+
+} // namespace
+
+// ============================================================================
+// Linking
+// ============================================================================
+
+std::vector<std::shared_ptr<const CompiledModule>> link_modules(
+    const std::vector<std::shared_ptr<const CompiledModule>>& modules,
+    LinkStats* stats) {
+    LinkStats local;
+    LinkStats& totals = stats ? *stats : local;
+    totals = LinkStats{};
+    totals.modules = modules.size();
+
+    // Every function gets a global id: its module's first id plus its index
+    std::vector<size_t> first_id;
+    std::vector<Function> functions;
+    Interner interner;
+    for (const std::shared_ptr<const CompiledModule>& module : modules) {
+        if (!module) {
+            throw VMException("Cannot link a null module");
+        }
+        first_id.push_back(functions.size());
+        for (size_t i = 0; i < module->function_count(); ++i) {
+            const Chunk& chunk = module->function(FunctionHandle{i});
+            totals.constants += chunk.constants().size();
+            totals.bytes_before += chunk.memory_bytes();
+            functions.push_back(canonicalize(chunk, functions.size(), interner));
+        }
+    }
+    first_id.push_back(functions.size());
+    totals.functions = functions.size();
+    totals.unique_constants = interner.size();
+
+    // Group by structural key, then split groups whose members call
+    // functions from different groups until no group splits
+    std::vector<size_t> group(functions.size());
+    size_t groups = 0;
+    {
+        std::unordered_map<std::string, size_t> by_key;
+        for (size_t id = 0; id < functions.size(); ++id) {
+            group[id] = by_key.emplace(functions[id].key, by_key.size()).first->second;
+        }
+        groups = by_key.size();
+    }
+    for (;;) {
+        std::map<std::vector<size_t>, size_t> by_signature;
+        std::vector<size_t> refined(functions.size());
+        for (size_t m = 0; m < modules.size(); ++m) {
+            size_t count = first_id[m + 1] - first_id[m];
+            for (size_t id = first_id[m]; id < first_id[m + 1]; ++id) {
+                std::vector<size_t> signature{group[id]};
+                for (uint8_t callee : functions[id].calls) {
+                    signature.push_back(callee < count ? group[first_id[m] + callee] : SIZE_MAX);
+                }
+                refined[id] = by_signature.emplace(std::move(signature), by_signature.size())
+                                  .first->second;
+            }
+        }
+        group = std::move(refined);
+        if (by_signature.size() == groups) {
+            break;
+        }
+        groups = by_signature.size();
+    }
+
+    // One body per group, built from its first member
+    std::vector<std::shared_ptr<const Chunk>> bodies(groups);
+    for (const Function& function : functions) {
+        std::shared_ptr<const Chunk>& body = bodies[group[&function - functions.data()]];
+        if (body) {
+            continue;
+        }
+        Chunk chunk;
+        const std::vector<int>& lines = function.source->lines();
+        for (size_t i = 0; i < function.code.size(); ++i) {
+            chunk.write_byte(function.code[i], i < lines.size() ? lines[i] : 0);
+        }
+        for (const Value& constant : function.constants) {
+            chunk.write_constant(constant);
+        }
+        totals.bytes_after += chunk.memory_bytes();
+        body = std::make_shared<const Chunk>(std::move(chunk));
+    }
+    totals.unique_functions = groups;
+
+    std::vector<std::shared_ptr<const CompiledModule>> linked;
+    linked.reserve(modules.size());
+    for (size_t m = 0; m < modules.size(); ++m) {
+        CompiledModule::Builder builder;
+        for (size_t id = first_id[m]; id < first_id[m + 1]; ++id) {
+            FunctionHandle fn{id - first_id[m]};
+            builder.add_function(modules[m]->function_name(fn), bodies[group[id]]);
+        }
+        builder.set_layout_order(modules[m]->layout_order());
+        linked.push_back(builder.build());
+    }
+
+    RPLUS_LOG(LogLevel::DEBUG,
+              "Linked {} modules: {} of {} functions unique, {} of {} constants, {} -> {} bytes",
+              totals.modules, totals.unique_functions, totals.functions, totals.unique_constants,
+              totals.constants, totals.bytes_before, totals.bytes_after);
+    return linked;
+}
+
+} // namespace rplus
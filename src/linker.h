@@ -0,0 +1,55 @@
+#ifndef LINKER_H
+#define LINKER_H
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace rplus {
+
+class CompiledModule;
+
+/**
+ * Link-time deduplication
+ *
+ * Generated code tends to repeat itself: the same small function in many
+ * modules, the same strings in every constant pool. link_modules() rebuilds
+ * a set of modules so that repeats are stored once:
+ *
+ *   - Constant pools. Each function's pool is reduced to the constants its
+ *     code uses, numbered in order of first use, so equal functions get
+ *     equal pools whatever order the compiler wrote them in. Constants are
+ *     interned across all the modules: every equal string shares one
+ *     StringObject.
+ *
+ *   - Function merging. Functions are hashed on their bytecode and
+ *     canonical constants, then the groups are refined until members also
+ *     call equivalent functions through each OP_CALL (whose operand indexes
+ *     the caller's own module). Each group keeps a single body, shared by
+ *     every export and module that had a copy, so it also occupies one
+ *     feedback vector and one set of optimised code per VM.
+ *
+ * Exports keep their names and indexes; only bodies are shared. A merged
+ * function reports the line numbers of the first copy linked. Object
+ * constants are compared by identity.
+ */
+
+struct LinkStats {
+    size_t modules = 0;
+    size_t functions = 0;         // exports across all modules
+    size_t unique_functions = 0;  // bodies after merging
+    size_t constants = 0;         // pool entries before linking
+    size_t unique_constants = 0;  // distinct interned constants
+    size_t bytes_before = 0;      // Chunk::memory_bytes() over all bodies
+    size_t bytes_after = 0;
+};
+
+// The modules, in the same order, with identical functions merged and
+// constants interned. Lazy modules are loaded in full.
+std::vector<std::shared_ptr<const CompiledModule>> link_modules(
+    const std::vector<std::shared_ptr<const CompiledModule>>& modules,
+    LinkStats* stats = nullptr);
+
+} // namespace rplus
+
+#endif // LINKER_H
@@ -0,0 +1,363 @@
+#include "logger.h"
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include "native.h"
+#include "vm.h"
+
+namespace rplus {
+
+/**
+ * Per-thread record ring
+ *
+ * Single producer (the owning thread) and single consumer (whoever holds
+ * the logger's drain mutex). Positions increase monotonically and are
+ * masked on access; the producer publishes with a release store of tail_
+ * and the consumer frees space with a release store of head_.
+ */
+class LogRing {
+public:
+    static constexpr size_t CAPACITY = 256 * 1024;
+
+    LogRing() : data_(new uint8_t[CAPACITY]) {}
+
+    // Producer side
+    uint8_t* reserve(size_t size) {
+        uint64_t tail = tail_.load(std::memory_order_relaxed);
+        size_t pos = static_cast<size_t>(tail & (CAPACITY - 1));
+        size_t contiguous = CAPACITY - pos;
+        // A record never wraps; pad to the start of the buffer instead
+        size_t needed = size <= contiguous ? size : contiguous + size;
+        if (tail + needed - cached_head_ > CAPACITY) {
+            cached_head_ = head_.load(std::memory_order_acquire);
+            if (tail + needed - cached_head_ > CAPACITY) {
+                return nullptr;
+            }
+        }
+        if (size > contiguous) {
+            uint32_t padding[2] = {static_cast<uint32_t>(contiguous), LogRecordHeader::PADDING};
+            std::memcpy(data_.get() + pos, padding, sizeof(padding));
+            tail += contiguous;
+            pos = 0;
+        }
+        pending_tail_ = tail + size;
+        return data_.get() + pos;
+    }
+
+    void commit() { tail_.store(pending_tail_, std::memory_order_release); }
+    
+    // True once more than half the ring is in use
+    bool half_full() {
+        if (pending_tail_ - cached_head_ <= CAPACITY / 2) {
+            return false;
+        }
+        cached_head_ = head_.load(std::memory_order_acquire);
+        return pending_tail_ - cached_head_ > CAPACITY / 2;
+    }
+
+    // Consumer side
+    const uint8_t* at(uint64_t position) const { return data_.get() + (position & (CAPACITY - 1)); }
+
+    alignas(64) std::atomic<uint64_t> head_{0};
+    alignas(64) std::atomic<uint64_t> tail_{0};
+    std::atomic<bool> orphaned_{false};  // owning thread has exited
+
+private:
+    uint64_t cached_head_ = 0;
+    uint64_t pending_tail_ = 0;
+    std::unique_ptr<uint8_t[]> data_;
+};
+
+const char* log_level_name(LogLevel level) {
+    switch (level) {
+        case LogLevel::TRACE: return "TRACE";
+        case LogLevel::DEBUG: return "DEBUG";
+        case LogLevel::INFO: return "INFO";
+        case LogLevel::WARN: return "WARN";
+        case LogLevel::ERROR: return "ERROR";
+    }
+    return "?";
+}
+
+// ============================================================================
+// Logger
+// ============================================================================
+
+Logger& Logger::instance() {
+    static Logger logger;
+    return logger;
+}
+
+Logger::Logger() {
+    flusher_ = std::thread([this]() {
+        std::unique_lock<std::mutex> lock(wake_mutex_);
+        while (!stopping_) {
+            wake_.wait_for(lock, std::chrono::milliseconds(10));
+            lock.unlock();
+            drain();
+            lock.lock();
+        }
+    });
+}
+
+Logger::~Logger() {
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_one();
+    flusher_.join();
+    drain();
+}
+
+void Logger::set_output(std::FILE* output) {
+    std::lock_guard<std::mutex> lock(drain_mutex_);
+    output_ = output;
+}
+
+uint32_t Logger::register_format(LogLevel level, const char* file, int line, const char* format) {
+    std::lock_guard<std::mutex> lock(formats_mutex_);
+    formats_.push_back(FormatInfo{level, file, line, format});
+    return static_cast<uint32_t>(formats_.size() - 1);
+}
+
+int64_t Logger::timestamp_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+LogRing& Logger::thread_ring() {
+    // The logger keeps the ring alive after the thread exits so records
+    // still in it are flushed
+    struct Holder {
+        std::shared_ptr<LogRing> ring;
+        ~Holder() {
+            if (ring) {
+                ring->orphaned_.store(true, std::memory_order_release);
+            }
+        }
+    };
+    thread_local Holder holder;
+    if (!holder.ring) {
+        holder.ring = std::make_shared<LogRing>();
+        std::lock_guard<std::mutex> lock(rings_mutex_);
+        rings_.push_back(holder.ring);
+    }
+    return *holder.ring;
+}
+
+uint8_t* Logger::reserve(size_t size) {
+    return thread_ring().reserve(size);
+}
+
+void Logger::commit() {
+    LogRing& ring = thread_ring();
+    ring.commit();
+    // Don't wait for the next periodic drain when a burst is filling the ring
+    if (ring.half_full()) {
+        wake_.notify_one();
+    }
+}
+
+void Logger::flush() {
+    drain();
+}
+
+/**
+ * Formats every committed record from every ring in timestamp order and
+ * writes them as one batch
+ */
+void Logger::drain() {
+    std::lock_guard<std::mutex> drain_lock(drain_mutex_);
+    
+    std::vector<std::shared_ptr<LogRing>> rings;
+    {
+        std::lock_guard<std::mutex> lock(rings_mutex_);
+        rings = rings_;
+    }
+    
+    struct Pending {
+        int64_t timestamp;
+        const uint8_t* record;
+    };
+    std::vector<Pending> pending;
+    std::vector<uint64_t> tails(rings.size());
+    std::vector<bool> orphaned(rings.size());
+    
+    for (size_t i = 0; i < rings.size(); ++i) {
+        LogRing& ring = *rings[i];
+        // Read the flag first: once set, the tail below is final
+        orphaned[i] = ring.orphaned_.load(std::memory_order_acquire);
+        uint64_t head = ring.head_.load(std::memory_order_relaxed);
+        uint64_t tail = ring.tail_.load(std::memory_order_acquire);
+        tails[i] = tail;
+        while (head < tail) {
+            const uint8_t* record = ring.at(head);
+            LogRecordHeader header;
+            std::memcpy(&header, record, 8);
+            if (header.format_id != LogRecordHeader::PADDING) {
+                std::memcpy(&header, record, sizeof(header));
+                pending.push_back(Pending{header.timestamp_ns, record});
+            }
+            head += header.size;
+        }
+    }
+    
+    if (!pending.empty()) {
+        std::stable_sort(pending.begin(), pending.end(),
+                         [](const Pending& a, const Pending& b) { return a.timestamp < b.timestamp; });
+        batch_.clear();
+        {
+            std::lock_guard<std::mutex> lock(formats_mutex_);
+            for (const Pending& entry : pending) {
+                format_record(entry.record, formats_, batch_);
+            }
+        }
+        std::fwrite(batch_.data(), 1, batch_.size(), output_);
+        std::fflush(output_);
+    }
+    
+    for (size_t i = 0; i < rings.size(); ++i) {
+        rings[i]->head_.store(tails[i], std::memory_order_release);
+    }
+    
+    std::lock_guard<std::mutex> lock(rings_mutex_);
+    for (size_t i = 0; i < rings.size(); ++i) {
+        if (orphaned[i]) {
+            rings_.erase(std::find(rings_.begin(), rings_.end(), rings[i]));
+        }
+    }
+}
+
+void Logger::format_record(const uint8_t* record, const std::deque<FormatInfo>& formats,
+                           std::string& out) {
+    LogRecordHeader header;
+    std::memcpy(&header, record, sizeof(header));
+    const FormatInfo& info = formats[header.format_id];
+    
+    // 2026-01-02T03:04:05.678901Z; the date part only changes once a second
+    int64_t seconds = header.timestamp_ns / 1000000000;
+    if (seconds != cached_second_) {
+        time_t t = static_cast<time_t>(seconds);
+        struct tm utc;
+        gmtime_r(&t, &utc);
+        char date[32];
+        cached_date_.assign(date, std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &utc));
+        cached_second_ = seconds;
+    }
+    const char* file = std::strrchr(info.file, '/');
+    file = file ? file + 1 : info.file;
+    char prefix[32];
+    std::snprintf(prefix, sizeof(prefix), ".%06dZ %-5s ",
+                  static_cast<int>(header.timestamp_ns % 1000000000 / 1000),
+                  log_level_name(info.level));
+    out.append(cached_date_);
+    out.append(prefix);
+    if (info.line > 0) {
+        out.append(file).append(":").append(std::to_string(info.line)).append(" ");
+    }
+    
+    const uint8_t* p = record + sizeof(header);
+    const uint8_t* end = record + header.size;
+    auto append_arg = [&]() {
+        char number[32];
+        switch (*p) {
+            case TAG_INT: {
+                int64_t v;
+                std::memcpy(&v, p + 1, 8);
+                std::snprintf(number, sizeof(number), "%lld", static_cast<long long>(v));
+                out.append(number);
+                p += 9;
+                break;
+            }
+            case TAG_UINT: {
+                uint64_t v;
+                std::memcpy(&v, p + 1, 8);
+                std::snprintf(number, sizeof(number), "%llu", static_cast<unsigned long long>(v));
+                out.append(number);
+                p += 9;
+                break;
+            }
+            case TAG_DOUBLE: {
+                double v;
+                std::memcpy(&v, p + 1, 8);
+                std::snprintf(number, sizeof(number), "%g", v);
+                out.append(number);
+                p += 9;
+                break;
+            }
+            case TAG_BOOL:
+                out.append(p[1] ? "true" : "false");
+                p += 2;
+                break;
+            case TAG_STRING: {
+                uint16_t size;
+                std::memcpy(&size, p + 1, 2);
+                out.append(reinterpret_cast<const char*>(p + 3), size);
+                p += 3 + size;
+                break;
+            }
+            default:
+                p = end;  // padding
+                break;
+        }
+    };
+    
+    for (const char* f = info.format; *f; ++f) {
+        if (f[0] == '{' && f[1] == '}' && p < end && *p != 0) {
+            append_arg();
+            ++f;
+        } else {
+            out.push_back(*f);
+        }
+    }
+    // Arguments without a placeholder go at the end
+    while (p < end && *p != 0) {
+        out.push_back(' ');
+        append_arg();
+    }
+    out.push_back('\n');
+}
+
+// ============================================================================
+// log builtin
+// ============================================================================
+
+namespace {
+
+void log_message(std::string_view level_name, const Value& message) {
+    static const char* const NAMES[] = {"trace", "debug", "info", "warn", "error"};
+    size_t level = 0;
+    while (level < 5 && level_name != NAMES[level]) {
+        level++;
+    }
+    if (level == 5) {
+        throw VMException("log: unknown level '" + std::string(level_name) + "'");
+    }
+    
+    Logger& logger = Logger::instance();
+    if (!logger.enabled(static_cast<LogLevel>(level))) {
+        return;
+    }
+    // Script records carry no source location
+    static const uint32_t FORMAT_IDS[] = {
+        logger.register_format(LogLevel::TRACE, "", 0, "{}"),
+        logger.register_format(LogLevel::DEBUG, "", 0, "{}"),
+        logger.register_format(LogLevel::INFO, "", 0, "{}"),
+        logger.register_format(LogLevel::WARN, "", 0, "{}"),
+        logger.register_format(LogLevel::ERROR, "", 0, "{}"),
+    };
+    if (message.is_string()) {
+        logger.write(FORMAT_IDS[level], "{}", message.as_string());
+    } else {
+        logger.write(FORMAT_IDS[level], "{}", message.to_string());
+    }
+}
+
+} // namespace
+
+void register_log_builtins(VirtualMachine& vm) {
+    bind_native<&log_message>(vm, "log");
+}
+
+} // namespace rplus
@@ -0,0 +1,231 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace rplus {
+
+class VirtualMachine;
+
+/**
+ * Asynchronous structured logger
+ *
+ *     RPLUS_LOG(LogLevel::WARN, "slow call to {} took {} ms", name, ms);
+ *
+ * The hot path does no formatting and takes no lock. Each call site
+ * registers its format string once and gets a format id. A log call then
+ * writes a binary record (timestamp, format id, tagged arguments) into a
+ * ring buffer owned by the calling thread, with a single producer and a
+ * single consumer. A background thread drains all rings every few
+ * milliseconds, formats the records in timestamp order and writes each
+ * batch with one fwrite.
+ *
+ * Records are dropped rather than blocking when a ring is full; dropped()
+ * counts them. Strings are copied into the record (truncated to
+ * MAX_STRING bytes), so arguments need not outlive the call.
+ */
+
+enum class LogLevel : uint8_t {
+    TRACE,
+    DEBUG,
+    INFO,
+    WARN,
+    ERROR
+};
+
+const char* log_level_name(LogLevel level);
+
+class LogRing;
+
+class Logger {
+public:
+    static constexpr size_t MAX_STRING = 1024;
+
+    static Logger& instance();
+
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+
+    bool enabled(LogLevel level) const {
+        return static_cast<uint8_t>(level) >= min_level_.load(std::memory_order_relaxed);
+    }
+    void set_level(LogLevel level) { min_level_.store(static_cast<uint8_t>(level)); }
+
+    // Defaults to stderr. The stream is written by the flush thread only.
+    void set_output(std::FILE* output);
+
+    // Called once per call site by RPLUS_LOG
+    uint32_t register_format(LogLevel level, const char* file, int line, const char* format);
+
+    template <typename... Args>
+    void write(uint32_t format_id, const char* /*format*/, const Args&... args);
+
+    // Format and write everything logged so far before returning
+    void flush();
+
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+    // Argument tags in the record payload; zero bytes pad the record end
+    enum Tag : uint8_t {
+        TAG_INT = 1,
+        TAG_UINT,
+        TAG_DOUBLE,
+        TAG_BOOL,
+        TAG_STRING
+    };
+
+    struct FormatInfo {
+        LogLevel level;
+        const char* file;
+        int line;
+        const char* format;
+    };
+
+    std::atomic<uint8_t> min_level_{static_cast<uint8_t>(LogLevel::INFO)};
+    std::atomic<uint64_t> dropped_{0};
+
+    std::mutex formats_mutex_;
+    std::deque<FormatInfo> formats_;
+
+    std::mutex rings_mutex_;
+    std::vector<std::shared_ptr<LogRing>> rings_;
+
+    std::mutex drain_mutex_;  // only one consumer per ring at a time
+    std::FILE* output_ = stderr;
+    std::string batch_;
+    int64_t cached_second_ = -1;
+    std::string cached_date_;
+
+    std::mutex wake_mutex_;
+    std::condition_variable wake_;
+    bool stopping_ = false;
+    std::thread flusher_;
+
+    Logger();
+    ~Logger();
+
+    LogRing& thread_ring();
+    uint8_t* reserve(size_t size);
+    void commit();
+    void drain();
+    void format_record(const uint8_t* record, const std::deque<FormatInfo>& formats,
+                       std::string& out);
+
+    // Payload encoding. A null C string is logged as an empty one.
+    static std::string_view string_arg(const char* s) { return s ? std::string_view(s) : std::string_view(); }
+    static size_t encoded_size(bool) { return 2; }
+    static size_t encoded_size(double) { return 9; }
+    static size_t encoded_size(float) { return 9; }
+    static size_t encoded_size(const char* s) { return encoded_size(string_arg(s)); }
+    static size_t encoded_size(std::string_view s) { return 3 + std::min(s.size(), MAX_STRING); }
+    static size_t encoded_size(const std::string& s) { return 3 + std::min(s.size(), MAX_STRING); }
+    template <typename T, typename = std::enable_if_t<std::is_integral<T>::value>>
+    static size_t encoded_size(T) { return 9; }
+
+    static uint8_t* encode(uint8_t* p, bool b) {
+        p[0] = TAG_BOOL;
+        p[1] = b ? 1 : 0;
+        return p + 2;
+    }
+    static uint8_t* encode(uint8_t* p, double d) {
+        p[0] = TAG_DOUBLE;
+        std::memcpy(p + 1, &d, 8);
+        return p + 9;
+    }
+    static uint8_t* encode(uint8_t* p, float f) { return encode(p, static_cast<double>(f)); }
+    static uint8_t* encode(uint8_t* p, std::string_view s) {
+        uint16_t length = static_cast<uint16_t>(std::min(s.size(), MAX_STRING));
+        p[0] = TAG_STRING;
+        std::memcpy(p + 1, &length, 2);
+        if (length > 0) {
+            std::memcpy(p + 3, s.data(), length);
+        }
+        return p + 3 + length;
+    }
+    static uint8_t* encode(uint8_t* p, const char* s) { return encode(p, string_arg(s)); }
+    static uint8_t* encode(uint8_t* p, const std::string& s) { return encode(p, std::string_view(s)); }
+    template <typename T, typename = std::enable_if_t<std::is_integral<T>::value>>
+    static uint8_t* encode(uint8_t* p, T n) {
+        if constexpr (std::is_signed<T>::value) {
+            int64_t v = n;
+            p[0] = TAG_INT;
+            std::memcpy(p + 1, &v, 8);
+        } else {
+            uint64_t v = n;
+            p[0] = TAG_UINT;
+            std::memcpy(p + 1, &v, 8);
+        }
+        return p + 9;
+    }
+
+    static int64_t timestamp_ns();
+};
+
+// Record layout: header, then the encoded arguments. Records are padded to
+// 8 bytes; a header with format_id PADDING skips to the ring's start.
+struct LogRecordHeader {
+    static constexpr uint32_t PADDING = UINT32_MAX;
+
+    uint32_t size;
+    uint32_t format_id;
+    int64_t timestamp_ns;
+};
+
+template <typename... Args>
+void Logger::write(uint32_t format_id, const char* /*format*/, const Args&... args) {
+    size_t payload = (sizeof(LogRecordHeader) + ... + encoded_size(args));
+    size_t size = (payload + 7) & ~static_cast<size_t>(7);
+
+    uint8_t* record = reserve(size);
+    if (!record) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    LogRecordHeader header{static_cast<uint32_t>(size), format_id, timestamp_ns()};
+    std::memcpy(record, &header, sizeof(header));
+    uint8_t* p = record + sizeof(header);
+    ((p = encode(p, args)), ...);
+    std::memset(p, 0, size - payload);
+    commit();
+}
+
+// Register log(level, message) as a native function. level is one of
+// "trace", "debug", "info", "warn" or "error"; message may be any value.
+void register_log_builtins(VirtualMachine& vm);
+
+namespace detail {
+inline const char* log_format(const char* format) { return format; }
+template <typename... Args>
+const char* log_format(const char* format, const Args&...) { return format; }
+} // namespace detail
+
+} // namespace rplus
+
+// Log through the global logger; the format string must be a literal and
+// uses {} placeholders: RPLUS_LOG(LogLevel::INFO, "loaded {} functions", n)
+#define RPLUS_LOG(level, ...)                                                             \
+    do {                                                                                  \
+        ::rplus::Logger& rplus_logger_ = ::rplus::Logger::instance();                     \
+        if (rplus_logger_.enabled(level)) {                                               \
+            static const uint32_t rplus_log_format_id_ = rplus_logger_.register_format(   \
+                level, __FILE__, __LINE__, ::rplus::detail::log_format(__VA_ARGS__));     \
+            rplus_logger_.write(rplus_log_format_id_, __VA_ARGS__);                       \
+        }                                                                                 \
+    } while (0)
+
+#endif // LOGGER_H
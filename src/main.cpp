@@ -3,9 +3,15 @@
 #include <sstream>
 #include <vector>
 #include <memory>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <atomic>
 #include "lexer.h"
 #include "parser.h"
 #include "compiler.h"
+#include "time_report.h"
+#include "trace.h"
 
 /**
  * @file main.cpp
@@ -18,12 +24,52 @@
  * - Bytecode/native code output
  */
 
+/**
+ * @brief Options for profiling a compile
+ */
+struct ProfilingOptions {
+    bool print = false;        ///< --time-report: print the pass breakdown
+    std::string jsonPath;      ///< --time-report-json=<file>: write it as JSON
+    std::string tracePath;     ///< --trace-events=<file>: write trace-event JSON
+    
+    bool timeReport() const { return print || !jsonPath.empty(); }
+    bool enabled() const { return timeReport() || !tracePath.empty(); }
+};
+
 // Forward declarations
 void printUsage(const char* programName);
 void printVersion();
 std::string readFile(const std::string& filename);
 bool compileFile(const std::string& inputFile, const std::string& outputFile);
 bool compileString(const std::string& source, const std::string& outputFile);
+ProfilingOptions extractProfilingOptions(int& argc, char* argv[]);
+bool compileFileWithReport(const std::string& inputFile, const std::string& outputFile,
+                           const ProfilingOptions& options);
+
+// Set while a time report is being taken
+static std::atomic<bool> countAllocations{false};
+
+// Count allocations for the time report. Only this program replaces the
+// global allocator; embedders of the runtime see zero allocations, and
+// without a report requested this is a plain malloc.
+void* operator new(std::size_t size) {
+    void* memory = std::malloc(size ? size : 1);
+    if (!memory) {
+        throw std::bad_alloc();
+    }
+    if (countAllocations.load(std::memory_order_relaxed)) {
+        rplus::detail::count_allocation(size);
+    }
+    return memory;
+}
+
+void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void* memory, std::size_t) noexcept {
+    std::free(memory);
+}
 
 /**
  * @brief Main entry point
@@ -36,6 +82,7 @@ int main(int argc, char* argv[]) {
     std::cout << std::endl;
     
     // Parse command line arguments
+    ProfilingOptions profiling = extractProfilingOptions(argc, argv);
     if (argc < 2) {
         printUsage(argv[0]);
         return 1;
@@ -66,7 +113,7 @@ int main(int argc, char* argv[]) {
         std::cout << "Compiling: " << inputFile << std::endl;
         std::cout << "Output: " << outputFile << std::endl;
         
-        if (!compileFile(inputFile, outputFile)) {
+        if (!compileFileWithReport(inputFile, outputFile, profiling)) {
             std::cerr << "Compilation failed!" << std::endl;
             return 1;
         }
@@ -139,7 +186,7 @@ int main(int argc, char* argv[]) {
     std::cout << "Compiling: " << inputFile << std::endl;
     std::cout << "Output: " << outputFile << std::endl;
     
-    if (!compileFile(inputFile, outputFile)) {
+    if (!compileFileWithReport(inputFile, outputFile, profiling)) {
         std::cerr << "Compilation failed!" << std::endl;
         return 1;
     }
@@ -160,10 +207,16 @@ void printUsage(const char* programName) {
     std::cout << "  -v, --version               Show version information" << std::endl;
     std::cout << "  -h, --help                  Show this help message" << std::endl;
     std::cout << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "  --time-report               Print time and allocations per compiler pass" << std::endl;
+    std::cout << "  --time-report-json=<file>   Write the same report as JSON" << std::endl;
+    std::cout << "  --trace-events=<file>       Write compile phases as Chrome trace events" << std::endl;
+    std::cout << std::endl;
     std::cout << "Examples:" << std::endl;
     std::cout << "  " << programName << " compile hello.rp" << std::endl;
     std::cout << "  " << programName << " hello.rp output.rpx" << std::endl;
     std::cout << "  " << programName << " interactive" << std::endl;
+    std::cout << "  " << programName << " compile hello.rp --time-report" << std::endl;
 }
 
 /**
@@ -202,7 +255,11 @@ bool compileFile(const std::string& inputFile, const std::string& outputFile) {
     try {
         // Read source file
         std::cout << "[1/5] Reading source file..." << std::endl;
-        std::string source = readFile(inputFile);
+        std::string source;
+        {
+            rplus::PassTimer timer("read source");
+            source = readFile(inputFile);
+        }
         std::cout << "  OK - " << source.length() << " bytes" << std::endl;
         
         // Lexical analysis
@@ -221,11 +278,16 @@ bool compileFile(const std::string& inputFile, const std::string& outputFile) {
         std::cout << "[4/5] Code generation..." << std::endl;
         Compiler compiler;
         compiler.setOptimizationLevel(2);
-        std::string code = compiler.generateCode(source);
+        std::string code;
+        {
+            rplus::PassTimer timer("generate code");
+            code = compiler.generateCode(source);
+        }
         std::cout << "  OK - Code generated" << std::endl;
         
         // Write output
         std::cout << "[5/5] Writing output file..." << std::endl;
+        rplus::PassTimer timer("write output");
         std::ofstream outfile(outputFile, std::ios::binary);
         if (!outfile.is_open()) {
             std::cerr << "Error: Cannot open output file" << std::endl;
@@ -273,3 +335,71 @@ bool compileString(const std::string& source, const std::string& outputFile) {
         return false;
     }
 }
+
+/**
+ * @brief Remove the profiling options from the command line
+ * @return The options found; argc and argv are left holding the rest
+ */
+ProfilingOptions extractProfilingOptions(int& argc, char* argv[]) {
+    static const char jsonOption[] = "--time-report-json=";
+    static const char traceOption[] = "--trace-events=";
+    ProfilingOptions options;
+    int kept = 1;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--time-report") == 0) {
+            options.print = true;
+        } else if (std::strncmp(argv[i], jsonOption, sizeof(jsonOption) - 1) == 0) {
+            options.jsonPath = argv[i] + sizeof(jsonOption) - 1;
+        } else if (std::strncmp(argv[i], traceOption, sizeof(traceOption) - 1) == 0) {
+            options.tracePath = argv[i] + sizeof(traceOption) - 1;
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    argc = kept;
+    return options;
+}
+
+/**
+ * @brief Compile a source file, reporting time and allocations per pass
+ * and recording trace events as requested
+ */
+bool compileFileWithReport(const std::string& inputFile, const std::string& outputFile,
+                           const ProfilingOptions& options) {
+    if (!options.enabled()) {
+        return compileFile(inputFile, outputFile);
+    }
+    
+    rplus::TimeReport report;
+    if (options.timeReport()) {
+        countAllocations.store(true, std::memory_order_relaxed);
+        report.start();
+    }
+    if (!options.tracePath.empty()) {
+        rplus::Tracer::global().set_thread_name("rplus compile");
+        rplus::Tracer::global().start();
+    }
+    bool ok = compileFile(inputFile, outputFile);
+    rplus::Tracer::global().stop();
+    report.stop();
+    countAllocations.store(false, std::memory_order_relaxed);
+    
+    if (options.print) {
+        std::cout << std::endl << "Time report:" << std::endl << report.format();
+    }
+    if (!options.jsonPath.empty()) {
+        if (report.write_json(options.jsonPath)) {
+            std::cout << "Time report written to " << options.jsonPath << std::endl;
+        } else {
+            std::cerr << "Error: Cannot write time report to " << options.jsonPath << std::endl;
+        }
+    }
+    if (!options.tracePath.empty()) {
+        if (rplus::Tracer::global().flush(options.tracePath)) {
+            std::cout << "Trace written to " << options.tracePath << std::endl;
+        } else {
+            std::cerr << "Error: Cannot write trace to " << options.tracePath << std::endl;
+        }
+    }
+    return ok;
+}
@@ -0,0 +1,407 @@
+#include "metrics.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace rplus {
+
+namespace detail {
+
+size_t metric_shard() {
+    static std::atomic<size_t> next{0};
+    thread_local size_t shard = next.fetch_add(1, std::memory_order_relaxed) % METRIC_SHARDS;
+    return shard;
+}
+
+} // namespace detail
+
+namespace {
+
+int64_t monotonic_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Prometheus float formatting; integers print without an exponent
+std::string format_value(double value) {
+    if (std::isinf(value)) {
+        return value > 0 ? "+Inf" : "-Inf";
+    }
+    if (std::isnan(value)) {
+        return "NaN";
+    }
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%.17g", value);
+    // %.17g round-trips but is noisy; use the shortest form that does too
+    for (int precision = 1; precision < 17; ++precision) {
+        char shorter[32];
+        std::snprintf(shorter, sizeof(shorter), "%.*g", precision, value);
+        if (std::strtod(shorter, nullptr) == value) {
+            return shorter;
+        }
+    }
+    return buffer;
+}
+
+// Exposed histogram buckets: le = 4^k recorded units for k in
+// [0, EXPOSED_BUCKETS), the same for every histogram and every scrape
+// (1 ns to about 18 minutes for latencies)
+constexpr unsigned EXPOSED_BUCKETS = 21;
+
+void append_header(std::string& out, const std::string& name, const std::string& help,
+                   const char* type) {
+    out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+    out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+}
+
+} // namespace
+
+// ============================================================================
+// Counter and Histogram
+// ============================================================================
+
+uint64_t Counter::value() const {
+    uint64_t total = 0;
+    for (const Shard& shard : shards_) {
+        total += shard.value.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+Histogram::Histogram(double scale) : scale_(scale) {}
+
+Histogram::~Histogram() {
+    for (auto& shard : shards_) {
+        delete shard.load();
+    }
+}
+
+Histogram::Shard* Histogram::allocate_shard(size_t index) {
+    Shard* fresh = new Shard();
+    Shard* expected = nullptr;
+    // Threads sharing a shard may race to allocate it
+    if (!shards_[index].compare_exchange_strong(expected, fresh, std::memory_order_acq_rel)) {
+        delete fresh;
+        return expected;
+    }
+    return fresh;
+}
+
+uint64_t Histogram::bucket_upper_bound(size_t index) {
+    if (index < 2 * SUB_BUCKETS) {
+        return index;
+    }
+    unsigned shift = static_cast<unsigned>(index / SUB_BUCKETS) - 1;
+    uint64_t lower = static_cast<uint64_t>(index % SUB_BUCKETS + SUB_BUCKETS) << shift;
+    return lower + ((uint64_t(1) << shift) - 1);
+}
+
+Histogram::Snapshot Histogram::snapshot() const {
+    Snapshot snapshot;
+    snapshot.counts.assign(BUCKETS, 0);
+    for (const auto& slot : shards_) {
+        const Shard* shard = slot.load(std::memory_order_acquire);
+        if (!shard) {
+            continue;
+        }
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            snapshot.counts[i] += shard->counts[i].load(std::memory_order_relaxed);
+        }
+        snapshot.sum += shard->sum.load(std::memory_order_relaxed);
+    }
+    for (uint64_t count : snapshot.counts) {
+        snapshot.count += count;
+    }
+    return snapshot;
+}
+
+uint64_t Histogram::Snapshot::value_at_quantile(double quantile) const {
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(std::ceil(std::min(std::max(quantile, 0.0), 1.0) * count));
+    rank = std::max<uint64_t>(rank, 1);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); ++i) {
+        seen += counts[i];
+        if (seen >= rank) {
+            return bucket_upper_bound(i);
+        }
+    }
+    return bucket_upper_bound(counts.size() - 1);
+}
+
+ScopedTimer::ScopedTimer(Histogram& histogram) : histogram_(histogram), start_ns_(monotonic_ns()) {}
+
+ScopedTimer::~ScopedTimer() {
+    histogram_.record(static_cast<uint64_t>(monotonic_ns() - start_ns_));
+}
+
+// ============================================================================
+// MetricsRegistry
+// ============================================================================
+
+MetricsRegistry& MetricsRegistry::global() {
+    static MetricsRegistry registry;
+    return registry;
+}
+
+MetricsRegistry::Entry* MetricsRegistry::find_or_add(const std::string& name,
+                                                     const std::string& help, Kind kind) {
+    for (auto& entry : entries_) {
+        if (entry->name == name) {
+            if (entry->kind != kind) {
+                throw std::invalid_argument("Metric '" + name + "' registered with another type");
+            }
+            return entry.get();
+        }
+    }
+    entries_.push_back(std::make_unique<Entry>());
+    Entry* entry = entries_.back().get();
+    entry->name = name;
+    entry->help = help;
+    entry->kind = kind;
+    return entry;
+}
+
+Counter& MetricsRegistry::counter(const std::string& name, const std::string& help) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Entry* entry = find_or_add(name, help, Kind::COUNTER);
+    if (!entry->counter) {
+        entry->counter = std::make_unique<Counter>();
+    }
+    return *entry->counter;
+}
+
+Gauge& MetricsRegistry::gauge(const std::string& name, const std::string& help) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Entry* entry = find_or_add(name, help, Kind::GAUGE);
+    if (!entry->gauge) {
+        entry->gauge = std::make_unique<Gauge>();
+    }
+    return *entry->gauge;
+}
+
+Histogram& MetricsRegistry::histogram(const std::string& name, const std::string& help,
+                                      double scale) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Entry* entry = find_or_add(name, help, Kind::HISTOGRAM);
+    if (!entry->histogram) {
+        entry->histogram = std::make_unique<Histogram>(scale);
+    }
+    return *entry->histogram;
+}
+
+void MetricsRegistry::gauge_callback(const std::string& name, const std::string& help,
+                                     std::function<double()> read) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    find_or_add(name, help, Kind::CALLBACK)->read = std::move(read);
+}
+
+std::string MetricsRegistry::scrape() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string out;
+    
+    for (const auto& entry : entries_) {
+        switch (entry->kind) {
+            case Kind::COUNTER:
+                append_header(out, entry->name, entry->help, "counter");
+                out.append(entry->name).append(" ")
+                   .append(std::to_string(entry->counter->value())).append("\n");
+                break;
+            case Kind::GAUGE:
+                append_header(out, entry->name, entry->help, "gauge");
+                out.append(entry->name).append(" ")
+                   .append(format_value(entry->gauge->value())).append("\n");
+                break;
+            case Kind::CALLBACK:
+                append_header(out, entry->name, entry->help, "gauge");
+                out.append(entry->name).append(" ")
+                   .append(format_value(entry->read ? entry->read() : 0.0)).append("\n");
+                break;
+            case Kind::HISTOGRAM: {
+                append_header(out, entry->name, entry->help, "histogram");
+                const Histogram& histogram = *entry->histogram;
+                Histogram::Snapshot snapshot = histogram.snapshot();
+                
+                // Cumulative buckets at a fixed set of bounds, so series
+                // line up across scrapes; the fine HDR buckets stay
+                // internal. A bound counts the HDR buckets entirely at or
+                // below it.
+                uint64_t cumulative = 0;
+                size_t bucket = 0;
+                for (unsigned k = 0; k < EXPOSED_BUCKETS; ++k) {
+                    uint64_t bound = uint64_t(1) << (2 * k);
+                    while (bucket < snapshot.counts.size() &&
+                           Histogram::bucket_upper_bound(bucket) <= bound) {
+                        cumulative += snapshot.counts[bucket++];
+                    }
+                    out.append(entry->name).append("_bucket{le=\"")
+                       .append(format_value(static_cast<double>(bound) * histogram.scale()))
+                       .append("\"} ").append(std::to_string(cumulative)).append("\n");
+                }
+                out.append(entry->name).append("_bucket{le=\"+Inf\"} ")
+                   .append(std::to_string(snapshot.count)).append("\n");
+                out.append(entry->name).append("_sum ")
+                   .append(format_value(static_cast<double>(snapshot.sum) * histogram.scale()))
+                   .append("\n");
+                out.append(entry->name).append("_count ")
+                   .append(std::to_string(snapshot.count)).append("\n");
+                break;
+            }
+        }
+    }
+    return out;
+}
+
+bool MetricsRegistry::write_file(const std::string& path) const {
+    std::string text = scrape();
+    std::string temporary = path + ".tmp";
+    std::FILE* file = std::fopen(temporary.c_str(), "w");
+    if (!file) {
+        return false;
+    }
+    bool ok = std::fwrite(text.data(), 1, text.size(), file) == text.size();
+    ok = std::fclose(file) == 0 && ok;
+    if (!ok || std::rename(temporary.c_str(), path.c_str()) != 0) {
+        std::remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+// ============================================================================
+// MetricsServer
+// ============================================================================
+
+MetricsServer::MetricsServer(MetricsRegistry& registry, uint16_t port, const std::string& address)
+    : registry_(registry), address_(address), port_(port) {}
+
+MetricsServer::~MetricsServer() {
+    stop();
+}
+
+bool MetricsServer::start() {
+    if (running_) {
+        return true;
+    }
+    listen_fd_ = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd_ < 0) {
+        return false;
+    }
+    int reuse = 1;
+    ::setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port_);
+    if (::inet_pton(AF_INET, address_.c_str(), &addr.sin_addr) != 1 ||
+        ::bind(listen_fd_, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0 ||
+        ::listen(listen_fd_, 16) != 0) {
+        ::close(listen_fd_);
+        listen_fd_ = -1;
+        return false;
+    }
+    socklen_t length = sizeof(addr);
+    ::getsockname(listen_fd_, reinterpret_cast<struct sockaddr*>(&addr), &length);
+    port_ = ntohs(addr.sin_port);
+    
+    running_ = true;
+    thread_ = std::thread([this]() { serve(); });
+    return true;
+}
+
+void MetricsServer::stop() {
+    if (!running_.exchange(false)) {
+        return;
+    }
+    thread_.join();
+    ::close(listen_fd_);
+    listen_fd_ = -1;
+}
+
+void MetricsServer::serve() {
+    while (running_) {
+        // Wake periodically to notice stop()
+        struct pollfd pfd = {listen_fd_, POLLIN, 0};
+        if (::poll(&pfd, 1, 200) <= 0) {
+            continue;
+        }
+        int client = ::accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client >= 0) {
+            handle(client);
+            ::close(client);
+        }
+    }
+}
+
+void MetricsServer::handle(int client_fd) {
+    // Only the request line matters; read until the end of the headers
+    std::string request;
+    char buffer[1024];
+    struct timeval timeout = {2, 0};
+    ::setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+        ssize_t n = ::recv(client_fd, buffer, sizeof(buffer), 0);
+        if (n <= 0) {
+            return;
+        }
+        request.append(buffer, static_cast<size_t>(n));
+    }
+    
+    std::string body;
+    const char* status;
+    const char* type = "text/plain; version=0.0.4; charset=utf-8";
+    if (request.compare(0, 12, "GET /metrics") == 0 && (request[12] == ' ' || request[12] == '?')) {
+        status = "200 OK";
+        body = registry_.scrape();
+    } else {
+        status = "404 Not Found";
+        body = "Not Found\n";
+    }
+    
+    std::string response = std::string("HTTP/1.1 ") + status + "\r\nContent-Type: " + type +
+                           "\r\nContent-Length: " + std::to_string(body.size()) +
+                           "\r\nConnection: close\r\n\r\n" + body;
+    size_t sent = 0;
+    while (sent < response.size()) {
+        ssize_t n = ::send(client_fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return;
+        }
+        sent += static_cast<size_t>(n);
+    }
+}
+
+// ============================================================================
+// Runtime metrics
+// ============================================================================
+
+RuntimeMetrics& runtime_metrics() {
+    static RuntimeMetrics metrics{
+        MetricsRegistry::global().counter(
+            "rplus_vm_instructions_total", "Bytecode instructions executed"),
+        MetricsRegistry::global().counter(
+            "rplus_vm_calls_total", "Function calls into bytecode"),
+        MetricsRegistry::global().counter(
+            "rplus_vm_runtime_errors_total", "Runtime errors raised by the VM"),
+        MetricsRegistry::global().histogram(
+            "rplus_compile_duration_seconds", "Time to compile one module", 1e-9),
+        MetricsRegistry::global().histogram(
+            "rplus_invoke_duration_seconds", "ExecutionContext::invoke latency", 1e-9),
+        MetricsRegistry::global().histogram(
+            "rplus_optimize_duration_seconds", "Time to optimise one function in the background", 1e-9),
+    };
+    return metrics;
+}
+
+} // namespace rplus
@@ -0,0 +1,235 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace rplus {
+
+/**
+ * Runtime metrics
+ *
+ * Counters and histograms are sharded: each thread updates its own
+ * cache-line-sized shard with a relaxed atomic add, so recording never
+ * contends with other threads. The shards are only summed when the
+ * registry is scraped. Output is Prometheus text exposition format,
+ * served over HTTP by MetricsServer or written with write_file.
+ *
+ *     static Counter& requests = MetricsRegistry::global().counter(
+ *         "rplus_requests_total", "Requests handled");
+ *     requests.add();
+ */
+
+namespace detail {
+
+constexpr size_t METRIC_SHARDS = 16;
+
+// Shard used by the calling thread; threads are assigned round-robin
+size_t metric_shard();
+
+} // namespace detail
+
+class Counter {
+public:
+    void add(uint64_t n = 1) {
+        shards_[detail::metric_shard()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+    uint64_t value() const;
+
+private:
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> value{0};
+    };
+    Shard shards_[detail::METRIC_SHARDS];
+};
+
+class Gauge {
+public:
+    void set(double value) { value_.store(value, std::memory_order_relaxed); }
+    double value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<double> value_{0.0};
+};
+
+/**
+ * Log-linear histogram in the style of HdrHistogram
+ *
+ * Values are unsigned integers in the recording unit (nanoseconds for
+ * latencies). Each power of two is split into 2^SUB_BUCKET_BITS linear
+ * buckets, so any recorded value is reproduced within 1/2^SUB_BUCKET_BITS
+ * (about 3%) of its true value, across the full 64-bit range. Recording is
+ * two shifts and an atomic add in the thread's shard.
+ */
+class Histogram {
+public:
+    static constexpr unsigned SUB_BUCKET_BITS = 5;
+    static constexpr size_t SUB_BUCKETS = size_t(1) << SUB_BUCKET_BITS;
+    static constexpr size_t BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    // scale converts recorded values to the exposed unit, e.g. 1e-9 to
+    // expose nanosecond recordings as seconds
+    explicit Histogram(double scale = 1.0);
+
+    ~Histogram();
+
+    Histogram(const Histogram&) = delete;
+    Histogram& operator=(const Histogram&) = delete;
+
+    void record(uint64_t value) {
+        size_t index = detail::metric_shard();
+        Shard* shard = shards_[index].load(std::memory_order_acquire);
+        if (!shard) {
+            shard = allocate_shard(index);
+        }
+        shard->counts[bucket_index(value)].fetch_add(1, std::memory_order_relaxed);
+        shard->sum.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    // Aggregated view of all shards at the time of the call
+    struct Snapshot {
+        std::vector<uint64_t> counts;  // per bucket
+        uint64_t count = 0;
+        uint64_t sum = 0;
+
+        // Recorded value at or below which the given fraction (0..1) of
+        // recordings fall, to histogram precision
+        uint64_t value_at_quantile(double quantile) const;
+    };
+    Snapshot snapshot() const;
+
+    double scale() const { return scale_; }
+
+    static size_t bucket_index(uint64_t value) {
+        if (value < SUB_BUCKETS) {
+            return static_cast<size_t>(value);
+        }
+        unsigned exponent = 63 - static_cast<unsigned>(__builtin_clzll(value));
+        unsigned shift = exponent - SUB_BUCKET_BITS;
+        // Top SUB_BUCKET_BITS + 1 bits of the value, leading one dropped
+        size_t sub = static_cast<size_t>(value >> shift) - SUB_BUCKETS;
+        return (shift + 1) * SUB_BUCKETS + sub;
+    }
+    // Largest value that maps to bucket index
+    static uint64_t bucket_upper_bound(size_t index);
+
+private:
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> counts[BUCKETS] = {};
+        std::atomic<uint64_t> sum{0};
+    };
+    double scale_;
+    // Allocated on a thread's first recording; most shards of most
+    // histograms stay empty
+    std::atomic<Shard*> shards_[detail::METRIC_SHARDS] = {};
+
+    Shard* allocate_shard(size_t index);
+};
+
+// Records the time from construction to destruction, in nanoseconds
+class ScopedTimer {
+public:
+    explicit ScopedTimer(Histogram& histogram);
+    ~ScopedTimer();
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+    Histogram& histogram_;
+    int64_t start_ns_;
+};
+
+class MetricsRegistry {
+public:
+    static MetricsRegistry& global();
+
+    // Metrics live as long as the registry; registering an existing name
+    // of the same kind returns the existing metric
+    Counter& counter(const std::string& name, const std::string& help);
+    Gauge& gauge(const std::string& name, const std::string& help);
+    Histogram& histogram(const std::string& name, const std::string& help, double scale = 1.0);
+    // Gauge whose value is computed at scrape time
+    void gauge_callback(const std::string& name, const std::string& help,
+                        std::function<double()> read);
+
+    // Prometheus text exposition format, version 0.0.4
+    std::string scrape() const;
+
+    // Write a scrape to path atomically (via a temporary file and rename)
+    bool write_file(const std::string& path) const;
+
+private:
+    enum class Kind { COUNTER, GAUGE, HISTOGRAM, CALLBACK };
+
+    struct Entry {
+        std::string name;
+        std::string help;
+        Kind kind;
+        std::unique_ptr<Counter> counter;
+        std::unique_ptr<Gauge> gauge;
+        std::unique_ptr<Histogram> histogram;
+        std::function<double()> read;
+    };
+
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<Entry>> entries_;
+
+    Entry* find_or_add(const std::string& name, const std::string& help, Kind kind);
+};
+
+/**
+ * Serves GET /metrics from a registry on a background thread
+ *
+ * Intended for a local scrape agent: one request per connection, no
+ * keep-alive, bound to the loopback address by default.
+ */
+class MetricsServer {
+public:
+    MetricsServer(MetricsRegistry& registry, uint16_t port, const std::string& address = "127.0.0.1");
+    ~MetricsServer();
+
+    MetricsServer(const MetricsServer&) = delete;
+    MetricsServer& operator=(const MetricsServer&) = delete;
+
+    // Bind and start serving; returns false if the socket could not be bound
+    bool start();
+    void stop();
+
+    // Bound port (useful when constructed with port 0)
+    uint16_t port() const { return port_; }
+
+private:
+    MetricsRegistry& registry_;
+    std::string address_;
+    uint16_t port_;
+    int listen_fd_ = -1;
+    std::atomic<bool> running_{false};
+    std::thread thread_;
+
+    void serve();
+    void handle(int client_fd);
+};
+
+// Metrics maintained by the runtime itself
+struct RuntimeMetrics {
+    Counter& instructions;        // bytecode instructions executed
+    Counter& calls;               // OP_CALL and host calls into the VM
+    Counter& runtime_errors;
+    Histogram& compile_seconds;   // per module
+    Histogram& invoke_seconds;    // ExecutionContext::invoke latency
+    Histogram& optimize_seconds;  // per background optimising compile
+};
+
+RuntimeMetrics& runtime_metrics();
+
+} // namespace rplus
+
+#endif // METRICS_H
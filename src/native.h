@@ -0,0 +1,189 @@
+#ifndef NATIVE_H
+#define NATIVE_H
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include "vm.h"
+
+namespace rplus {
+
+/**
+ * Typed native function binding
+ *
+ * bind_native<&f>(vm, "name") registers an ordinary C++ function such as
+ *
+ *     double f(int64_t n, std::string_view s);
+ *
+ * with the VM. The marshalling thunk is generated at compile time from the
+ * signature: each argument is converted straight from its stack slot via
+ * ValueTraits, with no intermediate vector or boxing, and the result is
+ * converted back to a single Value.
+ */
+
+// Conversion between Value and C++ types. Specialised below for the
+// supported argument and return types.
+template <typename T, typename Enable = void>
+struct ValueTraits;
+
+template <>
+struct ValueTraits<Value> {
+    static const Value& from_value(const Value& v) { return v; }
+    static Value to_value(Value v) { return v; }
+};
+
+template <>
+struct ValueTraits<bool> {
+    static bool from_value(const Value& v) {
+        if (!v.is_bool()) {
+            throw VMException("Native argument: expected bool");
+        }
+        return v.as_bool();
+    }
+    static Value to_value(bool b) { return Value(b); }
+};
+
+template <typename T>
+struct ValueTraits<T, std::enable_if_t<std::is_floating_point<T>::value>> {
+    static T from_value(const Value& v) {
+        if (!v.is_number()) {
+            throw VMException("Native argument: expected number");
+        }
+        return static_cast<T>(v.as_number());
+    }
+    static Value to_value(T n) { return Value(static_cast<double>(n)); }
+};
+
+template <typename T>
+struct ValueTraits<T, std::enable_if_t<std::is_integral<T>::value &&
+                                       !std::is_same<T, bool>::value>> {
+    // Exact conversion only: NaN, infinities, fractions and values outside
+    // T's range are rejected rather than truncated or wrapped
+    static T from_value(const Value& v) {
+        if (v.is_number()) {
+            double n = v.as_number();
+            // [-2^digits, 2^digits) for signed T, [0, 2^digits) for unsigned
+            const double limit = std::ldexp(1.0, std::numeric_limits<T>::digits);
+            const double lowest = std::is_signed<T>::value ? -limit : 0.0;
+            if (n >= lowest && n < limit && std::trunc(n) == n) {
+                return static_cast<T>(n);
+            }
+        }
+        throw VMException("Native argument: expected integer (" + type_name() + ")");
+    }
+    static Value to_value(T n) { return Value(static_cast<double>(n)); }
+    
+private:
+    static std::string type_name() {
+        return (std::is_signed<T>::value ? "int" : "uint") + std::to_string(sizeof(T) * 8) + "_t";
+    }
+};
+
+template <>
+struct ValueTraits<std::string_view> {
+    static std::string_view from_value(const Value& v) {
+        if (!v.is_string()) {
+            throw VMException("Native argument: expected string");
+        }
+        return v.as_string();
+    }
+    static Value to_value(std::string_view s) { return Value(std::string(s)); }
+};
+
+template <>
+struct ValueTraits<std::string> {
+    static std::string from_value(const Value& v) {
+        return std::string(ValueTraits<std::string_view>::from_value(v));
+    }
+    static Value to_value(const std::string& s) { return Value(s); }
+};
+
+namespace detail {
+
+template <typename T>
+using ArgTraits = ValueTraits<std::remove_cv_t<std::remove_reference_t<T>>>;
+
+template <typename Fn>
+struct NativeSignature;
+
+template <typename R, typename... Args>
+struct NativeSignature<R (*)(Args...)> {
+    using Result = R;
+    using Arguments = std::tuple<Args...>;
+    static constexpr size_t arity = sizeof...(Args);
+};
+
+template <auto F, typename R, typename... Args, size_t... I>
+Value invoke_native(const Value* args, std::index_sequence<I...>) {
+    if constexpr (std::is_void<R>::value) {
+        F(ArgTraits<Args>::from_value(args[I])...);
+        return Value();
+    } else {
+        return ArgTraits<R>::to_value(F(ArgTraits<Args>::from_value(args[I])...));
+    }
+}
+
+template <auto F, typename R, typename... Args>
+Value native_thunk_impl(const Value* args, std::tuple<Args...>*) {
+    return invoke_native<F, R, Args...>(args, std::index_sequence_for<Args...>{});
+}
+
+} // namespace detail
+
+// Thunk with the NativeFn signature for the function pointer F. Arity is
+// checked by the VM before the call, so the thunk only converts.
+template <auto F>
+Value native_thunk(VirtualMachine& /*vm*/, const Value* args, uint8_t /*argc*/) {
+    using Signature = detail::NativeSignature<decltype(F)>;
+    return detail::native_thunk_impl<F, typename Signature::Result>(
+        args, static_cast<typename Signature::Arguments*>(nullptr));
+}
+
+// Register F under name and return its OP_CALL_NATIVE index
+template <auto F>
+uint8_t bind_native(VirtualMachine& vm, const std::string& name) {
+    using Signature = detail::NativeSignature<decltype(F)>;
+    static_assert(Signature::arity <= UINT8_MAX, "too many native arguments");
+    return vm.register_native(name, &native_thunk<F>,
+                              static_cast<uint8_t>(Signature::arity));
+}
+
+// Call a compiled R+ function from C++ on the VM's live stack and convert
+// the result, e.g. vm_call<bool>(vm, comparator, a, b). May be used from
+// inside native functions and host callbacks while the VM is running.
+template <typename R = Value, typename... Args>
+R vm_call(VirtualMachine& vm, const Chunk& function, Args&&... args) {
+    static_assert(!std::is_same<R, std::string_view>::value,
+                  "string_view result would outlive the returned value");
+    static_assert(sizeof...(Args) <= UINT8_MAX, "too many call arguments");
+    
+    // A conversion or push that throws must not leave earlier arguments
+    // on the caller's stack
+    size_t base = vm.stack_size();
+    try {
+        (vm.push(ValueTraits<std::decay_t<Args>>::to_value(std::forward<Args>(args))), ...);
+    } catch (...) {
+        while (vm.stack_size() > base) {
+            vm.pop();
+        }
+        throw;
+    }
+    Value result = vm.call_function(function, static_cast<uint8_t>(sizeof...(Args)));
+    
+    if constexpr (std::is_void<R>::value) {
+        return;
+    } else if constexpr (std::is_same<R, Value>::value) {
+        return result;
+    } else {
+        return R(ValueTraits<R>::from_value(result));
+    }
+}
+
+} // namespace rplus
+
+#endif // NATIVE_H
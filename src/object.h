@@ -0,0 +1,33 @@
+#ifndef OBJECT_H
+#define OBJECT_H
+
+#include <cstdint>
+
+namespace rplus {
+
+// Kinds of heap object a Value of type OBJECT can refer to
+enum class ObjectKind : uint8_t {
+    MAP,
+    SET,
+    ARRAY
+};
+
+// Base class for reference-counted heap objects. Values hold objects
+// through shared_ptr, so an object lives as long as any Value refers to it.
+class Object {
+public:
+    explicit Object(ObjectKind kind) : kind_(kind) {}
+    virtual ~Object() = default;
+    
+    Object(const Object&) = delete;
+    Object& operator=(const Object&) = delete;
+    
+    ObjectKind kind() const { return kind_; }
+    
+private:
+    ObjectKind kind_;
+};
+
+} // namespace rplus
+
+#endif // OBJECT_H
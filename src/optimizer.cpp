@@ -0,0 +1,564 @@
+#include "optimizer.h"
+#include "feedback.h"
+#include "trace.h"
+#include <algorithm>
+
+namespace rplus {
+
+namespace {
+
+bool is_jump(OpCode op) {
+    return op == OpCode::OP_JUMP || op == OpCode::OP_JUMP_IF_FALSE ||
+           op == OpCode::OP_JUMP_IF_TRUE || op == OpCode::OP_LOOP || op == OpCode::OP_JUMP_BACK;
+}
+
+bool is_backward(OpCode op) {
+    return op == OpCode::OP_LOOP || op == OpCode::OP_JUMP_BACK;
+}
+
+// Typed counterpart of a generic instruction, or the instruction itself
+OpCode number_op(OpCode op) {
+    switch (op) {
+        case OpCode::OP_ADD: return OpCode::OP_ADD_NUMBER;
+        case OpCode::OP_SUBTRACT: return OpCode::OP_SUBTRACT_NUMBER;
+        case OpCode::OP_MULTIPLY: return OpCode::OP_MULTIPLY_NUMBER;
+        case OpCode::OP_DIVIDE: return OpCode::OP_DIVIDE_NUMBER;
+        case OpCode::OP_NEGATE: return OpCode::OP_NEGATE_NUMBER;
+        case OpCode::OP_EQUAL: return OpCode::OP_EQUAL_NUMBER;
+        case OpCode::OP_NOT_EQUAL: return OpCode::OP_NOT_EQUAL_NUMBER;
+        case OpCode::OP_LESS: return OpCode::OP_LESS_NUMBER;
+        case OpCode::OP_LESS_EQUAL: return OpCode::OP_LESS_EQUAL_NUMBER;
+        case OpCode::OP_GREATER: return OpCode::OP_GREATER_NUMBER;
+        case OpCode::OP_GREATER_EQUAL: return OpCode::OP_GREATER_EQUAL_NUMBER;
+        default: return op;
+    }
+}
+
+bool is_arithmetic(OpCode op) {
+    return op == OpCode::OP_ADD || op == OpCode::OP_SUBTRACT || op == OpCode::OP_MULTIPLY ||
+           op == OpCode::OP_DIVIDE || op == OpCode::OP_NEGATE;
+}
+
+// Instructions allowed in an inlined body: no control flow, calls or
+// global writes
+bool inlinable_op(OpCode op) {
+    switch (op) {
+        case OpCode::OP_CONSTANT:
+        case OpCode::OP_GET_GLOBAL:
+        case OpCode::OP_GET_LOCAL:
+        case OpCode::OP_SET_LOCAL:
+        case OpCode::OP_ADD:
+        case OpCode::OP_SUBTRACT:
+        case OpCode::OP_MULTIPLY:
+        case OpCode::OP_DIVIDE:
+        case OpCode::OP_MODULO:
+        case OpCode::OP_NEGATE:
+        case OpCode::OP_EQUAL:
+        case OpCode::OP_NOT_EQUAL:
+        case OpCode::OP_LESS:
+        case OpCode::OP_LESS_EQUAL:
+        case OpCode::OP_GREATER:
+        case OpCode::OP_GREATER_EQUAL:
+        case OpCode::OP_AND:
+        case OpCode::OP_OR:
+        case OpCode::OP_NOT:
+        case OpCode::OP_POP:
+        case OpCode::OP_DUP:
+        case OpCode::OP_RETURN:
+            return true;
+        default:
+            return false;
+    }
+}
+
+} // anonymous namespace
+
+const DeoptPoint* OptimizedFunction::deopt_point(size_t offset) const {
+    auto it = std::lower_bound(deopt_points_.begin(), deopt_points_.end(), offset,
+                               [](const DeoptPoint& point, size_t value) {
+                                   return point.optimized_offset < value;
+                               });
+    if (it == deopt_points_.end() || it->optimized_offset != offset) {
+        return nullptr;
+    }
+    return &*it;
+}
+
+bool OptimizedFunction::inlines(const Chunk& chunk) const {
+    return std::any_of(deopt_points_.begin(), deopt_points_.end(),
+                       [&](const DeoptPoint& point) { return point.inlined == &chunk; });
+}
+
+int64_t OptimizedFunction::osr_entry(size_t baseline_offset) const {
+    auto it = std::lower_bound(osr_entries_.begin(), osr_entries_.end(),
+                               std::make_pair(static_cast<uint32_t>(baseline_offset), 0u));
+    if (it == osr_entries_.end() || it->first != baseline_offset) {
+        return -1;
+    }
+    return it->second;
+}
+
+// ============================================================================
+// Analysis
+// ============================================================================
+
+std::vector<Optimizer::Instruction> Optimizer::decode(const Chunk& chunk) {
+    std::vector<Instruction> code;
+    const std::vector<uint8_t>& bytes = chunk.code();
+    for (size_t offset = 0; offset < bytes.size();) {
+        Instruction instruction{static_cast<uint32_t>(offset), static_cast<OpCode>(bytes[offset]),
+                                0, 0, 0};
+        size_t length = instruction_length(instruction.op);
+        if (offset + length > bytes.size()) {
+            break;
+        }
+        if (length >= 2) {
+            instruction.a = bytes[offset + 1];
+        }
+        if (length >= 3) {
+            instruction.b = bytes[offset + 2];
+            // Big-endian, matching read_short
+            instruction.jump = static_cast<uint16_t>(bytes[offset + 1] << 8 | bytes[offset + 2]);
+        }
+        code.push_back(instruction);
+        offset += length;
+    }
+    return code;
+}
+
+/**
+ * Values an instruction pops and pushes. Conditional jumps leave their
+ * condition on the stack for a following OP_POP.
+ */
+void Optimizer::stack_effect(const Instruction& instruction, int& pops, int& pushes) {
+    pops = 0;
+    pushes = 0;
+    switch (instruction.op) {
+        case OpCode::OP_CONSTANT:
+        case OpCode::OP_GET_GLOBAL:
+        case OpCode::OP_GET_LOCAL:
+        case OpCode::OP_DUP:
+            pushes = 1;
+            break;
+        case OpCode::OP_DEFINE_GLOBAL:
+        case OpCode::OP_POP:
+            pops = 1;
+            break;
+        case OpCode::OP_ADD:
+        case OpCode::OP_SUBTRACT:
+        case OpCode::OP_MULTIPLY:
+        case OpCode::OP_DIVIDE:
+        case OpCode::OP_MODULO:
+        case OpCode::OP_EQUAL:
+        case OpCode::OP_NOT_EQUAL:
+        case OpCode::OP_LESS:
+        case OpCode::OP_LESS_EQUAL:
+        case OpCode::OP_GREATER:
+        case OpCode::OP_GREATER_EQUAL:
+        case OpCode::OP_AND:
+        case OpCode::OP_OR:
+            pops = 2;
+            pushes = 1;
+            break;
+        case OpCode::OP_NEGATE:
+        case OpCode::OP_NOT:
+            pops = 1;
+            pushes = 1;
+            break;
+        case OpCode::OP_CALL:
+        case OpCode::OP_CALL_NATIVE:
+            pops = instruction.b;
+            pushes = 1;
+            break;
+        case OpCode::OP_RETURN:
+            pops = 1;
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Stack height, relative to the frame base, before each instruction.
+ * Unreachable instructions get -1. Fails if heights disagree where paths
+ * meet, a jump leaves the function, or the stack would underflow.
+ */
+bool Optimizer::stack_heights(const std::vector<Instruction>& code, int arity,
+                              std::vector<int>& heights) {
+    heights.assign(code.size(), -1);
+    if (code.empty() || arity < 0) {
+        return false;
+    }
+
+    std::vector<int> index_of(code.back().offset + 1, -1);
+    for (size_t i = 0; i < code.size(); ++i) {
+        index_of[code[i].offset] = static_cast<int>(i);
+    }
+
+    std::vector<size_t> worklist{0};
+    heights[0] = arity;
+    while (!worklist.empty()) {
+        size_t i = worklist.back();
+        worklist.pop_back();
+        const Instruction& instruction = code[i];
+
+        int pops, pushes;
+        stack_effect(instruction, pops, pushes);
+        if (heights[i] < pops) {
+            return false;
+        }
+        int height = heights[i] - pops + pushes;
+        if (height > static_cast<int>(VirtualMachine::STACK_MAX)) {
+            return false;
+        }
+
+        auto flow = [&](int64_t offset) {
+            if (offset < 0 || offset >= static_cast<int64_t>(index_of.size()) ||
+                index_of[offset] < 0) {
+                return false;
+            }
+            int target = index_of[offset];
+            if (heights[target] < 0) {
+                heights[target] = height;
+                worklist.push_back(target);
+                return true;
+            }
+            return heights[target] == height;
+        };
+
+        int64_t next = static_cast<int64_t>(instruction.offset) + 3;
+        switch (instruction.op) {
+            case OpCode::OP_RETURN:
+            case OpCode::OP_EXIT:
+                break;
+            case OpCode::OP_JUMP:
+                if (!flow(next + instruction.jump)) return false;
+                break;
+            case OpCode::OP_LOOP:
+            case OpCode::OP_JUMP_BACK:
+                if (!flow(next - instruction.jump)) return false;
+                break;
+            case OpCode::OP_JUMP_IF_FALSE:
+            case OpCode::OP_JUMP_IF_TRUE:
+                if (!flow(next + instruction.jump)) return false;
+                if (i + 1 < code.size() && !flow(code[i + 1].offset)) return false;
+                break;
+            default:
+                if (i + 1 < code.size() && !flow(code[i + 1].offset)) return false;
+                break;
+        }
+    }
+    return true;
+}
+
+/**
+ * A callee is inlined when it is small, straight-line, ends in its only
+ * OP_RETURN, has always been called with this many arguments, and its
+ * rebased locals and constants still fit their one-byte operands
+ */
+bool Optimizer::inlinable(const Chunk* callee, uint8_t argc, int height) const {
+    if (!callee || snapshot_.live(*callee) == snapshot_.baseline ||
+        callee->size() > MAX_INLINE_SIZE || height < argc) {
+        return false;
+    }
+    const FeedbackVector* feedback = snapshot_.feedback_for(*callee);
+    if (!feedback || feedback->arity() != argc) {
+        return false;
+    }
+    if (result_->code_.constants().size() + callee->constants().size() > UINT8_MAX + 1) {
+        return false;
+    }
+
+    std::vector<Instruction> code = decode(*callee);
+    if (code.empty() || code.back().op != OpCode::OP_RETURN) {
+        return false;
+    }
+    int inline_base = height - argc;
+    for (size_t i = 0; i < code.size(); ++i) {
+        const Instruction& instruction = code[i];
+        if (!inlinable_op(instruction.op)) {
+            return false;
+        }
+        if (instruction.op == OpCode::OP_RETURN && i + 1 != code.size()) {
+            return false;
+        }
+        if ((instruction.op == OpCode::OP_GET_LOCAL || instruction.op == OpCode::OP_SET_LOCAL) &&
+            inline_base + instruction.a > UINT8_MAX) {
+            return false;
+        }
+    }
+    std::vector<int> heights;
+    return stack_heights(code, argc, heights);
+}
+
+// ============================================================================
+// Code Generation
+// ============================================================================
+
+void Optimizer::emit_copy(const Chunk& chunk, const Instruction& instruction, int line) {
+    size_t length = instruction_length(instruction.op);
+    for (size_t i = 0; i < length; ++i) {
+        emit(chunk.get_byte(instruction.offset + i), line);
+    }
+}
+
+/**
+ * Emits the typed form of an arithmetic or comparison instruction whose
+ * feedback has only seen numbers, guarding the operands not already known
+ * to be numbers. Returns false, emitting nothing, if the feedback does not
+ * justify it.
+ */
+bool Optimizer::emit_specialised(const Instruction& instruction, const FeedbackVector& feedback,
+                                 int line, DeoptPoint deopt) {
+    OpCode typed = number_op(instruction.op);
+    const FeedbackSlot* slot = feedback.slot(instruction.offset);
+    if (typed == instruction.op || !slot || slot->state != FeedbackState::MONOMORPHIC) {
+        return false;
+    }
+
+    int operands = instruction.op == OpCode::OP_NEGATE ? 1 : 2;
+    if (operands == 1) {
+        if (slot->entries[0].key != FeedbackSlot::type_key(FeedbackType::NUMBER)) {
+            return false;
+        }
+    } else {
+        FeedbackType left, right;
+        if (!slot->monomorphic_types(left, right) || left != FeedbackType::NUMBER ||
+            right != FeedbackType::NUMBER) {
+            return false;
+        }
+    }
+
+    uint8_t mask = 0;
+    size_t depth = known_numbers_.size();
+    for (int i = 0; i < operands; ++i) {
+        if (depth <= static_cast<size_t>(i) || !known_numbers_[depth - 1 - i]) {
+            mask |= static_cast<uint8_t>(1 << i);
+        }
+    }
+    if (mask) {
+        deopt.optimized_offset = static_cast<uint32_t>(code_.size());
+        result_->deopt_points_.push_back(deopt);
+        emit(static_cast<uint8_t>(OpCode::OP_GUARD_NUMBERS), line);
+        emit(mask, line);
+    }
+    if (typed == OpCode::OP_DIVIDE_NUMBER) {
+        deopt.optimized_offset = static_cast<uint32_t>(code_.size());
+        result_->deopt_points_.push_back(deopt);
+    }
+    emit(static_cast<uint8_t>(typed), line);
+    changed_ = true;
+    return true;
+}
+
+/**
+ * Tracks which stack slots are known to hold numbers across one
+ * instruction. Anything not produced by numeric arithmetic or a number
+ * constant is unknown.
+ */
+void Optimizer::simulate(const Chunk& chunk, const Instruction& instruction,
+                         bool result_is_number) {
+    int pops, pushes;
+    stack_effect(instruction, pops, pushes);
+    uint8_t top = known_numbers_.empty() ? 0 : known_numbers_.back();
+    known_numbers_.resize(known_numbers_.size() - std::min<size_t>(pops, known_numbers_.size()));
+    if (!pushes) {
+        return;
+    }
+
+    uint8_t known = 0;
+    if (instruction.op == OpCode::OP_CONSTANT) {
+        known = chunk.get_constant(instruction.a).is_number();
+    } else if (instruction.op == OpCode::OP_DUP) {
+        known = top;
+    } else {
+        known = result_is_number;
+    }
+    known_numbers_.push_back(known);
+}
+
+/**
+ * Emits a callee's body in place of an OP_CALL. The arguments already sit
+ * where the callee's frame would start, so locals are rebased onto them;
+ * constants are appended to the caller's pool.
+ */
+void Optimizer::emit_inlined(const Chunk& callee, uint8_t argc, int height, int line,
+                             uint32_t call_offset) {
+    const FeedbackVector& feedback = *snapshot_.feedback_for(callee);
+    uint8_t inline_base = static_cast<uint8_t>(height - argc);
+    size_t constant_base = result_->code_.constants().size();
+    for (const Value& constant : callee.constants()) {
+        result_->code_.write_constant(constant);
+    }
+
+    for (const Instruction& instruction : decode(callee)) {
+        bool number_result = false;
+        switch (instruction.op) {
+            case OpCode::OP_CONSTANT:
+            case OpCode::OP_GET_GLOBAL:
+                emit(static_cast<uint8_t>(instruction.op), line);
+                emit(static_cast<uint8_t>(constant_base + instruction.a), line);
+                break;
+            case OpCode::OP_GET_LOCAL:
+            case OpCode::OP_SET_LOCAL:
+                emit(static_cast<uint8_t>(instruction.op), line);
+                emit(static_cast<uint8_t>(inline_base + instruction.a), line);
+                break;
+            case OpCode::OP_RETURN: {
+                emit(static_cast<uint8_t>(OpCode::OP_INLINE_RETURN), line);
+                emit(inline_base, line);
+                uint8_t result = known_numbers_.empty() ? 0 : known_numbers_.back();
+                known_numbers_.resize(std::min<size_t>(inline_base, known_numbers_.size()));
+                known_numbers_.push_back(result);
+                continue;
+            }
+            default: {
+                DeoptPoint deopt{0, instruction.offset, snapshot_.live(callee), call_offset + 3,
+                                 inline_base};
+                if (emit_specialised(instruction, feedback, line, deopt)) {
+                    number_result = is_arithmetic(instruction.op);
+                } else {
+                    emit_copy(callee, instruction, line);
+                }
+                break;
+            }
+        }
+        simulate(callee, instruction, number_result);
+    }
+
+    ++result_->inlined_calls_;
+    changed_ = true;
+}
+
+CompilationSnapshot Optimizer::snapshot(const VirtualMachine& vm, const Chunk& baseline,
+                                       const FeedbackVector& feedback) {
+    CompilationSnapshot snapshot(baseline, feedback);
+    snapshot.feedback.optimized.reset();
+    for (const Instruction& instruction : decode(baseline)) {
+        const Chunk* callee = instruction.op == OpCode::OP_CALL ? vm.function(instruction.a) : nullptr;
+        if (!callee || snapshot.callees.count(instruction.a)) {
+            continue;
+        }
+        CompilationSnapshot::Callee& copy = snapshot.callees[instruction.a];
+        copy.live = callee;
+        copy.code = *callee;
+        if (const FeedbackVector* vector = vm.feedback(*callee)) {
+            copy.feedback = std::make_unique<FeedbackVector>(*vector);
+            copy.feedback->optimized.reset();
+        }
+    }
+    return snapshot;
+}
+
+std::shared_ptr<OptimizedFunction> Optimizer::optimize() {
+    TraceSpan span("jit", "optimize");
+    const Chunk& baseline = snapshot_.baseline_code;
+    const FeedbackVector& feedback = snapshot_.feedback;
+    std::vector<Instruction> code = decode(baseline);
+    std::vector<int> heights;
+    if (!stack_heights(code, feedback.arity(), heights)) {
+        return nullptr;
+    }
+
+    result_.reset(new OptimizedFunction(*snapshot_.baseline));
+    code_.clear();
+    lines_.clear();
+    known_numbers_.clear();
+    changed_ = false;
+    for (const Value& constant : baseline.constants()) {
+        result_->code_.write_constant(constant);
+    }
+
+    // Jump targets start blocks; nothing is known about values on entry
+    std::vector<uint8_t> block_start(code.size(), 0);
+    std::vector<uint8_t> loop_header(code.size(), 0);
+    std::vector<int> index_of(code.back().offset + 1, -1);
+    for (size_t i = 0; i < code.size(); ++i) {
+        index_of[code[i].offset] = static_cast<int>(i);
+    }
+    auto jump_target = [&](const Instruction& instruction) {
+        int64_t next = static_cast<int64_t>(instruction.offset) + 3;
+        int64_t target = is_backward(instruction.op) ? next - instruction.jump
+                                                     : next + instruction.jump;
+        if (target < 0 || target >= static_cast<int64_t>(index_of.size())) {
+            return -1;
+        }
+        return index_of[target];
+    };
+    for (const Instruction& instruction : code) {
+        if (is_jump(instruction.op)) {
+            int target = jump_target(instruction);
+            if (target < 0) {
+                return nullptr;
+            }
+            block_start[target] = 1;
+            loop_header[target] |= instruction.op == OpCode::OP_LOOP;
+        }
+    }
+
+    struct Patch {
+        size_t operand;  // offset of the jump operand in the new code
+        size_t target;   // instruction index
+        bool backward;
+    };
+    std::vector<Patch> patches;
+    std::vector<size_t> new_offset(code.size());
+
+    for (size_t i = 0; i < code.size(); ++i) {
+        const Instruction& instruction = code[i];
+        int line = baseline.get_line(instruction.offset);
+        if (block_start[i] || heights[i] < 0) {
+            known_numbers_.assign(std::max(heights[i], 0), 0);
+        }
+        new_offset[i] = code_.size();
+        if (loop_header[i] && heights[i] >= 0) {
+            result_->osr_entries_.emplace_back(instruction.offset,
+                                               static_cast<uint32_t>(code_.size()));
+        }
+
+        bool number_result = false;
+        if (is_jump(instruction.op)) {
+            emit(static_cast<uint8_t>(instruction.op), line);
+            patches.push_back(Patch{code_.size(), static_cast<size_t>(jump_target(instruction)),
+                                    is_backward(instruction.op)});
+            emit(0, line);
+            emit(0, line);
+        } else if (instruction.op == OpCode::OP_CALL && heights[i] >= 0 &&
+                   inlinable(snapshot_.function(instruction.a), instruction.b, heights[i])) {
+            emit_inlined(*snapshot_.function(instruction.a), instruction.b, heights[i], line,
+                         instruction.offset);
+            continue;
+        } else {
+            DeoptPoint deopt{0, instruction.offset, nullptr, 0, 0};
+            if (emit_specialised(instruction, feedback, line, deopt)) {
+                number_result = is_arithmetic(instruction.op);
+            } else {
+                emit_copy(baseline, instruction, line);
+            }
+        }
+        simulate(baseline, instruction, number_result);
+    }
+
+    if (!changed_) {
+        return nullptr;
+    }
+
+    for (const Patch& patch : patches) {
+        size_t after = patch.operand + 2;
+        size_t target = new_offset[patch.target];
+        size_t distance = patch.backward ? after - target : target - after;
+        if ((patch.backward && target > after) || (!patch.backward && target < after) ||
+            distance > UINT16_MAX) {
+            return nullptr;
+        }
+        code_[patch.operand] = static_cast<uint8_t>(distance >> 8);
+        code_[patch.operand + 1] = static_cast<uint8_t>(distance & 0xff);
+    }
+
+    for (size_t i = 0; i < code_.size(); ++i) {
+        result_->code_.write_byte(code_[i], lines_[i]);
+    }
+    return std::move(result_);
+}
+
+} // namespace rplus
@@ -0,0 +1,190 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "feedback.h"
+#include "vm.h"
+
+namespace rplus {
+
+/**
+ * Optimising bytecode tier
+ *
+ * A hot function is recompiled from its baseline bytecode and the type
+ * feedback collected while it ran:
+ *
+ *   - arithmetic and comparison sites that have only seen numbers become
+ *     typed instructions (OP_ADD_NUMBER, ...) that skip type dispatch,
+ *     preceded by an OP_GUARD_NUMBERS check;
+ *   - guards on values already known to be numbers (constants, results of
+ *     numeric arithmetic) are eliminated;
+ *   - calls to small straight-line functions are inlined: the callee's
+ *     body runs in the caller's frame with its locals rebased, and
+ *     OP_INLINE_RETURN takes the place of the call's frame teardown.
+ *
+ * Loop headers are on-stack replacement entries: a baseline frame that has
+ * looped long enough switches to the optimised code at the same loop
+ * header without waiting for the next call.
+ *
+ * Every guard has a deoptimisation point. When a guard fails, the VM
+ * switches the frame back to the baseline bytecode at the instruction the
+ * guard protected; the stack layout is the same in both. A guard inside an
+ * inlined body also rebuilds the callee's interpreter frame, returning to
+ * the instruction after the baseline call.
+ */
+
+struct DeoptPoint {
+    uint32_t optimized_offset;  // guard in the optimised code
+    uint32_t baseline_offset;   // instruction to resume at in the baseline function
+    const Chunk* inlined;       // baseline callee when the guard is in an inlined body
+    uint32_t caller_resume;     // baseline caller offset after the inlined call
+    uint8_t inline_base;        // callee frame base, relative to the caller's
+};
+
+class OptimizedFunction {
+public:
+    const Chunk& code() const { return code_; }
+    const Chunk& baseline() const { return *baseline_; }
+
+    // Deoptimisation point of the guard at offset, or nullptr
+    const DeoptPoint* deopt_point(size_t offset) const;
+
+    // Offset in the optimised code equivalent to the loop header at
+    // baseline_offset, or -1. Stack slots are laid out identically at both,
+    // so a running frame can switch over between instructions.
+    int64_t osr_entry(size_t baseline_offset) const;
+
+    size_t guard_count() const { return deopt_points_.size(); }
+    size_t inlined_calls() const { return inlined_calls_; }
+    // Whether a body of chunk was inlined (deoptimisation may resume in it)
+    bool inlines(const Chunk& chunk) const;
+
+    uint32_t deopts = 0;
+
+private:
+    friend class Optimizer;
+
+    explicit OptimizedFunction(const Chunk& baseline) : baseline_(&baseline) {}
+
+    Chunk code_;
+    const Chunk* baseline_;
+    std::vector<DeoptPoint> deopt_points_;  // sorted by optimized_offset
+    std::vector<std::pair<uint32_t, uint32_t>> osr_entries_;  // baseline -> optimised, sorted
+    size_t inlined_calls_ = 0;
+};
+
+/**
+ * Everything one compile reads, copied out of the VM when the compile is
+ * requested. The VM keeps running, updating its feedback and possibly
+ * flushing bytecode meanwhile, so the optimiser works on private copies
+ * and may run on another thread. The live chunks are kept only as
+ * identities for the optimised code to refer to.
+ */
+struct CompilationSnapshot {
+    // A function called from the baseline
+    struct Callee {
+        const Chunk* live;
+        Chunk code;
+        std::unique_ptr<FeedbackVector> feedback;  // null if it never ran
+    };
+
+    const Chunk* baseline;  // live
+    Chunk baseline_code;
+    FeedbackVector feedback;
+    std::unordered_map<size_t, Callee> callees;  // by function table index
+
+    CompilationSnapshot(const Chunk& chunk, const FeedbackVector& vector)
+        : baseline(&chunk), baseline_code(chunk), feedback(vector) {}
+
+    // Copy of a function table entry, or nullptr
+    const Chunk* function(size_t index) const {
+        auto it = callees.find(index);
+        return it != callees.end() ? &it->second.code : nullptr;
+    }
+    // Feedback of a copied callee, or nullptr
+    const FeedbackVector* feedback_for(const Chunk& code) const {
+        const Callee* callee = find(code);
+        return callee ? callee->feedback.get() : nullptr;
+    }
+    // Live chunk a copy was taken from
+    const Chunk* live(const Chunk& code) const {
+        const Callee* callee = find(code);
+        return callee ? callee->live : &code == &baseline_code ? baseline : nullptr;
+    }
+    // Whether the compile read chunk
+    bool uses(const Chunk& chunk) const {
+        for (const auto& [index, callee] : callees) {
+            if (callee.live == &chunk) return true;
+        }
+        return baseline == &chunk;
+    }
+
+private:
+    const Callee* find(const Chunk& code) const {
+        for (const auto& [index, callee] : callees) {
+            if (&callee.code == &code) return &callee;
+        }
+        return nullptr;
+    }
+};
+
+class Optimizer {
+public:
+    // Largest callee inlined, in bytes of bytecode
+    static constexpr size_t MAX_INLINE_SIZE = 64;
+
+    // Copies what optimising baseline needs: its bytecode and feedback,
+    // and those of the functions it calls
+    static CompilationSnapshot snapshot(const VirtualMachine& vm, const Chunk& baseline,
+                                        const FeedbackVector& feedback);
+
+    explicit Optimizer(const CompilationSnapshot& snapshot) : snapshot_(snapshot) {}
+
+    // Returns nullptr when the function cannot be optimised, e.g. when its
+    // stack heights cannot be determined or nothing would change
+    std::shared_ptr<OptimizedFunction> optimize();
+
+private:
+    struct Instruction {
+        uint32_t offset;
+        OpCode op;
+        uint8_t a;
+        uint8_t b;
+        uint16_t jump;  // read_short operand of jumps
+    };
+
+    const CompilationSnapshot& snapshot_;
+
+    // Per-compile state
+    std::shared_ptr<OptimizedFunction> result_;
+    std::vector<uint8_t> code_;
+    std::vector<int> lines_;
+    std::vector<uint8_t> known_numbers_;  // abstract stack: 1 = known to be a number
+    bool changed_ = false;
+
+    static std::vector<Instruction> decode(const Chunk& chunk);
+    static void stack_effect(const Instruction& instruction, int& pops, int& pushes);
+    static bool stack_heights(const std::vector<Instruction>& code, int arity,
+                              std::vector<int>& heights);
+    bool inlinable(const Chunk* callee, uint8_t argc, int height) const;
+
+    void emit(uint8_t byte, int line) {
+        code_.push_back(byte);
+        lines_.push_back(line);
+    }
+    void emit_copy(const Chunk& chunk, const Instruction& instruction, int line);
+    bool emit_specialised(const Instruction& instruction, const FeedbackVector& feedback,
+                          int line, DeoptPoint deopt);
+    void emit_inlined(const Chunk& callee, uint8_t argc, int height, int line,
+                      uint32_t call_offset);
+    void simulate(const Chunk& chunk, const Instruction& instruction, bool result_is_number);
+};
+
+} // namespace rplus
+
+#endif // OPTIMIZER_H
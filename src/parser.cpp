@@ -2,11 +2,13 @@
 #include <stdexcept>
 #include <iostream>
 #include <memory>
+#include "time_report.h"
 
 Parser::Parser(const std::vector<Token>& tokens) 
     : tokens(tokens), current(0) {}
 
 std::unique_ptr<ASTNode> Parser::parse() {
+    rplus::PassTimer timer("parse");
     try {
         if (tokens.empty()) {
             throw std::runtime_error("No tokens provided");
@@ -434,7 +436,7 @@ bool Parser::isAtEnd() const {
 
 Token Parser::peek() const {
     if (current >= tokens.size()) {
-        static Token eof{TokenType::END_OF_FILE, "", 0};
+        static const Token eof{TokenType::END_OF_FILE, "", 0};
         return eof;
     }
     return tokens[current];
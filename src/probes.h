@@ -0,0 +1,46 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/**
+ * USDT (user-level statically defined tracing) probes
+ *
+ * With RPLUS_ENABLE_USDT and <sys/sdt.h> available, each probe compiles to
+ * a single nop plus an ELF note describing its arguments. bpftrace, perf
+ * and SystemTap patch the nop into a breakpoint only while attached, so
+ * an unattached probe costs the nop. Without USDT support the macros
+ * expand to nothing.
+ *
+ * Probes, provider "rplus":
+ *
+ *     function__entry(chunk, argc, depth)   VirtualMachine enters a function
+ *     function__return(chunk, depth)        VirtualMachine returns from one
+ *     compile__start(root)                  Compiler::compile begins
+ *     compile__done(root, ok)               Compiler::compile ends
+ *     runtime__error(message)               uncaught runtime error
+ *
+ *     bpftrace -e 'usdt:./rplus:rplus:runtime__error { printf("%s\n", str(arg0)); }'
+ *
+ * Probe arguments are evaluated even when nothing is attached, so keep
+ * them to values already at hand.
+ */
+
+#if defined(RPLUS_ENABLE_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define RPLUS_HAVE_USDT 1
+#endif
+#endif
+
+#ifdef RPLUS_HAVE_USDT
+#define RPLUS_PROBE0(name) DTRACE_PROBE(rplus, name)
+#define RPLUS_PROBE1(name, a) DTRACE_PROBE1(rplus, name, a)
+#define RPLUS_PROBE2(name, a, b) DTRACE_PROBE2(rplus, name, a, b)
+#define RPLUS_PROBE3(name, a, b, c) DTRACE_PROBE3(rplus, name, a, b, c)
+#else
+#define RPLUS_PROBE0(name) do {} while (0)
+#define RPLUS_PROBE1(name, a) do {} while (0)
+#define RPLUS_PROBE2(name, a, b) do {} while (0)
+#define RPLUS_PROBE3(name, a, b, c) do {} while (0)
+#endif
+
+#endif // PROBES_H
@@ -0,0 +1,280 @@
+#include "profiler.h"
+#include "embed.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <thread>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define RPLUS_PROFILER_RDTSC 1
+#endif
+
+namespace rplus {
+
+thread_local Profiler* Profiler::current_ = nullptr;
+
+namespace {
+
+uint64_t saturating_sub(uint64_t a, uint64_t b) {
+    return a > b ? a - b : 0;
+}
+
+uint64_t steady_ns() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+} // anonymous namespace
+
+Profiler::Profiler() {
+    stack_.reserve(256);
+}
+
+Profiler::~Profiler() {
+    if (active()) {
+        current_ = nullptr;
+    }
+}
+
+uint64_t Profiler::now() {
+#ifdef RPLUS_PROFILER_RDTSC
+    return __rdtsc();
+#else
+    return steady_ns();
+#endif
+}
+
+// ============================================================================
+// Call Hooks
+// ============================================================================
+
+void Profiler::enter(uint64_t function) {
+    Function& stats = functions_[function];
+    ++stats.active;
+    stack_.push_back(Frame{function, &stats, 0, 0, 0});
+    // Read the clock last so the bookkeeping above counts as hook overhead
+    stack_.back().start = now();
+}
+
+void Profiler::leave() {
+    uint64_t end = now();
+    if (!stack_.empty()) {
+        close_frame(end);
+    }
+}
+
+/**
+ * Charges a finished activation to its function and to the edge from its
+ * caller, then folds its corrected time and the hook overhead into the
+ * caller's frame
+ */
+void Profiler::close_frame(uint64_t end) {
+    Frame frame = stack_.back();
+    stack_.pop_back();
+
+    uint64_t inclusive = saturating_sub(end - frame.start, frame.overhead + inner_overhead_);
+    uint64_t self = saturating_sub(inclusive, frame.children);
+
+    Function& stats = *frame.stats;
+    ++stats.calls;
+    stats.self += self;
+    if (--stats.active == 0) {
+        stats.inclusive += inclusive;
+    }
+
+    uint64_t caller = stack_.empty() ? ROOT : stack_.back().function;
+    Edge& edge = edges_[EdgeKey{caller, frame.function}];
+    ++edge.calls;
+    edge.inclusive += inclusive;
+
+    if (!stack_.empty()) {
+        Frame& parent = stack_.back();
+        parent.children += inclusive;
+        parent.overhead += frame.overhead + inner_overhead_ + outer_overhead_;
+    }
+}
+
+void Profiler::unwind(size_t depth) {
+    uint64_t end = now();
+    while (stack_.size() > depth) {
+        close_frame(end);
+    }
+}
+
+// ============================================================================
+// Control
+// ============================================================================
+
+bool Profiler::start() {
+    if (current_ && current_ != this) {
+        return false;
+    }
+    if (!calibrated_) {
+        calibrate();
+    }
+    current_ = this;
+    return true;
+}
+
+void Profiler::stop() {
+    unwind(0);
+    if (active()) {
+        current_ = nullptr;
+    }
+}
+
+void Profiler::reset() {
+    stack_.clear();
+    functions_.clear();
+    edges_.clear();
+}
+
+/**
+ * Measures the tick rate against the steady clock and the cost of the
+ * hooks. A nested empty function is entered and left many times: its
+ * mean measured time is the overhead inside a callee's interval, and the
+ * parent's mean self time per call is the remainder seen by the caller.
+ * The smallest of several rounds is kept to discard interrupts.
+ */
+void Profiler::calibrate() {
+#ifdef RPLUS_PROFILER_RDTSC
+    uint64_t ns_start = steady_ns();
+    uint64_t tick_start = now();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    uint64_t ns_elapsed = steady_ns() - ns_start;
+    uint64_t ticks_elapsed = now() - tick_start;
+    ns_per_tick_ = ticks_elapsed ? static_cast<double>(ns_elapsed) / ticks_elapsed : 1.0;
+#endif
+
+    constexpr uint64_t PARENT = 1;
+    constexpr uint64_t CHILD = 2;
+    constexpr uint64_t CALLS = 20000;
+    constexpr int ROUNDS = 5;
+
+    inner_overhead_ = 0;
+    outer_overhead_ = 0;
+    uint64_t best_inner = UINT64_MAX;
+    uint64_t best_outer = UINT64_MAX;
+    for (int round = 0; round < ROUNDS; ++round) {
+        reset();
+        enter(PARENT);
+        for (uint64_t i = 0; i < CALLS; ++i) {
+            enter(CHILD);
+            leave();
+        }
+        leave();
+        best_inner = std::min(best_inner, edges_[EdgeKey{PARENT, CHILD}].inclusive / CALLS);
+        best_outer = std::min(best_outer, functions_[PARENT].self / CALLS);
+    }
+    reset();
+
+    inner_overhead_ = best_inner;
+    outer_overhead_ = best_outer;
+    calibrated_ = true;
+}
+
+// ============================================================================
+// Reporting
+// ============================================================================
+
+void Profiler::set_name(uint64_t function, const std::string& name) {
+    names_[function] = name;
+}
+
+void Profiler::name_functions(const CompiledModule& module) {
+    for (size_t i = 0; i < module.function_count(); ++i) {
+        FunctionHandle fn{i};
+        set_name(reinterpret_cast<uintptr_t>(module.function_address(fn)), module.function_name(fn));
+    }
+}
+
+std::string Profiler::name_of(uint64_t function) const {
+    auto it = names_.find(function);
+    if (it != names_.end()) {
+        return it->second;
+    }
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "function_%llx", static_cast<unsigned long long>(function));
+    return buffer;
+}
+
+std::vector<Profiler::FunctionStats> Profiler::functions() const {
+    std::vector<FunctionStats> result;
+    result.reserve(functions_.size());
+    for (const auto& [function, stats] : functions_) {
+        FunctionStats entry;
+        entry.function = function;
+        entry.name = name_of(function);
+        entry.calls = stats.calls;
+        entry.self_ns = static_cast<uint64_t>(stats.self * ns_per_tick_);
+        entry.inclusive_ns = static_cast<uint64_t>(stats.inclusive * ns_per_tick_);
+        result.push_back(std::move(entry));
+    }
+    std::sort(result.begin(), result.end(), [](const FunctionStats& a, const FunctionStats& b) {
+        return a.self_ns > b.self_ns;
+    });
+    return result;
+}
+
+/**
+ * Writes the profile in callgrind format: one block per function with its
+ * self cost, followed by a calls= record and the inclusive cost of each
+ * callee. Functions are named through name compression, "(id) name" on
+ * first use and "(id)" afterwards.
+ */
+bool Profiler::write_callgrind(const std::string& path) const {
+    std::ofstream out(path);
+    if (!out) {
+        return false;
+    }
+
+    std::unordered_map<uint64_t, size_t> ids;
+    auto ref = [&](uint64_t function) {
+        auto [it, inserted] = ids.emplace(function, ids.size() + 1);
+        std::string text = "(" + std::to_string(it->second) + ")";
+        if (inserted) {
+            text += " " + name_of(function);
+        }
+        return text;
+    };
+    auto ns = [&](uint64_t ticks) { return static_cast<uint64_t>(ticks * ns_per_tick_); };
+
+    // Group edges by caller
+    std::unordered_map<uint64_t, std::vector<std::pair<uint64_t, const Edge*>>> callees;
+    for (const auto& [key, edge] : edges_) {
+        if (key.caller != ROOT) {
+            callees[key.caller].emplace_back(key.callee, &edge);
+        }
+    }
+
+    uint64_t total = 0;
+    for (const auto& entry : functions_) {
+        total += ns(entry.second.self);
+    }
+
+    out << "# callgrind format\n"
+        << "version: 1\n"
+        << "creator: rplus profiler\n"
+        << "positions: line\n"
+        << "events: Nanoseconds\n"
+        << "summary: " << total << "\n";
+
+    for (const auto& [function, stats] : functions_) {
+        out << "\nfn=" << ref(function) << "\n"
+            << "0 " << ns(stats.self) << "\n";
+        auto it = callees.find(function);
+        if (it == callees.end()) {
+            continue;
+        }
+        for (const auto& [callee, edge] : it->second) {
+            out << "cfn=" << ref(callee) << "\n"
+                << "calls=" << edge->calls << " 0\n"
+                << "0 " << ns(edge->inclusive) << "\n";
+        }
+    }
+
+    return static_cast<bool>(out);
+}
+
+} // namespace rplus
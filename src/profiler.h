@@ -0,0 +1,142 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace rplus {
+
+class CompiledModule;
+
+/**
+ * Instrumented call-graph profiler
+ *
+ * While a profiler is started on a thread, both VMs on that thread report
+ * every call and return to it. Each activation is timestamped with the
+ * cycle counter and kept on a shadow stack; on return its inclusive time
+ * is added to the caller -> callee edge and its exclusive (self) time to
+ * the callee. Counts are exact, unlike sampling.
+ *
+ * The hooks themselves take time, which would otherwise be charged to
+ * every function in proportion to the number of calls it makes. start()
+ * measures the cost of an enter/leave pair and that cost is subtracted
+ * from each activation and from its callers.
+ *
+ *     Profiler profiler;
+ *     profiler.name_functions(*module);
+ *     profiler.start();
+ *     ctx.invoke(fn);
+ *     profiler.stop();
+ *     profiler.write_callgrind("callgrind.out.rplus");  // open in KCachegrind
+ */
+class Profiler {
+public:
+    struct FunctionStats {
+        uint64_t function;
+        std::string name;
+        uint64_t calls = 0;
+        uint64_t self_ns = 0;
+        uint64_t inclusive_ns = 0;  // outermost activations only, so recursion is not double counted
+    };
+
+    Profiler();
+    ~Profiler();
+
+    Profiler(const Profiler&) = delete;
+    Profiler& operator=(const Profiler&) = delete;
+
+    // Profiler receiving calls on this thread, or nullptr
+    static Profiler* current() { return current_; }
+
+    // Begin receiving this thread's calls; calibrates hook overhead on
+    // first use. Returns false if another profiler is active on the thread.
+    bool start();
+    // Close open activations and detach from the thread
+    void stop();
+    bool active() const { return current_ == this; }
+
+    // Function ids are Chunk addresses for VirtualMachine and call target
+    // addresses for the register VM
+    void set_name(uint64_t function, const std::string& name);
+    void name_functions(const CompiledModule& module);
+
+    void enter(uint64_t function);
+    void leave();
+    // Pop activations abandoned by an exception until depth remain
+    void unwind(size_t depth);
+    size_t depth() const { return stack_.size(); }
+
+    // Per-function totals, most self time first
+    std::vector<FunctionStats> functions() const;
+
+    // Callgrind format, costs in nanoseconds
+    bool write_callgrind(const std::string& path) const;
+
+    void reset();
+
+    // Calibrated cost of one enter/leave pair, in nanoseconds
+    double overhead_ns() const { return (inner_overhead_ + outer_overhead_) * ns_per_tick_; }
+
+private:
+    static thread_local Profiler* current_;
+
+    struct Function {
+        uint64_t calls = 0;
+        uint64_t self = 0;
+        uint64_t inclusive = 0;
+        uint32_t active = 0;  // activations on the shadow stack
+    };
+
+    struct Frame {
+        uint64_t function;
+        Function* stats;
+        uint64_t start;
+        uint64_t children;  // corrected inclusive ticks of callees
+        uint64_t overhead;  // hook ticks spent inside this activation
+    };
+
+    struct Edge {
+        uint64_t calls = 0;
+        uint64_t inclusive = 0;
+    };
+
+    struct EdgeKey {
+        uint64_t caller;
+        uint64_t callee;
+        bool operator==(const EdgeKey& other) const {
+            return caller == other.caller && callee == other.callee;
+        }
+    };
+    struct EdgeHash {
+        size_t operator()(const EdgeKey& key) const {
+            return static_cast<size_t>(key.caller * 0x9e3779b97f4a7c15ULL ^ key.callee);
+        }
+    };
+
+    // Caller of top-level activations
+    static constexpr uint64_t ROOT = 0;
+
+    std::vector<Frame> stack_;
+    std::unordered_map<uint64_t, Function> functions_;
+    std::unordered_map<EdgeKey, Edge, EdgeHash> edges_;
+    std::unordered_map<uint64_t, std::string> names_;
+
+    // Hook cost in ticks: the part that lands inside the callee's measured
+    // interval, and the part that only its caller sees
+    uint64_t inner_overhead_ = 0;
+    uint64_t outer_overhead_ = 0;
+    double ns_per_tick_ = 1.0;
+    bool calibrated_ = false;
+
+    static uint64_t now();
+    void close_frame(uint64_t end);
+    void calibrate();
+    std::string name_of(uint64_t function) const;
+};
+
+} // namespace rplus
+
+#endif // PROFILER_H
@@ -0,0 +1,237 @@
+#include "rstring.h"
+#include <cstring>
+#include "utf8.h"
+
+namespace rplus {
+
+/**
+ * Hashes a byte string eight bytes at a time
+ * @param data Bytes to hash
+ * @param length Number of bytes
+ * @return Well-mixed 64-bit hash
+ */
+uint64_t hash_bytes(const char* data, size_t length) {
+    constexpr uint64_t MULTIPLIER = 0x9E3779B97F4A7C15ULL;
+    uint64_t h = MULTIPLIER ^ length;
+    
+    while (length >= 8) {
+        uint64_t word;
+        std::memcpy(&word, data, 8);
+        h = (h ^ mix_hash(word)) * MULTIPLIER;
+        data += 8;
+        length -= 8;
+    }
+    
+    // data may be null when length is 0, which memcpy does not allow
+    uint64_t tail = 0;
+    if (length > 0) {
+        std::memcpy(&tail, data, length);
+    }
+    h = (h ^ mix_hash(tail ^ (static_cast<uint64_t>(length) << 56))) * MULTIPLIER;
+    
+    return mix_hash(h);
+}
+
+// ============================================================================
+// Construction and Validation
+// ============================================================================
+
+StringObject::StringObject(std::string chars)
+    : StringObject(validate(std::move(chars))) {
+}
+
+StringObject::StringObject(ValidatedChars input)
+    : chars_(std::move(input.chars)),
+      data_(chars_.data()),
+      length_(chars_.size()),
+      hash_(0),
+      ascii_(input.ascii),
+      code_points_(chars_.size()) {
+    if (!ascii_) {
+        build_index();
+    }
+}
+
+StringObject::StringObject(std::shared_ptr<const StringObject> owner, const char* data,
+                           size_t length, bool ascii)
+    : owner_(std::move(owner)),
+      data_(data),
+      length_(length),
+      hash_(0),
+      ascii_(ascii),
+      code_points_(length) {
+    if (!ascii_) {
+        build_index();
+    }
+}
+
+/**
+ * Validates chars with the SIMD UTF-8 scanner, repairing it if needed
+ * @param chars Candidate string contents
+ * @return Well-formed contents and whether they are pure ASCII
+ */
+StringObject::ValidatedChars StringObject::validate(std::string chars) {
+    Utf8Scan scan = scan_utf8(chars.data(), chars.size());
+    if (!scan.valid) {
+        chars = repair_utf8(chars);
+        scan = scan_utf8(chars.data(), chars.size());
+    }
+    return ValidatedChars{std::move(chars), scan.ascii};
+}
+
+/**
+ * Counts code points and records a checkpoint every INDEX_STRIDE of them
+ */
+void StringObject::build_index() {
+    checkpoints_.clear();
+    checkpoints_.reserve(length_ / INDEX_STRIDE + 1);
+    
+    size_t count = 0;
+    for (size_t i = 0; i < length_; ++i) {
+        if ((static_cast<unsigned char>(data_[i]) & 0xC0) != 0x80) {
+            if (count % INDEX_STRIDE == 0) {
+                checkpoints_.push_back(static_cast<uint32_t>(i));
+            }
+            count++;
+        }
+    }
+    code_points_ = count;
+}
+
+/**
+ * Creates a substring that shares the buffer of str instead of copying.
+ * Offsets must fall on code point boundaries; if they do not, the
+ * substring is copied and repaired like any other new string.
+ * @param str Source string
+ * @param offset Byte offset of the substring
+ * @param length Byte length of the substring
+ * @return View into the buffer that owns str's characters
+ */
+std::shared_ptr<const StringObject> StringObject::substring(
+    const std::shared_ptr<const StringObject>& str, size_t offset, size_t length) {
+    if (offset == 0 && length == str->length_) {
+        return str;
+    }
+    
+    const char* data = str->data_ + offset;
+    bool ascii = str->ascii_;
+    if (!ascii) {
+        Utf8Scan scan = scan_utf8(data, length);
+        if (!scan.valid) {
+            return std::make_shared<const StringObject>(std::string(data, length));
+        }
+        ascii = scan.ascii;
+    }
+    
+    // Point at the buffer's owner so chains of views don't keep each other alive
+    const std::shared_ptr<const StringObject>& owner = str->owner_ ? str->owner_ : str;
+    return std::shared_ptr<const StringObject>(new StringObject(owner, data, length, ascii));
+}
+
+// ============================================================================
+// Character Indexing
+// ============================================================================
+
+/**
+ * Byte offset of a code point in a non-ASCII string: jumps to the nearest
+ * checkpoint and walks forward at most INDEX_STRIDE - 1 characters
+ */
+size_t StringObject::indexed_byte_offset(size_t index) const {
+    if (index >= code_points_) {
+        return length_;
+    }
+    size_t offset = checkpoints_[index / INDEX_STRIDE];
+    for (size_t remaining = index % INDEX_STRIDE; remaining > 0; --remaining) {
+        offset++;
+        while ((static_cast<unsigned char>(data_[offset]) & 0xC0) == 0x80) {
+            offset++;
+        }
+    }
+    return offset;
+}
+
+uint32_t StringObject::code_point_at(size_t index) const {
+    if (index >= code_points_) {
+        return 0;
+    }
+    if (ascii_) {
+        return static_cast<unsigned char>(data_[index]);
+    }
+    return decode_utf8(data_ + indexed_byte_offset(index));
+}
+
+// ============================================================================
+// Interning
+// ============================================================================
+
+StringTable& StringTable::global() {
+    // Never destroyed: interned strings may outlive static destruction
+    static StringTable* table = new StringTable();
+    return *table;
+}
+
+/**
+ * Looks up or creates the interned string with the given contents.
+ * Contents are validated like any other string, so ill-formed input is
+ * interned in its repaired form.
+ * @param chars String contents
+ * @return The live interned string equal to chars
+ */
+std::shared_ptr<const StringObject> StringTable::intern(std::string_view chars) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = strings_.find(chars);
+    if (it != strings_.end()) {
+        if (std::shared_ptr<const StringObject> live = it->second.ref.lock()) {
+            return live;
+        }
+    }
+    
+    auto* created = new StringObject(std::string(chars));
+    created->interned_ = true;
+    std::shared_ptr<const StringObject> str(created, [this](const StringObject* dead) {
+        release(dead);
+        delete dead;
+    });
+    
+    // Repair can change the contents, and with them the key
+    if (str->view() != chars) {
+        it = strings_.find(str->view());
+        if (it != strings_.end()) {
+            if (std::shared_ptr<const StringObject> live = it->second.ref.lock()) {
+                created->interned_ = false;  // released below without an entry
+                return live;
+            }
+        }
+    }
+    // An expired entry's key views characters about to be freed
+    if (it != strings_.end()) {
+        strings_.erase(it);
+    }
+    strings_.emplace(str->view(), Entry{created, str});
+    return str;
+}
+
+std::shared_ptr<const StringObject> StringTable::intern(
+    const std::shared_ptr<const StringObject>& str) {
+    return str->is_interned() ? str : intern(str->view());
+}
+
+size_t StringTable::size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return strings_.size();
+}
+
+// Runs as an interned string is destroyed
+void StringTable::release(const StringObject* str) {
+    if (!str->is_interned()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = strings_.find(str->view());
+    // A newer string with the same contents may have replaced the entry
+    if (it != strings_.end() && it->second.string == str) {
+        strings_.erase(it);
+    }
+}
+
+} // namespace rplus
@@ -0,0 +1,147 @@
+#ifndef RSTRING_H
+#define RSTRING_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace rplus {
+
+// 64-bit hash of a byte string, used for string keys in hash tables
+uint64_t hash_bytes(const char* data, size_t length);
+
+// Final avalanche step; spreads all input bits over the 64-bit result
+inline uint64_t mix_hash(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+/**
+ * Immutable string storage shared by every Value that refers to it.
+ * Copying a string Value only copies the pointer, and the hash is computed
+ * once on first use and cached in the header.
+ *
+ * A StringObject either owns its characters or is a view into another
+ * string's buffer (see substring()), which it keeps alive.
+ *
+ * Contents are always valid UTF-8: the constructor validates its input and
+ * replaces ill-formed sequences with U+FFFD. The header records whether the
+ * string is pure ASCII, in which case character indexing is a plain byte
+ * offset; otherwise it keeps the byte offset of every INDEX_STRIDE-th code
+ * point, so indexing scans at most INDEX_STRIDE - 1 characters.
+ *
+ * Strings obtained from a StringTable are interned: at most one interned
+ * string with given contents is alive at a time, so two interned strings
+ * are equal exactly when they are the same object.
+ */
+class StringObject {
+public:
+    static constexpr size_t INDEX_STRIDE = 64;
+    
+    explicit StringObject(std::string chars);
+    
+    StringObject(const StringObject&) = delete;
+    StringObject& operator=(const StringObject&) = delete;
+    
+    // View of [offset, offset + length) sharing the buffer of str
+    static std::shared_ptr<const StringObject> substring(
+        const std::shared_ptr<const StringObject>& str, size_t offset, size_t length);
+    
+    std::string_view view() const { return std::string_view(data_, length_); }
+    size_t length() const { return length_; }
+    bool is_view() const { return owner_ != nullptr; }
+    
+    bool is_ascii() const { return ascii_; }
+    bool is_interned() const { return interned_; }
+    size_t code_point_count() const { return code_points_; }
+    
+    // Byte offset of code point index (index == code_point_count() gives length())
+    size_t byte_offset(size_t index) const {
+        return ascii_ ? index : indexed_byte_offset(index);
+    }
+    
+    // Code point at character index
+    uint32_t code_point_at(size_t index) const;
+    
+    uint64_t hash() const {
+        uint64_t h = hash_.load(std::memory_order_relaxed);
+        if (h == 0) {
+            h = hash_bytes(data_, length_);
+            h = h == 0 ? 1 : h;  // 0 marks "not computed yet"
+            hash_.store(h, std::memory_order_relaxed);
+        }
+        return h;
+    }
+    
+private:
+    friend class StringTable;
+    
+    struct ValidatedChars {
+        std::string chars;
+        bool ascii;
+    };
+    
+    explicit StringObject(ValidatedChars input);
+    StringObject(std::shared_ptr<const StringObject> owner, const char* data, size_t length, bool ascii);
+    
+    static ValidatedChars validate(std::string chars);
+    void build_index();
+    size_t indexed_byte_offset(size_t index) const;
+    
+    const std::string chars_;                        // empty for views
+    const std::shared_ptr<const StringObject> owner_;  // buffer owner for views
+    const char* const data_;
+    const size_t length_;
+    mutable std::atomic<uint64_t> hash_;
+    
+    bool ascii_;
+    bool interned_ = false;
+    size_t code_points_;
+    std::vector<uint32_t> checkpoints_;  // byte offset of code point k * INDEX_STRIDE
+};
+
+/**
+ * Interned strings, for constants and map keys. The table only holds weak
+ * references: a string leaves it when its last Value goes away, so
+ * interning keys built at runtime does not grow it without bound.
+ */
+class StringTable {
+public:
+    // Process-wide table shared by every module and VM. Any other table
+    // must outlive the strings it interns.
+    static StringTable& global();
+    
+    // The interned string with these contents, created if there is none
+    std::shared_ptr<const StringObject> intern(std::string_view chars);
+    // str itself if it is already interned
+    std::shared_ptr<const StringObject> intern(const std::shared_ptr<const StringObject>& str);
+    
+    size_t size() const;
+    
+private:
+    struct Entry {
+        const StringObject* string;
+        std::weak_ptr<const StringObject> ref;
+    };
+    
+    void release(const StringObject* str);
+    
+    mutable std::mutex mutex_;
+    // Keys view the characters of the entry's string
+    std::unordered_map<std::string_view, Entry> strings_;
+};
+
+} // namespace rplus
+
+#endif // RSTRING_H
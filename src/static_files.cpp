@@ -0,0 +1,485 @@
+#include "static_files.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <strings.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace rplus {
+
+namespace {
+
+const char* content_type_for(const std::string& path) {
+    static const struct {
+        const char* extension;
+        const char* type;
+    } TYPES[] = {
+        {".html", "text/html; charset=utf-8"},
+        {".htm", "text/html; charset=utf-8"},
+        {".css", "text/css; charset=utf-8"},
+        {".js", "text/javascript; charset=utf-8"},
+        {".json", "application/json"},
+        {".txt", "text/plain; charset=utf-8"},
+        {".svg", "image/svg+xml"},
+        {".png", "image/png"},
+        {".jpg", "image/jpeg"},
+        {".jpeg", "image/jpeg"},
+        {".gif", "image/gif"},
+        {".webp", "image/webp"},
+        {".ico", "image/x-icon"},
+        {".woff2", "font/woff2"},
+        {".wasm", "application/wasm"},
+    };
+    size_t dot = path.rfind('.');
+    if (dot != std::string::npos) {
+        const char* extension = path.c_str() + dot;
+        for (const auto& entry : TYPES) {
+            if (strcasecmp(extension, entry.extension) == 0) {
+                return entry.type;
+            }
+        }
+    }
+    return "application/octet-stream";
+}
+
+int64_t mtime_ns(const struct stat& st) {
+    return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+std::string make_etag(const struct stat& st) {
+    char buffer[64];
+    std::snprintf(buffer, sizeof(buffer), "\"%llx-%llx-%llx\"",
+                  static_cast<unsigned long long>(st.st_ino),
+                  static_cast<unsigned long long>(st.st_size),
+                  static_cast<unsigned long long>(mtime_ns(st)));
+    return buffer;
+}
+
+bool etag_matches(const std::string& if_none_match, const std::string& etag) {
+    if (if_none_match.empty()) {
+        return false;
+    }
+    if (if_none_match == "*") {
+        return true;
+    }
+    // The header may list several tags, optionally weak (W/"..."); the
+    // quotes around each tag keep a substring match from being ambiguous
+    return if_none_match.find(etag) != std::string::npos;
+}
+
+std::string response_headers(const char* status, const std::string& etag,
+                             const char* content_type, uint64_t content_length) {
+    std::string headers;
+    headers.reserve(192);
+    headers.append("HTTP/1.1 ").append(status).append("\r\n");
+    headers.append("ETag: ").append(etag).append("\r\n");
+    if (content_type) {
+        headers.append("Content-Type: ").append(content_type).append("\r\n");
+    }
+    headers.append("Content-Length: ").append(std::to_string(content_length)).append("\r\n");
+    headers.append("Cache-Control: no-cache\r\n\r\n");
+    return headers;
+}
+
+enum class Progress {
+    DONE,
+    BLOCKED,   // socket buffer full (EAGAIN); try again once writable
+    FAILED
+};
+
+// Write the buffers from byte offset sent onwards, advancing sent by what
+// the socket accepted
+Progress write_all(int fd, const struct iovec* buffers, int count, size_t& sent) {
+    struct iovec iov[2];
+    int remaining = 0;
+    size_t skip = sent;
+    for (int i = 0; i < count; ++i) {
+        if (skip >= buffers[i].iov_len) {
+            skip -= buffers[i].iov_len;
+            continue;
+        }
+        iov[remaining].iov_base = static_cast<char*>(buffers[i].iov_base) + skip;
+        iov[remaining].iov_len = buffers[i].iov_len - skip;
+        skip = 0;
+        remaining++;
+    }
+    
+    struct iovec* next = iov;
+    while (remaining > 0) {
+        ssize_t written = ::writev(fd, next, remaining);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? Progress::BLOCKED : Progress::FAILED;
+        }
+        sent += static_cast<size_t>(written);
+        size_t done = static_cast<size_t>(written);
+        while (remaining > 0 && done >= next->iov_len) {
+            done -= next->iov_len;
+            next++;
+            remaining--;
+        }
+        if (remaining > 0) {
+            next->iov_base = static_cast<char*>(next->iov_base) + done;
+            next->iov_len -= done;
+        }
+    }
+    return Progress::DONE;
+}
+
+// Read a whole small file into memory
+bool read_file(int fd, uint64_t size, std::string& out) {
+    out.resize(size);
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = ::pread(fd, &out[done], size - done, static_cast<off_t>(done));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        done += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Stream file_fd from offset up to size to socket_fd inside the kernel,
+// advancing offset by what the socket accepted
+Progress send_file(int socket_fd, int file_fd, uint64_t& offset, uint64_t size) {
+    while (offset < size) {
+        off_t position = static_cast<off_t>(offset);
+        size_t chunk = static_cast<size_t>(std::min<uint64_t>(size - offset, 1u << 30));
+        ssize_t sent = ::sendfile(socket_fd, file_fd, &position, chunk);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? Progress::BLOCKED : Progress::FAILED;
+        }
+        if (sent == 0) {
+            return Progress::FAILED;  // file shrank underneath us
+        }
+        offset = static_cast<uint64_t>(position);
+    }
+    return Progress::DONE;
+}
+
+void set_cork(int socket_fd, bool on) {
+    int cork = on ? 1 : 0;
+    ::setsockopt(socket_fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+}
+
+struct FileDescriptor {
+    int fd;
+    explicit FileDescriptor(int f) : fd(f) {}
+    ~FileDescriptor() {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+    int release() {
+        int f = fd;
+        fd = -1;
+        return f;
+    }
+};
+
+/**
+ * Opens path ("/dir/file") below root one component at a time, refusing
+ * symbolic links, so that no link inside the root can lead outside it
+ * @return File descriptor, or -1
+ */
+int open_below(const std::string& root, const std::string& path) {
+    FileDescriptor dir(::open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (dir.fd < 0) {
+        return -1;
+    }
+    for (size_t start = 1;;) {
+        size_t slash = path.find('/', start);
+        if (slash == std::string::npos) {
+            return ::openat(dir.fd, path.c_str() + start, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        }
+        std::string name = path.substr(start, slash - start);
+        if (!name.empty()) {
+            FileDescriptor next(::openat(dir.fd, name.c_str(),
+                                         O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+            if (next.fd < 0) {
+                return -1;
+            }
+            std::swap(dir.fd, next.fd);
+        }
+        start = slash + 1;
+    }
+}
+
+} // namespace
+
+// ============================================================================
+// Transfer
+// ============================================================================
+
+StaticFileHandler::Transfer& StaticFileHandler::Transfer::operator=(Transfer&& other) noexcept {
+    if (this != &other) {
+        reset();
+        pending_ = other.pending_;
+        result_ = other.result_;
+        cached_ = std::move(other.cached_);
+        headers_ = std::move(other.headers_);
+        sent_ = other.sent_;
+        file_fd_ = other.file_fd_;
+        file_offset_ = other.file_offset_;
+        file_size_ = other.file_size_;
+        corked_ = other.corked_;
+        other.file_fd_ = -1;
+        other.reset();
+    }
+    return *this;
+}
+
+void StaticFileHandler::Transfer::reset() {
+    if (file_fd_ >= 0) {
+        ::close(file_fd_);
+    }
+    pending_ = false;
+    result_ = Status::OK;
+    cached_.reset();
+    headers_.clear();
+    sent_ = 0;
+    file_fd_ = -1;
+    file_offset_ = 0;
+    file_size_ = 0;
+    corked_ = false;
+}
+
+// ============================================================================
+// StaticFileHandler
+// ============================================================================
+
+StaticFileHandler::StaticFileHandler(std::string root, Options options)
+    : root_(std::move(root)), options_(options) {
+    while (root_.size() > 1 && root_.back() == '/') {
+        root_.pop_back();
+    }
+}
+
+/**
+ * Maps a request path to a path relative to the root ("/dir/file"),
+ * rejecting any path that could escape it lexically. Symbolic links are
+ * refused when the file is opened (see open_below).
+ */
+bool StaticFileHandler::resolve(const std::string& request_path, std::string& relative_path) const {
+    if (request_path.empty() || request_path[0] != '/' ||
+        request_path.find('\0') != std::string::npos) {
+        return false;
+    }
+    size_t end = request_path.find_first_of("?#");
+    std::string path = request_path.substr(0, end);
+    
+    // Reject "." and ".." segments
+    for (size_t start = 1; start <= path.size();) {
+        size_t slash = path.find('/', start);
+        size_t stop = slash == std::string::npos ? path.size() : slash;
+        std::string segment = path.substr(start, stop - start);
+        if (segment == "." || segment == "..") {
+            return false;
+        }
+        start = stop + 1;
+    }
+    
+    if (path.back() == '/') {
+        path += "index.html";
+    }
+    relative_path = std::move(path);
+    return true;
+}
+
+/**
+ * Serves a file on a connected socket. Sends as much of the response as
+ * the socket takes; if it fills up, the rest is left in transfer.
+ * @param socket_fd Connected client socket
+ * @param request_path Path from the request line
+ * @param if_none_match If-None-Match header value, or empty
+ * @param transfer Receives the unsent remainder on WOULD_BLOCK
+ * @return What was sent
+ */
+StaticFileHandler::Status StaticFileHandler::serve(int socket_fd, const std::string& request_path,
+                                                   const std::string& if_none_match,
+                                                   Transfer& transfer) {
+    transfer.reset();
+    std::string relative;
+    if (!resolve(request_path, relative)) {
+        return Status::NOT_FOUND;
+    }
+    std::string path = root_ + relative;
+    
+    FileDescriptor file(open_below(root_, relative));
+    if (file.fd < 0) {
+        return Status::NOT_FOUND;
+    }
+    struct stat st;
+    if (::fstat(file.fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return Status::NOT_FOUND;
+    }
+    uint64_t size = static_cast<uint64_t>(st.st_size);
+    
+    std::shared_ptr<const CachedFile> cached = lookup(path, mtime_ns(st), size);
+    std::string etag = cached ? cached->etag : make_etag(st);
+    
+    transfer.pending_ = true;
+    if (etag_matches(if_none_match, etag)) {
+        transfer.result_ = Status::NOT_MODIFIED;
+        transfer.headers_ = response_headers("304 Not Modified", etag, nullptr, 0);
+        return send(socket_fd, transfer);
+    }
+    
+    if (!cached && size <= options_.max_cached_file_size) {
+        auto entry = std::make_shared<CachedFile>();
+        if (read_file(file.fd, size, entry->body)) {
+            entry->etag = etag;
+            entry->headers = response_headers("200 OK", etag, content_type_for(path), size);
+            entry->mtime_ns = mtime_ns(st);
+            entry->size = size;
+            cached = entry;
+            store(path, cached);
+        }
+    }
+    
+    transfer.result_ = Status::OK;
+    if (cached) {
+        transfer.cached_ = std::move(cached);
+        return send(socket_fd, transfer);
+    }
+    
+    // Large file: headers from user space, body straight from the page cache
+    transfer.headers_ = response_headers("200 OK", etag, content_type_for(path), size);
+    transfer.file_fd_ = file.release();
+    transfer.file_size_ = size;
+    transfer.corked_ = true;
+    set_cork(socket_fd, true);
+    return send(socket_fd, transfer);
+}
+
+StaticFileHandler::Status StaticFileHandler::resume(int socket_fd, Transfer& transfer) {
+    if (!transfer.pending()) {
+        return Status::IO_ERROR;
+    }
+    return send(socket_fd, transfer);
+}
+
+/**
+ * Serves a file, waiting for the socket to drain whenever it is full
+ */
+StaticFileHandler::Status StaticFileHandler::serve(int socket_fd, const std::string& request_path,
+                                                   const std::string& if_none_match) {
+    Transfer transfer;
+    Status status = serve(socket_fd, request_path, if_none_match, transfer);
+    while (status == Status::WOULD_BLOCK) {
+        struct pollfd writable = {socket_fd, POLLOUT, 0};
+        if (::poll(&writable, 1, -1) < 0 && errno != EINTR) {
+            return Status::IO_ERROR;
+        }
+        status = resume(socket_fd, transfer);
+    }
+    return status;
+}
+
+/**
+ * Sends what is left of a response: the header block and cached body
+ * with writev, then any file body with sendfile
+ */
+StaticFileHandler::Status StaticFileHandler::send(int socket_fd, Transfer& transfer) {
+    struct iovec iov[2];
+    int count = 0;
+    if (transfer.cached_) {
+        iov[count++] = {const_cast<char*>(transfer.cached_->headers.data()),
+                        transfer.cached_->headers.size()};
+        iov[count++] = {const_cast<char*>(transfer.cached_->body.data()),
+                        transfer.cached_->body.size()};
+    } else {
+        iov[count++] = {const_cast<char*>(transfer.headers_.data()), transfer.headers_.size()};
+    }
+    
+    Progress progress = write_all(socket_fd, iov, count, transfer.sent_);
+    if (progress == Progress::DONE && transfer.file_fd_ >= 0) {
+        progress = send_file(socket_fd, transfer.file_fd_, transfer.file_offset_, transfer.file_size_);
+    }
+    if (progress == Progress::BLOCKED) {
+        return Status::WOULD_BLOCK;
+    }
+    
+    if (transfer.corked_) {
+        set_cork(socket_fd, false);
+    }
+    Status result = progress == Progress::DONE ? transfer.result_ : Status::IO_ERROR;
+    transfer.reset();
+    return result;
+}
+
+std::shared_ptr<const StaticFileHandler::CachedFile> StaticFileHandler::lookup(
+    const std::string& path, int64_t mtime, uint64_t size) {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    auto it = cache_.find(path);
+    if (it == cache_.end()) {
+        return nullptr;
+    }
+    CacheList::iterator entry = it->second;
+    if (entry->second->mtime_ns != mtime || entry->second->size != size) {
+        evict(entry);
+        return nullptr;
+    }
+    lru_.splice(lru_.begin(), lru_, entry);
+    return entry->second;
+}
+
+/**
+ * Adds a file to the cache, evicting the least recently served files
+ * until it fits
+ */
+void StaticFileHandler::store(const std::string& path, std::shared_ptr<const CachedFile> file) {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    auto it = cache_.find(path);
+    if (it != cache_.end()) {
+        evict(it->second);
+    }
+    if (file->body.size() > options_.max_cache_bytes) {
+        return;
+    }
+    while (!lru_.empty() && cached_bytes_ + file->body.size() > options_.max_cache_bytes) {
+        evict(std::prev(lru_.end()));
+    }
+    cached_bytes_ += file->body.size();
+    lru_.emplace_front(path, std::move(file));
+    cache_[path] = lru_.begin();
+}
+
+// Caller holds cache_mutex_
+void StaticFileHandler::evict(CacheList::iterator entry) {
+    cached_bytes_ -= entry->second->body.size();
+    cache_.erase(entry->first);
+    lru_.erase(entry);
+}
+
+size_t StaticFileHandler::cached_bytes() const {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    return cached_bytes_;
+}
+
+void StaticFileHandler::clear_cache() {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    cache_.clear();
+    lru_.clear();
+    cached_bytes_ = 0;
+}
+
+} // namespace rplus
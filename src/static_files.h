@@ -0,0 +1,124 @@
+#ifndef STATIC_FILES_H
+#define STATIC_FILES_H
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+namespace rplus {
+
+/**
+ * Static file handler for the web runtime
+ *
+ * Serves files below a document root directly on a connected socket,
+ * without involving the VM. Symbolic links below the root are not
+ * followed, so nothing outside it can be served. Small files are kept in an in-memory cache
+ * keyed by path and validated against the file's mtime and size on every
+ * request; larger files are streamed from the page cache with sendfile(2)
+ * and never copied into user space. Responses carry an ETag derived from
+ * inode, size and mtime, and If-None-Match requests get 304 Not Modified.
+ * The cache evicts least recently served files first.
+ *
+ * On a non-blocking socket a response can fill the send buffer. serve()
+ * then returns WOULD_BLOCK with the rest of the response in a Transfer;
+ * call resume() with it each time the socket is writable (EPOLLOUT)
+ * until it returns something else.
+ */
+class StaticFileHandler {
+    struct CachedFile;
+    
+public:
+    struct Options {
+        size_t max_cached_file_size = 64 * 1024;
+        size_t max_cache_bytes = 32 * 1024 * 1024;
+    };
+    
+    enum class Status {
+        OK,             // 200 sent
+        NOT_MODIFIED,   // 304 sent
+        NOT_FOUND,      // nothing sent; caller decides how to respond
+        IO_ERROR,       // connection failed mid-response
+        WOULD_BLOCK     // socket full; resume() the Transfer once writable
+    };
+    
+    // Unsent remainder of a response. Owns the open file being streamed.
+    class Transfer {
+    public:
+        Transfer() = default;
+        Transfer(Transfer&& other) noexcept { *this = std::move(other); }
+        Transfer& operator=(Transfer&& other) noexcept;
+        ~Transfer() { reset(); }
+        
+        Transfer(const Transfer&) = delete;
+        Transfer& operator=(const Transfer&) = delete;
+        
+        bool pending() const { return pending_; }
+        
+    private:
+        friend class StaticFileHandler;
+        
+        void reset();
+        
+        bool pending_ = false;
+        Status result_ = Status::OK;          // reported once everything is sent
+        std::shared_ptr<const CachedFile> cached_;
+        std::string headers_;                 // when not cached
+        size_t sent_ = 0;                     // bytes of headers and cached body
+        int file_fd_ = -1;                    // body sent with sendfile, if any
+        uint64_t file_offset_ = 0;
+        uint64_t file_size_ = 0;
+        bool corked_ = false;
+    };
+    
+    StaticFileHandler(std::string root, Options options);
+    explicit StaticFileHandler(std::string root) : StaticFileHandler(std::move(root), Options()) {}
+    
+    // Send the file for request_path (e.g. "/css/site.css") on socket_fd.
+    // if_none_match is the request's If-None-Match header, or empty. On
+    // WOULD_BLOCK, transfer holds the rest of the response.
+    Status serve(int socket_fd, const std::string& request_path, const std::string& if_none_match,
+                 Transfer& transfer);
+    // Continue a response after WOULD_BLOCK, once socket_fd is writable
+    Status resume(int socket_fd, Transfer& transfer);
+    // The same, waiting in poll(2) whenever the socket is full
+    Status serve(int socket_fd, const std::string& request_path, const std::string& if_none_match);
+    
+    size_t cached_bytes() const;
+    void clear_cache();
+    
+private:
+    struct CachedFile {
+        std::string headers;  // complete 200 response header block
+        std::string body;
+        std::string etag;
+        int64_t mtime_ns;
+        uint64_t size;
+    };
+    
+    std::string root_;
+    Options options_;
+    
+    // Most recently served first
+    using CacheList = std::list<std::pair<std::string, std::shared_ptr<const CachedFile>>>;
+    
+    mutable std::mutex cache_mutex_;
+    CacheList lru_;
+    std::unordered_map<std::string, CacheList::iterator> cache_;
+    size_t cached_bytes_ = 0;
+    
+    bool resolve(const std::string& request_path, std::string& relative_path) const;
+    std::shared_ptr<const CachedFile> lookup(const std::string& path, int64_t mtime_ns, uint64_t size);
+    void store(const std::string& path, std::shared_ptr<const CachedFile> file);
+    void evict(CacheList::iterator entry);
+    Status send(int socket_fd, Transfer& transfer);
+};
+
+} // namespace rplus
+
+#endif // STATIC_FILES_H
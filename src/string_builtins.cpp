@@ -0,0 +1,154 @@
+#include "string_builtins.h"
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <string_view>
+#include "collections.h"
+#include "native.h"
+#include "rstring.h"
+#include "string_search.h"
+
+namespace rplus {
+
+namespace {
+
+const Value& expect_string(const Value& v, const char* builtin) {
+    if (!v.is_string()) {
+        throw VMException(std::string(builtin) + ": expected a string");
+    }
+    return v;
+}
+
+Value make_string(std::string chars) {
+    return Value(std::shared_ptr<const StringObject>(std::make_shared<const StringObject>(std::move(chars))));
+}
+
+// Character index of the first occurrence of sub, or -1
+double index_of(const Value& str, std::string_view sub) {
+    const StringObject& string = expect_string(str, "indexOf").as_string_object();
+    std::string_view s = string.view();
+    size_t pos = find_substring(s, sub);
+    if (pos == std::string_view::npos) {
+        return -1;
+    }
+    if (string.is_ascii()) {
+        return static_cast<double>(pos);
+    }
+    return static_cast<double>(count_code_points(s.data(), pos));
+}
+
+// Number of characters (code points)
+double string_length(const Value& str) {
+    return static_cast<double>(expect_string(str, "stringLength").as_string_object().code_point_count());
+}
+
+// One-character string at index, sharing the source buffer; "" when out of range
+Value char_at(const Value& str, double index) {
+    const std::shared_ptr<const StringObject>& source = expect_string(str, "charAt").string_ref();
+    if (!(index >= 0) || index >= static_cast<double>(source->code_point_count())) {
+        return make_string(std::string());
+    }
+    size_t i = static_cast<size_t>(index);
+    size_t start = source->byte_offset(i);
+    size_t end = source->is_ascii() ? start + 1
+                                    : start + utf8_sequence_length(static_cast<unsigned char>(source->view()[start]));
+    return Value(StringObject::substring(source, start, end - start));
+}
+
+// Code point at index, or nil when out of range
+Value code_point_at(const Value& str, double index) {
+    const StringObject& string = expect_string(str, "codePointAt").as_string_object();
+    if (!(index >= 0) || index >= static_cast<double>(string.code_point_count())) {
+        return Value();
+    }
+    return Value(static_cast<double>(string.code_point_at(static_cast<size_t>(index))));
+}
+
+bool contains(std::string_view s, std::string_view sub) {
+    return find_substring(s, sub) != std::string_view::npos;
+}
+
+bool starts_with(std::string_view s, std::string_view prefix) {
+    return s.size() >= prefix.size() && s.compare(0, prefix.size(), prefix) == 0;
+}
+
+// Splits on sep (or into code points when sep is empty). The parts are
+// views into the original string's buffer rather than copies.
+Value split(const Value& str, std::string_view sep) {
+    const std::shared_ptr<const StringObject>& source = expect_string(str, "split").string_ref();
+    std::string_view s = source->view();
+    
+    auto array = std::make_shared<ArrayObject>();
+    std::vector<Value>& parts = array->elements;
+    
+    if (sep.empty()) {
+        for (size_t i = 0; i < s.size();) {
+            size_t length = utf8_sequence_length(static_cast<unsigned char>(s[i]));
+            length = std::min(length, s.size() - i);
+            parts.emplace_back(StringObject::substring(source, i, length));
+            i += length;
+        }
+    } else {
+        size_t start = 0;
+        for (;;) {
+            size_t pos = find_substring(s, sep, start);
+            if (pos == std::string_view::npos) {
+                break;
+            }
+            parts.emplace_back(StringObject::substring(source, start, pos - start));
+            start = pos + sep.size();
+        }
+        parts.emplace_back(StringObject::substring(source, start, s.size() - start));
+    }
+    
+    return Value(std::shared_ptr<Object>(std::move(array)));
+}
+
+// Replaces every occurrence of from with to. An empty pattern matches at
+// every code point boundary, including both ends.
+Value replace_all(std::string_view s, std::string_view from, std::string_view to) {
+    std::string out;
+    
+    if (from.empty()) {
+        out.reserve(s.size() + (s.size() + 1) * to.size());
+        out.append(to);
+        for (size_t i = 0; i < s.size();) {
+            size_t length = std::min(utf8_sequence_length(static_cast<unsigned char>(s[i])), s.size() - i);
+            out.append(s.data() + i, length);
+            out.append(to);
+            i += length;
+        }
+        return make_string(std::move(out));
+    }
+    
+    size_t pos = find_substring(s, from);
+    if (pos == std::string_view::npos) {
+        return make_string(std::string(s));
+    }
+    
+    out.reserve(s.size() + (to.size() > from.size() ? (to.size() - from.size()) * 4 : 0));
+    size_t start = 0;
+    while (pos != std::string_view::npos) {
+        out.append(s.data() + start, pos - start);
+        out.append(to);
+        start = pos + from.size();
+        pos = find_substring(s, from, start);
+    }
+    out.append(s.data() + start, s.size() - start);
+    return make_string(std::move(out));
+}
+
+} // namespace
+
+void register_string_builtins(VirtualMachine& vm) {
+    bind_native<&index_of>(vm, "indexOf");
+    bind_native<&string_length>(vm, "stringLength");
+    bind_native<&char_at>(vm, "charAt");
+    bind_native<&code_point_at>(vm, "codePointAt");
+    bind_native<&contains>(vm, "contains");
+    bind_native<&starts_with>(vm, "startsWith");
+    bind_native<&split>(vm, "split");
+    bind_native<&replace_all>(vm, "replaceAll");
+}
+
+} // namespace rplus
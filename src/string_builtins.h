@@ -0,0 +1,15 @@
+#ifndef STRING_BUILTINS_H
+#define STRING_BUILTINS_H
+
+#include "vm.h"
+
+namespace rplus {
+
+// Register indexOf, stringLength, charAt, codePointAt, contains,
+// startsWith, split and replaceAll as native functions. split returns an
+// Array of substrings that share the buffer of the string being split.
+void register_string_builtins(VirtualMachine& vm);
+
+} // namespace rplus
+
+#endif // STRING_BUILTINS_H
@@ -0,0 +1,185 @@
+#include "string_search.h"
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define RPLUS_STRING_SSE2 1
+#if defined(__GNUC__) || defined(__clang__)
+#define RPLUS_STRING_AVX2 1
+#endif
+#endif
+
+namespace rplus {
+
+namespace {
+
+using FindKernel = size_t (*)(const char* haystack, size_t n, const char* needle, size_t m);
+
+inline unsigned lowest_bit(uint32_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+    return static_cast<unsigned>(__builtin_ctz(mask));
+#else
+    unsigned i = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        i++;
+    }
+    return i;
+#endif
+}
+
+// Portable search: memchr for the first byte, memcmp for the rest
+size_t find_scalar(const char* haystack, size_t n, const char* needle, size_t m) {
+    if (m > n) {
+        return std::string_view::npos;
+    }
+    const char* p = haystack;
+    const char* end = haystack + (n - m) + 1;
+    while (p < end) {
+        p = static_cast<const char*>(std::memchr(p, needle[0], static_cast<size_t>(end - p)));
+        if (!p) {
+            break;
+        }
+        if (std::memcmp(p + 1, needle + 1, m - 1) == 0) {
+            return static_cast<size_t>(p - haystack);
+        }
+        p++;
+    }
+    return std::string_view::npos;
+}
+
+#ifdef RPLUS_STRING_SSE2
+
+size_t find_sse2(const char* haystack, size_t n, const char* needle, size_t m) {
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[m - 1]);
+    
+    size_t i = 0;
+    for (; i + m + 15 <= n; i += 16) {
+        __m128i block_first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(haystack + i));
+        __m128i block_last = _mm_loadu_si128(reinterpret_cast<const __m128i*>(haystack + i + m - 1));
+        uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(first, block_first), _mm_cmpeq_epi8(last, block_last))));
+        for (; mask != 0; mask &= mask - 1) {
+            size_t pos = i + lowest_bit(mask);
+            if (std::memcmp(haystack + pos + 1, needle + 1, m - 2) == 0) {
+                return pos;
+            }
+        }
+    }
+    
+    size_t tail = find_scalar(haystack + i, n - i, needle, m);
+    return tail == std::string_view::npos ? tail : i + tail;
+}
+
+#endif
+
+#ifdef RPLUS_STRING_AVX2
+
+__attribute__((target("avx2")))
+size_t find_avx2(const char* haystack, size_t n, const char* needle, size_t m) {
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[m - 1]);
+    
+    size_t i = 0;
+    for (; i + m + 31 <= n; i += 32) {
+        __m256i block_first = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(haystack + i));
+        __m256i block_last = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(haystack + i + m - 1));
+        uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(first, block_first),
+                             _mm256_cmpeq_epi8(last, block_last))));
+        for (; mask != 0; mask &= mask - 1) {
+            size_t pos = i + lowest_bit(mask);
+            if (std::memcmp(haystack + pos + 1, needle + 1, m - 2) == 0) {
+                return pos;
+            }
+        }
+    }
+    
+    size_t tail = find_scalar(haystack + i, n - i, needle, m);
+    return tail == std::string_view::npos ? tail : i + tail;
+}
+
+#endif
+
+FindKernel select_find_kernel() {
+#ifdef RPLUS_STRING_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        return &find_avx2;
+    }
+#endif
+#ifdef RPLUS_STRING_SSE2
+    return &find_sse2;
+#else
+    return &find_scalar;
+#endif
+}
+
+} // namespace
+
+/**
+ * Finds needle in haystack
+ * @param haystack String to search
+ * @param needle String to find
+ * @param from Byte offset to start searching at
+ * @return Byte offset of the match, or npos
+ */
+size_t find_substring(std::string_view haystack, std::string_view needle, size_t from) {
+    if (from > haystack.size()) {
+        return std::string_view::npos;
+    }
+    if (needle.empty()) {
+        return from;
+    }
+    
+    const char* data = haystack.data() + from;
+    size_t n = haystack.size() - from;
+    if (needle.size() > n) {
+        return std::string_view::npos;
+    }
+    
+    size_t pos;
+    if (needle.size() == 1) {
+        const void* hit = std::memchr(data, needle[0], n);
+        pos = hit ? static_cast<size_t>(static_cast<const char*>(hit) - data) : std::string_view::npos;
+    } else {
+        static const FindKernel kernel = select_find_kernel();
+        pos = kernel(data, n, needle.data(), needle.size());
+    }
+    return pos == std::string_view::npos ? pos : from + pos;
+}
+
+/**
+ * Counts UTF-8 code points by counting bytes that are not continuation
+ * bytes (10xxxxxx), 16 at a time where SSE2 is available
+ */
+size_t count_code_points(const char* data, size_t length) {
+    size_t count = 0;
+    size_t i = 0;
+#ifdef RPLUS_STRING_SSE2
+    // Continuation bytes are 0x80-0xBF, i.e. -128..-65 as signed bytes
+    const __m128i threshold = _mm_set1_epi8(-64);
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        uint32_t continuation = static_cast<uint32_t>(
+            _mm_movemask_epi8(_mm_cmplt_epi8(block, threshold)));
+#if defined(__GNUC__) || defined(__clang__)
+        count += 16 - static_cast<size_t>(__builtin_popcount(continuation));
+#else
+        for (; continuation != 0; continuation &= continuation - 1) {
+            count--;
+        }
+        count += 16;
+#endif
+    }
+#endif
+    for (; i < length; ++i) {
+        if ((static_cast<unsigned char>(data[i]) & 0xC0) != 0x80) {
+            count++;
+        }
+    }
+    return count;
+}
+
+} // namespace rplus
@@ -0,0 +1,35 @@
+#ifndef STRING_SEARCH_H
+#define STRING_SEARCH_H
+
+#include <cstddef>
+#include <string_view>
+
+namespace rplus {
+
+/**
+ * Vectorised string kernels
+ *
+ * find_substring filters candidate positions 16 or 32 bytes at a time by
+ * comparing the needle's first and last bytes against the haystack (SSE2,
+ * or AVX2 when the CPU supports it, selected once at runtime) and only
+ * verifies the survivors with memcmp. Other targets use a scalar loop
+ * built on memchr.
+ */
+
+// Byte offset of the first occurrence of needle at or after from, or npos
+size_t find_substring(std::string_view haystack, std::string_view needle, size_t from = 0);
+
+// Number of UTF-8 code points in the byte range (counts non-continuation bytes)
+size_t count_code_points(const char* data, size_t length);
+
+// Byte length of the UTF-8 sequence starting with lead byte c (1 for invalid leads)
+inline size_t utf8_sequence_length(unsigned char c) {
+    if (c < 0xC0) return 1;
+    if (c < 0xE0) return 2;
+    if (c < 0xF0) return 3;
+    return 4;
+}
+
+} // namespace rplus
+
+#endif // STRING_SEARCH_H
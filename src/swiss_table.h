@@ -0,0 +1,277 @@
+#ifndef SWISS_TABLE_H
+#define SWISS_TABLE_H
+
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define RPLUS_SWISS_SSE2 1
+#endif
+
+namespace rplus {
+
+/**
+ * Open-addressing hash table in the style of a Swiss table
+ *
+ * A control byte per slot holds the low 7 bits of the key's hash (H2), or
+ * one of the EMPTY/DELETED markers. Lookups probe 16 control bytes at a
+ * time with a single SIMD compare and only touch slots whose H2 matches.
+ *
+ * Entries live in a dense vector in insertion order and the slots only hold
+ * indices into it, so iteration order is deterministic and independent of
+ * hash values and capacity. Each entry stores its full hash, so growing the
+ * table never rehashes keys.
+ *
+ * Hash must return a well-mixed 64-bit hash; Eq compares keys.
+ */
+template <typename K, typename V, typename Hash, typename Eq>
+class SwissTable {
+public:
+    struct Entry {
+        K key;
+        V value;
+        uint64_t hash;
+        bool live;
+    };
+
+    SwissTable() = default;
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    V* find(const K& key) {
+        uint32_t index = find_index(key, Hash()(key));
+        return index == NOT_FOUND ? nullptr : &entries_[index].value;
+    }
+
+    const V* find(const K& key) const {
+        return const_cast<SwissTable*>(this)->find(key);
+    }
+
+    bool contains(const K& key) const { return find(key) != nullptr; }
+
+    // Insert or overwrite; returns true if the key was newly inserted
+    bool insert(const K& key, V value) {
+        auto [slot, inserted] = find_or_insert(key, [&key]() { return key; });
+        *slot = std::move(value);
+        return inserted;
+    }
+
+    // Value for key, inserting a default one under make_key() if key is
+    // absent; second is true if it was inserted. A single probe both looks
+    // the key up and picks the slot it goes in, and make_key only runs on
+    // insertion, so callers can defer building the stored key until then.
+    template <typename MakeKey>
+    std::pair<V*, bool> find_or_insert(const K& key, MakeKey&& make_key) {
+        uint64_t hash = Hash()(key);
+        size_t available = NO_SLOT;
+        size_t slot = find_slot(key, hash, &available);
+        if (slot != NO_SLOT) {
+            return {&entries_[slots_[slot]].value, false};
+        }
+        if (available == NO_SLOT || (ctrl_[available] == EMPTY && growth_left_ == 0)) {
+            rehash(capacity_ == 0 ? MIN_CAPACITY : (size_ * 2 >= capacity_ ? capacity_ * 2 : capacity_));
+            available = find_insert_slot(hash);
+        }
+
+        if (ctrl_[available] == EMPTY) {
+            growth_left_--;
+        }
+        set_ctrl(available, h2(hash));
+        slots_[available] = static_cast<uint32_t>(entries_.size());
+        entries_.push_back(Entry{make_key(), V(), hash, true});
+        size_++;
+        return {&entries_.back().value, true};
+    }
+
+    bool erase(const K& key) {
+        uint64_t hash = Hash()(key);
+        size_t slot = find_slot(key, hash);
+        if (slot == NO_SLOT) {
+            return false;
+        }
+        Entry& entry = entries_[slots_[slot]];
+        entry.live = false;
+        entry.key = K();
+        entry.value = V();
+        set_ctrl(slot, DELETED);
+        size_--;
+        // Erased entries stay in the dense vector until the next rehash;
+        // compact early if they start to dominate it
+        if (entries_.size() > 2 * size_ + MIN_CAPACITY) {
+            rehash(capacity_);
+        }
+        return true;
+    }
+
+    void clear() {
+        entries_.clear();
+        ctrl_.clear();
+        slots_.clear();
+        capacity_ = 0;
+        size_ = 0;
+        growth_left_ = 0;
+    }
+
+    // Visit live entries in insertion order
+    template <typename Fn>
+    void for_each(Fn&& fn) const {
+        for (const Entry& entry : entries_) {
+            if (entry.live) {
+                fn(entry.key, entry.value);
+            }
+        }
+    }
+
+private:
+    static constexpr size_t GROUP_WIDTH = 16;
+    static constexpr size_t MIN_CAPACITY = 16;
+    static constexpr int8_t EMPTY = -128;
+    static constexpr int8_t DELETED = -2;
+    static constexpr uint32_t NOT_FOUND = UINT32_MAX;
+    static constexpr size_t NO_SLOT = SIZE_MAX;
+
+    std::vector<Entry> entries_;
+    std::vector<int8_t> ctrl_;     // capacity_ + GROUP_WIDTH - 1 bytes (tail mirrors the head)
+    std::vector<uint32_t> slots_;  // entry index per slot
+    size_t capacity_ = 0;          // power of two, 0 when unallocated
+    size_t size_ = 0;
+    size_t growth_left_ = 0;
+
+    static size_t h1(uint64_t hash) { return static_cast<size_t>(hash >> 7); }
+    static int8_t h2(uint64_t hash) { return static_cast<int8_t>(hash & 0x7F); }
+
+    // Bitmask of positions in the group at pos whose control byte equals b
+    uint32_t match_byte(size_t pos, int8_t b) const {
+#ifdef RPLUS_SWISS_SSE2
+        __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&ctrl_[pos]));
+        return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(b))));
+#else
+        uint32_t mask = 0;
+        for (size_t i = 0; i < GROUP_WIDTH; ++i) {
+            mask |= static_cast<uint32_t>(ctrl_[pos + i] == b) << i;
+        }
+        return mask;
+#endif
+    }
+
+    // Bitmask of EMPTY or DELETED positions in the group at pos
+    uint32_t match_empty_or_deleted(size_t pos) const {
+#ifdef RPLUS_SWISS_SSE2
+        __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&ctrl_[pos]));
+        return static_cast<uint32_t>(_mm_movemask_epi8(group));
+#else
+        uint32_t mask = 0;
+        for (size_t i = 0; i < GROUP_WIDTH; ++i) {
+            mask |= static_cast<uint32_t>(ctrl_[pos + i] < 0) << i;
+        }
+        return mask;
+#endif
+    }
+
+    static unsigned lowest_bit(uint32_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+        return static_cast<unsigned>(__builtin_ctz(mask));
+#else
+        unsigned i = 0;
+        while (!(mask & 1)) {
+            mask >>= 1;
+            i++;
+        }
+        return i;
+#endif
+    }
+
+    void set_ctrl(size_t slot, int8_t value) {
+        ctrl_[slot] = value;
+        // Mirror the first GROUP_WIDTH - 1 bytes past the end so a group
+        // load starting near the end wraps around without a branch
+        if (slot < GROUP_WIDTH - 1) {
+            ctrl_[capacity_ + slot] = value;
+        }
+    }
+
+    // Slot holding key, or NO_SLOT. If available is given, it receives the
+    // first EMPTY or DELETED slot on the probe sequence (NO_SLOT if none),
+    // which is where key belongs when it is absent.
+    size_t find_slot(const K& key, uint64_t hash, size_t* available = nullptr) const {
+        if (available) {
+            *available = NO_SLOT;
+        }
+        if (capacity_ == 0) {
+            return NO_SLOT;
+        }
+        size_t mask = capacity_ - 1;
+        size_t pos = h1(hash) & mask;
+        int8_t tag = h2(hash);
+        for (size_t step = GROUP_WIDTH;; step += GROUP_WIDTH) {
+            for (uint32_t m = match_byte(pos, tag); m != 0; m &= m - 1) {
+                size_t slot = (pos + lowest_bit(m)) & mask;
+                const Entry& entry = entries_[slots_[slot]];
+                if (entry.hash == hash && Eq()(entry.key, key)) {
+                    return slot;
+                }
+            }
+            if (available && *available == NO_SLOT) {
+                uint32_t free = match_empty_or_deleted(pos);
+                if (free != 0) {
+                    *available = (pos + lowest_bit(free)) & mask;
+                }
+            }
+            if (match_byte(pos, EMPTY) != 0) {
+                return NO_SLOT;
+            }
+            pos = (pos + step) & mask;
+        }
+    }
+
+    uint32_t find_index(const K& key, uint64_t hash) const {
+        size_t slot = find_slot(key, hash);
+        return slot == NO_SLOT ? NOT_FOUND : slots_[slot];
+    }
+
+    size_t find_insert_slot(uint64_t hash) const {
+        size_t mask = capacity_ - 1;
+        size_t pos = h1(hash) & mask;
+        for (size_t step = GROUP_WIDTH;; step += GROUP_WIDTH) {
+            uint32_t m = match_empty_or_deleted(pos);
+            if (m != 0) {
+                return (pos + lowest_bit(m)) & mask;
+            }
+            pos = (pos + step) & mask;
+        }
+    }
+
+    // Rebuild the control bytes at new_capacity, compacting erased entries
+    // out of the entry vector while keeping insertion order
+    void rehash(size_t new_capacity) {
+        size_t live = 0;
+        for (size_t i = 0; i < entries_.size(); ++i) {
+            if (entries_[i].live) {
+                if (live != i) {
+                    entries_[live] = std::move(entries_[i]);
+                }
+                live++;
+            }
+        }
+        entries_.resize(live);
+
+        capacity_ = new_capacity;
+        ctrl_.assign(capacity_ + GROUP_WIDTH - 1, EMPTY);
+        slots_.assign(capacity_, 0);
+        growth_left_ = capacity_ - capacity_ / 8 - size_;
+
+        for (size_t i = 0; i < entries_.size(); ++i) {
+            size_t slot = find_insert_slot(entries_[i].hash);
+            set_ctrl(slot, h2(entries_[i].hash));
+            slots_[slot] = static_cast<uint32_t>(i);
+        }
+    }
+};
+
+} // namespace rplus
+
+#endif // SWISS_TABLE_H
@@ -0,0 +1,372 @@
+#include "text_codec.h"
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include "native.h"
+#include "rstring.h"
+#include "utf8.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define RPLUS_CODEC_SSE2 1
+#endif
+
+namespace rplus {
+
+namespace {
+
+const char HEX_DIGITS[] = "0123456789ABCDEF";
+
+const char BASE64_ALPHABET[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+inline unsigned lowest_bit(uint32_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+    return static_cast<unsigned>(__builtin_ctz(mask));
+#else
+    unsigned i = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        i++;
+    }
+    return i;
+#endif
+}
+
+// ============================================================================
+// Clean-Run Scanners
+// ============================================================================
+
+inline bool is_html_special(unsigned char c) {
+    return c == '&' || c == '<' || c == '>' || c == '"' || c == '\'';
+}
+
+inline bool is_uri_unreserved(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') ||
+           c == '-' || c == '_' || c == '.' || c == '!' || c == '~' || c == '*' ||
+           c == '\'' || c == '(' || c == ')';
+}
+
+// Length of the prefix of data that contains no HTML special characters
+size_t clean_html_run(const char* data, size_t length) {
+    size_t i = 0;
+#ifdef RPLUS_CODEC_SSE2
+    const __m128i amp = _mm_set1_epi8('&');
+    const __m128i lt = _mm_set1_epi8('<');
+    const __m128i gt = _mm_set1_epi8('>');
+    const __m128i quot = _mm_set1_epi8('"');
+    const __m128i apos = _mm_set1_epi8('\'');
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i special = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(block, amp), _mm_cmpeq_epi8(block, lt)),
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, gt), _mm_cmpeq_epi8(block, quot)),
+                         _mm_cmpeq_epi8(block, apos)));
+        uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(special));
+        if (mask != 0) {
+            return i + lowest_bit(mask);
+        }
+    }
+#endif
+    while (i < length && !is_html_special(static_cast<unsigned char>(data[i]))) {
+        i++;
+    }
+    return i;
+}
+
+// Length of the prefix of data made of URI-unreserved characters
+size_t clean_uri_run(const char* data, size_t length) {
+    size_t i = 0;
+#ifdef RPLUS_CODEC_SSE2
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        // Range checks via signed compares; bytes >= 0x80 are negative and
+        // fall outside every range
+        __m128i lower = _mm_or_si128(block, _mm_set1_epi8(0x20));
+        __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                      _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+        __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8('0' - 1)),
+                                      _mm_cmplt_epi8(block, _mm_set1_epi8('9' + 1)));
+        // ' ( ) * are contiguous (0x27-0x2A); - . are 0x2D-0x2E
+        __m128i punct_a = _mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8(0x26)),
+                                        _mm_cmplt_epi8(block, _mm_set1_epi8(0x2B)));
+        __m128i punct_b = _mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8(0x2C)),
+                                        _mm_cmplt_epi8(block, _mm_set1_epi8(0x2F)));
+        __m128i punct_c = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('_')), _mm_cmpeq_epi8(block, _mm_set1_epi8('!'))),
+            _mm_cmpeq_epi8(block, _mm_set1_epi8('~')));
+        __m128i ok = _mm_or_si128(_mm_or_si128(alpha, digit),
+                                  _mm_or_si128(_mm_or_si128(punct_a, punct_b), punct_c));
+        uint32_t bad = ~static_cast<uint32_t>(_mm_movemask_epi8(ok)) & 0xFFFF;
+        if (bad != 0) {
+            return i + lowest_bit(bad);
+        }
+    }
+#endif
+    while (i < length && is_uri_unreserved(static_cast<unsigned char>(data[i]))) {
+        i++;
+    }
+    return i;
+}
+
+int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+struct Base64DecodeTable {
+    uint8_t values[256];
+    
+    Base64DecodeTable() {
+        std::memset(values, 0xFF, sizeof(values));
+        for (int i = 0; i < 64; ++i) {
+            values[static_cast<unsigned char>(BASE64_ALPHABET[i])] = static_cast<uint8_t>(i);
+        }
+    }
+};
+
+const Base64DecodeTable BASE64_DECODE;
+
+} // namespace
+
+// ============================================================================
+// Encoders and Decoders
+// ============================================================================
+
+bool escape_html(std::string_view in, std::string& out) {
+    const char* data = in.data();
+    size_t length = in.size();
+    size_t run = clean_html_run(data, length);
+    if (run == length) {
+        out.append(data, length);
+        return false;
+    }
+    
+    out.reserve(out.size() + length + length / 8 + 16);
+    size_t i = 0;
+    while (i < length) {
+        run = clean_html_run(data + i, length - i);
+        out.append(data + i, run);
+        i += run;
+        if (i == length) {
+            break;
+        }
+        switch (data[i]) {
+            case '&': out.append("&amp;", 5); break;
+            case '<': out.append("&lt;", 4); break;
+            case '>': out.append("&gt;", 4); break;
+            case '"': out.append("&quot;", 6); break;
+            default: out.append("&#39;", 5); break;
+        }
+        i++;
+    }
+    return true;
+}
+
+void encode_uri_component(std::string_view in, std::string& out) {
+    const char* data = in.data();
+    size_t length = in.size();
+    out.reserve(out.size() + length + length / 4 + 16);
+    
+    size_t i = 0;
+    while (i < length) {
+        size_t run = clean_uri_run(data + i, length - i);
+        out.append(data + i, run);
+        i += run;
+        
+        // Escape the run of reserved bytes that follows
+        while (i < length && !is_uri_unreserved(static_cast<unsigned char>(data[i]))) {
+            unsigned char c = static_cast<unsigned char>(data[i]);
+            char escaped[3] = {'%', HEX_DIGITS[c >> 4], HEX_DIGITS[c & 0x0F]};
+            out.append(escaped, 3);
+            i++;
+        }
+    }
+}
+
+bool decode_uri_component(std::string_view in, std::string& out) {
+    const char* data = in.data();
+    size_t length = in.size();
+    size_t start = out.size();
+    out.reserve(start + length);
+    
+    size_t i = 0;
+    while (i < length) {
+        const void* percent = std::memchr(data + i, '%', length - i);
+        size_t run = percent ? static_cast<size_t>(static_cast<const char*>(percent) - (data + i)) : length - i;
+        out.append(data + i, run);
+        i += run;
+        if (i == length) {
+            break;
+        }
+        if (i + 2 >= length) {
+            out.resize(start);
+            return false;
+        }
+        int hi = hex_value(data[i + 1]);
+        int lo = hex_value(data[i + 2]);
+        if (hi < 0 || lo < 0) {
+            out.resize(start);
+            return false;
+        }
+        out.push_back(static_cast<char>((hi << 4) | lo));
+        i += 3;
+    }
+    // Escapes may spell out ill-formed UTF-8, which is an error rather
+    // than something to repair
+    if (!validate_utf8(out.data() + start, out.size() - start)) {
+        out.resize(start);
+        return false;
+    }
+    return true;
+}
+
+void base64_encode(std::string_view in, std::string& out) {
+    const unsigned char* data = reinterpret_cast<const unsigned char*>(in.data());
+    size_t length = in.size();
+    size_t start = out.size();
+    out.resize(start + (length + 2) / 3 * 4);
+    char* dst = &out[start];
+    
+    size_t i = 0;
+    for (; i + 3 <= length; i += 3) {
+        uint32_t triple = (static_cast<uint32_t>(data[i]) << 16) |
+                          (static_cast<uint32_t>(data[i + 1]) << 8) | data[i + 2];
+        dst[0] = BASE64_ALPHABET[(triple >> 18) & 0x3F];
+        dst[1] = BASE64_ALPHABET[(triple >> 12) & 0x3F];
+        dst[2] = BASE64_ALPHABET[(triple >> 6) & 0x3F];
+        dst[3] = BASE64_ALPHABET[triple & 0x3F];
+        dst += 4;
+    }
+    
+    size_t rest = length - i;
+    if (rest > 0) {
+        uint32_t triple = static_cast<uint32_t>(data[i]) << 16;
+        if (rest == 2) {
+            triple |= static_cast<uint32_t>(data[i + 1]) << 8;
+        }
+        dst[0] = BASE64_ALPHABET[(triple >> 18) & 0x3F];
+        dst[1] = BASE64_ALPHABET[(triple >> 12) & 0x3F];
+        dst[2] = rest == 2 ? BASE64_ALPHABET[(triple >> 6) & 0x3F] : '=';
+        dst[3] = '=';
+    }
+}
+
+bool base64_decode(std::string_view in, std::string& out) {
+    const unsigned char* data = reinterpret_cast<const unsigned char*>(in.data());
+    size_t length = in.size();
+    if (length % 4 != 0) {
+        return false;
+    }
+    if (length == 0) {
+        return true;
+    }
+    
+    size_t padding = (data[length - 1] == '=') + (data[length - 2] == '=');
+    size_t start = out.size();
+    out.resize(start + length / 4 * 3 - padding);
+    char* dst = &out[start];
+    
+    // Full quads: one table lookup per character, one error check per quad
+    size_t full = padding > 0 ? length - 4 : length;
+    size_t i = 0;
+    for (; i < full; i += 4) {
+        uint32_t a = BASE64_DECODE.values[data[i]];
+        uint32_t b = BASE64_DECODE.values[data[i + 1]];
+        uint32_t c = BASE64_DECODE.values[data[i + 2]];
+        uint32_t d = BASE64_DECODE.values[data[i + 3]];
+        if ((a | b | c | d) & 0x80) {
+            out.resize(start);
+            return false;
+        }
+        uint32_t triple = (a << 18) | (b << 12) | (c << 6) | d;
+        dst[0] = static_cast<char>(triple >> 16);
+        dst[1] = static_cast<char>(triple >> 8);
+        dst[2] = static_cast<char>(triple);
+        dst += 3;
+    }
+    
+    if (padding > 0) {
+        uint32_t a = BASE64_DECODE.values[data[i]];
+        uint32_t b = BASE64_DECODE.values[data[i + 1]];
+        uint32_t c = padding == 1 ? BASE64_DECODE.values[data[i + 2]] : 0;
+        if ((a | b | c) & 0x80) {
+            out.resize(start);
+            return false;
+        }
+        uint32_t triple = (a << 18) | (b << 12) | (c << 6);
+        dst[0] = static_cast<char>(triple >> 16);
+        if (padding == 1) {
+            dst[1] = static_cast<char>(triple >> 8);
+        }
+    }
+    return true;
+}
+
+// ============================================================================
+// Builtins
+// ============================================================================
+
+namespace {
+
+Value make_string(std::string chars) {
+    return Value(std::shared_ptr<const StringObject>(std::make_shared<const StringObject>(std::move(chars))));
+}
+
+const Value& expect_string(const Value& v, const char* builtin) {
+    if (!v.is_string()) {
+        throw VMException(std::string(builtin) + ": expected a string");
+    }
+    return v;
+}
+
+// Returns the argument itself when it contains nothing to escape
+Value escape_html_builtin(const Value& str) {
+    std::string out;
+    if (!escape_html(expect_string(str, "escapeHtml").as_string(), out)) {
+        return str;
+    }
+    return make_string(std::move(out));
+}
+
+Value encode_uri_component_builtin(std::string_view s) {
+    std::string out;
+    encode_uri_component(s, out);
+    return make_string(std::move(out));
+}
+
+Value decode_uri_component_builtin(std::string_view s) {
+    std::string out;
+    if (!decode_uri_component(s, out)) {
+        throw VMException("decodeURIComponent: URI malformed");
+    }
+    return make_string(std::move(out));
+}
+
+Value base64_encode_builtin(std::string_view s) {
+    std::string out;
+    base64_encode(s, out);
+    return make_string(std::move(out));
+}
+
+Value base64_decode_builtin(std::string_view s) {
+    std::string out;
+    if (!base64_decode(s, out)) {
+        throw VMException("base64Decode: invalid base64 input");
+    }
+    return make_string(std::move(out));
+}
+
+} // namespace
+
+void register_text_codec_builtins(VirtualMachine& vm) {
+    bind_native<&escape_html_builtin>(vm, "escapeHtml");
+    bind_native<&encode_uri_component_builtin>(vm, "encodeURIComponent");
+    bind_native<&decode_uri_component_builtin>(vm, "decodeURIComponent");
+    bind_native<&base64_encode_builtin>(vm, "base64Encode");
+    bind_native<&base64_decode_builtin>(vm, "base64Decode");
+}
+
+} // namespace rplus
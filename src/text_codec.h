@@ -0,0 +1,41 @@
+#ifndef TEXT_CODEC_H
+#define TEXT_CODEC_H
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include "vm.h"
+
+namespace rplus {
+
+/**
+ * Escaping and encoding kernels
+ *
+ * Each encoder appends to out after reserving for the common case, and
+ * copies runs of bytes that need no escaping with a single append. The
+ * runs are found 16 bytes at a time with SSE2 where available.
+ */
+
+// &, <, >, " and ' become entities; returns false if nothing needed escaping
+bool escape_html(std::string_view in, std::string& out);
+
+// Percent-encodes everything except A-Z a-z 0-9 - _ . ! ~ * ' ( )
+void encode_uri_component(std::string_view in, std::string& out);
+
+// Decodes %XX escapes; returns false on a malformed escape or if the
+// result is not well-formed UTF-8, leaving out as it was
+bool decode_uri_component(std::string_view in, std::string& out);
+
+// Standard base64 alphabet with '=' padding
+void base64_encode(std::string_view in, std::string& out);
+
+// Returns false on characters outside the alphabet or bad padding
+bool base64_decode(std::string_view in, std::string& out);
+
+// Register escapeHtml, encodeURIComponent, decodeURIComponent,
+// base64Encode and base64Decode as native functions
+void register_text_codec_builtins(VirtualMachine& vm);
+
+} // namespace rplus
+
+#endif // TEXT_CODEC_H
@@ -0,0 +1,228 @@
+#include "time_report.h"
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+
+namespace rplus {
+
+namespace detail {
+
+thread_local AllocationCounts allocation_counts;
+
+} // namespace detail
+
+thread_local TimeReport* TimeReport::current_ = nullptr;
+
+namespace {
+
+uint64_t steady_ns() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+uint64_t saturating_sub(uint64_t a, uint64_t b) {
+    return a > b ? a - b : 0;
+}
+
+std::string format_duration(uint64_t ns) {
+    char buffer[32];
+    if (ns >= 1000000000) {
+        std::snprintf(buffer, sizeof(buffer), "%.3f s", ns / 1e9);
+    } else if (ns >= 1000000) {
+        std::snprintf(buffer, sizeof(buffer), "%.3f ms", ns / 1e6);
+    } else {
+        std::snprintf(buffer, sizeof(buffer), "%.3f us", ns / 1e3);
+    }
+    return buffer;
+}
+
+std::string format_bytes(uint64_t bytes) {
+    char buffer[32];
+    if (bytes >= 1024 * 1024) {
+        std::snprintf(buffer, sizeof(buffer), "%.1f MiB", bytes / (1024.0 * 1024.0));
+    } else if (bytes >= 1024) {
+        std::snprintf(buffer, sizeof(buffer), "%.1f KiB", bytes / 1024.0);
+    } else {
+        std::snprintf(buffer, sizeof(buffer), "%llu B", static_cast<unsigned long long>(bytes));
+    }
+    return buffer;
+}
+
+void format_pass(const TimeReport::Pass& pass, size_t depth, uint64_t whole_ns, std::string& out) {
+    std::string name(depth * 2, ' ');
+    name += pass.name;
+    char line[256];
+    std::snprintf(line, sizeof(line), "%-36s %8llu %12s %12s %6.1f%% %10llu %10s\n", name.c_str(),
+                  static_cast<unsigned long long>(pass.calls), format_duration(pass.total_ns).c_str(),
+                  format_duration(pass.self_ns).c_str(),
+                  whole_ns ? 100.0 * pass.total_ns / whole_ns : 0.0,
+                  static_cast<unsigned long long>(pass.allocations),
+                  format_bytes(pass.allocated_bytes).c_str());
+    out += line;
+    for (const std::unique_ptr<TimeReport::Pass>& child : pass.children) {
+        format_pass(*child, depth + 1, whole_ns, out);
+    }
+}
+
+void json_string(const std::string& value, std::string& out) {
+    out += '"';
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char escape[8];
+            std::snprintf(escape, sizeof(escape), "\\u%04x", c);
+            out += escape;
+        } else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+void json_pass(const TimeReport::Pass& pass, std::string& out) {
+    out += "{\"name\":";
+    json_string(pass.name, out);
+    out += ",\"calls\":" + std::to_string(pass.calls);
+    out += ",\"total_ns\":" + std::to_string(pass.total_ns);
+    out += ",\"self_ns\":" + std::to_string(pass.self_ns);
+    out += ",\"allocations\":" + std::to_string(pass.allocations);
+    out += ",\"allocated_bytes\":" + std::to_string(pass.allocated_bytes);
+    out += ",\"children\":[";
+    for (size_t i = 0; i < pass.children.size(); ++i) {
+        if (i > 0) {
+            out += ',';
+        }
+        json_pass(*pass.children[i], out);
+    }
+    out += "]}";
+}
+
+} // anonymous namespace
+
+TimeReport::TimeReport() {
+    root_.name = "total";
+    stack_.reserve(32);
+}
+
+TimeReport::~TimeReport() {
+    if (active()) {
+        current_ = nullptr;
+    }
+}
+
+bool TimeReport::start() {
+    if (current_ && current_ != this) {
+        return false;
+    }
+    if (!active()) {
+        current_ = this;
+        stack_.push_back(Frame{&root_, false, steady_ns(), 0, detail::allocation_counts, {}});
+    }
+    return true;
+}
+
+void TimeReport::stop() {
+    if (!active()) {
+        return;
+    }
+    while (!stack_.empty()) {
+        leave();
+    }
+    current_ = nullptr;
+}
+
+void TimeReport::enter(const char* name, bool flat) {
+    // Flat passes hang off the innermost nested one
+    Pass* parent = &root_;
+    for (auto it = stack_.rbegin(); it != stack_.rend(); ++it) {
+        if (!it->flat) {
+            parent = it->pass;
+            break;
+        }
+    }
+    Pass* pass = nullptr;
+    for (const std::unique_ptr<Pass>& child : parent->children) {
+        if (child->name == name) {
+            pass = child.get();
+            break;
+        }
+    }
+    if (!pass) {
+        parent->children.push_back(std::make_unique<Pass>());
+        pass = parent->children.back().get();
+        pass->name = name;
+    }
+    stack_.push_back(Frame{pass, flat, steady_ns(), 0, detail::allocation_counts, {}});
+}
+
+void TimeReport::leave() {
+    if (stack_.empty()) {
+        return;
+    }
+    Frame frame = stack_.back();
+    stack_.pop_back();
+
+    uint64_t elapsed = steady_ns() - frame.start_ns;
+    uint64_t allocations = detail::allocation_counts.count - frame.start_allocations.count;
+    uint64_t bytes = detail::allocation_counts.bytes - frame.start_allocations.bytes;
+    uint64_t self = saturating_sub(elapsed, frame.children_ns);
+
+    Pass& pass = *frame.pass;
+    ++pass.calls;
+    pass.self_ns += self;
+    if (frame.flat) {
+        pass.total_ns += self;
+        pass.allocations += saturating_sub(allocations, frame.children_allocations.count);
+        pass.allocated_bytes += saturating_sub(bytes, frame.children_allocations.bytes);
+    } else {
+        pass.total_ns += elapsed;
+        pass.allocations += allocations;
+        pass.allocated_bytes += bytes;
+    }
+
+    if (!stack_.empty()) {
+        Frame& parent = stack_.back();
+        parent.children_ns += elapsed;
+        parent.children_allocations.count += allocations;
+        parent.children_allocations.bytes += bytes;
+    }
+}
+
+std::string TimeReport::format() const {
+    char header[256];
+    std::snprintf(header, sizeof(header), "%-36s %8s %12s %12s %7s %10s %10s\n", "pass", "calls",
+                  "total", "self", "%", "allocs", "bytes");
+    std::string out = header;
+    format_pass(root_, 0, root_.total_ns, out);
+    return out;
+}
+
+std::string TimeReport::to_json() const {
+    std::string out;
+    json_pass(root_, out);
+    out += '\n';
+    return out;
+}
+
+bool TimeReport::write_json(const std::string& path) const {
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        return false;
+    }
+    file << to_json();
+    return static_cast<bool>(file);
+}
+
+void TimeReport::reset() {
+    stop();
+    root_.calls = 0;
+    root_.total_ns = 0;
+    root_.self_ns = 0;
+    root_.allocations = 0;
+    root_.allocated_bytes = 0;
+    root_.children.clear();
+}
+
+} // namespace rplus
@@ -0,0 +1,144 @@
+#ifndef TIME_REPORT_H
+#define TIME_REPORT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "trace.h"
+
+namespace rplus {
+
+/**
+ * Compiler time report
+ *
+ * While a report is started on a thread, every PassTimer on that thread
+ * adds the time and allocations of its scope to a tree of passes: a timer
+ * opened inside another becomes its child, and repeated passes with the
+ * same name under the same parent are merged. FLAT timers are for
+ * recursive work such as a tree walk; they only record self time, and
+ * attach to the nearest enclosing non-flat pass, so nesting depth follows
+ * the pipeline rather than the shape of the program.
+ *
+ * Besides the CLI phases (reading the source, lexing, parsing, code
+ * generation, writing the output), the compiler times each of its passes:
+ * code generation, with the AST visitors as flat children, finalisation
+ * and the bytecode optimisations.
+ *
+ * Allocations are counted by a replacement operator new that calls
+ * detail::count_allocation; the rplus CLI installs one and counts only
+ * while a report is requested. Elsewhere the allocation columns stay zero.
+ *
+ *     TimeReport report;
+ *     report.start();
+ *     compile(...);           // PassTimers inside record into report
+ *     report.stop();
+ *     std::cout << report.format();
+ *     report.write_json("time-report.json");
+ */
+
+namespace detail {
+
+struct AllocationCounts {
+    uint64_t count = 0;
+    uint64_t bytes = 0;
+};
+
+// Allocations made by the calling thread so far
+extern thread_local AllocationCounts allocation_counts;
+
+inline void count_allocation(size_t bytes) {
+    ++allocation_counts.count;
+    allocation_counts.bytes += bytes;
+}
+
+} // namespace detail
+
+class TimeReport {
+public:
+    struct Pass {
+        std::string name;
+        uint64_t calls = 0;
+        uint64_t total_ns = 0;         // including children; FLAT passes count self time only
+        uint64_t self_ns = 0;
+        uint64_t allocations = 0;      // including children, like total_ns
+        uint64_t allocated_bytes = 0;
+        std::vector<std::unique_ptr<Pass>> children;  // in order of first entry
+    };
+
+    TimeReport();
+    ~TimeReport();
+
+    TimeReport(const TimeReport&) = delete;
+    TimeReport& operator=(const TimeReport&) = delete;
+
+    // Report receiving this thread's passes, or nullptr
+    static TimeReport* current() { return current_; }
+
+    // Begin receiving this thread's passes. Returns false if another
+    // report is active on the thread.
+    bool start();
+    // Close open passes and detach from the thread
+    void stop();
+    bool active() const { return current_ == this; }
+
+    void enter(const char* name, bool flat);
+    void leave();
+
+    // Whole run from start() to stop(), with the passes as children
+    const Pass& root() const { return root_; }
+
+    // Indented table, one line per pass
+    std::string format() const;
+    std::string to_json() const;
+    bool write_json(const std::string& path) const;
+
+    void reset();
+
+private:
+    static thread_local TimeReport* current_;
+
+    struct Frame {
+        Pass* pass;
+        bool flat;
+        uint64_t start_ns;
+        uint64_t children_ns;  // inclusive time of passes opened inside
+        detail::AllocationCounts start_allocations;
+        detail::AllocationCounts children_allocations;
+    };
+
+    Pass root_;
+    std::vector<Frame> stack_;
+};
+
+// Times the enclosing scope as a pass of the thread's active report, and
+// records non-flat passes as "compile" trace spans (see trace.h). Costs a
+// thread-local load and a relaxed load when neither is active.
+class PassTimer {
+public:
+    enum Mode { NESTED, FLAT };
+
+    explicit PassTimer(const char* name, Mode mode = NESTED)
+        : report_(TimeReport::current()), span_(mode == NESTED ? "compile" : nullptr, name) {
+        if (report_) {
+            report_->enter(name, mode == FLAT);
+        }
+    }
+    ~PassTimer() {
+        if (report_) {
+            report_->leave();
+        }
+    }
+
+    PassTimer(const PassTimer&) = delete;
+    PassTimer& operator=(const PassTimer&) = delete;
+
+private:
+    TimeReport* report_;
+    TraceSpan span_;
+};
+
+} // namespace rplus
+
+#endif // TIME_REPORT_H
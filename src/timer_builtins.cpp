@@ -0,0 +1,77 @@
+#include "timer_builtins.h"
+#include <cmath>
+#include <string>
+#include "event_loop.h"
+#include "native.h"
+
+namespace rplus {
+
+namespace {
+
+// Longest setTimeout delay; longer ones are clamped to it
+constexpr double MAX_DELAY_MS = 2147483647.0;
+
+EventLoop& require_loop(VirtualMachine& vm, const char* builtin) {
+    EventLoop* loop = vm.event_loop();
+    if (!loop) {
+        throw VMException(std::string(builtin) + ": no event loop");
+    }
+    return *loop;
+}
+
+Value set_timeout(VirtualMachine& vm, const Value* args, uint8_t /*argc*/) {
+    EventLoop& loop = require_loop(vm, "setTimeout");
+    size_t function;
+    try {
+        function = ValueTraits<size_t>::from_value(args[0]);
+    } catch (const VMException&) {
+        throw VMException("setTimeout: invalid function");
+    }
+    if (!vm.function(function)) {
+        throw VMException("setTimeout: invalid function");
+    }
+    // Clamped to [0, MAX_DELAY_MS] (NaN counts as 0); a fraction of a
+    // millisecond rounds up so the callback never runs early
+    double delay = ValueTraits<double>::from_value(args[1]);
+    uint64_t delay_ms = delay > 0 ? static_cast<uint64_t>(std::ceil(std::fmin(delay, MAX_DELAY_MS))) : 0;
+    
+    // Only the index is kept: a lazily loaded body may be flushed and
+    // reloaded elsewhere before the timer fires (see embed.h)
+    VirtualMachine* machine = &vm;
+    uint64_t id = loop.set_timer(delay_ms, [machine, function]() {
+        // Keep one failing callback from dropping the rest of the batch,
+        // or an earlier callback's error
+        std::string error = machine->get_error();
+        try {
+            machine->call_function(function, nullptr, 0);
+        } catch (const VMException& e) {
+            if (error.empty()) {
+                error = std::string("setTimeout callback: ") + e.what();
+            }
+        }
+        machine->set_error(error);
+    });
+    // Timer ids are below 2^53, so they are exact as numbers
+    return Value(static_cast<double>(id));
+}
+
+Value clear_timeout(VirtualMachine& vm, const Value* args, uint8_t /*argc*/) {
+    EventLoop& loop = require_loop(vm, "clearTimeout");
+    uint64_t id;
+    try {
+        id = ValueTraits<uint64_t>::from_value(args[0]);
+    } catch (const VMException&) {
+        // Not a value setTimeout returns, so no timer to cancel
+        return Value(false);
+    }
+    return Value(id > 0 && loop.cancel_timer(id));
+}
+
+} // namespace
+
+void register_timer_builtins(VirtualMachine& vm) {
+    vm.register_native("setTimeout", &set_timeout, 2);
+    vm.register_native("clearTimeout", &clear_timeout, 1);
+}
+
+} // namespace rplus
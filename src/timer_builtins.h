@@ -0,0 +1,18 @@
+#ifndef TIMER_BUILTINS_H
+#define TIMER_BUILTINS_H
+
+#include "vm.h"
+
+namespace rplus {
+
+// Register setTimeout(function, delayMs) and clearTimeout(id) as native
+// functions. The function argument is an index into the VM's function
+// table and must be an exact integer; the delay is clamped to
+// [0, 2^31 - 1] ms. Timers run on the event loop installed with
+// set_event_loop, and an error raised by a timer callback is reported
+// through set_error.
+void register_timer_builtins(VirtualMachine& vm);
+
+} // namespace rplus
+
+#endif // TIMER_BUILTINS_H
@@ -0,0 +1,203 @@
+#include "timer_wheel.h"
+#include <algorithm>
+#include <cstring>
+
+namespace rplus {
+
+TimerWheel::TimerWheel(uint64_t now_ms) : now_(now_ms) {
+    std::fill(std::begin(heads_), std::end(heads_), NIL);
+    std::fill(std::begin(tails_), std::end(tails_), NIL);
+    std::memset(occupied_, 0, sizeof(occupied_));
+}
+
+uint64_t TimerWheel::schedule(uint64_t delay_ms) {
+    uint32_t index;
+    if (!free_.empty()) {
+        index = free_.back();
+        free_.pop_back();
+    } else {
+        index = static_cast<uint32_t>(nodes_.size());
+        nodes_.push_back(Node{0, NIL, NIL, 1, NIL});
+    }
+    
+    // Ticks up to now_ have already been processed
+    Node& node = nodes_[index];
+    node.expires = now_ + std::max<uint64_t>(std::min(delay_ms, UINT64_MAX - now_), 1);
+    place(index);
+    size_++;
+    return (static_cast<uint64_t>(node.generation) << 32) | index;
+}
+
+bool TimerWheel::cancel(uint64_t id) {
+    uint32_t index = index_of(id);
+    if (index >= nodes_.size()) {
+        return false;
+    }
+    Node& node = nodes_[index];
+    if (node.generation != static_cast<uint32_t>(id >> 32) || node.bucket == NIL) {
+        return false;
+    }
+    unlink(index);
+    release(index);
+    return true;
+}
+
+size_t TimerWheel::advance(uint64_t now_ms, std::vector<uint64_t>& expired) {
+    size_t before = expired.size();
+    
+    // Jump straight to ticks with work: occupied level-0 slots and the
+    // starts of occupied upper-level slots, which cascade
+    while (now_ < now_ms && size_ > 0) {
+        now_ = std::min(now_ms, now_ + static_cast<uint64_t>(next_timeout()));
+        if (slot_of(now_, 0) == 0) {
+            cascade(1);
+        }
+        expire_slot(now_, expired);
+    }
+    if (now_ < now_ms) {
+        now_ = now_ms;
+    }
+    return expired.size() - before;
+}
+
+int64_t TimerWheel::next_timeout() const {
+    if (size_ == 0) {
+        return -1;
+    }
+    
+    uint64_t best = UINT64_MAX;
+    unsigned distance = next_occupied(0, slot_of(now_, 0));
+    if (distance != 0) {
+        best = distance;
+    }
+    // An upper-level slot needs attention when the wheel reaches its start
+    for (unsigned level = 1; level < LEVELS; ++level) {
+        distance = next_occupied(level, slot_of(now_, level));
+        if (distance != 0) {
+            unsigned shift = SLOT_BITS * level;
+            uint64_t wake = ((now_ >> shift) + distance) << shift;
+            best = std::min(best, wake - now_);
+        }
+    }
+    return static_cast<int64_t>(std::min<uint64_t>(best, INT64_MAX));
+}
+
+/**
+ * Puts a timer in the lowest level whose span covers its remaining delay
+ */
+void TimerWheel::place(uint32_t index) {
+    uint64_t expires = nodes_[index].expires;
+    uint64_t delay = expires > now_ ? expires - now_ : 0;
+    if (delay > MAX_DELAY) {
+        // Park in the top level; it is re-placed when that slot cascades
+        delay = MAX_DELAY;
+    }
+    uint64_t at = now_ + delay;
+    
+    unsigned level = 0;
+    while (level + 1 < LEVELS && delay >= (uint64_t(1) << (SLOT_BITS * (level + 1)))) {
+        level++;
+    }
+    link(index, level * SLOTS + slot_of(at, level));
+}
+
+void TimerWheel::link(uint32_t index, uint32_t bucket) {
+    Node& node = nodes_[index];
+    node.bucket = bucket;
+    node.next = NIL;
+    node.prev = tails_[bucket];
+    if (tails_[bucket] != NIL) {
+        nodes_[tails_[bucket]].next = index;
+    } else {
+        heads_[bucket] = index;
+        unsigned level = bucket / SLOTS;
+        unsigned slot = bucket % SLOTS;
+        occupied_[level][slot / 64] |= uint64_t(1) << (slot % 64);
+    }
+    tails_[bucket] = index;
+}
+
+void TimerWheel::unlink(uint32_t index) {
+    Node& node = nodes_[index];
+    uint32_t bucket = node.bucket;
+    if (node.prev != NIL) {
+        nodes_[node.prev].next = node.next;
+    } else {
+        heads_[bucket] = node.next;
+    }
+    if (node.next != NIL) {
+        nodes_[node.next].prev = node.prev;
+    } else {
+        tails_[bucket] = node.prev;
+    }
+    if (heads_[bucket] == NIL) {
+        unsigned level = bucket / SLOTS;
+        unsigned slot = bucket % SLOTS;
+        occupied_[level][slot / 64] &= ~(uint64_t(1) << (slot % 64));
+    }
+    node.bucket = NIL;
+}
+
+void TimerWheel::release(uint32_t index) {
+    Node& node = nodes_[index];
+    node.bucket = NIL;
+    node.generation = (node.generation + 1) & GENERATION_MASK;
+    if (node.generation == 0) {
+        node.generation = 1;
+    }
+    free_.push_back(index);
+    size_--;
+}
+
+/**
+ * Redistributes the level's current slot into the levels below. Called
+ * when the level below wraps around, after the level above has done the
+ * same if it wrapped too.
+ */
+void TimerWheel::cascade(unsigned level) {
+    unsigned slot = slot_of(now_, level);
+    if (slot == 0 && level + 1 < LEVELS) {
+        cascade(level + 1);
+    }
+    
+    uint32_t bucket = level * SLOTS + slot;
+    uint32_t index = heads_[bucket];
+    heads_[bucket] = NIL;
+    tails_[bucket] = NIL;
+    occupied_[level][slot / 64] &= ~(uint64_t(1) << (slot % 64));
+    
+    while (index != NIL) {
+        uint32_t next = nodes_[index].next;
+        place(index);
+        index = next;
+    }
+}
+
+void TimerWheel::expire_slot(uint64_t tick, std::vector<uint64_t>& expired) {
+    uint32_t bucket = slot_of(tick, 0);
+    uint32_t index = heads_[bucket];
+    heads_[bucket] = NIL;
+    tails_[bucket] = NIL;
+    occupied_[0][bucket / 64] &= ~(uint64_t(1) << (bucket % 64));
+    
+    while (index != NIL) {
+        uint32_t next = nodes_[index].next;
+        expired.push_back((static_cast<uint64_t>(nodes_[index].generation) << 32) | index);
+        release(index);
+        index = next;
+    }
+}
+
+unsigned TimerWheel::next_occupied(unsigned level, unsigned cursor) const {
+    for (unsigned distance = 1; distance <= SLOTS;) {
+        unsigned slot = (cursor + distance) & (SLOTS - 1);
+        uint64_t word = occupied_[level][slot / 64] >> (slot % 64);
+        if (word != 0) {
+            return distance + static_cast<unsigned>(__builtin_ctzll(word));
+        }
+        distance += 64 - slot % 64;
+    }
+    return 0;
+}
+
+} // namespace rplus
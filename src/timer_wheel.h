@@ -0,0 +1,94 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace rplus {
+
+/**
+ * Hierarchical timing wheel
+ *
+ * Four levels of 256 slots with a 1 ms tick cover 2^32 ms (~49 days);
+ * later deadlines park in the top level and are re-placed as it turns.
+ * A timer lives in the slot of the lowest level whose span covers its
+ * remaining delay and moves down a level each time the slot it occupies
+ * is reached ("cascading"), so insert and cancel are O(1) and each timer
+ * is touched at most once per level.
+ *
+ * Timers are identified by a 64-bit id: a slot index in the low half and
+ * a generation in the high half, so ids of fired or cancelled timers never
+ * alias a later timer reusing the same slot. Generations wrap at 21 bits so
+ * ids stay below 2^53 and survive a round trip through a script number.
+ * Id 0 is never issued.
+ */
+class TimerWheel {
+public:
+    static constexpr unsigned LEVELS = 4;
+    static constexpr unsigned SLOT_BITS = 8;
+    static constexpr unsigned SLOTS = 1u << SLOT_BITS;
+
+    explicit TimerWheel(uint64_t now_ms);
+
+    // Schedule a timer delay_ms after the wheel's current time. A delay of
+    // zero fires on the next tick.
+    uint64_t schedule(uint64_t delay_ms);
+
+    // Returns false if the timer already fired or was cancelled
+    bool cancel(uint64_t id);
+
+    // Move the wheel to now_ms and append the ids of all timers that expired
+    // on the way, in deadline order. Returns the number appended.
+    size_t advance(uint64_t now_ms, std::vector<uint64_t>& expired);
+
+    // Milliseconds until the wheel next needs to advance (an expiry or a
+    // cascade), or -1 when no timers are pending
+    int64_t next_timeout() const;
+
+    uint64_t now() const { return now_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    static uint32_t index_of(uint64_t id) { return static_cast<uint32_t>(id); }
+
+private:
+    static constexpr uint32_t NIL = UINT32_MAX;
+    static constexpr uint32_t GENERATION_MASK = (1u << 21) - 1;
+    static constexpr uint64_t MAX_DELAY = (uint64_t(1) << (SLOT_BITS * LEVELS)) - 1;
+
+    struct Node {
+        uint64_t expires;
+        uint32_t prev;
+        uint32_t next;
+        uint32_t generation;
+        uint32_t bucket;  // level * SLOTS + slot, or NIL when not scheduled
+    };
+
+    uint64_t now_;
+    size_t size_ = 0;
+    std::vector<Node> nodes_;
+    std::vector<uint32_t> free_;
+    uint32_t heads_[LEVELS * SLOTS];  // FIFO list per slot, so equal deadlines fire in schedule order
+    uint32_t tails_[LEVELS * SLOTS];
+    uint64_t occupied_[LEVELS][SLOTS / 64];  // non-empty slot bitmap per level
+
+    void place(uint32_t index);
+    void link(uint32_t index, uint32_t bucket);
+    void unlink(uint32_t index);
+    void release(uint32_t index);
+    void cascade(unsigned level);
+    void expire_slot(uint64_t tick, std::vector<uint64_t>& expired);
+
+    // Distance in slots from the cursor to the next occupied slot of level,
+    // in 1..SLOTS, or 0 if the level is empty
+    unsigned next_occupied(unsigned level, unsigned cursor) const;
+
+    static unsigned slot_of(uint64_t tick, unsigned level) {
+        return static_cast<unsigned>(tick >> (SLOT_BITS * level)) & (SLOTS - 1);
+    }
+};
+
+} // namespace rplus
+
+#endif // TIMER_WHEEL_H
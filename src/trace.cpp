@@ -0,0 +1,150 @@
+#include "trace.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace rplus {
+
+namespace {
+
+void json_string(const std::string& value, std::string& out) {
+    out += '"';
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char escape[8];
+            std::snprintf(escape, sizeof(escape), "\\u%04x", c);
+            out += escape;
+        } else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+// Trace-event timestamps are microseconds
+void json_microseconds(uint64_t ns, std::string& out) {
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%llu.%03llu",
+                  static_cast<unsigned long long>(ns / 1000),
+                  static_cast<unsigned long long>(ns % 1000));
+    out += buffer;
+}
+
+} // anonymous namespace
+
+Tracer& Tracer::global() {
+    static Tracer tracer;
+    return tracer;
+}
+
+uint64_t Tracer::now_ns() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+Tracer::ThreadBuffer& Tracer::buffer() {
+    thread_local std::shared_ptr<ThreadBuffer> local;
+    if (!local) {
+        local = std::make_shared<ThreadBuffer>();
+        local->tid = static_cast<uint32_t>(::syscall(SYS_gettid));
+        std::lock_guard<std::mutex> lock(mutex_);
+        buffers_.push_back(local);
+    }
+    return *local;
+}
+
+void Tracer::set_thread_name(const std::string& name) {
+    ThreadBuffer& thread = buffer();
+    std::lock_guard<std::mutex> lock(thread.mutex);
+    thread.name = name;
+}
+
+void Tracer::record(const char* category, const char* name, uint64_t start_ns, uint64_t end_ns,
+                    std::string detail) {
+    ThreadBuffer& thread = buffer();
+    std::lock_guard<std::mutex> lock(thread.mutex);
+    if (thread.events.size() >= MAX_EVENTS_PER_THREAD) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    thread.events.push_back(Event{category, name, start_ns, end_ns - start_ns, std::move(detail)});
+}
+
+/**
+ * Drains every thread's buffer into one trace. Buffers of threads that
+ * have exited are released once drained.
+ */
+std::string Tracer::flush() {
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        buffers = buffers_;
+        // Referenced by the registry, this copy and, while it runs, the owner
+        buffers_.erase(std::remove_if(buffers_.begin(), buffers_.end(),
+                                      [](const std::shared_ptr<ThreadBuffer>& thread) {
+                                          return thread.use_count() <= 2;
+                                      }),
+                       buffers_.end());
+    }
+
+    std::string pid = std::to_string(::getpid());
+    std::string out = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    bool first = true;
+    for (const std::shared_ptr<ThreadBuffer>& thread : buffers) {
+        std::vector<Event> events;
+        std::string name;
+        {
+            std::lock_guard<std::mutex> lock(thread->mutex);
+            events.swap(thread->events);
+            name = thread->name;
+        }
+        std::string tid = std::to_string(thread->tid);
+
+        if (!name.empty()) {
+            out += first ? "" : ",";
+            first = false;
+            out += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" + pid + ",\"tid\":" + tid +
+                   ",\"args\":{\"name\":";
+            json_string(name, out);
+            out += "}}";
+        }
+        for (const Event& event : events) {
+            out += first ? "" : ",";
+            first = false;
+            out += "{\"name\":";
+            json_string(event.name, out);
+            out += ",\"cat\":";
+            json_string(event.category, out);
+            out += ",\"ph\":\"X\",\"ts\":";
+            json_microseconds(event.start_ns, out);
+            out += ",\"dur\":";
+            json_microseconds(event.duration_ns, out);
+            out += ",\"pid\":" + pid + ",\"tid\":" + tid;
+            if (!event.detail.empty()) {
+                out += ",\"args\":{\"detail\":";
+                json_string(event.detail, out);
+                out += '}';
+            }
+            out += '}';
+        }
+    }
+    out += "]}\n";
+    return out;
+}
+
+bool Tracer::flush(const std::string& path) {
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        return false;
+    }
+    file << flush();
+    return static_cast<bool>(file);
+}
+
+} // namespace rplus
@@ -0,0 +1,127 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace rplus {
+
+/**
+ * Trace-event recording
+ *
+ * Spans of runtime work, written as Chrome trace-event JSON for
+ * chrome://tracing or ui.perfetto.dev. While the tracer is started, each
+ * TraceSpan appends one complete ("X") event to a buffer owned by the
+ * calling thread, so threads never contend while recording; flush()
+ * collects every buffer, tagged with the thread's id and name, and empties
+ * them. When the tracer is stopped a span costs one relaxed load.
+ *
+ * Categories in use:
+ *
+ *   compile      compiler pipeline phases (every non-flat PassTimer)
+ *   vm           ExecutionContext::invoke, detail is the function name
+ *   jit          optimising compiles and trace compiles
+ *   gc           bytecode flushing (see CompiledModule::collect)
+ *   event_loop   EventLoop::run_once iterations and their timers
+ *   io           time blocked waiting for I/O completions
+ *
+ *     Tracer::global().start();
+ *     Tracer::global().set_thread_name("isolate 1");   // on each thread
+ *     ...
+ *     Tracer::global().flush("slow-request.json");
+ */
+
+class Tracer {
+public:
+    // Events kept per thread between flushes; later ones are dropped
+    static constexpr size_t MAX_EVENTS_PER_THREAD = size_t(1) << 20;
+
+    struct Event {
+        const char* category;
+        const char* name;
+        uint64_t start_ns;
+        uint64_t duration_ns;
+        std::string detail;
+    };
+
+    static Tracer& global();
+
+    void start() { enabled_.store(true, std::memory_order_relaxed); }
+    void stop() { enabled_.store(false, std::memory_order_relaxed); }
+    bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+    // Shown for the calling thread in trace viewers
+    void set_thread_name(const std::string& name);
+
+    // category and name must be string literals or otherwise outlive the
+    // tracer
+    void record(const char* category, const char* name, uint64_t start_ns, uint64_t end_ns,
+                std::string detail = std::string());
+
+    // Trace-event JSON for everything recorded since the last flush, which
+    // is then discarded
+    std::string flush();
+    // The same, written to path; false if it cannot be written
+    bool flush(const std::string& path);
+
+    // Events lost to full buffers since the tracer was created
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+    static uint64_t now_ns();
+
+private:
+    Tracer() = default;
+
+    struct ThreadBuffer {
+        std::mutex mutex;  // taken by the owner per event, by flush() once
+        uint32_t tid = 0;
+        std::string name;
+        std::vector<Event> events;
+    };
+
+    ThreadBuffer& buffer();
+
+    std::atomic<bool> enabled_{false};
+    std::atomic<uint64_t> dropped_{0};
+    std::mutex mutex_;
+    // Kept after their threads exit, until flushed
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers_;
+};
+
+// Records the enclosing scope as a span if the tracer is running when it
+// begins. A null category disables the span.
+class TraceSpan {
+public:
+    TraceSpan(const char* category, const char* name)
+        : category_(category && Tracer::global().enabled() ? category : nullptr),
+          name_(name),
+          start_ns_(category_ ? Tracer::now_ns() : 0) {}
+    ~TraceSpan() {
+        if (category_) {
+            Tracer::global().record(category_, name_, start_ns_, Tracer::now_ns(),
+                                    std::move(detail_));
+        }
+    }
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+    // Whether the span is being recorded; check before building a detail
+    bool active() const { return category_ != nullptr; }
+    void set_detail(std::string detail) { detail_ = std::move(detail); }
+
+private:
+    const char* category_;
+    const char* name_;
+    uint64_t start_ns_;
+    std::string detail_;
+};
+
+} // namespace rplus
+
+#endif // TRACE_H
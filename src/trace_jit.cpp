@@ -0,0 +1,900 @@
+#include "trace_jit.h"
+#include "feedback.h"
+#include "logger.h"
+#include "trace.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <set>
+#include <tuple>
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#include <sys/mman.h>
+#define RPLUS_TRACE_JIT_X64 1
+#endif
+
+namespace rplus {
+
+// ============================================================================
+// Trace IR
+// ============================================================================
+
+namespace {
+
+enum class IrOp : uint8_t {
+    SLOT,           // stack slot loaded on trace entry; lives in its home
+    CONST,
+    ADD,
+    SUB,
+    MUL,
+    DIV,
+    NEG,
+    LT,
+    LE,
+    GT,
+    GE,
+    EQ,
+    NE,
+    NOT,
+    GUARD_TRUE,     // exit unless a is true
+    GUARD_FALSE,    // exit unless a is false
+    GUARD_NONZERO   // exit if a is zero or NaN
+};
+
+enum class IrType : uint8_t {
+    NUMBER,
+    BOOL
+};
+
+using Ref = uint32_t;
+constexpr Ref NONE = UINT32_MAX;
+
+struct IrIns {
+    IrOp op;
+    IrType type;
+    Ref a;
+    Ref b;
+    double k;       // CONST value; booleans are 0 and 1
+    uint32_t slot;  // SLOT index
+    uint32_t exit;  // guard's snapshot
+};
+
+// Stack slot to write back at an exit: a trace value, or the slot's home
+// when ref is NONE (loop-carried slots not otherwise live at the exit)
+struct SnapshotEntry {
+    uint32_t slot;
+    Ref ref;
+    IrType type;
+};
+
+struct Snapshot {
+    uint32_t resume;
+    uint32_t height;
+    bool loop_back;
+    std::vector<SnapshotEntry> entries;
+};
+
+} // anonymous namespace
+
+struct TraceExit {
+    uint32_t resume;
+    uint32_t height;
+    bool loop_back;
+    std::vector<std::pair<uint32_t, IrType>> slots;  // in exit area order
+    uint32_t hits = 0;
+    uint32_t attempts = 0;
+    std::unique_ptr<Trace> side;
+};
+
+class Trace {
+public:
+    using Entry = uint32_t (*)(double* frame);
+
+    Trace() = default;
+    ~Trace() {
+#ifdef RPLUS_TRACE_JIT_X64
+        if (code_) {
+            munmap(code_, code_size_);
+        }
+#endif
+    }
+
+    Trace(const Trace&) = delete;
+    Trace& operator=(const Trace&) = delete;
+
+    size_t start = 0;   // loop header, or the parent exit's resume offset
+    size_t height = 0;  // stack height at the loop header
+    std::vector<std::pair<uint32_t, IrType>> inputs;
+    std::vector<TraceExit> exits;
+    size_t frame_size = 0;  // doubles
+    size_t exit_area = 0;   // index of the exit area in the frame
+    size_t ir_size = 0;
+    Entry entry = nullptr;
+
+    // Copies machine code into executable memory
+    bool install(const std::vector<uint8_t>& code) {
+#ifdef RPLUS_TRACE_JIT_X64
+        void* memory = mmap(nullptr, code.size(), PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            return false;
+        }
+        std::memcpy(memory, code.data(), code.size());
+        if (mprotect(memory, code.size(), PROT_READ | PROT_EXEC) != 0) {
+            munmap(memory, code.size());
+            return false;
+        }
+        code_ = memory;
+        code_size_ = code.size();
+        entry = reinterpret_cast<Entry>(memory);
+        return true;
+#else
+        (void)code;
+        return false;
+#endif
+    }
+
+    size_t code_size() const { return code_size_; }
+
+private:
+    void* code_ = nullptr;
+    size_t code_size_ = 0;
+};
+
+// ============================================================================
+// Recorder
+// ============================================================================
+
+struct TraceJit::Recorder {
+    const Chunk* chunk;
+    size_t depth;
+    size_t header;    // loop header the trace closes at
+    size_t expected;  // offset of the next instruction on the recorded path
+    size_t start_height;
+    LoopInfo* loop;   // root trace being recorded, or
+    Trace* root;      // root of the side trace being recorded
+    TraceExit* exit;  // exit the side trace hangs off
+
+    std::vector<IrIns> ir;
+    std::vector<Snapshot> snapshots;
+    std::vector<Ref> stack;  // abstract stack; NONE = slot not read yet
+
+    std::map<std::tuple<IrOp, Ref, Ref>, Ref> pure;  // for sharing pure operations
+    std::map<std::pair<IrType, uint64_t>, Ref> constants;
+    std::set<std::pair<Ref, IrOp>> guarded;
+
+    IrType type(Ref ref) const { return ir[ref].type; }
+    bool is_const(Ref ref) const { return ir[ref].op == IrOp::CONST; }
+
+    Ref emit(IrOp op, IrType type, Ref a = NONE, Ref b = NONE) {
+        ir.push_back(IrIns{op, type, a, b, 0.0, 0, 0});
+        return static_cast<Ref>(ir.size() - 1);
+    }
+
+    Ref constant(double value, IrType type) {
+        uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        auto [it, inserted] = constants.emplace(std::make_pair(type, bits), NONE);
+        if (inserted) {
+            it->second = emit(IrOp::CONST, type);
+            ir[it->second].k = value;
+        }
+        return it->second;
+    }
+
+    // Slot value, loading it from the interpreter's frame on first use
+    Ref slot(size_t index, const Value* slots) {
+        if (index >= stack.size()) {
+            return NONE;
+        }
+        if (stack[index] == NONE) {
+            const Value& value = slots[index];
+            if (!value.is_number() && !value.is_bool()) {
+                return NONE;
+            }
+            Ref ref = emit(IrOp::SLOT, value.is_number() ? IrType::NUMBER : IrType::BOOL);
+            ir[ref].slot = static_cast<uint32_t>(index);
+            stack[index] = ref;
+        }
+        return stack[index];
+    }
+
+    bool is_home(Ref ref, size_t index) const {
+        return ir[ref].op == IrOp::SLOT && ir[ref].slot == index;
+    }
+
+    // Pure operation with constant folding and sharing
+    Ref pure_op(IrOp op, Ref a, Ref b = NONE) {
+        bool boolean = op >= IrOp::LT;
+        if (is_const(a) && (b == NONE || is_const(b))) {
+            double x = ir[a].k;
+            double y = b == NONE ? 0.0 : ir[b].k;
+            double result = 0.0;
+            switch (op) {
+                case IrOp::ADD: result = x + y; break;
+                case IrOp::SUB: result = x - y; break;
+                case IrOp::MUL: result = x * y; break;
+                case IrOp::DIV: result = x / y; break;
+                case IrOp::NEG: result = -x; break;
+                case IrOp::LT: result = x < y; break;
+                case IrOp::LE: result = x <= y; break;
+                case IrOp::GT: result = x > y; break;
+                case IrOp::GE: result = x >= y; break;
+                case IrOp::EQ: result = x == y; break;
+                case IrOp::NE: result = x != y; break;
+                case IrOp::NOT: result = x == 0.0; break;
+                default: break;
+            }
+            return constant(result, boolean ? IrType::BOOL : IrType::NUMBER);
+        }
+        if (op == IrOp::NOT && ir[a].op == IrOp::NOT) {
+            return ir[a].a;
+        }
+        if ((op == IrOp::ADD || op == IrOp::MUL || op == IrOp::EQ || op == IrOp::NE) && b < a) {
+            std::swap(a, b);
+        }
+        auto [it, inserted] = pure.emplace(std::make_tuple(op, a, b), NONE);
+        if (inserted) {
+            it->second = emit(op, boolean ? IrType::BOOL : IrType::NUMBER, a, b);
+        }
+        return it->second;
+    }
+
+    uint32_t snapshot(size_t resume, bool loop_back = false) {
+        Snapshot snapshot{static_cast<uint32_t>(resume), static_cast<uint32_t>(stack.size()),
+                          loop_back, {}};
+        for (size_t i = 0; i < stack.size(); ++i) {
+            if (stack[i] != NONE && !is_home(stack[i], i)) {
+                snapshot.entries.push_back(
+                    SnapshotEntry{static_cast<uint32_t>(i), stack[i], type(stack[i])});
+            }
+        }
+        snapshots.push_back(std::move(snapshot));
+        return static_cast<uint32_t>(snapshots.size() - 1);
+    }
+
+    // Returns false if the guard can never pass
+    bool guard(IrOp op, Ref ref, size_t resume) {
+        if (is_const(ref)) {
+            double k = ir[ref].k;
+            switch (op) {
+                case IrOp::GUARD_TRUE: return k != 0.0;
+                case IrOp::GUARD_FALSE: return k == 0.0;
+                default: return k != 0.0 && k == k;
+            }
+        }
+        if (!guarded.emplace(ref, op).second) {
+            return true;
+        }
+        Ref guard = emit(op, IrType::BOOL, ref);
+        ir[guard].exit = snapshot(resume);
+        return true;
+    }
+};
+
+// ============================================================================
+// x86-64 Code Generation
+// ============================================================================
+
+namespace {
+
+// The few SSE2 and integer instructions traces need. Trace code takes the
+// frame pointer in rdi and addresses every value as [rdi + disp32].
+class Assembler {
+public:
+    std::vector<uint8_t> code;
+
+    size_t size() const { return code.size(); }
+
+    void movsd_load(int xmm, int32_t disp) { sse_mem(0xF2, 0x10, xmm, disp); }
+    void movsd_store(int32_t disp, int xmm) { sse_mem(0xF2, 0x11, xmm, disp); }
+    void addsd(int xmm, int32_t disp) { sse_mem(0xF2, 0x58, xmm, disp); }
+    void mulsd(int xmm, int32_t disp) { sse_mem(0xF2, 0x59, xmm, disp); }
+    void subsd(int xmm, int32_t disp) { sse_mem(0xF2, 0x5C, xmm, disp); }
+    void divsd(int xmm, int32_t disp) { sse_mem(0xF2, 0x5E, xmm, disp); }
+    void ucomisd(int xmm, int32_t disp) { sse_mem(0x66, 0x2E, xmm, disp); }
+
+    void ucomisd_reg(int a, int b) { sse_reg(0x66, 0x2E, a, b); }
+    void xorpd_reg(int a, int b) { sse_reg(0x66, 0x57, a, b); }
+
+    void mov_rax_imm(uint64_t value) {
+        bytes({0x48, 0xB8});
+        u64(value);
+    }
+    void movq_xmm_rax(int xmm) { bytes({0x66, 0x48, 0x0F, 0x6E, static_cast<uint8_t>(0xC0 | xmm << 3)}); }
+    void mov_mem_rax(int32_t disp) {
+        bytes({0x48, 0x89, 0x87});
+        u32(static_cast<uint32_t>(disp));
+    }
+
+    // setcc into al (reg 0) or cl (reg 1)
+    void setcc(uint8_t cc, int reg) { bytes({0x0F, cc, static_cast<uint8_t>(0xC0 | reg)}); }
+    void and_al_cl() { bytes({0x20, 0xC8}); }
+    void or_al_cl() { bytes({0x08, 0xC8}); }
+    void movzx_eax_al() { bytes({0x0F, 0xB6, 0xC0}); }
+    void cvtsi2sd_eax(int xmm) { bytes({0xF2, 0x0F, 0x2A, static_cast<uint8_t>(0xC0 | xmm << 3)}); }
+
+    // Jumps return the position of their rel32 for patch()
+    size_t jcc(uint8_t cc) {
+        bytes({0x0F, cc});
+        u32(0);
+        return code.size() - 4;
+    }
+    size_t jmp() {
+        bytes({0xE9});
+        u32(0);
+        return code.size() - 4;
+    }
+    void patch(size_t at, size_t target) {
+        int32_t rel = static_cast<int32_t>(static_cast<int64_t>(target) - static_cast<int64_t>(at + 4));
+        std::memcpy(&code[at], &rel, sizeof(rel));
+    }
+
+    void mov_eax_imm(uint32_t value) {
+        bytes({0xB8});
+        u32(value);
+    }
+    void ret() { bytes({0xC3}); }
+
+    static constexpr uint8_t SETA = 0x97;
+    static constexpr uint8_t SETAE = 0x93;
+    static constexpr uint8_t SETE = 0x94;
+    static constexpr uint8_t SETNE = 0x95;
+    static constexpr uint8_t SETP = 0x9A;
+    static constexpr uint8_t SETNP = 0x9B;
+    static constexpr uint8_t JE = 0x84;
+    static constexpr uint8_t JNE = 0x85;
+
+private:
+    void bytes(std::initializer_list<uint8_t> values) { code.insert(code.end(), values); }
+    void u32(uint32_t value) {
+        for (int i = 0; i < 4; ++i) code.push_back(static_cast<uint8_t>(value >> (8 * i)));
+    }
+    void u64(uint64_t value) {
+        for (int i = 0; i < 8; ++i) code.push_back(static_cast<uint8_t>(value >> (8 * i)));
+    }
+    // prefix 0F opcode with a [rdi + disp32] operand
+    void sse_mem(uint8_t prefix, uint8_t opcode, int xmm, int32_t disp) {
+        bytes({prefix, 0x0F, opcode, static_cast<uint8_t>(0x80 | xmm << 3 | 7)});
+        u32(static_cast<uint32_t>(disp));
+    }
+    void sse_reg(uint8_t prefix, uint8_t opcode, int a, int b) {
+        bytes({prefix, 0x0F, opcode, static_cast<uint8_t>(0xC0 | a << 3 | b)});
+    }
+};
+
+uint64_t double_bits(double value) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+} // anonymous namespace
+
+/**
+ * Compiles a recorded trace. Frame layout, in doubles: slot homes, one
+ * cell per IR value, the exit area and scratch space for the loop's
+ * parallel copy. Constants are stored once before the loop; the body loads
+ * operands into xmm0/xmm1 and stores each result to its cell. A root trace
+ * ends by copying loop-carried values to their homes and jumping back; a
+ * side trace ends in its loop-back exit.
+ */
+static std::unique_ptr<Trace> compile_trace(const std::vector<IrIns>& ir,
+                                            const std::vector<Snapshot>& snapshots,
+                                            const std::vector<std::pair<uint32_t, Ref>>& carried,
+                                            size_t homes, bool root) {
+    auto trace = std::make_unique<Trace>();
+    size_t temps = homes;
+    size_t max_entries = 0;
+    for (const Snapshot& snapshot : snapshots) {
+        max_entries = std::max(max_entries, snapshot.entries.size());
+    }
+    size_t exit_area = temps + ir.size();
+    size_t scratch = exit_area + max_entries;
+    trace->frame_size = scratch + carried.size();
+    trace->exit_area = exit_area;
+    trace->ir_size = ir.size();
+
+    auto loc = [&](Ref ref) {
+        size_t index = ir[ref].op == IrOp::SLOT ? ir[ref].slot : temps + ref;
+        return static_cast<int32_t>(index * sizeof(double));
+    };
+    auto cell = [](size_t index) { return static_cast<int32_t>(index * sizeof(double)); };
+
+    Assembler as;
+    for (Ref ref = 0; ref < ir.size(); ++ref) {
+        if (ir[ref].op == IrOp::CONST) {
+            as.mov_rax_imm(double_bits(ir[ref].k));
+            as.mov_mem_rax(loc(ref));
+        }
+    }
+    size_t loop_top = as.size();
+
+    std::vector<std::pair<size_t, uint32_t>> exit_jumps;
+    for (Ref ref = 0; ref < ir.size(); ++ref) {
+        const IrIns& ins = ir[ref];
+        switch (ins.op) {
+            case IrOp::SLOT:
+            case IrOp::CONST:
+                break;
+            case IrOp::ADD:
+            case IrOp::SUB:
+            case IrOp::MUL:
+            case IrOp::DIV:
+                as.movsd_load(0, loc(ins.a));
+                if (ins.op == IrOp::ADD) as.addsd(0, loc(ins.b));
+                if (ins.op == IrOp::SUB) as.subsd(0, loc(ins.b));
+                if (ins.op == IrOp::MUL) as.mulsd(0, loc(ins.b));
+                if (ins.op == IrOp::DIV) as.divsd(0, loc(ins.b));
+                as.movsd_store(loc(ref), 0);
+                break;
+            case IrOp::NEG:
+                as.movsd_load(0, loc(ins.a));
+                as.mov_rax_imm(0x8000000000000000ULL);
+                as.movq_xmm_rax(1);
+                as.xorpd_reg(0, 1);
+                as.movsd_store(loc(ref), 0);
+                break;
+            case IrOp::NOT:
+                as.mov_rax_imm(double_bits(1.0));
+                as.movq_xmm_rax(0);
+                as.subsd(0, loc(ins.a));
+                as.movsd_store(loc(ref), 0);
+                break;
+            case IrOp::LT:
+            case IrOp::LE:
+            case IrOp::GT:
+            case IrOp::GE:
+            case IrOp::EQ:
+            case IrOp::NE:
+                // a < b is b > a: seta and setae are false for unordered
+                if (ins.op == IrOp::LT || ins.op == IrOp::LE) {
+                    as.movsd_load(0, loc(ins.b));
+                    as.ucomisd(0, loc(ins.a));
+                } else {
+                    as.movsd_load(0, loc(ins.a));
+                    as.ucomisd(0, loc(ins.b));
+                }
+                switch (ins.op) {
+                    case IrOp::LT:
+                    case IrOp::GT:
+                        as.setcc(Assembler::SETA, 0);
+                        break;
+                    case IrOp::LE:
+                    case IrOp::GE:
+                        as.setcc(Assembler::SETAE, 0);
+                        break;
+                    case IrOp::EQ:
+                        as.setcc(Assembler::SETE, 0);
+                        as.setcc(Assembler::SETNP, 1);
+                        as.and_al_cl();
+                        break;
+                    default:
+                        as.setcc(Assembler::SETNE, 0);
+                        as.setcc(Assembler::SETP, 1);
+                        as.or_al_cl();
+                        break;
+                }
+                as.movzx_eax_al();
+                as.cvtsi2sd_eax(0);
+                as.movsd_store(loc(ref), 0);
+                break;
+            case IrOp::GUARD_TRUE:
+            case IrOp::GUARD_FALSE:
+            case IrOp::GUARD_NONZERO:
+                as.movsd_load(0, loc(ins.a));
+                as.xorpd_reg(1, 1);
+                as.ucomisd_reg(0, 1);
+                exit_jumps.emplace_back(
+                    as.jcc(ins.op == IrOp::GUARD_FALSE ? Assembler::JNE : Assembler::JE), ins.exit);
+                break;
+        }
+    }
+
+    if (root) {
+        for (size_t i = 0; i < carried.size(); ++i) {
+            as.movsd_load(0, loc(carried[i].second));
+            as.movsd_store(cell(scratch + i), 0);
+        }
+        for (size_t i = 0; i < carried.size(); ++i) {
+            as.movsd_load(0, cell(scratch + i));
+            as.movsd_store(cell(carried[i].first), 0);
+        }
+        as.patch(as.jmp(), loop_top);
+    } else {
+        // The loop-back snapshot is the last one
+        exit_jumps.emplace_back(as.jmp(), static_cast<uint32_t>(snapshots.size() - 1));
+    }
+
+    std::vector<size_t> stubs;
+    for (uint32_t id = 0; id < snapshots.size(); ++id) {
+        const Snapshot& snapshot = snapshots[id];
+        stubs.push_back(as.size());
+        TraceExit exit;
+        exit.resume = snapshot.resume;
+        exit.height = snapshot.height;
+        exit.loop_back = snapshot.loop_back;
+        for (size_t i = 0; i < snapshot.entries.size(); ++i) {
+            const SnapshotEntry& entry = snapshot.entries[i];
+            as.movsd_load(0, entry.ref == NONE ? cell(entry.slot) : loc(entry.ref));
+            as.movsd_store(cell(exit_area + i), 0);
+            exit.slots.emplace_back(entry.slot, entry.type);
+        }
+        as.mov_eax_imm(id);
+        as.ret();
+        trace->exits.push_back(std::move(exit));
+    }
+    for (const auto& [at, id] : exit_jumps) {
+        as.patch(at, stubs[id]);
+    }
+
+    if (!trace->install(as.code)) {
+        return nullptr;
+    }
+    return trace;
+}
+
+// ============================================================================
+// Recording
+// ============================================================================
+
+bool TraceJit::supported() {
+#ifdef RPLUS_TRACE_JIT_X64
+    return true;
+#else
+    return false;
+#endif
+}
+
+TraceJit::TraceJit() = default;
+TraceJit::~TraceJit() = default;
+
+Trace* TraceJit::loop(const State& state) {
+    LoopInfo& info = loops_[std::make_pair(state.chunk, state.offset)];
+    if (info.trace) {
+        return info.trace.get();
+    }
+    if (!recorder_ && info.attempts < MAX_ATTEMPTS && ++info.hits >= HOT_LOOP) {
+        start_recording(state, &info, nullptr, nullptr);
+    }
+    return nullptr;
+}
+
+void TraceJit::start_recording(const State& state, LoopInfo* loop, Trace* root, TraceExit* exit) {
+    recorder_ = std::make_unique<Recorder>();
+    Recorder& r = *recorder_;
+    r.chunk = state.chunk;
+    r.depth = state.depth;
+    r.header = root ? root->start : state.offset;
+    r.expected = state.offset;
+    r.start_height = state.height;
+    r.loop = loop;
+    r.root = root;
+    r.exit = exit;
+    r.stack.assign(state.height, NONE);
+    if (loop) {
+        ++loop->attempts;
+        loop->hits = 0;
+    }
+    if (exit) {
+        ++exit->attempts;
+        exit->hits = 0;
+    }
+}
+
+void TraceJit::abort_recording() {
+    recorder_.reset();
+}
+
+/**
+ * Records the instruction at state.offset from the values the interpreter
+ * is about to run it with. The abstract stack must match the interpreter's
+ * at every step; any difference, or an instruction traces cannot express,
+ * abandons the recording.
+ */
+bool TraceJit::record(const State& state) {
+    Recorder& r = *recorder_;
+    if (state.chunk != r.chunk || state.depth != r.depth || state.offset != r.expected ||
+        state.height != r.stack.size() || r.ir.size() > MAX_TRACE_LENGTH) {
+        abort_recording();
+        return false;
+    }
+
+    const std::vector<uint8_t>& code = state.chunk->code();
+    size_t offset = state.offset;
+    OpCode op = static_cast<OpCode>(code[offset]);
+    size_t next = offset + instruction_length(op);
+    if (next > code.size()) {
+        abort_recording();
+        return false;
+    }
+    uint8_t operand = next > offset + 1 ? code[offset + 1] : 0;
+    uint16_t jump = next > offset + 2 ? static_cast<uint16_t>(code[offset + 1] << 8 | code[offset + 2]) : 0;
+    r.expected = next;
+
+    auto numbers = [&](size_t count) {
+        if (r.stack.size() < count) return false;
+        for (size_t i = 0; i < count; ++i) {
+            Ref ref = r.stack[r.stack.size() - 1 - i];
+            if (ref == NONE || r.type(ref) != IrType::NUMBER) return false;
+        }
+        return true;
+    };
+    auto pop = [&]() {
+        Ref ref = r.stack.back();
+        r.stack.pop_back();
+        return ref;
+    };
+
+    bool ok = true;
+    switch (op) {
+        case OpCode::OP_CONSTANT: {
+            const Value& value = state.chunk->get_constant(operand);
+            if (value.is_number()) {
+                r.stack.push_back(r.constant(value.as_number(), IrType::NUMBER));
+            } else if (value.is_bool()) {
+                r.stack.push_back(r.constant(value.as_bool() ? 1.0 : 0.0, IrType::BOOL));
+            } else {
+                ok = false;
+            }
+            break;
+        }
+        case OpCode::OP_GET_LOCAL: {
+            Ref ref = r.slot(operand, state.slots);
+            ok = ref != NONE;
+            if (ok) r.stack.push_back(ref);
+            break;
+        }
+        case OpCode::OP_SET_LOCAL:
+            ok = operand < r.stack.size() && r.stack.back() != NONE;
+            if (ok) r.stack[operand] = r.stack.back();
+            break;
+        case OpCode::OP_ADD:
+        case OpCode::OP_SUBTRACT:
+        case OpCode::OP_MULTIPLY:
+        case OpCode::OP_DIVIDE: {
+            if (!(ok = numbers(2))) break;
+            Ref b = r.stack.back();
+            if (op == OpCode::OP_DIVIDE) {
+                // Division by zero is left to the interpreter
+                ok = r.guard(IrOp::GUARD_NONZERO, b, offset);
+                if (!ok) break;
+            }
+            pop();
+            Ref a = pop();
+            IrOp ir_op = op == OpCode::OP_ADD ? IrOp::ADD
+                       : op == OpCode::OP_SUBTRACT ? IrOp::SUB
+                       : op == OpCode::OP_MULTIPLY ? IrOp::MUL : IrOp::DIV;
+            r.stack.push_back(r.pure_op(ir_op, a, b));
+            break;
+        }
+        case OpCode::OP_NEGATE:
+            if (!(ok = numbers(1))) break;
+            r.stack.push_back(r.pure_op(IrOp::NEG, pop()));
+            break;
+        case OpCode::OP_LESS:
+        case OpCode::OP_LESS_EQUAL:
+        case OpCode::OP_GREATER:
+        case OpCode::OP_GREATER_EQUAL: {
+            if (!(ok = numbers(2))) break;
+            Ref b = pop();
+            Ref a = pop();
+            IrOp ir_op = op == OpCode::OP_LESS ? IrOp::LT
+                       : op == OpCode::OP_LESS_EQUAL ? IrOp::LE
+                       : op == OpCode::OP_GREATER ? IrOp::GT : IrOp::GE;
+            r.stack.push_back(r.pure_op(ir_op, a, b));
+            break;
+        }
+        case OpCode::OP_EQUAL:
+        case OpCode::OP_NOT_EQUAL: {
+            if (!(ok = r.stack.size() >= 2)) break;
+            Ref b = pop();
+            Ref a = pop();
+            if (!(ok = a != NONE && b != NONE)) break;
+            IrOp ir_op = op == OpCode::OP_EQUAL ? IrOp::EQ : IrOp::NE;
+            if (r.type(a) == r.type(b)) {
+                r.stack.push_back(r.pure_op(ir_op, a, b));
+            } else {
+                r.stack.push_back(r.constant(ir_op == IrOp::NE ? 1.0 : 0.0, IrType::BOOL));
+            }
+            break;
+        }
+        case OpCode::OP_NOT:
+            ok = !r.stack.empty() && r.stack.back() != NONE && r.type(r.stack.back()) == IrType::BOOL;
+            if (ok) r.stack.push_back(r.pure_op(IrOp::NOT, pop()));
+            break;
+        case OpCode::OP_POP:
+            ok = !r.stack.empty();
+            if (ok) pop();
+            break;
+        case OpCode::OP_DUP:
+            ok = !r.stack.empty() && r.stack.back() != NONE;
+            if (ok) r.stack.push_back(r.stack.back());
+            break;
+        case OpCode::OP_JUMP:
+            r.expected = next + jump;
+            break;
+        case OpCode::OP_JUMP_BACK:
+            r.expected = next - jump;
+            break;
+        case OpCode::OP_JUMP_IF_FALSE:
+        case OpCode::OP_JUMP_IF_TRUE: {
+            // Only booleans: other values' truthiness is the interpreter's business
+            Ref condition = r.stack.empty() ? NONE : r.stack.back();
+            if (!(ok = condition != NONE && r.type(condition) == IrType::BOOL)) break;
+            bool value = state.slots[state.height - 1].as_bool();
+            bool taken = op == OpCode::OP_JUMP_IF_FALSE ? !value : value;
+            size_t target = next + jump;
+            r.expected = taken ? target : next;
+            ok = r.guard(value ? IrOp::GUARD_TRUE : IrOp::GUARD_FALSE, condition,
+                         taken ? next : target);
+            break;
+        }
+        case OpCode::OP_LOOP:
+            if (next - jump == r.header) {
+                finish_recording();
+                return false;
+            }
+            ok = false;
+            break;
+        default:
+            ok = false;
+            break;
+    }
+
+    if (!ok) {
+        abort_recording();
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Closes the recorded loop and compiles it. A root trace must leave every
+ * loop-carried slot with the type it was entered with; those slots are
+ * loaded on entry even if the trace never reads them, and written back by
+ * every exit.
+ */
+void TraceJit::finish_recording() {
+    std::unique_ptr<Recorder> recorder = std::move(recorder_);
+    Recorder& r = *recorder;
+    bool root = r.loop != nullptr;
+    size_t header_height = root ? r.start_height : r.root->height;
+    if (r.stack.size() != header_height) {
+        return;
+    }
+
+    std::vector<std::pair<uint32_t, Ref>> carried;
+    std::vector<std::pair<uint32_t, IrType>> inputs;
+    for (const IrIns& ins : r.ir) {
+        if (ins.op == IrOp::SLOT) {
+            inputs.emplace_back(ins.slot, ins.type);
+        }
+    }
+
+    if (root) {
+        for (uint32_t i = 0; i < r.stack.size(); ++i) {
+            Ref ref = r.stack[i];
+            if (ref == NONE || r.is_home(ref, i)) {
+                continue;
+            }
+            IrType type = r.type(ref);
+            auto input = std::find_if(inputs.begin(), inputs.end(),
+                                      [&](const auto& entry) { return entry.first == i; });
+            if (input == inputs.end()) {
+                inputs.emplace_back(i, type);
+            } else if (input->second != type) {
+                return;  // type-unstable loop
+            }
+            carried.emplace_back(i, ref);
+        }
+        for (Snapshot& snapshot : r.snapshots) {
+            for (const auto& [slot, ref] : carried) {
+                bool present = std::any_of(snapshot.entries.begin(), snapshot.entries.end(),
+                                           [&](const SnapshotEntry& e) { return e.slot == slot; });
+                if (!present && slot < snapshot.height) {
+                    snapshot.entries.push_back(SnapshotEntry{slot, NONE, r.type(ref)});
+                }
+            }
+        }
+    } else {
+        r.snapshot(r.header, true);
+    }
+
+    std::unique_ptr<Trace> trace;
+    {
+        TraceSpan span("jit", "compile trace");
+        trace = compile_trace(r.ir, r.snapshots, carried, r.start_height, root);
+    }
+    if (!trace) {
+        return;
+    }
+    trace->start = root ? r.header : r.exit->resume;
+    trace->height = header_height;
+    trace->inputs = std::move(inputs);
+    ++trace_count_;
+    RPLUS_LOG(LogLevel::DEBUG, "Compiled {} trace at offset {}: {} IR, {} exits, {} bytes",
+              root ? "root" : "side", trace->start, trace->ir_size, trace->exits.size(),
+              trace->code_size());
+    if (root) {
+        r.loop->trace = std::move(trace);
+    } else {
+        r.exit->side = std::move(trace);
+    }
+}
+
+// ============================================================================
+// Execution
+// ============================================================================
+
+TraceJit::Result TraceJit::execute(Trace& root, const State& state) {
+    Trace* trace = &root;
+    Value* slots = state.slots;
+    size_t height = state.height;
+
+    for (;;) {
+        if (frame_.size() < trace->frame_size) {
+            frame_.resize(trace->frame_size);
+        }
+        double* frame = frame_.data();
+        for (const auto& [slot, type] : trace->inputs) {
+            const Value& value = slots[slot];
+            bool matches = slot < height &&
+                           (type == IrType::NUMBER ? value.is_number() : value.is_bool());
+            if (!matches) {
+                return Result{trace->start, height};
+            }
+            frame[slot] = type == IrType::NUMBER ? value.as_number() : (value.as_bool() ? 1.0 : 0.0);
+        }
+
+        uint32_t id = trace->entry(frame);
+        TraceExit& exit = trace->exits[id];
+        const double* values = frame + trace->exit_area;
+        for (size_t i = 0; i < exit.slots.size(); ++i) {
+            const auto& [slot, type] = exit.slots[i];
+            slots[slot] = type == IrType::NUMBER ? Value(values[i]) : Value(values[i] != 0.0);
+        }
+        height = exit.height;
+
+        if (exit.loop_back) {
+            trace = &root;
+            continue;
+        }
+        if (exit.side) {
+            trace = exit.side.get();
+            continue;
+        }
+        if (++exit.hits >= HOT_EXIT && exit.attempts < MAX_ATTEMPTS && !recorder_) {
+            start_recording(State{state.chunk, exit.resume, slots, height, state.depth}, nullptr,
+                            &root, &exit);
+        }
+        return Result{exit.resume, height};
+    }
+}
+
+std::string TraceJit::dump() const {
+    std::string out;
+    char line[128];
+    std::vector<std::pair<const Trace*, int>> pending;
+    for (const auto& [key, info] : loops_) {
+        if (info.trace) {
+            pending.emplace_back(info.trace.get(), 0);
+        }
+        while (!pending.empty()) {
+            auto [trace, indent] = pending.back();
+            pending.pop_back();
+            std::snprintf(line, sizeof(line), "%*s%s trace @%zu: %zu IR, %zu exits, %zu bytes\n",
+                          indent * 2, "", indent ? "side" : "root", trace->start, trace->ir_size,
+                          trace->exits.size(), trace->code_size());
+            out += line;
+            for (const TraceExit& exit : trace->exits) {
+                if (exit.side) {
+                    pending.emplace_back(exit.side.get(), indent + 1);
+                }
+            }
+        }
+    }
+    return out;
+}
+
+} // namespace rplus
@@ -0,0 +1,121 @@
+#ifndef TRACE_JIT_H
+#define TRACE_JIT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "vm.h"
+
+namespace rplus {
+
+/**
+ * Tracing JIT for hot loops
+ *
+ * When an OP_LOOP back edge has been taken HOT_LOOP times, the recorder
+ * follows the interpreter through one iteration of the loop and records
+ * the path actually taken as a linear trace in SSA form. Numbers and
+ * booleans are kept unboxed in the trace; conditional branches become
+ * guards that check the recorded direction. While recording, constants
+ * are folded, identical pure operations are shared and repeated guards on
+ * the same value are dropped. No Value is created inside a trace: boxing
+ * is sunk into the side exits, which are the only place values leave it.
+ *
+ * The trace is compiled to x86-64 (SSE2) and entered from the interpreter
+ * at the loop header; it keeps looping natively until a guard fails. A
+ * failed guard takes a side exit that writes the live stack slots back as
+ * Values and resumes the interpreter at the right bytecode offset. When a
+ * side exit becomes hot, a side trace is recorded from it back to the loop
+ * header, and later exits through it continue in native code.
+ *
+ * Traces cover locals, number and boolean constants, arithmetic,
+ * comparisons, NOT and control flow within one frame. Anything else
+ * (calls, globals, strings, nested loops) aborts recording, and a loop
+ * whose recording keeps aborting is left to the interpreter.
+ */
+
+class Trace;
+struct TraceExit;
+
+class TraceJit {
+public:
+    // Back edges before a loop is recorded
+    static constexpr uint32_t HOT_LOOP = 56;
+    // Side exits taken before a side trace is recorded
+    static constexpr uint32_t HOT_EXIT = 10;
+    // Recording attempts per loop or exit before giving up on it
+    static constexpr uint32_t MAX_ATTEMPTS = 3;
+    // Longest trace recorded, in IR instructions
+    static constexpr size_t MAX_TRACE_LENGTH = 512;
+
+    // Whether native code can be generated on this platform
+    static bool supported();
+
+    TraceJit();
+    ~TraceJit();
+
+    TraceJit(const TraceJit&) = delete;
+    TraceJit& operator=(const TraceJit&) = delete;
+
+    // Interpreter state of the current frame
+    struct State {
+        const Chunk* chunk;
+        size_t offset;  // instruction about to run
+        Value* slots;   // frame base
+        size_t height;  // stack slots in use above the frame base
+        size_t depth;   // frame count
+    };
+
+    // Called before each instruction while recording. Returns false once
+    // recording has ended, because the trace was completed or aborted.
+    bool record(const State& state);
+    bool recording() const { return recorder_ != nullptr; }
+
+    // Called after a back edge to the loop header at state.offset. Returns
+    // the loop's trace, or nullptr after counting the iteration (which may
+    // start recording).
+    Trace* loop(const State& state);
+
+    struct Result {
+        size_t resume;  // bytecode offset to continue interpreting at
+        size_t height;  // stack height after the exit's write-back
+    };
+    // Run a trace and any side traces it exits into, leaving the frame's
+    // stack slots as the interpreter expects them at the resume offset
+    Result execute(Trace& trace, const State& state);
+
+    size_t trace_count() const { return trace_count_; }
+    std::string dump() const;
+
+private:
+    struct Recorder;
+
+    struct LoopInfo {
+        uint32_t hits = 0;
+        uint32_t attempts = 0;
+        std::unique_ptr<Trace> trace;
+    };
+
+    struct LoopKeyHash {
+        size_t operator()(const std::pair<const Chunk*, size_t>& key) const {
+            return std::hash<const Chunk*>()(key.first) ^ (key.second * 0x9e3779b97f4a7c15ULL);
+        }
+    };
+
+    // Keyed by (chunk, loop header offset)
+    std::unordered_map<std::pair<const Chunk*, size_t>, LoopInfo, LoopKeyHash> loops_;
+    std::unique_ptr<Recorder> recorder_;
+    std::vector<double> frame_;  // native frame, sized for the largest trace
+    size_t trace_count_ = 0;
+
+    void start_recording(const State& state, LoopInfo* loop, Trace* root, TraceExit* exit);
+    void abort_recording();
+    void finish_recording();
+};
+
+} // namespace rplus
+
+#endif // TRACE_JIT_H
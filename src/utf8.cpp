@@ -0,0 +1,279 @@
+#include "utf8.h"
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define RPLUS_UTF8_SSE2 1
+#if defined(__GNUC__) || defined(__clang__)
+#define RPLUS_UTF8_SSSE3 1
+#endif
+#endif
+
+namespace rplus {
+
+namespace {
+
+// Sequence length and allowed second-byte range for a multi-byte lead
+// byte, per the table of well-formed byte sequences in the Unicode
+// standard. C0, C1 and F5-FF never start a sequence.
+bool lead_byte(unsigned char c, size_t& needed, unsigned char& lo, unsigned char& hi) {
+    lo = 0x80;
+    hi = 0xBF;
+    if (c >= 0xC2 && c <= 0xDF) {
+        needed = 2;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        needed = 3;
+        if (c == 0xE0) lo = 0xA0;
+        if (c == 0xED) hi = 0x9F;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        needed = 4;
+        if (c == 0xF0) lo = 0x90;
+        if (c == 0xF4) hi = 0x8F;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Bytes at data[0..length) that begin a well-formed sequence: all of it
+// if it is complete, otherwise its maximal subpart (at least 1)
+size_t sequence_prefix(const unsigned char* data, size_t length, bool& complete) {
+    size_t needed;
+    unsigned char lo;
+    unsigned char hi;
+    complete = data[0] < 0x80;
+    if (complete || !lead_byte(data[0], needed, lo, hi)) {
+        return 1;
+    }
+    if (length < 2 || data[1] < lo || data[1] > hi) {
+        return 1;
+    }
+    size_t i = 2;
+    while (i < needed && i < length && data[i] >= 0x80 && data[i] <= 0xBF) {
+        i++;
+    }
+    complete = i == needed;
+    return i;
+}
+
+// Length of the well-formed sequence at data[0..length), or 0 if invalid
+size_t valid_sequence_length(const unsigned char* data, size_t length) {
+    bool complete;
+    size_t n = sequence_prefix(data, length, complete);
+    return complete ? n : 0;
+}
+
+Utf8Scan scan_scalar(const char* data, size_t length) {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+    bool ascii = true;
+    size_t i = 0;
+    while (i < length) {
+        if (bytes[i] < 0x80) {
+            i++;
+            continue;
+        }
+        ascii = false;
+        size_t n = valid_sequence_length(bytes + i, length - i);
+        if (n == 0) {
+            return Utf8Scan{false, false};
+        }
+        i += n;
+    }
+    return Utf8Scan{true, ascii};
+}
+
+#ifdef RPLUS_UTF8_SSSE3
+
+// Error classes for a (previous byte, current byte) pair; see Keiser &
+// Lemire, "Validating UTF-8 In Less Than One Instruction Per Byte"
+constexpr uint8_t TOO_SHORT = 1 << 0;
+constexpr uint8_t TOO_LONG = 1 << 1;
+constexpr uint8_t OVERLONG_3 = 1 << 2;
+constexpr uint8_t TOO_LARGE = 1 << 3;
+constexpr uint8_t SURROGATE = 1 << 4;
+constexpr uint8_t OVERLONG_2 = 1 << 5;
+constexpr uint8_t TOO_LARGE_1000 = 1 << 6;
+constexpr uint8_t OVERLONG_4 = 1 << 6;
+constexpr uint8_t TWO_CONTS = 1 << 7;
+constexpr uint8_t CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS;
+
+__attribute__((target("ssse3")))
+inline __m128i lookup16(__m128i nibbles, __m128i table) {
+    return _mm_shuffle_epi8(table, nibbles);
+}
+
+__attribute__((target("ssse3")))
+inline __m128i high_nibbles(__m128i v) {
+    return _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0x0F));
+}
+
+__attribute__((target("ssse3")))
+__m128i check_special_cases(__m128i input, __m128i prev1) {
+    const __m128i byte_1_high_table = _mm_setr_epi8(
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        static_cast<char>(TWO_CONTS), static_cast<char>(TWO_CONTS),
+        static_cast<char>(TWO_CONTS), static_cast<char>(TWO_CONTS),
+        TOO_SHORT | OVERLONG_2,
+        TOO_SHORT,
+        TOO_SHORT | OVERLONG_3 | SURROGATE,
+        static_cast<char>(TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4));
+    const __m128i byte_1_low_table = _mm_setr_epi8(
+        static_cast<char>(CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4),
+        static_cast<char>(CARRY | OVERLONG_2),
+        static_cast<char>(CARRY),
+        static_cast<char>(CARRY),
+        static_cast<char>(CARRY | TOO_LARGE),
+        static_cast<char>(CARRY | TOO_LARGE | TOO_LARGE_1000),
+        static_cast<char>(CARRY | TOO_LARGE | TOO_LARGE_1000),
+        static_cast<char>(CARRY | TOO_LARGE | TOO_LARGE_1000),
+        static_cast<char>(CARRY | TOO_LARGE | TOO_LARGE_1000),
+        static_cast<char>(CARRY | TOO_LARGE | TOO_LARGE_1000),
+        static_cast<char>(CARRY | TOO_LARGE | TOO_LARGE_1000),
+        static_cast<char>(CARRY | TOO_LARGE | TOO_LARGE_1000),
+        static_cast<char>(CARRY | TOO_LARGE | TOO_LARGE_1000),
+        static_cast<char>(CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE),
+        static_cast<char>(CARRY | TOO_LARGE | TOO_LARGE_1000),
+        static_cast<char>(CARRY | TOO_LARGE | TOO_LARGE_1000));
+    const __m128i byte_2_high_table = _mm_setr_epi8(
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        static_cast<char>(TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4),
+        static_cast<char>(TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE),
+        static_cast<char>(TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE),
+        static_cast<char>(TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE),
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT);
+    
+    __m128i byte_1_high = lookup16(high_nibbles(prev1), byte_1_high_table);
+    __m128i byte_1_low = lookup16(_mm_and_si128(prev1, _mm_set1_epi8(0x0F)), byte_1_low_table);
+    __m128i byte_2_high = lookup16(high_nibbles(input), byte_2_high_table);
+    return _mm_and_si128(_mm_and_si128(byte_1_high, byte_1_low), byte_2_high);
+}
+
+__attribute__((target("ssse3")))
+__m128i check_block(__m128i input, __m128i prev_input) {
+    __m128i prev1 = _mm_alignr_epi8(input, prev_input, 15);
+    __m128i special_cases = check_special_cases(input, prev1);
+    
+    // Bytes that must be the 2nd/3rd continuation of a 3- or 4-byte lead
+    __m128i prev2 = _mm_alignr_epi8(input, prev_input, 14);
+    __m128i prev3 = _mm_alignr_epi8(input, prev_input, 13);
+    __m128i is_third_byte = _mm_subs_epu8(prev2, _mm_set1_epi8(static_cast<char>(0xE0 - 0x80)));
+    __m128i is_fourth_byte = _mm_subs_epu8(prev3, _mm_set1_epi8(static_cast<char>(0xF0 - 0x80)));
+    __m128i must23_80 = _mm_and_si128(_mm_or_si128(is_third_byte, is_fourth_byte),
+                                      _mm_set1_epi8(static_cast<char>(0x80)));
+    return _mm_xor_si128(must23_80, special_cases);
+}
+
+// Non-zero where a block ends inside a multi-byte sequence
+__attribute__((target("ssse3")))
+__m128i incomplete_tail(__m128i input) {
+    const __m128i max_value = _mm_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        static_cast<char>(0xF0 - 1), static_cast<char>(0xE0 - 1), static_cast<char>(0xC0 - 1));
+    return _mm_subs_epu8(input, max_value);
+}
+
+__attribute__((target("ssse3")))
+Utf8Scan scan_ssse3(const char* data, size_t length) {
+    __m128i error = _mm_setzero_si128();
+    __m128i prev_input = _mm_setzero_si128();
+    __m128i prev_incomplete = _mm_setzero_si128();
+    __m128i high_bits = _mm_setzero_si128();
+    
+    size_t i = 0;
+    for (;;) {
+        __m128i input;
+        if (i + 16 <= length) {
+            input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        } else if (i < length) {
+            // Zero padding is ASCII, so a sequence cut off by the end of
+            // the input is reported as too short
+            alignas(16) char tail[16] = {};
+            std::memcpy(tail, data + i, length - i);
+            input = _mm_load_si128(reinterpret_cast<const __m128i*>(tail));
+        } else {
+            break;
+        }
+        
+        high_bits = _mm_or_si128(high_bits, input);
+        if (_mm_movemask_epi8(input) == 0) {
+            error = _mm_or_si128(error, prev_incomplete);
+            prev_incomplete = _mm_setzero_si128();
+        } else {
+            error = _mm_or_si128(error, check_block(input, prev_input));
+            prev_incomplete = incomplete_tail(input);
+        }
+        prev_input = input;
+        i += 16;
+    }
+    error = _mm_or_si128(error, prev_incomplete);
+    
+    bool ok = _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) == 0xFFFF;
+    bool ascii = _mm_movemask_epi8(high_bits) == 0;
+    return Utf8Scan{ok, ok && ascii};
+}
+
+#endif
+
+} // namespace
+
+/**
+ * Checks that data is well-formed UTF-8 and whether it is pure ASCII
+ * @param data Bytes to check
+ * @param length Number of bytes
+ * @return Validity and ASCII flags
+ */
+Utf8Scan scan_utf8(const char* data, size_t length) {
+#ifdef RPLUS_UTF8_SSSE3
+    static const bool has_ssse3 = __builtin_cpu_supports("ssse3");
+    if (has_ssse3) {
+        return scan_ssse3(data, length);
+    }
+#endif
+    return scan_scalar(data, length);
+}
+
+/**
+ * Replaces invalid sequences with U+FFFD, one replacement per maximal
+ * subpart of an ill-formed sequence
+ * @param text Possibly invalid UTF-8
+ * @return Well-formed UTF-8
+ */
+std::string repair_utf8(std::string_view text) {
+    static const char REPLACEMENT[] = "\xEF\xBF\xBD";
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(text.data());
+    std::string out;
+    out.reserve(text.size() + 8);
+    
+    size_t i = 0;
+    while (i < text.size()) {
+        bool complete;
+        size_t n = sequence_prefix(bytes + i, text.size() - i, complete);
+        if (complete) {
+            out.append(text.data() + i, n);
+        } else {
+            out.append(REPLACEMENT, 3);
+        }
+        i += n;
+    }
+    return out;
+}
+
+uint32_t decode_utf8(const char* data) {
+    const unsigned char* b = reinterpret_cast<const unsigned char*>(data);
+    if (b[0] < 0x80) {
+        return b[0];
+    }
+    if (b[0] < 0xE0) {
+        return (static_cast<uint32_t>(b[0] & 0x1F) << 6) | (b[1] & 0x3F);
+    }
+    if (b[0] < 0xF0) {
+        return (static_cast<uint32_t>(b[0] & 0x0F) << 12) |
+               (static_cast<uint32_t>(b[1] & 0x3F) << 6) | (b[2] & 0x3F);
+    }
+    return (static_cast<uint32_t>(b[0] & 0x07) << 18) | (static_cast<uint32_t>(b[1] & 0x3F) << 12) |
+           (static_cast<uint32_t>(b[2] & 0x3F) << 6) | (b[3] & 0x3F);
+}
+
+} // namespace rplus
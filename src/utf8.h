@@ -0,0 +1,40 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace rplus {
+
+/**
+ * UTF-8 validation
+ *
+ * validate_utf8 checks 16 bytes per step with the lookup-table method of
+ * Keiser and Lemire (SSSE3, selected at runtime): three nibble lookups
+ * classify every byte pair, and 3- and 4-byte sequences are checked with
+ * saturating subtractions. Blocks that are entirely ASCII take a single
+ * movemask. Other targets use a scalar decoder.
+ */
+
+struct Utf8Scan {
+    bool valid;  // well-formed UTF-8 (no overlongs, surrogates or values > U+10FFFF)
+    bool ascii;  // every byte < 0x80
+};
+
+Utf8Scan scan_utf8(const char* data, size_t length);
+
+inline bool validate_utf8(const char* data, size_t length) {
+    return scan_utf8(data, length).valid;
+}
+
+// Copy of text with each maximal invalid subsequence replaced by U+FFFD
+std::string repair_utf8(std::string_view text);
+
+// Decode the code point at data (which must be valid UTF-8)
+uint32_t decode_utf8(const char* data);
+
+} // namespace rplus
+
+#endif // UTF8_H
@@ -1,614 +1,1147 @@
 #include "vm.h"
+#include <cmath>
 #include <iostream>
+#include <cstdio>
 #include <cstring>
 #include <stdexcept>
+#include "logger.h"
+#include "metrics.h"
+#include "background_compiler.h"
+#include "collections.h"
+#include "feedback.h"
+#include "object.h"
+#include "optimizer.h"
+#include "probes.h"
+#include "profiler.h"
+#include "rstring.h"
+#include "string_builtins.h"
+#include "text_codec.h"
+#include "timer_builtins.h"
+#include "trace_jit.h"
 
 /**
  * Virtual Machine Implementation
- * Handles instruction execution, memory management, and runtime state
+ * Handles value representation, bytecode chunks and instruction execution
  */
 
+namespace rplus {
+
 // ============================================================================
-// VM Constructor and Initialization
+// Values
 // ============================================================================
 
-VM::VM(size_t heap_size, size_t stack_size)
-    : heap_size_(heap_size),
-      stack_size_(stack_size),
-      pc_(0),
-      sp_(0),
-      fp_(0),
-      halt_flag_(false) {
-    // Allocate memory regions
-    heap_ = new uint8_t[heap_size_];
-    stack_ = new uint8_t[stack_size_];
-    
-    if (!heap_ || !stack_) {
-        throw std::runtime_error("Failed to allocate VM memory");
+Value::Value()
+    : type_(Type::NIL), bool_value_(false), number_value_(0) {}
+
+Value::Value(bool b)
+    : type_(Type::BOOL), bool_value_(b), number_value_(0) {}
+
+Value::Value(double n)
+    : type_(Type::NUMBER), bool_value_(false), number_value_(n) {}
+
+Value::Value(const std::string& s)
+    : Value(std::make_shared<const StringObject>(s)) {}
+
+Value::Value(std::shared_ptr<const StringObject> s)
+    : type_(Type::STRING), bool_value_(false), number_value_(0), string_value_(std::move(s)) {}
+
+Value::Value(std::shared_ptr<Object> object)
+    : type_(Type::OBJECT), bool_value_(false), number_value_(0), object_value_(std::move(object)) {}
+
+bool Value::as_bool() const {
+    return bool_value_;
+}
+
+double Value::as_number() const {
+    return number_value_;
+}
+
+std::string_view Value::as_string() const {
+    return string_value_ ? string_value_->view() : std::string_view();
+}
+
+/**
+ * Printable form of the value. Integral numbers print without a fraction.
+ */
+std::string Value::to_string() const {
+    switch (type_) {
+        case Type::NIL:
+            return "nil";
+        case Type::BOOL:
+            return bool_value_ ? "true" : "false";
+        case Type::NUMBER: {
+            char buffer[32];
+            std::snprintf(buffer, sizeof(buffer), "%.17g", number_value_);
+            // Prefer the shortest form that reads back as the same number
+            for (int precision = 1; precision < 17; ++precision) {
+                char shorter[32];
+                std::snprintf(shorter, sizeof(shorter), "%.*g", precision, number_value_);
+                if (std::strtod(shorter, nullptr) == number_value_) {
+                    return shorter;
+                }
+            }
+            return buffer;
+        }
+        case Type::STRING:
+            return std::string(as_string());
+        case Type::OBJECT:
+            switch (object_value_->kind()) {
+                case ObjectKind::MAP: return "<map>";
+                case ObjectKind::SET: return "<set>";
+                case ObjectKind::ARRAY: return "<array>";
+            }
+            break;
     }
-    
-    // Initialize memory to zero
-    std::memset(heap_, 0, heap_size_);
-    std::memset(stack_, 0, stack_size_);
-    
-    // Initialize registers
-    std::memset(registers_, 0, sizeof(registers_));
-    
-    // Initialize call stack
-    call_stack_.reserve(256);
+    return "?";
+}
+
+/**
+ * Only nil and false are falsy
+ */
+bool Value::is_truthy() const {
+    return !(type_ == Type::NIL || (type_ == Type::BOOL && !bool_value_));
+}
+
+/**
+ * Strings compare by contents, objects by identity
+ */
+bool Value::equals(const Value& other) const {
+    if (type_ != other.type_) {
+        return false;
+    }
+    switch (type_) {
+        case Type::NIL: return true;
+        case Type::BOOL: return bool_value_ == other.bool_value_;
+        case Type::NUMBER: return number_value_ == other.number_value_;
+        case Type::STRING:
+            return string_value_ == other.string_value_ || as_string() == other.as_string();
+        case Type::OBJECT: return object_value_ == other.object_value_;
+    }
+    return false;
+}
+
+// ============================================================================
+// Chunks
+// ============================================================================
+
+void Chunk::write_byte(uint8_t byte, int line) {
+    code_.push_back(byte);
+    lines_.push_back(line);
+}
+
+void Chunk::write_constant(const Value& value) {
+    constants_.push_back(value);
+}
+
+uint8_t Chunk::get_byte(size_t offset) const {
+    if (offset >= code_.size()) {
+        throw VMException("Instruction pointer out of range");
+    }
+    return code_[offset];
+}
+
+const Value& Chunk::get_constant(size_t index) const {
+    if (index >= constants_.size()) {
+        throw VMException("Constant index out of range");
+    }
+    return constants_[index];
+}
+
+int Chunk::get_line(size_t offset) const {
+    return offset < lines_.size() ? lines_[offset] : -1;
+}
+
+void Chunk::clear() {
+    code_.clear();
+    constants_.clear();
+    lines_.clear();
 }
 
 // ============================================================================
-// VM Destructor and Cleanup
+// Stack Virtual Machine: Construction and Stack
 // ============================================================================
 
-VM::~VM() {
-    if (heap_) {
-        delete[] heap_;
-        heap_ = nullptr;
+VirtualMachine::VirtualMachine()
+    : stack_top_(0),
+      running_(false),
+      current_chunk_(nullptr),
+      instruction_pointer_(0),
+      trace_enabled_(false) {
+    // Standard library; natives the host registers come after these
+    register_collection_builtins(*this);
+    register_string_builtins(*this);
+    register_text_codec_builtins(*this);
+    register_log_builtins(*this);
+    register_timer_builtins(*this);
+}
+
+VirtualMachine::~VirtualMachine() = default;
+
+void VirtualMachine::push(const Value& value) {
+    if (stack_top_ >= STACK_MAX) {
+        throw VMException("Stack overflow");
+    }
+    stack_[stack_top_++] = value;
+}
+
+Value VirtualMachine::pop() {
+    if (stack_top_ == 0) {
+        throw VMException("Stack underflow");
+    }
+    Value value = std::move(stack_[--stack_top_]);
+    stack_[stack_top_] = Value();
+    return value;
+}
+
+const Value& VirtualMachine::peek(size_t distance) const {
+    if (distance >= stack_top_) {
+        throw VMException("Stack underflow");
     }
-    if (stack_) {
-        delete[] stack_;
-        stack_ = nullptr;
+    return stack_[stack_top_ - 1 - distance];
+}
+
+void VirtualMachine::clear_stack() {
+    while (stack_top_ > 0) {
+        stack_[--stack_top_] = Value();
     }
 }
 
+void VirtualMachine::set_error(const std::string& message) {
+    error_message_ = message;
+}
+
 // ============================================================================
-// Memory Management
+// Stack Virtual Machine: Instruction Decoding
 // ============================================================================
 
+uint8_t VirtualMachine::read_byte() {
+    return current_chunk_->get_byte(instruction_pointer_++);
+}
+
 /**
- * Allocates memory on the heap
- * @param size Number of bytes to allocate
- * @return Pointer to allocated memory (as uint32_t address)
+ * Reads a big-endian 16-bit operand
  */
-uint32_t VM::allocate(size_t size) {
-    if (heap_alloc_ptr_ + size > heap_size_) {
-        throw std::runtime_error("Heap allocation failed: out of memory");
+uint16_t VirtualMachine::read_short() {
+    uint16_t high = read_byte();
+    uint16_t low = read_byte();
+    return static_cast<uint16_t>((high << 8) | low);
+}
+
+/**
+ * Prints the stack and the instruction about to run
+ */
+void VirtualMachine::trace_instruction() {
+    std::fprintf(stderr, "          ");
+    for (size_t i = 0; i < stack_top_; ++i) {
+        std::fprintf(stderr, "[ %s ]", stack_[i].to_string().c_str());
     }
-    
-    uint32_t addr = static_cast<uint32_t>(heap_alloc_ptr_);
-    heap_alloc_ptr_ += size;
-    
-    // Zero-initialize allocated memory
-    std::memset(heap_ + addr, 0, size);
-    
-    return addr;
+    std::fprintf(stderr, "\n%04zu op %u line %d\n", instruction_pointer_,
+                 current_chunk_->get_byte(instruction_pointer_),
+                 current_chunk_->get_line(instruction_pointer_));
+}
+
+// ============================================================================
+// Stack Virtual Machine: Instruction Handlers
+// ============================================================================
+
+void VirtualMachine::handle_constant(uint8_t index) {
+    push(current_chunk_->get_constant(index));
 }
 
 /**
- * Frees allocated heap memory
- * @param addr Address to free
- * @param size Size of memory to free
+ * Adds numbers or concatenates strings
  */
-void VM::deallocate(uint32_t addr, size_t size) {
-    if (addr >= heap_size_ || addr + size > heap_size_) {
-        throw std::runtime_error("Invalid deallocation: address out of bounds");
+void VirtualMachine::handle_add() {
+    if (peek(0).is_string() && peek(1).is_string()) {
+        Value b = pop();
+        Value a = pop();
+        std::string joined(a.as_string());
+        joined += b.as_string();
+        push(Value(joined));
+        return;
     }
-    
-    // Zero out freed memory for security
-    std::memset(heap_ + addr, 0, size);
+    binary_op(OpCode::OP_ADD);
+}
+
+void VirtualMachine::handle_subtract() { binary_op(OpCode::OP_SUBTRACT); }
+void VirtualMachine::handle_multiply() { binary_op(OpCode::OP_MULTIPLY); }
+void VirtualMachine::handle_divide() { binary_op(OpCode::OP_DIVIDE); }
+void VirtualMachine::handle_modulo() { binary_op(OpCode::OP_MODULO); }
+
+void VirtualMachine::handle_negate() {
+    if (!peek().is_number()) {
+        throw VMException("Operand must be a number");
+    }
+    push(Value(-pop().as_number()));
+}
+
+void VirtualMachine::handle_equal() {
+    Value b = pop();
+    Value a = pop();
+    push(Value(a.equals(b)));
+}
+
+void VirtualMachine::handle_not_equal() {
+    Value b = pop();
+    Value a = pop();
+    push(Value(!a.equals(b)));
+}
+
+void VirtualMachine::handle_less() { comparison_op(OpCode::OP_LESS); }
+void VirtualMachine::handle_less_equal() { comparison_op(OpCode::OP_LESS_EQUAL); }
+void VirtualMachine::handle_greater() { comparison_op(OpCode::OP_GREATER); }
+void VirtualMachine::handle_greater_equal() { comparison_op(OpCode::OP_GREATER_EQUAL); }
+
+void VirtualMachine::handle_and() {
+    Value b = pop();
+    Value a = pop();
+    push(Value(a.is_truthy() && b.is_truthy()));
+}
+
+void VirtualMachine::handle_or() {
+    Value b = pop();
+    Value a = pop();
+    push(Value(a.is_truthy() || b.is_truthy()));
+}
+
+void VirtualMachine::handle_not() {
+    push(Value(!pop().is_truthy()));
+}
+
+// Conditional jumps leave the condition on the stack for the code after
+// them to pop
+void VirtualMachine::handle_jump(uint16_t offset) {
+    instruction_pointer_ += offset;
 }
 
+void VirtualMachine::handle_jump_if_false(uint16_t offset) {
+    if (!peek().is_truthy()) {
+        instruction_pointer_ += offset;
+    }
+}
+
+void VirtualMachine::handle_jump_if_true(uint16_t offset) {
+    if (peek().is_truthy()) {
+        instruction_pointer_ += offset;
+    }
+}
+
+void VirtualMachine::handle_loop(uint16_t offset) {
+    if (offset > instruction_pointer_) {
+        throw VMException("Loop target out of range");
+    }
+    instruction_pointer_ -= offset;
+}
+
+// ============================================================================
+// Stack Virtual Machine: Arithmetic Helpers
+// ============================================================================
+
 /**
- * Gets a value from heap memory
- * @param addr Address to read from
- * @param size Number of bytes to read
- * @return Value as 64-bit integer
+ * Pops two numeric operands and pushes the arithmetic result
  */
-uint64_t VM::read_memory(uint32_t addr, size_t size) {
-    if (addr + size > heap_size_) {
-        throw std::runtime_error("Memory read out of bounds");
+void VirtualMachine::binary_op(OpCode op) {
+    if (!peek(0).is_number() || !peek(1).is_number()) {
+        throw VMException("Operands must be numbers");
+    }
+    double b = pop().as_number();
+    double a = pop().as_number();
+    switch (op) {
+        case OpCode::OP_ADD: push(Value(a + b)); break;
+        case OpCode::OP_SUBTRACT: push(Value(a - b)); break;
+        case OpCode::OP_MULTIPLY: push(Value(a * b)); break;
+        case OpCode::OP_DIVIDE:
+            if (b == 0) {
+                throw VMException("Division by zero");
+            }
+            push(Value(a / b));
+            break;
+        case OpCode::OP_MODULO: push(Value(std::fmod(a, b))); break;
+        default:
+            throw VMException("Unknown arithmetic operation");
     }
-    
-    uint64_t value = 0;
-    std::memcpy(&value, heap_ + addr, std::min(size, sizeof(uint64_t)));
-    return value;
 }
 
 /**
- * Writes a value to heap memory
- * @param addr Address to write to
- * @param value Value to write
- * @param size Number of bytes to write
+ * Pops two numeric operands and pushes the comparison result
  */
-void VM::write_memory(uint32_t addr, uint64_t value, size_t size) {
-    if (addr + size > heap_size_) {
-        throw std::runtime_error("Memory write out of bounds");
+void VirtualMachine::comparison_op(OpCode op) {
+    if (!peek(0).is_number() || !peek(1).is_number()) {
+        throw VMException("Operands must be numbers");
+    }
+    double b = pop().as_number();
+    double a = pop().as_number();
+    switch (op) {
+        case OpCode::OP_LESS: push(Value(a < b)); break;
+        case OpCode::OP_LESS_EQUAL: push(Value(a <= b)); break;
+        case OpCode::OP_GREATER: push(Value(a > b)); break;
+        case OpCode::OP_GREATER_EQUAL: push(Value(a >= b)); break;
+        default:
+            throw VMException("Unknown comparison");
     }
-    
-    std::memcpy(heap_ + addr, &value, std::min(size, sizeof(uint64_t)));
 }
 
 // ============================================================================
-// Stack Operations
+// Stack Virtual Machine: Native Functions
 // ============================================================================
 
+
 /**
- * Pushes a value onto the stack
- * @param value Value to push
- * @param size Size of value in bytes
+ * Registers a host function callable through OP_CALL_NATIVE
+ * @param name Name the function is resolved by
+ * @param fn Thunk receiving the arguments in place on the stack
+ * @param arity Number of arguments the thunk expects
+ * @return Index to encode as the OP_CALL_NATIVE operand
  */
-void VM::push(uint64_t value, size_t size) {
-    if (sp_ + size > stack_size_) {
-        throw std::runtime_error("Stack overflow");
+uint8_t VirtualMachine::register_native(const std::string& name, NativeFn fn, uint8_t arity) {
+    int existing = find_native(name);
+    if (existing >= 0) {
+        natives_[existing] = NativeFunction{name, fn, arity};
+        return static_cast<uint8_t>(existing);
     }
-    
-    std::memcpy(stack_ + sp_, &value, std::min(size, sizeof(uint64_t)));
-    sp_ += size;
+    if (natives_.size() > UINT8_MAX) {
+        throw VMException("Too many native functions");
+    }
+    natives_.push_back(NativeFunction{name, fn, arity});
+    return static_cast<uint8_t>(natives_.size() - 1);
 }
 
 /**
- * Pops a value from the stack
- * @param size Size of value in bytes
- * @return Popped value
+ * Looks up a native function by name
+ * @param name Registered name
+ * @return Native index, or -1 if not registered
  */
-uint64_t VM::pop(size_t size) {
-    if (sp_ < size) {
-        throw std::runtime_error("Stack underflow");
+int VirtualMachine::find_native(const std::string& name) const {
+    for (size_t i = 0; i < natives_.size(); ++i) {
+        if (natives_[i].name == name) {
+            return static_cast<int>(i);
+        }
     }
-    
-    sp_ -= size;
-    uint64_t value = 0;
-    std::memcpy(&value, stack_ + sp_, std::min(size, sizeof(uint64_t)));
-    return value;
+    return -1;
 }
 
 /**
- * Reads value from stack without popping
- * @param offset Offset from stack pointer
- * @param size Size of value in bytes
- * @return Value read from stack
+ * Calls a native function with the top argc stack slots as arguments.
+ * The arguments are passed by pointer into the stack and replaced by
+ * the result, mirroring the stack effect of a bytecode call.
+ * @param index Native function index
+ * @param argc Number of arguments on the stack
  */
-uint64_t VM::peek_stack(size_t offset, size_t size) {
-    if (sp_ < offset + size) {
-        throw std::runtime_error("Stack read out of bounds");
+void VirtualMachine::handle_call_native(uint8_t index, uint8_t argc) {
+    if (index >= natives_.size()) {
+        throw VMException("Invalid native function index");
+    }
+    const NativeFunction& native = natives_[index];
+    if (argc != native.arity) {
+        throw VMException("Native function '" + native.name + "' expects " +
+                          std::to_string(native.arity) + " arguments");
+    }
+    if (stack_top_ < argc) {
+        throw VMException("Stack underflow");
     }
     
-    uint64_t value = 0;
-    std::memcpy(&value, stack_ + sp_ - offset - size, std::min(size, sizeof(uint64_t)));
-    return value;
+    size_t base = stack_top_ - argc;
+    Value result = native.fn(*this, &stack_[base], argc);
+    stack_top_ = base;
+    stack_[stack_top_++] = std::move(result);
 }
 
+} // namespace rplus
+
 // ============================================================================
-// Register Operations
+// Stack Virtual Machine: Calls and Frames
 // ============================================================================
 
+namespace rplus {
+
 /**
- * Reads a register value
- * @param reg Register index (0-15)
- * @return Register value
+ * Runs a chunk as the top-level function. Values already on the stack
+ * become its arguments. Runtime errors are reported through get_error().
+ * @param chunk Bytecode to execute
  */
-uint64_t VM::read_register(uint8_t reg) {
-    if (reg >= NUM_REGISTERS) {
-        throw std::runtime_error("Invalid register index");
+void VirtualMachine::execute(const Chunk& chunk) {
+    frames_.clear();
+    frame_base_ = 0;
+    try {
+        push(call_function(chunk, static_cast<uint8_t>(stack_top_)));
+    } catch (const VMException& e) {
+        runtime_metrics().runtime_errors.add();
+        RPLUS_PROBE1(runtime__error, e.what());
+        set_error(e.what());
     }
-    return registers_[reg];
 }
 
 /**
- * Writes to a register
- * @param reg Register index (0-15)
- * @param value Value to write
+ * Calls a function whose arguments are on top of the stack. The current
+ * frame, instruction pointer and running state are saved and restored, so
+ * this may be re-entered from native functions and host callbacks. If the
+ * callee executes OP_EXIT, the call returns the value on top of the
+ * callee's stack (or nil) with the caller's state restored and the VM
+ * stopped, so the exit propagates to the outermost run loop.
+ * @param chunk Function body
+ * @param argc Number of arguments on the stack
+ * @return The function's return value
  */
-void VM::write_register(uint8_t reg, uint64_t value) {
-    if (reg >= NUM_REGISTERS) {
-        throw std::runtime_error("Invalid register index");
+Value VirtualMachine::call_function(const Chunk& chunk, uint8_t argc) {
+    size_t exit_depth = frames_.size();
+    size_t saved_base = frame_base_;
+    const Chunk* saved_chunk = current_chunk_;
+    size_t saved_ip = instruction_pointer_;
+    FeedbackVector* saved_feedback = current_feedback_;
+    bool was_running = running_;
+    Profiler* profiler = Profiler::current();
+    size_t profile_depth = profiler ? profiler->depth() : 0;
+    
+    push_frame(chunk, argc);
+    size_t callee_base = frame_base_;
+    // Drops the frames pushed by this call and resumes the caller's
+    auto unwind = [&]() {
+        frames_.resize(exit_depth);
+        frame_base_ = saved_base;
+        current_chunk_ = saved_chunk;
+        instruction_pointer_ = saved_ip;
+        current_feedback_ = saved_feedback;
+        stack_top_ = callee_base;
+        if (profiler && profiler->active()) {
+            profiler->unwind(profile_depth);
+        }
+    };
+    
+    running_ = true;
+    try {
+        run(exit_depth);
+    } catch (...) {
+        unwind();
+        running_ = was_running;
+        throw;
     }
-    registers_[reg] = value;
+    
+    // OP_EXIT stopped the loop inside the callee: unwind its frames and
+    // leave running_ false, so the exit also ends the caller's loop
+    if (frames_.size() > exit_depth) {
+        Value result = stack_top_ > callee_base ? pop() : Value();
+        unwind();
+        return result;
+    }
+    running_ = was_running;
+    
+    return pop();
 }
 
-// ============================================================================
-// Instruction Execution
-// ============================================================================
+/**
+ * Calls a function by its function table index on behalf of the host,
+ * e.g. a timer callback. The index is resolved when the call is made, so
+ * a body reloaded since the call was scheduled is the one that runs.
+ * @param index Function table index
+ * @param args Argument values
+ * @param argc Number of arguments
+ * @return The function's return value
+ */
+Value VirtualMachine::call_function(size_t index, const Value* args, size_t argc) {
+    if (function_caller_) {
+        return function_caller_(index, args, argc);
+    }
+    const Chunk* chunk = function(index);
+    if (!chunk) {
+        throw VMException("Invalid function index");
+    }
+    if (argc > UINT8_MAX) {
+        throw VMException("Too many call arguments");
+    }
+    size_t base = stack_top_;
+    try {
+        for (size_t i = 0; i < argc; ++i) {
+            push(args[i]);
+        }
+    } catch (...) {
+        stack_top_ = base;
+        throw;
+    }
+    return call_function(*chunk, static_cast<uint8_t>(argc));
+}
 
 /**
- * Executes a single instruction
- * @param instr Instruction to execute
+ * Enters a function: saves the caller's position and makes the top argc
+ * stack slots the first locals of the new frame
  */
-void VM::execute_instruction(const Instruction& instr) {
-    switch (instr.opcode) {
-        // Arithmetic Operations
-        case OpCode::ADD:
-            execute_add(instr);
-            break;
-        case OpCode::SUB:
-            execute_sub(instr);
-            break;
-        case OpCode::MUL:
-            execute_mul(instr);
-            break;
-        case OpCode::DIV:
-            execute_div(instr);
-            break;
-        case OpCode::MOD:
-            execute_mod(instr);
+void VirtualMachine::push_frame(const Chunk& chunk, uint8_t argc) {
+    if (frames_.size() >= FRAMES_MAX) {
+        throw VMException("Call stack overflow");
+    }
+    if (stack_top_ < argc) {
+        throw VMException("Stack underflow");
+    }
+    
+    frames_.push_back(CallFrame{current_chunk_, instruction_pointer_, frame_base_, current_feedback_});
+    runtime_metrics().calls.add();
+    RPLUS_PROBE3(function__entry, &chunk, argc, frames_.size());
+    if (Profiler* profiler = Profiler::current()) {
+        profiler->enter(reinterpret_cast<uintptr_t>(&chunk));
+    }
+    current_chunk_ = &chunk;
+    instruction_pointer_ = 0;
+    frame_base_ = stack_top_ - argc;
+    current_feedback_ = nullptr;
+    
+    if (feedback_enabled_) {
+        FeedbackVector* feedback = feedback_for(chunk);
+        feedback->note_invocation(argc);
+        current_feedback_ = feedback;
+        if (tiering_enabled_) {
+            if (!compile_jobs_.jobs.empty()) {
+                install_compiled();
+            }
+            if (!feedback->optimized && feedback->invocations() >= feedback->next_tier_up) {
+                tier_up(chunk, *feedback);
+            }
+            if (feedback->optimized) {
+                // Optimised code records no feedback of its own
+                current_chunk_ = &feedback->optimized->code();
+                current_feedback_ = nullptr;
+            }
+        }
+    }
+}
+
+/**
+ * Dispatch loop. Returns once the frame count drops back to exit_depth,
+ * i.e. when the function entered above exit_depth returns.
+ */
+void VirtualMachine::run(size_t exit_depth) {
+    // Counted locally and published once on exit, including on error
+    struct InstructionCount {
+        uint64_t n = 0;
+        ~InstructionCount() { runtime_metrics().instructions.add(n); }
+    } count;
+    
+    while (running_ && frames_.size() > exit_depth) {
+        if (trace_enabled_) {
+            trace_instruction();
+        }
+        ++count.n;
+        execute_instruction(static_cast<OpCode>(read_byte()));
+    }
+}
+
+void VirtualMachine::execute_instruction(OpCode op) {
+    if (current_feedback_) {
+        record_feedback();
+    }
+    if (trace_recording_) {
+        record_trace();
+    }
+    
+    switch (op) {
+        case OpCode::OP_CONSTANT:
+            handle_constant(read_byte());
             break;
-        
-        // Bitwise Operations
-        case OpCode::AND:
-            execute_and(instr);
+        case OpCode::OP_DEFINE_GLOBAL: {
+            const Value& name = current_chunk_->get_constant(read_byte());
+            globals_[std::string(name.as_string())] = pop();
             break;
-        case OpCode::OR:
-            execute_or(instr);
+        }
+        case OpCode::OP_GET_GLOBAL: {
+            const Value& name = current_chunk_->get_constant(read_byte());
+            auto it = globals_.find(std::string(name.as_string()));
+            if (it == globals_.end()) {
+                throw VMException("Undefined variable '" + std::string(name.as_string()) + "'");
+            }
+            push(it->second);
             break;
-        case OpCode::XOR:
-            execute_xor(instr);
+        }
+        case OpCode::OP_SET_GLOBAL: {
+            const Value& name = current_chunk_->get_constant(read_byte());
+            auto it = globals_.find(std::string(name.as_string()));
+            if (it == globals_.end()) {
+                throw VMException("Undefined variable '" + std::string(name.as_string()) + "'");
+            }
+            it->second = peek();
             break;
-        case OpCode::SHL:
-            execute_shl(instr);
+        }
+        case OpCode::OP_GET_LOCAL:
+            push(stack_[frame_base_ + read_byte()]);
             break;
-        case OpCode::SHR:
-            execute_shr(instr);
+        case OpCode::OP_SET_LOCAL:
+            stack_[frame_base_ + read_byte()] = peek();
             break;
         
-        // Memory Operations
-        case OpCode::LOAD:
-            execute_load(instr);
-            break;
-        case OpCode::STORE:
-            execute_store(instr);
-            break;
-        case OpCode::LOADIMM:
-            execute_loadimm(instr);
-            break;
+        case OpCode::OP_ADD: handle_add(); break;
+        case OpCode::OP_SUBTRACT: handle_subtract(); break;
+        case OpCode::OP_MULTIPLY: handle_multiply(); break;
+        case OpCode::OP_DIVIDE: handle_divide(); break;
+        case OpCode::OP_MODULO: handle_modulo(); break;
+        case OpCode::OP_NEGATE: handle_negate(); break;
         
-        // Stack Operations
-        case OpCode::PUSH:
-            execute_push(instr);
-            break;
-        case OpCode::POP:
-            execute_pop(instr);
-            break;
+        case OpCode::OP_EQUAL: handle_equal(); break;
+        case OpCode::OP_NOT_EQUAL: handle_not_equal(); break;
+        case OpCode::OP_LESS: handle_less(); break;
+        case OpCode::OP_LESS_EQUAL: handle_less_equal(); break;
+        case OpCode::OP_GREATER: handle_greater(); break;
+        case OpCode::OP_GREATER_EQUAL: handle_greater_equal(); break;
         
-        // Control Flow
-        case OpCode::JMP:
-            execute_jmp(instr);
-            break;
-        case OpCode::JZ:
-            execute_jz(instr);
-            break;
-        case OpCode::JNZ:
-            execute_jnz(instr);
-            break;
-        case OpCode::JLT:
-            execute_jlt(instr);
+        case OpCode::OP_AND: handle_and(); break;
+        case OpCode::OP_OR: handle_or(); break;
+        case OpCode::OP_NOT: handle_not(); break;
+        
+        case OpCode::OP_JUMP: handle_jump(read_short()); break;
+        case OpCode::OP_JUMP_IF_FALSE: handle_jump_if_false(read_short()); break;
+        case OpCode::OP_JUMP_IF_TRUE: handle_jump_if_true(read_short()); break;
+        case OpCode::OP_JUMP_BACK: handle_loop(read_short()); break;
+        case OpCode::OP_LOOP:
+            handle_loop(read_short());
+            if (trace_jit_) {
+                run_trace();
+            } else if (current_feedback_ && tiering_enabled_) {
+                on_stack_replace();
+            }
             break;
-        case OpCode::JLE:
-            execute_jle(instr);
+        
+        case OpCode::OP_CALL: {
+            uint8_t function_index = read_byte();
+            handle_call(function_index, read_byte());
             break;
-        case OpCode::JGT:
-            execute_jgt(instr);
+        }
+        case OpCode::OP_RETURN:
+            handle_return();
             break;
-        case OpCode::JGE:
-            execute_jge(instr);
+        case OpCode::OP_CALL_NATIVE: {
+            uint8_t index = read_byte();
+            handle_call_native(index, read_byte());
             break;
-        case OpCode::CALL:
-            execute_call(instr);
+        }
+        
+        case OpCode::OP_POP:
+            pop();
             break;
-        case OpCode::RET:
-            execute_ret(instr);
+        case OpCode::OP_DUP:
+            push(peek());
             break;
         
-        // Comparison
-        case OpCode::CMP:
-            execute_cmp(instr);
+        case OpCode::OP_EXIT:
+            running_ = false;
             break;
         
-        // Other Operations
-        case OpCode::NOP:
-            // No operation
+        case OpCode::OP_GUARD_NUMBERS: {
+            uint8_t mask = read_byte();
+            if (((mask & 1) && !peek(0).is_number()) || ((mask & 2) && !peek(1).is_number())) {
+                deoptimize(instruction_pointer_ - 2);
+            }
+            break;
+        }
+        case OpCode::OP_ADD_NUMBER:
+        case OpCode::OP_SUBTRACT_NUMBER:
+        case OpCode::OP_MULTIPLY_NUMBER:
+        case OpCode::OP_DIVIDE_NUMBER:
+        case OpCode::OP_NEGATE_NUMBER:
+        case OpCode::OP_EQUAL_NUMBER:
+        case OpCode::OP_NOT_EQUAL_NUMBER:
+        case OpCode::OP_LESS_NUMBER:
+        case OpCode::OP_LESS_EQUAL_NUMBER:
+        case OpCode::OP_GREATER_NUMBER:
+        case OpCode::OP_GREATER_EQUAL_NUMBER:
+            handle_number_op(op);
             break;
-        case OpCode::HALT:
-            halt_flag_ = true;
+        case OpCode::OP_INLINE_RETURN: {
+            size_t base = frame_base_ + read_byte();
+            Value result = pop();
+            stack_top_ = base;
+            push(result);
             break;
+        }
         
         default:
-            throw std::runtime_error("Unknown opcode");
+            throw VMException("Unknown opcode");
     }
-    
-    pc_++;
 }
 
 // ============================================================================
-// Arithmetic Operation Handlers
+// Optimising Tier
 // ============================================================================
 
-void VM::execute_add(const Instruction& instr) {
-    uint64_t a = registers_[instr.operand1];
-    uint64_t b = registers_[instr.operand2];
-    registers_[instr.dest] = a + b;
-}
-
-void VM::execute_sub(const Instruction& instr) {
-    uint64_t a = registers_[instr.operand1];
-    uint64_t b = registers_[instr.operand2];
-    registers_[instr.dest] = a - b;
-}
-
-void VM::execute_mul(const Instruction& instr) {
-    uint64_t a = registers_[instr.operand1];
-    uint64_t b = registers_[instr.operand2];
-    registers_[instr.dest] = a * b;
-}
-
-void VM::execute_div(const Instruction& instr) {
-    uint64_t a = registers_[instr.operand1];
-    uint64_t b = registers_[instr.operand2];
-    
-    if (b == 0) {
-        throw std::runtime_error("Division by zero");
+/**
+ * Typed arithmetic and comparison on operands already checked to be
+ * numbers by a guard or by construction. The result replaces the operands
+ * in place.
+ */
+void VirtualMachine::handle_number_op(OpCode op) {
+    if (op == OpCode::OP_NEGATE_NUMBER) {
+        Value& operand = stack_[stack_top_ - 1];
+        operand = Value(-operand.as_number());
+        return;
     }
     
-    registers_[instr.dest] = a / b;
+    double b = stack_[stack_top_ - 1].as_number();
+    double a = stack_[stack_top_ - 2].as_number();
+    Value result;
+    switch (op) {
+        case OpCode::OP_ADD_NUMBER: result = Value(a + b); break;
+        case OpCode::OP_SUBTRACT_NUMBER: result = Value(a - b); break;
+        case OpCode::OP_MULTIPLY_NUMBER: result = Value(a * b); break;
+        case OpCode::OP_DIVIDE_NUMBER:
+            if (b == 0) {
+                // Leave division by zero to the generic instruction
+                deoptimize(instruction_pointer_ - 1);
+                return;
+            }
+            result = Value(a / b);
+            break;
+        case OpCode::OP_EQUAL_NUMBER: result = Value(a == b); break;
+        case OpCode::OP_NOT_EQUAL_NUMBER: result = Value(a != b); break;
+        case OpCode::OP_LESS_NUMBER: result = Value(a < b); break;
+        case OpCode::OP_LESS_EQUAL_NUMBER: result = Value(a <= b); break;
+        case OpCode::OP_GREATER_NUMBER: result = Value(a > b); break;
+        case OpCode::OP_GREATER_EQUAL_NUMBER: result = Value(a >= b); break;
+        default: throw VMException("Unknown opcode");
+    }
+    --stack_top_;
+    stack_[stack_top_ - 1] = std::move(result);
 }
 
-void VM::execute_mod(const Instruction& instr) {
-    uint64_t a = registers_[instr.operand1];
-    uint64_t b = registers_[instr.operand2];
-    
-    if (b == 0) {
-        throw std::runtime_error("Modulo by zero");
+/**
+ * Recompiles a hot function from its feedback and installs the result for
+ * subsequent calls. Failed attempts are retried after another
+ * TIER_UP_CALLS calls, up to MAX_OPTIMIZATIONS attempts.
+ */
+void VirtualMachine::tier_up(const Chunk& chunk, FeedbackVector& feedback) {
+    feedback.next_tier_up = feedback.invocations() + TIER_UP_CALLS;
+    if (feedback.compiling || feedback.optimizations >= MAX_OPTIMIZATIONS ||
+        feedback.arity() < 0) {
+        return;
     }
+    ++feedback.optimizations;
     
-    registers_[instr.dest] = a % b;
-}
-
-// ============================================================================
-// Bitwise Operation Handlers
-// ============================================================================
-
-void VM::execute_and(const Instruction& instr) {
-    uint64_t a = registers_[instr.operand1];
-    uint64_t b = registers_[instr.operand2];
-    registers_[instr.dest] = a & b;
-}
-
-void VM::execute_or(const Instruction& instr) {
-    uint64_t a = registers_[instr.operand1];
-    uint64_t b = registers_[instr.operand2];
-    registers_[instr.dest] = a | b;
-}
-
-void VM::execute_xor(const Instruction& instr) {
-    uint64_t a = registers_[instr.operand1];
-    uint64_t b = registers_[instr.operand2];
-    registers_[instr.dest] = a ^ b;
-}
-
-void VM::execute_shl(const Instruction& instr) {
-    uint64_t value = registers_[instr.operand1];
-    uint64_t shift = registers_[instr.operand2];
-    registers_[instr.dest] = value << shift;
-}
-
-void VM::execute_shr(const Instruction& instr) {
-    uint64_t value = registers_[instr.operand1];
-    uint64_t shift = registers_[instr.operand2];
-    registers_[instr.dest] = value >> shift;
-}
-
-// ============================================================================
-// Memory Operation Handlers
-// ============================================================================
-
-void VM::execute_load(const Instruction& instr) {
-    uint32_t addr = static_cast<uint32_t>(registers_[instr.operand1]);
-    uint64_t value = read_memory(addr, 8);
-    registers_[instr.dest] = value;
-}
-
-void VM::execute_store(const Instruction& instr) {
-    uint32_t addr = static_cast<uint32_t>(registers_[instr.operand1]);
-    uint64_t value = registers_[instr.operand2];
-    write_memory(addr, value, 8);
-}
-
-void VM::execute_loadimm(const Instruction& instr) {
-    registers_[instr.dest] = instr.immediate;
-}
-
-// ============================================================================
-// Stack Operation Handlers
-// ============================================================================
-
-void VM::execute_push(const Instruction& instr) {
-    uint64_t value = registers_[instr.operand1];
-    push(value, 8);
-}
-
-void VM::execute_pop(const Instruction& instr) {
-    uint64_t value = pop(8);
-    registers_[instr.dest] = value;
-}
-
-// ============================================================================
-// Control Flow Handlers
-// ============================================================================
-
-void VM::execute_jmp(const Instruction& instr) {
-    pc_ = instr.immediate - 1;  // -1 because pc_ will be incremented
-}
-
-void VM::execute_jz(const Instruction& instr) {
-    if (registers_[instr.operand1] == 0) {
-        pc_ = instr.immediate - 1;
+    CompilationSnapshot snapshot = Optimizer::snapshot(*this, chunk, feedback);
+    if (background_compilation_) {
+        auto job = std::make_shared<CompileJob>(std::move(snapshot));
+        BackgroundCompiler::shared().submit(job);
+        compile_jobs_.jobs.push_back(std::move(job));
+        feedback.compiling = true;
+        return;
     }
+    install_optimized(chunk, feedback, Optimizer(snapshot).optimize());
 }
 
-void VM::execute_jnz(const Instruction& instr) {
-    if (registers_[instr.operand1] != 0) {
-        pc_ = instr.immediate - 1;
+void VirtualMachine::install_optimized(const Chunk& chunk, FeedbackVector& feedback,
+                                       std::shared_ptr<OptimizedFunction> optimized) {
+    if (!optimized) {
+        return;
     }
+    RPLUS_LOG(LogLevel::DEBUG, "Optimised function at {}: {} guards, {} calls inlined",
+              reinterpret_cast<uintptr_t>(&chunk), optimized->guard_count(),
+              optimized->inlined_calls());
+    optimized_code_[&optimized->code()] = optimized;
+    feedback.optimized = std::move(optimized);
+    // A frame looping in the baseline code switches over at its next back edge
+    feedback.next_osr = feedback.back_edges;
 }
 
-void VM::execute_jlt(const Instruction& instr) {
-    int64_t a = static_cast<int64_t>(registers_[instr.operand1]);
-    int64_t b = static_cast<int64_t>(registers_[instr.operand2]);
-    if (a < b) {
-        pc_ = instr.immediate - 1;
+/**
+ * Safepoint: installs the results of finished background compiles. Runs
+ * between instructions, where no frame is in the middle of an operation,
+ * and only swaps what new calls and OSR will enter; frames already
+ * running baseline code are unaffected.
+ */
+void VirtualMachine::install_compiled() {
+    std::vector<std::shared_ptr<CompileJob>>& jobs = compile_jobs_.jobs;
+    for (auto it = jobs.begin(); it != jobs.end();) {
+        const CompileJob& job = **it;
+        if (!job.done()) {
+            ++it;
+            continue;
+        }
+        const Chunk& chunk = *job.snapshot().baseline;
+        FeedbackVector& feedback = *feedback_for(chunk);
+        feedback.compiling = false;
+        if (tiering_enabled_ && !feedback.optimized) {
+            install_optimized(chunk, feedback, job.result());
+        }
+        it = jobs.erase(it);
     }
 }
 
-void VM::execute_jle(const Instruction& instr) {
-    int64_t a = static_cast<int64_t>(registers_[instr.operand1]);
-    int64_t b = static_cast<int64_t>(registers_[instr.operand2]);
-    if (a <= b) {
-        pc_ = instr.immediate - 1;
+void VirtualMachine::discard_function(const Chunk& chunk) {
+    feedback_.erase(&chunk);
+    for (auto it = optimized_code_.begin(); it != optimized_code_.end();) {
+        const std::shared_ptr<OptimizedFunction>& optimized = it->second;
+        if (&optimized->baseline() != &chunk && !optimized->inlines(chunk)) {
+            ++it;
+            continue;
+        }
+        auto owner = feedback_.find(&optimized->baseline());
+        if (owner != feedback_.end() && owner->second->optimized == optimized) {
+            owner->second->optimized.reset();
+        }
+        it = optimized_code_.erase(it);
     }
-}
-
-void VM::execute_jgt(const Instruction& instr) {
-    int64_t a = static_cast<int64_t>(registers_[instr.operand1]);
-    int64_t b = static_cast<int64_t>(registers_[instr.operand2]);
-    if (a > b) {
-        pc_ = instr.immediate - 1;
+    
+    // Compiles work on copies, so they can finish; their code is dropped
+    std::vector<std::shared_ptr<CompileJob>>& jobs = compile_jobs_.jobs;
+    for (auto it = jobs.begin(); it != jobs.end();) {
+        if (!(*it)->snapshot().uses(chunk)) {
+            ++it;
+            continue;
+        }
+        auto owner = feedback_.find((*it)->snapshot().baseline);
+        if (owner != feedback_.end()) {
+            owner->second->compiling = false;
+        }
+        it = jobs.erase(it);
     }
 }
 
-void VM::execute_jge(const Instruction& instr) {
-    int64_t a = static_cast<int64_t>(registers_[instr.operand1]);
-    int64_t b = static_cast<int64_t>(registers_[instr.operand2]);
-    if (a >= b) {
-        pc_ = instr.immediate - 1;
+VirtualMachine::CompileJobs::~CompileJobs() {
+    for (const std::shared_ptr<CompileJob>& job : jobs) {
+        BackgroundCompiler::shared().cancel(job);
     }
 }
 
-void VM::execute_call(const Instruction& instr) {
-    // Push return address onto call stack
-    call_stack_.push_back(pc_);
+/**
+ * Leaves optimised code at a failed guard. The frame continues in the
+ * baseline function at the instruction the guard protected; when the
+ * guard belongs to an inlined body, the caller is resumed in baseline
+ * code after its call and the callee's frame is rebuilt on top of it.
+ * @param offset Offset of the guard in the current optimised code
+ */
+void VirtualMachine::deoptimize(size_t offset) {
+    auto it = optimized_code_.find(current_chunk_);
+    const DeoptPoint* point = it != optimized_code_.end() ? it->second->deopt_point(offset) : nullptr;
+    if (!point) {
+        throw VMException("Missing deoptimisation point");
+    }
+    OptimizedFunction& optimized = *it->second;
+    const Chunk& baseline = optimized.baseline();
     
-    // Jump to function
-    pc_ = instr.immediate - 1;
-}
-
-void VM::execute_ret(const Instruction& instr) {
-    if (call_stack_.empty()) {
-        throw std::runtime_error("Return from empty call stack");
+    FeedbackVector* feedback = feedback_for(baseline);
+    if (++optimized.deopts >= MAX_DEOPTS && feedback->optimized.get() == &optimized) {
+        // Stop entering this code; frames already running it may finish
+        feedback->optimized.reset();
+        RPLUS_LOG(LogLevel::DEBUG, "Discarded optimised code for function at {} after {} deopts",
+                  reinterpret_cast<uintptr_t>(&baseline), optimized.deopts);
     }
     
-    pc_ = call_stack_.back();
-    call_stack_.pop_back();
-}
-
-void VM::execute_cmp(const Instruction& instr) {
-    int64_t a = static_cast<int64_t>(registers_[instr.operand1]);
-    int64_t b = static_cast<int64_t>(registers_[instr.operand2]);
+    current_chunk_ = &baseline;
+    instruction_pointer_ = point->baseline_offset;
+    current_feedback_ = feedback;
+    if (!point->inlined) {
+        return;
+    }
     
-    // Set comparison flags in a flag register (register 15)
-    if (a == b) {
-        registers_[15] = 0;  // Zero flag
-    } else if (a < b) {
-        registers_[15] = 1;  // Less than flag
-    } else {
-        registers_[15] = 2;  // Greater than flag
+    if (frames_.size() >= FRAMES_MAX) {
+        throw VMException("Call stack overflow");
     }
+    frames_.push_back(CallFrame{&baseline, point->caller_resume, frame_base_, feedback});
+    if (Profiler* profiler = Profiler::current()) {
+        profiler->enter(reinterpret_cast<uintptr_t>(point->inlined));
+    }
+    current_chunk_ = point->inlined;
+    frame_base_ += point->inline_base;
+    current_feedback_ = feedback_for(*point->inlined);
 }
 
-// ============================================================================
-// VM Execution Loop
-// ============================================================================
-
 /**
- * Runs the VM with the given program
- * @param program Vector of instructions to execute
+ * Back edge in a baseline frame. Every OSR_BACK_EDGES iterations the
+ * function is optimised if it is not already, and the frame jumps to the
+ * optimised code's copy of the loop header it is about to run. Locals and
+ * temporaries stay in their stack slots.
  */
-void VM::run(const std::vector<Instruction>& program) {
-    program_ = program;
-    pc_ = 0;
-    halt_flag_ = false;
+void VirtualMachine::on_stack_replace() {
+    if (!compile_jobs_.jobs.empty()) {
+        install_compiled();
+    }
+    FeedbackVector& feedback = *current_feedback_;
+    if (++feedback.back_edges < feedback.next_osr) {
+        return;
+    }
+    feedback.next_osr = feedback.back_edges + OSR_BACK_EDGES;
     
-    while (!halt_flag_ && pc_ < program_.size()) {
-        try {
-            execute_instruction(program_[pc_]);
-        } catch (const std::exception& e) {
-            std::cerr << "Runtime error at PC " << pc_ << ": " << e.what() << std::endl;
-            throw;
+    const Chunk& baseline = *current_chunk_;
+    if (!feedback.optimized) {
+        tier_up(baseline, feedback);
+        if (!feedback.optimized) {
+            return;
         }
     }
+    int64_t entry = feedback.optimized->osr_entry(instruction_pointer_);
+    if (entry < 0) {
+        return;
+    }
+    RPLUS_LOG(LogLevel::DEBUG, "OSR into function at {} at loop offset {}",
+              reinterpret_cast<uintptr_t>(&baseline), instruction_pointer_);
+    current_chunk_ = &feedback.optimized->code();
+    instruction_pointer_ = static_cast<size_t>(entry);
+    current_feedback_ = nullptr;
 }
 
 // ============================================================================
-// Debugging and State Inspection
+// Tracing JIT
 // ============================================================================
 
+void VirtualMachine::enable_trace_jit(bool enable) {
+    if (!enable) {
+        trace_jit_.reset();
+        trace_recording_ = false;
+        return;
+    }
+    if (!TraceJit::supported()) {
+        RPLUS_LOG(LogLevel::WARN, "Tracing JIT is not supported on this platform");
+        return;
+    }
+    if (!trace_jit_) {
+        trace_jit_ = std::make_shared<TraceJit>();
+    }
+    tiering_enabled_ = false;
+}
+
 /**
- * Dumps the current state of all registers
+ * Feeds the instruction whose opcode was just read to the trace recorder.
  */
-void VM::dump_registers() const {
-    std::cout << "=== Register State ===" << std::endl;
-    for (int i = 0; i < NUM_REGISTERS; ++i) {
-        std::cout << "R" << i << ": 0x" << std::hex << registers_[i] << std::dec << std::endl;
+void VirtualMachine::record_trace() {
+    TraceJit::State state{current_chunk_, instruction_pointer_ - 1, &stack_[frame_base_],
+                          stack_top_ - frame_base_, frames_.size()};
+    trace_recording_ = trace_jit_->record(state);
+}
+
+/**
+ * Back edge to the loop header at the instruction pointer. Runs the loop's
+ * trace if it has one and continues where the trace exited.
+ */
+void VirtualMachine::run_trace() {
+    TraceJit::State state{current_chunk_, instruction_pointer_, &stack_[frame_base_],
+                          stack_top_ - frame_base_, frames_.size()};
+    if (Trace* trace = trace_jit_->loop(state)) {
+        TraceJit::Result result = trace_jit_->execute(*trace, state);
+        stack_top_ = frame_base_ + result.height;
+        instruction_pointer_ = result.resume;
     }
-    std::cout << "PC: " << pc_ << ", SP: " << sp_ << ", FP: " << fp_ << std::endl;
+    trace_recording_ = trace_jit_->recording();
 }
 
+const OptimizedFunction* VirtualMachine::optimized(const Chunk& chunk) const {
+    const FeedbackVector* vector = feedback(chunk);
+    return vector ? vector->optimized.get() : nullptr;
+}
+
+// ============================================================================
+// Type Feedback
+// ============================================================================
+
 /**
- * Dumps a portion of heap memory
- * @param start Starting address
- * @param size Number of bytes to dump
+ * Records the operands or call target of the instruction whose opcode was
+ * just read, if it is a feedback site. Runs before the instruction, so the
+ * operands are still on the stack and the operand bytes still unread.
  */
-void VM::dump_heap(uint32_t start, size_t size) const {
-    if (start + size > heap_size_) {
-        std::cerr << "Heap dump out of bounds" << std::endl;
+void VirtualMachine::record_feedback() {
+    size_t offset = instruction_pointer_ - 1;
+    FeedbackSlot* slot = current_feedback_->slot(offset);
+    if (!slot) {
         return;
     }
     
-    std::cout << "=== Heap Memory [" << start << "-" << (start + size - 1) << "] ===" << std::endl;
-    for (size_t i = 0; i < size; ++i) {
-        if (i % 16 == 0) {
-            std::cout << "0x" << std::hex << (start + i) << ": ";
+    switch (slot->kind) {
+        case FeedbackSiteKind::UNARY:
+            slot->record(FeedbackSlot::type_key(feedback_type(peek(0))));
+            break;
+        case FeedbackSiteKind::BINARY:
+        case FeedbackSiteKind::COMPARE:
+            slot->record(FeedbackSlot::type_key(feedback_type(peek(1)), feedback_type(peek(0))));
+            break;
+        case FeedbackSiteKind::CALL: {
+            uint8_t index = current_chunk_->get_byte(instruction_pointer_);
+            slot->record(reinterpret_cast<uintptr_t>(function(index)));
+            break;
         }
-        std::cout << std::hex << static_cast<int>(heap_[start + i]) << " ";
-        if ((i + 1) % 16 == 0) {
-            std::cout << std::dec << std::endl;
+        case FeedbackSiteKind::CALL_NATIVE:
+            slot->record(current_chunk_->get_byte(instruction_pointer_));
+            break;
+        case FeedbackSiteKind::BRANCH: {
+            // Conditional jumps leave the condition on the stack either way
+            bool jump_if_true = current_chunk_->get_byte(offset) ==
+                                static_cast<uint8_t>(OpCode::OP_JUMP_IF_TRUE);
+            bool taken = peek(0).is_truthy() == jump_if_true;
+            slot->record(taken ? FeedbackSlot::BRANCH_TAKEN : FeedbackSlot::BRANCH_NOT_TAKEN);
+            break;
         }
     }
-    std::cout << std::dec << std::endl;
+}
+
+FeedbackVector* VirtualMachine::feedback_for(const Chunk& chunk) {
+    std::shared_ptr<FeedbackVector>& vector = feedback_[&chunk];
+    if (!vector) {
+        vector = std::make_shared<FeedbackVector>(chunk);
+        vector->next_tier_up = TIER_UP_CALLS;
+        vector->next_osr = OSR_BACK_EDGES;
+    }
+    return vector.get();
+}
+
+const FeedbackVector* VirtualMachine::feedback(const Chunk& chunk) const {
+    auto it = feedback_.find(&chunk);
+    return it != feedback_.end() ? it->second.get() : nullptr;
 }
 
 /**
- * Dumps a portion of stack memory
- * @param size Number of bytes to dump from top
+ * Dumps every feedback vector, naming functions by their function table
+ * index where they have one
  */
-void VM::dump_stack(size_t size) const {
-    size_t dump_size = std::min(size, static_cast<size_t>(sp_));
-    
-    std::cout << "=== Stack Memory (top " << dump_size << " bytes) ===" << std::endl;
-    for (size_t i = 0; i < dump_size; ++i) {
-        if (i % 16 == 0) {
-            std::cout << "0x" << std::hex << (sp_ - dump_size + i) << ": ";
+std::string VirtualMachine::dump_feedback() const {
+    std::string out;
+    for (const auto& [chunk, vector] : feedback_) {
+        std::string name;
+        for (size_t i = 0; i < functions_.size(); ++i) {
+            if (functions_[i] == chunk) {
+                name = "function " + std::to_string(i);
+                break;
+            }
         }
-        std::cout << std::hex << static_cast<int>(stack_[sp_ - dump_size + i]) << " ";
-        if ((i + 1) % 16 == 0) {
-            std::cout << std::dec << std::endl;
+        if (name.empty()) {
+            char buffer[32];
+            std::snprintf(buffer, sizeof(buffer), "chunk@%p", static_cast<const void*>(chunk));
+            name = buffer;
         }
+        out += vector->dump(name);
     }
-    std::cout << std::dec << std::endl;
+    return out;
 }
 
 /**
- * Gets current VM state
- * @return VMState structure with current state
+ * OP_CALL: enters a function from the function table with its arguments
+ * on top of the stack
  */
-VMState VM::get_state() const {
-    VMState state;
-    state.pc = pc_;
-    state.sp = sp_;
-    state.fp = fp_;
-    state.halted = halt_flag_;
-    std::memcpy(state.registers, registers_, sizeof(registers_));
-    return state;
+void VirtualMachine::handle_call(uint8_t function_index, uint8_t argc) {
+    const Chunk* chunk = function(function_index);
+    if (!chunk) {
+        throw VMException("Invalid function index");
+    }
+    push_frame(*chunk, argc);
+}
+
+const Chunk* VirtualMachine::resolve_function(size_t index) const {
+    const Chunk* chunk = function_resolver_(index);
+    functions_[index] = chunk;
+    return chunk;
 }
 
 /**
- * Restores VM state
- * @param state VMState structure to restore
+ * OP_RETURN: discards the callee's frame and leaves its result where the
+ * arguments were
  */
-void VM::set_state(const VMState& state) {
-    pc_ = state.pc;
-    sp_ = state.sp;
-    fp_ = state.fp;
-    halt_flag_ = state.halted;
-    std::memcpy(registers_, state.registers, sizeof(registers_));
+void VirtualMachine::handle_return() {
+    Value result = pop();
+    stack_top_ = frame_base_;
+    
+    // Reports the returning function at the depth its entry probe gave
+    RPLUS_PROBE2(function__return, current_chunk_, frames_.size());
+    const CallFrame& caller = frames_.back();
+    current_chunk_ = caller.chunk;
+    instruction_pointer_ = caller.ip;
+    frame_base_ = caller.base;
+    current_feedback_ = caller.feedback;
+    frames_.pop_back();
+    if (Profiler* profiler = Profiler::current()) {
+        profiler->leave();
+    }
+    
+    push(result);
 }
+
+} // namespace rplus
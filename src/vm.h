@@ -6,12 +6,25 @@
 #include <memory>
 #include <stdexcept>
 #include <array>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
 
 namespace rplus {
 
 // Forward declarations
 class Value;
 class Chunk;
+class VirtualMachine;
+class Object;
+class StringObject;
+class EventLoop;
+class FeedbackVector;
+class OptimizedFunction;
+class TraceJit;
+class CompileJob;
 
 // Bytecode instruction opcodes
 enum class OpCode : uint8_t {
@@ -49,15 +62,33 @@ enum class OpCode : uint8_t {
     OP_JUMP_IF_FALSE = 41,
     OP_JUMP_IF_TRUE = 42,
     OP_LOOP = 43,
+    OP_JUMP_BACK = 44,       // backward jump that is not a loop back edge (see layout.h)
     
     // Function calls
     OP_CALL = 50,
     OP_RETURN = 51,
+    OP_CALL_NATIVE = 52,
     
     // Stack operations
     OP_POP = 60,
     OP_DUP = 61,
     
+    // Specialised instructions, emitted only by the optimising tier (see
+    // optimizer.h). Typed operations assume their operands were checked.
+    OP_GUARD_NUMBERS = 70,   // operand: mask of stack slots (bit 0 = top) that must be numbers
+    OP_ADD_NUMBER = 71,
+    OP_SUBTRACT_NUMBER = 72,
+    OP_MULTIPLY_NUMBER = 73,
+    OP_DIVIDE_NUMBER = 74,   // deoptimises on a zero divisor
+    OP_NEGATE_NUMBER = 75,
+    OP_EQUAL_NUMBER = 76,
+    OP_NOT_EQUAL_NUMBER = 77,
+    OP_LESS_NUMBER = 78,
+    OP_LESS_EQUAL_NUMBER = 79,
+    OP_GREATER_NUMBER = 80,
+    OP_GREATER_EQUAL_NUMBER = 81,
+    OP_INLINE_RETURN = 82,   // operand: inlined frame base; leaves the result there
+    
     // End of execution
     OP_EXIT = 255
 };
@@ -69,24 +100,32 @@ public:
         NIL,
         BOOL,
         NUMBER,
-        STRING
+        STRING,
+        OBJECT
     };
     
     Value();
     explicit Value(bool b);
     explicit Value(double n);
     explicit Value(const std::string& s);
+    explicit Value(std::shared_ptr<const StringObject> s);
+    explicit Value(std::shared_ptr<Object> object);
     
     Type type() const { return type_; }
     
     bool as_bool() const;
     double as_number() const;
-    const std::string& as_string() const;
+    std::string_view as_string() const;
+    const StringObject& as_string_object() const { return *string_value_; }
+    const std::shared_ptr<const StringObject>& string_ref() const { return string_value_; }
+    Object* as_object() const { return object_value_.get(); }
+    const std::shared_ptr<Object>& object_ref() const { return object_value_; }
     
     bool is_nil() const { return type_ == Type::NIL; }
     bool is_bool() const { return type_ == Type::BOOL; }
     bool is_number() const { return type_ == Type::NUMBER; }
     bool is_string() const { return type_ == Type::STRING; }
+    bool is_object() const { return type_ == Type::OBJECT; }
     
     std::string to_string() const;
     bool is_truthy() const;
@@ -96,7 +135,8 @@ private:
     Type type_;
     bool bool_value_;
     double number_value_;
-    std::string string_value_;
+    std::shared_ptr<const StringObject> string_value_;
+    std::shared_ptr<Object> object_value_;
 };
 
 // Bytecode chunk containing instructions and constants
@@ -117,6 +157,11 @@ public:
     int get_line(size_t offset) const;
     
     size_t size() const { return code_.size(); }
+    // Memory the chunk holds: itself, its bytecode, line table and pool
+    size_t memory_bytes() const {
+        return sizeof(Chunk) + code_.size() + lines_.size() * sizeof(int) +
+               constants_.size() * sizeof(Value);
+    }
     void clear();
     
 private:
@@ -125,10 +170,37 @@ private:
     std::vector<int> lines_;
 };
 
+// Host function callable from bytecode. Arguments are read in place from
+// the VM stack: args[0] is the first argument, args[argc - 1] the last.
+using NativeFn = Value (*)(VirtualMachine& vm, const Value* args, uint8_t argc);
+
+struct NativeFunction {
+    std::string name;
+    NativeFn fn;
+    uint8_t arity;
+};
+
+// Saved caller state for an active bytecode call
+struct CallFrame {
+    const Chunk* chunk;
+    size_t ip;
+    size_t base;
+    FeedbackVector* feedback;
+};
+
 // Virtual Machine for bytecode execution
 class VirtualMachine {
 public:
     static constexpr size_t STACK_MAX = 256;
+    static constexpr size_t FRAMES_MAX = 64;
+    // Calls before a function is considered for the optimising tier
+    static constexpr uint32_t TIER_UP_CALLS = 1000;
+    // Deoptimisations after which optimised code is discarded
+    static constexpr uint32_t MAX_DEOPTS = 16;
+    // Optimisation attempts per function
+    static constexpr uint8_t MAX_OPTIMIZATIONS = 3;
+    // Loop iterations in baseline code before on-stack replacement
+    static constexpr uint32_t OSR_BACK_EDGES = 10000;
     
     VirtualMachine();
     ~VirtualMachine();
@@ -136,6 +208,40 @@ public:
     // Execute bytecode
     void execute(const Chunk& chunk);
     
+    // Call a function whose argc arguments are already on the stack and
+    // return its result. Safe to use while the VM is executing (e.g. from
+    // a native function): the callee runs on top of the live stack and
+    // frames, and the caller's state is restored on return or error.
+    // See vm_call<R>() in native.h for the typed wrapper.
+    Value call_function(const Chunk& chunk, uint8_t argc);
+    // Call the function at a function table index with the given
+    // arguments, resolving it at the time of the call. Embeddings whose
+    // bodies can change (see embed.h) route this through the function
+    // caller so the call runs under the module's rules.
+    Value call_function(size_t index, const Value* args, size_t argc);
+    void set_function_caller(std::function<Value(size_t, const Value*, size_t)> caller) {
+        function_caller_ = std::move(caller);
+    }
+    
+    // Functions addressable by OP_CALL's function index operand. A null
+    // entry is filled in from the resolver, if any, on first use; lazily
+    // loaded modules (see image.h) leave functions null until called.
+    void set_function_table(std::vector<const Chunk*> functions) { functions_ = std::move(functions); }
+    void set_function_resolver(std::function<const Chunk*(size_t)> resolver) {
+        function_resolver_ = std::move(resolver);
+    }
+    const Chunk* function(size_t index) const {
+        if (index >= functions_.size()) {
+            return nullptr;
+        }
+        const Chunk* chunk = functions_[index];
+        return chunk || !function_resolver_ ? chunk : resolve_function(index);
+    }
+    
+    // Event loop that runs this VM's timer callbacks (see timer_builtins.h)
+    void set_event_loop(EventLoop* loop) { event_loop_ = loop; }
+    EventLoop* event_loop() const { return event_loop_; }
+    
     // Stack operations
     void push(const Value& value);
     Value pop();
@@ -145,6 +251,7 @@ public:
     // VM state queries
     bool is_running() const { return running_; }
     size_t stack_size() const { return stack_top_; }
+    size_t frame_depth() const { return frames_.size(); }
     
     // Error handling
     void set_error(const std::string& message);
@@ -155,6 +262,48 @@ public:
     void enable_trace(bool enable) { trace_enabled_ = enable; }
     bool is_trace_enabled() const { return trace_enabled_; }
     
+    // Type feedback (see feedback.h). Vectors are created per function on
+    // first entry while enabled and kept until the VM is destroyed.
+    void enable_feedback(bool enable) { feedback_enabled_ = enable; }
+    bool is_feedback_enabled() const { return feedback_enabled_; }
+    const FeedbackVector* feedback(const Chunk& chunk) const;
+    std::string dump_feedback() const;
+    
+    // Optimising tier: functions called TIER_UP_CALLS times are recompiled
+    // from their feedback into specialised bytecode, and frames looping for
+    // OSR_BACK_EDGES iterations switch to it mid-loop. Implies feedback.
+    void enable_tiering(bool enable) {
+        tiering_enabled_ = enable;
+        feedback_enabled_ = feedback_enabled_ || enable;
+    }
+    bool is_tiering_enabled() const { return tiering_enabled_; }
+    // Optimised code installed for a function, or nullptr
+    const OptimizedFunction* optimized(const Chunk& chunk) const;
+    // Optimise on the shared compiler threads (the default) and install the
+    // code at a later safepoint, or synchronously on the calling thread
+    void enable_background_compilation(bool enable) { background_compilation_ = enable; }
+    bool is_background_compilation_enabled() const { return background_compilation_; }
+    // Background compiles not yet installed
+    size_t pending_compiles() const { return compile_jobs_.jobs.size(); }
+    // Forgets everything derived from chunk (feedback, optimised code
+    // built from or inlining it, pending compiles reading it) before its
+    // bytecode is freed or replaced. No frame may be running it.
+    void discard_function(const Chunk& chunk);
+    
+    // Tracing JIT (see trace_jit.h): hot loops are recorded and compiled
+    // to native code. Ignored where unsupported; replaces the optimising
+    // tier while enabled.
+    void enable_trace_jit(bool enable);
+    bool is_trace_jit_enabled() const { return trace_jit_ != nullptr; }
+    const TraceJit* trace_jit() const { return trace_jit_.get(); }
+    
+    // Native functions (see native.h for the typed binding API). A new VM
+    // already has the standard builtins; host natives are numbered after them.
+    uint8_t register_native(const std::string& name, NativeFn fn, uint8_t arity);
+    int find_native(const std::string& name) const;
+    const NativeFunction& native(uint8_t index) const { return natives_[index]; }
+    size_t native_count() const { return natives_.size(); }
+    
 private:
     // Stack management
     std::array<Value, STACK_MAX> stack_;
@@ -167,10 +316,41 @@ private:
     // Bytecode execution
     const Chunk* current_chunk_;
     size_t instruction_pointer_;
+    size_t frame_base_ = 0;
+    std::vector<CallFrame> frames_;
+    mutable std::vector<const Chunk*> functions_;  // filled in lazily by function()
+    std::function<const Chunk*(size_t)> function_resolver_;
+    std::function<Value(size_t, const Value*, size_t)> function_caller_;
+    std::unordered_map<std::string, Value> globals_;
+    EventLoop* event_loop_ = nullptr;
     
     // Debug
     bool trace_enabled_;
     
+    // Type feedback, keyed by function
+    bool feedback_enabled_ = false;
+    FeedbackVector* current_feedback_ = nullptr;
+    std::unordered_map<const Chunk*, std::shared_ptr<FeedbackVector>> feedback_;
+    
+    // Optimising tier. Every optimised function ever installed is kept,
+    // keyed by its code, since frames may still run discarded code.
+    bool tiering_enabled_ = false;
+    std::unordered_map<const Chunk*, std::shared_ptr<OptimizedFunction>> optimized_code_;
+    bool background_compilation_ = true;
+    
+    // Outstanding background compiles, dropped from the queue if the VM goes first
+    struct CompileJobs {
+        std::vector<std::shared_ptr<CompileJob>> jobs;
+        ~CompileJobs();
+    } compile_jobs_;
+    
+    // Tracing JIT
+    std::shared_ptr<TraceJit> trace_jit_;
+    bool trace_recording_ = false;
+    
+    // Native function table, indexed by OP_CALL_NATIVE operand
+    std::vector<NativeFunction> natives_;
+    
     // Instruction handlers
     void execute_instruction(OpCode op);
     void handle_constant(uint8_t index);
@@ -193,11 +373,30 @@ private:
     void handle_jump_if_false(uint16_t offset);
     void handle_jump_if_true(uint16_t offset);
     void handle_loop(uint16_t offset);
+    void handle_call_native(uint8_t index, uint8_t argc);
+    void handle_call(uint8_t function_index, uint8_t argc);
+    void handle_return();
+    
+    // Frame management
+    void push_frame(const Chunk& chunk, uint8_t argc);
+    void run(size_t exit_depth);
     
     // Utility methods
     uint16_t read_short();
     uint8_t read_byte();
     void trace_instruction();
+    const Chunk* resolve_function(size_t index) const;
+    void record_feedback();
+    FeedbackVector* feedback_for(const Chunk& chunk);
+    void tier_up(const Chunk& chunk, FeedbackVector& feedback);
+    void install_optimized(const Chunk& chunk, FeedbackVector& feedback,
+                           std::shared_ptr<OptimizedFunction> optimized);
+    void install_compiled();
+    void deoptimize(size_t offset);
+    void on_stack_replace();
+    void handle_number_op(OpCode op);
+    void record_trace();
+    void run_trace();
     
     // Arithmetic helpers
     void binary_op(OpCode op);
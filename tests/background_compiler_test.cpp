@@ -0,0 +1,55 @@
+// Compile jobs work on their own copies of the bytecode, so they survive
+// the chunk they were taken from; a pool that has shut down completes new
+// jobs at once, and the shared pool stops its threads at exit.
+
+#include <memory>
+#include <vector>
+#include "background_compiler.h"
+#include "check.h"
+#include "feedback.h"
+
+using namespace rplus;
+
+namespace {
+
+std::shared_ptr<CompileJob> make_job() {
+    // f(a) { return a + a }
+    auto chunk = std::make_unique<Chunk>(make_chunk(
+        {op(OpCode::OP_GET_LOCAL), 0, op(OpCode::OP_GET_LOCAL), 0, op(OpCode::OP_ADD),
+         op(OpCode::OP_RETURN)}));
+    FeedbackVector feedback(*chunk);
+    auto job = std::make_shared<CompileJob>(CompilationSnapshot(*chunk, feedback));
+    // The bytecode is copied; chunk goes away before the job runs
+    CHECK(job->snapshot().baseline_code.code() == chunk->code());
+    CHECK(job->snapshot().baseline_code.code().data() != chunk->code().data());
+    return job;
+}
+
+} // namespace
+
+int main() {
+    std::vector<std::shared_ptr<CompileJob>> jobs;
+    {
+        BackgroundCompiler compiler(1);
+        for (int i = 0; i < 64; ++i) {
+            jobs.push_back(make_job());
+            compiler.submit(jobs.back());
+        }
+        compiler.shutdown();
+        CHECK(compiler.queued() == 0);
+        // Whatever had not started is gone; cancelling it never waits
+        compiler.cancel(jobs.back());
+
+        auto late = make_job();
+        compiler.submit(late);
+        CHECK(late->done());
+        CHECK(late->result() == nullptr);
+        compiler.shutdown();
+    }
+
+    // Left queued on the shared pool when main returns
+    for (int i = 0; i < 64; ++i) {
+        BackgroundCompiler::shared().submit(make_job());
+    }
+    return 0;
+}
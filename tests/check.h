@@ -0,0 +1,46 @@
+#ifndef RPLUS_TESTS_CHECK_H
+#define RPLUS_TESTS_CHECK_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <initializer_list>
+#include "vm.h"
+
+// Minimal assertion for the test executables: reports the failing
+// expression and exits non-zero, so ctest marks the test failed
+#define CHECK(condition)                                                          \
+    do {                                                                          \
+        if (!(condition)) {                                                       \
+            std::fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, \
+                         #condition);                                             \
+            std::exit(1);                                                         \
+        }                                                                         \
+    } while (0)
+
+// Bytecode fixture: a chunk with the given code (all on line 1) and
+// constants, and an opcode as a code byte
+inline rplus::Chunk make_chunk(std::initializer_list<uint8_t> code,
+                               std::initializer_list<rplus::Value> constants = {}) {
+    rplus::Chunk chunk;
+    for (uint8_t byte : code) {
+        chunk.write_byte(byte, 1);
+    }
+    for (const rplus::Value& constant : constants) {
+        chunk.write_constant(constant);
+    }
+    return chunk;
+}
+
+inline uint8_t op(rplus::OpCode code) {
+    return static_cast<uint8_t>(code);
+}
+
+// OP_CALL_NATIVE index of the first native a test registers; a new VM
+// already holds the standard builtins
+inline uint8_t first_host_native() {
+    static const size_t builtins = rplus::VirtualMachine().native_count();
+    return static_cast<uint8_t>(builtins);
+}
+
+#endif // RPLUS_TESTS_CHECK_H
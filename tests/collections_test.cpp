@@ -0,0 +1,96 @@
+// Inserting into a Swiss table hashes and probes once, whether the key is
+// new or present; erased slots are reused; iteration keeps insertion
+// order; and the Map and Set builtins store each key once.
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "check.h"
+#include "collections.h"
+#include "rstring.h"
+#include "swiss_table.h"
+
+using namespace rplus;
+
+namespace {
+
+size_t hash_calls = 0;
+
+struct CountingHash {
+    uint64_t operator()(uint64_t key) const {
+        ++hash_calls;
+        return mix_hash(key);
+    }
+};
+
+struct KeyEq {
+    bool operator()(uint64_t a, uint64_t b) const { return a == b; }
+};
+
+Value call(VirtualMachine& vm, const char* name, std::vector<Value> args) {
+    const NativeFunction& native = vm.native(static_cast<uint8_t>(vm.find_native(name)));
+    return native.fn(vm, args.data(), static_cast<uint8_t>(args.size()));
+}
+
+} // namespace
+
+int main() {
+    SwissTable<uint64_t, int, CountingHash, KeyEq> table;
+    for (uint64_t key = 0; key < 1000; ++key) {
+        hash_calls = 0;
+        size_t made = 0;
+        auto [value, inserted] = table.find_or_insert(key, [&]() {
+            ++made;
+            return key;
+        });
+        CHECK(inserted);
+        CHECK(made == 1);
+        CHECK(hash_calls == 1);
+        *value = static_cast<int>(key);
+    }
+    hash_calls = 0;
+    auto [existing, inserted] = table.find_or_insert(7, []() -> uint64_t {
+        CHECK(false);
+        return 0;
+    });
+    CHECK(!inserted && *existing == 7);
+    CHECK(hash_calls == 1);
+
+    // Erased keys leave, and their slots take new keys
+    for (uint64_t key = 0; key < 1000; key += 2) {
+        CHECK(table.erase(key));
+    }
+    CHECK(table.size() == 500);
+    for (uint64_t key = 0; key < 1000; key += 2) {
+        CHECK(table.insert(key + 1000, 1));
+        CHECK(!table.insert(key + 1000, 2));
+    }
+    CHECK(table.size() == 1000);
+    CHECK(table.find(2) == nullptr);
+    CHECK(*table.find(1002) == 2);
+    uint64_t previous = 0;
+    bool ordered = true;
+    table.for_each([&](uint64_t key, int) {
+        ordered = ordered && (key > previous || key == 1);
+        previous = key;
+    });
+    CHECK(ordered);
+
+    // Builtins: overwriting keeps one entry, equal strings are one key
+    VirtualMachine vm;
+    Value map = call(vm, "Map", {});
+    Value key(std::string("name"));
+    call(vm, "mapSet", {map, key, Value(1.0)});
+    call(vm, "mapSet", {map, Value(std::string("na") + "me"), Value(2.0)});
+    CHECK(call(vm, "mapSize", {map}).as_number() == 1.0);
+    CHECK(call(vm, "mapGet", {map, key}).as_number() == 2.0);
+
+    Value set = call(vm, "Set", {});
+    for (int i = 0; i < 3; ++i) {
+        call(vm, "setAdd", {set, Value(std::string("member"))});
+        call(vm, "setAdd", {set, Value(1.0)});
+    }
+    CHECK(call(vm, "setSize", {set}).as_number() == 2.0);
+    CHECK(call(vm, "setHas", {set, Value(std::string("member"))}).as_bool());
+    return 0;
+}
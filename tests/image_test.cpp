@@ -0,0 +1,106 @@
+// Functions load on first call, rewriting an image leaves processes that
+// mapped the old one reading it intact, a file that is not an image is
+// refused, and loading a function rejects code that does not decode into
+// valid instructions.
+
+#include <cstdio>
+#include <string>
+#include <unistd.h>
+#include "check.h"
+#include "image.h"
+
+using namespace rplus;
+
+namespace {
+
+std::string image_path;
+
+// answer() { return value }, main() { return answer() + 1 }
+std::shared_ptr<const CompiledModule> module_returning(double value) {
+    CompiledModule::Builder builder;
+    builder.add_function("answer", make_chunk({op(OpCode::OP_CONSTANT), 0, op(OpCode::OP_RETURN)},
+                                              {Value(value)}));
+    builder.add_function("main", make_chunk({op(OpCode::OP_CALL), 0, 0, op(OpCode::OP_CONSTANT), 0,
+                                             op(OpCode::OP_ADD), op(OpCode::OP_RETURN)},
+                                            {Value(1.0)}));
+    return builder.build();
+}
+
+// Writes a single-function image and reports whether calling it is
+// rejected as corrupt
+bool rejected(Chunk chunk) {
+    CompiledModule::Builder builder;
+    builder.add_function("f", std::move(chunk));
+    CHECK(write_image(*builder.build(), image_path));
+    auto module = load_image(image_path);
+    CHECK(module != nullptr);
+    ExecutionContext ctx(module);
+    try {
+        ctx.invoke(ctx.lookup("f"));
+    } catch (const VMException& e) {
+        return std::string(e.what()).find("Corrupt bytecode image") != std::string::npos;
+    }
+    return false;
+}
+
+} // namespace
+
+int main() {
+    char dir_template[] = "/tmp/rplus-image-XXXXXX";
+    CHECK(::mkdtemp(dir_template) != nullptr);
+    std::string dir = dir_template;
+    image_path = dir + "/module.rpx";
+
+    std::string error;
+    CHECK(write_image(*module_returning(41.0), image_path, &error));
+    auto old_image = load_image(image_path, &error);
+    CHECK(old_image != nullptr);
+    CHECK(!old_image->is_loaded(old_image->lookup("answer")));
+
+    // Replace the file while old_image still maps it and has not loaded
+    // anything; its functions still come from the old contents
+    CHECK(write_image(*module_returning(99.0), image_path, &error));
+    CHECK(::access((image_path + ".tmp").c_str(), F_OK) != 0);
+    ExecutionContext old_ctx(old_image);
+    CHECK(old_ctx.invoke(old_ctx.lookup("main")).as_number() == 42.0);
+    CHECK(old_image->is_loaded(old_image->lookup("answer")));
+    auto new_image = load_image(image_path, &error);
+    CHECK(new_image != nullptr);
+    ExecutionContext new_ctx(new_image);
+    CHECK(new_ctx.invoke(new_ctx.lookup("main")).as_number() == 100.0);
+
+    // A file that is not an image is refused up front
+    std::string garbage_path = dir + "/garbage.rpx";
+    FILE* garbage = std::fopen(garbage_path.c_str(), "wb");
+    CHECK(garbage != nullptr);
+    std::fputs("not an image, just some bytes", garbage);
+    std::fclose(garbage);
+    error.clear();
+    CHECK(load_image(garbage_path, &error) == nullptr);
+    CHECK(!error.empty());
+    ::unlink(garbage_path.c_str());
+
+    // Unknown and specialised opcodes
+    CHECK(rejected(make_chunk({200, op(OpCode::OP_RETURN)})));
+    CHECK(rejected(make_chunk({op(OpCode::OP_GUARD_NUMBERS), 1, op(OpCode::OP_RETURN)})));
+    // Operand past the end of the code
+    CHECK(rejected(make_chunk({op(OpCode::OP_JUMP), 0})));
+    // Constant and function indexes out of range
+    CHECK(rejected(make_chunk({op(OpCode::OP_CONSTANT), 1, op(OpCode::OP_RETURN)}, {Value(1.0)})));
+    CHECK(rejected(make_chunk({op(OpCode::OP_GET_GLOBAL), 0, op(OpCode::OP_RETURN)}, {Value(1.0)})));
+    CHECK(rejected(make_chunk({op(OpCode::OP_CALL), 1, 0, op(OpCode::OP_RETURN)})));
+    // Jumps outside the function or into an operand
+    CHECK(rejected(make_chunk({op(OpCode::OP_JUMP), 0, 5, op(OpCode::OP_RETURN)})));
+    CHECK(rejected(make_chunk({op(OpCode::OP_LOOP), 0, 4, op(OpCode::OP_RETURN)})));
+    CHECK(rejected(make_chunk({op(OpCode::OP_CONSTANT), 0, op(OpCode::OP_LOOP), 0, 4,
+                               op(OpCode::OP_RETURN)},
+                              {Value(1.0)})));
+    // Valid code still loads
+    CHECK(!rejected(make_chunk({op(OpCode::OP_CONSTANT), 0, op(OpCode::OP_JUMP), 0, 0,
+                                op(OpCode::OP_RETURN)},
+                               {Value(1.0)})));
+
+    ::unlink(image_path.c_str());
+    ::rmdir(dir.c_str());
+    return 0;
+}
@@ -0,0 +1,36 @@
+// Every opcode's length covers its operands, including the one-byte
+// operands of the optimising tier's guard and inline return, so walks over
+// bytecode never mistake an operand for an instruction.
+
+#include "check.h"
+#include "feedback.h"
+
+using namespace rplus;
+
+int main() {
+    for (OpCode code : {OpCode::OP_CONSTANT, OpCode::OP_DEFINE_GLOBAL, OpCode::OP_GET_GLOBAL,
+                        OpCode::OP_SET_GLOBAL, OpCode::OP_GET_LOCAL, OpCode::OP_SET_LOCAL,
+                        OpCode::OP_GUARD_NUMBERS, OpCode::OP_INLINE_RETURN}) {
+        CHECK(instruction_length(code) == 2);
+    }
+    for (OpCode code : {OpCode::OP_JUMP, OpCode::OP_JUMP_IF_FALSE, OpCode::OP_JUMP_IF_TRUE,
+                        OpCode::OP_LOOP, OpCode::OP_JUMP_BACK, OpCode::OP_CALL,
+                        OpCode::OP_CALL_NATIVE}) {
+        CHECK(instruction_length(code) == 3);
+    }
+    for (OpCode code : {OpCode::OP_ADD, OpCode::OP_NEGATE, OpCode::OP_RETURN, OpCode::OP_POP,
+                        OpCode::OP_ADD_NUMBER, OpCode::OP_DIVIDE_NUMBER, OpCode::OP_EXIT}) {
+        CHECK(instruction_length(code) == 1);
+    }
+
+    // Operands that happen to equal OP_ADD are not feedback sites
+    uint8_t add = op(OpCode::OP_ADD);
+    Chunk chunk = make_chunk({op(OpCode::OP_GUARD_NUMBERS), add, op(OpCode::OP_INLINE_RETURN), add,
+                              op(OpCode::OP_ADD), op(OpCode::OP_RETURN)});
+    FeedbackVector feedback(chunk);
+    CHECK(feedback.slots().size() == 1);
+    CHECK(feedback.slot(4) != nullptr);
+    CHECK(feedback.slot(1) == nullptr);
+    CHECK(feedback.slot(3) == nullptr);
+    return 0;
+}
@@ -0,0 +1,83 @@
+// Layout stores hot functions first without renumbering them, and a jump
+// it turns backwards is not counted as a loop back edge.
+
+#include <vector>
+#include "check.h"
+#include "embed.h"
+#include "feedback.h"
+#include "layout.h"
+
+using namespace rplus;
+
+namespace {
+
+bool contains(const Chunk& chunk, OpCode wanted) {
+    for (size_t offset = 0; offset < chunk.size();) {
+        OpCode op = static_cast<OpCode>(chunk.get_byte(offset));
+        if (op == wanted) {
+            return true;
+        }
+        offset += instruction_length(op);
+    }
+    return false;
+}
+
+} // namespace
+
+int main() {
+    CompiledModule::Builder builder;
+    // cold() { return 1 }  -- never called
+    builder.add_function("cold", make_chunk({op(OpCode::OP_CONSTANT), 0, op(OpCode::OP_RETURN)},
+                                            {Value(1.0)}));
+    // main() { return hot() + 1 }
+    builder.add_function("main", make_chunk({op(OpCode::OP_CALL), 2, 0, op(OpCode::OP_CONSTANT), 0,
+                                             op(OpCode::OP_ADD), op(OpCode::OP_RETURN)},
+                                            {Value(1.0)}));
+    // hot() { return 41 }
+    builder.add_function("hot", make_chunk({op(OpCode::OP_CONSTANT), 0, op(OpCode::OP_RETURN)},
+                                           {Value(41.0)}));
+    // branchy(x) { return x ? 20 : 10 }, the x branch in the middle
+    builder.add_function("branchy", make_chunk({op(OpCode::OP_GET_LOCAL), 0,
+                                                op(OpCode::OP_JUMP_IF_TRUE), 0, 6,
+                                                op(OpCode::OP_POP), op(OpCode::OP_CONSTANT), 0,
+                                                op(OpCode::OP_JUMP), 0, 3,
+                                                op(OpCode::OP_POP), op(OpCode::OP_CONSTANT), 1,
+                                                op(OpCode::OP_RETURN)},
+                                               {Value(10.0), Value(20.0)}));
+    auto module = builder.build();
+
+    ExecutionContext profiled(module);
+    profiled.vm().enable_feedback(true);
+    for (int i = 0; i < 10; ++i) {
+        CHECK(profiled.invoke(profiled.lookup("main")).as_number() == 42.0);
+    }
+    for (int i = 0; i < 200; ++i) {
+        CHECK(profiled.invoke(profiled.lookup("branchy"), false).as_number() == 10.0);
+    }
+
+    LayoutStats stats;
+    auto laid = layout_module(*module, profiled.vm(), &stats);
+    CHECK(stats.functions == 4);
+    CHECK(stats.functions_split == 1);
+
+    // Hottest first in storage; indexes unchanged
+    CHECK((laid->layout_order() == std::vector<size_t>{3, 1, 2, 0}));
+    CHECK(laid->lookup("cold").index == 0);
+    CHECK(laid->lookup("hot").index == 2);
+    ExecutionContext ctx(laid);
+    CHECK(ctx.invoke(ctx.lookup("main")).as_number() == 42.0);
+    CHECK(ctx.vm().call_function(2, nullptr, 0).as_number() == 41.0);
+
+    // The cold branch now sits last and jumps back to the return
+    const Chunk& branchy = laid->function(laid->lookup("branchy"));
+    CHECK(contains(branchy, OpCode::OP_JUMP_BACK));
+    CHECK(!contains(branchy, OpCode::OP_LOOP));
+    ctx.vm().enable_tiering(true);
+    ctx.vm().enable_background_compilation(false);
+    for (int i = 0; i < 50; ++i) {
+        CHECK(ctx.invoke(ctx.lookup("branchy"), true).as_number() == 20.0);
+    }
+    CHECK(ctx.invoke(ctx.lookup("branchy"), false).as_number() == 10.0);
+    CHECK(ctx.vm().feedback(branchy)->back_edges == 0);
+    return 0;
+}
@@ -0,0 +1,83 @@
+// Linking merges functions that are equal up to the order of their
+// constants, and callers whose calls reach merged functions, but not
+// callers whose identical OP_CALL reaches a different function; the
+// linked modules still run.
+
+#include <string>
+#include "check.h"
+#include "embed.h"
+#include "linker.h"
+
+using namespace rplus;
+
+namespace {
+
+// scale(x) { return x * k + 1 }, with the pool in either order and, when
+// swapped, an unused string that linking drops
+Chunk scale(double k, bool swapped) {
+    if (!swapped) {
+        return make_chunk({op(OpCode::OP_GET_LOCAL), 0, op(OpCode::OP_CONSTANT), 0,
+                           op(OpCode::OP_MULTIPLY), op(OpCode::OP_CONSTANT), 1, op(OpCode::OP_ADD),
+                           op(OpCode::OP_RETURN)},
+                          {Value(k), Value(1.0)});
+    }
+    return make_chunk({op(OpCode::OP_GET_LOCAL), 0, op(OpCode::OP_CONSTANT), 1,
+                       op(OpCode::OP_MULTIPLY), op(OpCode::OP_CONSTANT), 0, op(OpCode::OP_ADD),
+                       op(OpCode::OP_RETURN)},
+                      {Value(1.0), Value(k), Value(std::string("unused"))});
+}
+
+// call(x) { return function[index](x) }
+Chunk call(uint8_t index) {
+    return make_chunk({op(OpCode::OP_GET_LOCAL), 0, op(OpCode::OP_CALL), index, 1,
+                       op(OpCode::OP_RETURN)});
+}
+
+const Chunk* body(const CompiledModule& module, const char* name) {
+    return module.function_address(module.lookup(name));
+}
+
+} // namespace
+
+int main() {
+    CompiledModule::Builder a;
+    a.add_function("times2", scale(2, false));
+    a.add_function("times3", scale(3, false));
+    a.add_function("call", call(0));  // times2
+    CompiledModule::Builder b;
+    b.add_function("times2", scale(2, true));
+    b.add_function("times3", scale(3, true));
+    b.add_function("call", call(0));  // times2
+    CompiledModule::Builder c;
+    c.add_function("times3", scale(3, true));
+    c.add_function("call", call(0));  // times3
+
+    LinkStats stats;
+    auto linked = link_modules({a.build(), b.build(), c.build()}, &stats);
+    CHECK(linked.size() == 3);
+    CHECK(stats.modules == 3);
+    CHECK(stats.functions == 8);
+    CHECK(stats.unique_functions == 4);
+    CHECK(stats.constants == 13);
+    CHECK(stats.unique_constants == 3);
+    CHECK(stats.bytes_after < stats.bytes_before);
+
+    const CompiledModule& la = *linked[0];
+    const CompiledModule& lb = *linked[1];
+    const CompiledModule& lc = *linked[2];
+    CHECK(body(la, "times2") == body(lb, "times2"));
+    CHECK(body(la, "times3") == body(lb, "times3"));
+    CHECK(body(la, "times3") == body(lc, "times3"));
+    CHECK(body(la, "call") == body(lb, "call"));
+    CHECK(body(la, "call") != body(lc, "call"));
+    CHECK(lb.function(lb.lookup("times2")).constants().size() == 2);
+
+    ExecutionContext ca(linked[0]);
+    ExecutionContext cb(linked[1]);
+    ExecutionContext cc(linked[2]);
+    CHECK(ca.invoke(ca.lookup("call"), 5.0).as_number() == 11.0);
+    CHECK(cb.invoke(cb.lookup("call"), 5.0).as_number() == 11.0);
+    CHECK(cc.invoke(cc.lookup("call"), 5.0).as_number() == 16.0);
+    CHECK(cb.invoke(cb.lookup("times3"), 5.0).as_number() == 16.0);
+    return 0;
+}
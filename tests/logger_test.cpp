@@ -0,0 +1,76 @@
+// Records from several threads are all written once flushed, arguments are
+// formatted into their placeholders (a null C string as an empty one),
+// records below the level are skipped, and scripts log through log().
+
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+#include "check.h"
+#include "logger.h"
+
+using namespace rplus;
+
+namespace {
+
+size_t count(const std::string& text, const std::string& needle) {
+    size_t found = 0;
+    for (size_t at = text.find(needle); at != std::string::npos; at = text.find(needle, at + 1)) {
+        ++found;
+    }
+    return found;
+}
+
+} // namespace
+
+int main() {
+    std::FILE* output = std::tmpfile();
+    CHECK(output != nullptr);
+    Logger& logger = Logger::instance();
+    logger.set_output(output);
+
+    const char* missing = nullptr;
+    RPLUS_LOG(LogLevel::INFO, "values {} {} {} {} [{}]", 42, -7, 3.5, "str", missing);
+    RPLUS_LOG(LogLevel::DEBUG, "hidden");
+    RPLUS_LOG(LogLevel::WARN, "extra", std::string("a"), true);
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([t]() {
+            for (int i = 0; i < 100; ++i) {
+                RPLUS_LOG(LogLevel::INFO, "thread {} record {}", t, i);
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    VirtualMachine vm;
+    const NativeFunction& log = vm.native(static_cast<uint8_t>(vm.find_native("log")));
+    const Value args[] = {Value(std::string("error")), Value(std::string("from script"))};
+    log.fn(vm, args, log.arity);
+
+    logger.flush();
+    logger.set_output(stderr);
+    CHECK(logger.dropped() == 0);
+
+    std::string text;
+    std::rewind(output);
+    char buffer[4096];
+    size_t n;
+    while ((n = std::fread(buffer, 1, sizeof(buffer), output)) > 0) {
+        text.append(buffer, n);
+    }
+    std::fclose(output);
+
+    CHECK(text.find("INFO  logger_test.cpp:") != std::string::npos);
+    CHECK(text.find("values 42 -7 3.5 str []\n") != std::string::npos);
+    CHECK(text.find("hidden") == std::string::npos);
+    CHECK(text.find("WARN ") != std::string::npos);
+    CHECK(text.find("extra a true\n") != std::string::npos);
+    CHECK(count(text, " record ") == 400);
+    CHECK(text.find("thread 3 record 99\n") != std::string::npos);
+    CHECK(text.find("ERROR from script\n") != std::string::npos);
+    return 0;
+}
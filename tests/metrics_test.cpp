@@ -0,0 +1,54 @@
+// Histograms expose the same bucket bounds on every scrape, and a value
+// equal to a bound counts towards it.
+
+#include <string>
+#include <vector>
+#include "check.h"
+#include "metrics.h"
+
+using namespace rplus;
+
+namespace {
+
+// The le="..." labels of name's buckets, in order
+std::vector<std::string> bounds(const std::string& scrape, const std::string& name) {
+    std::vector<std::string> out;
+    std::string prefix = name + "_bucket{le=\"";
+    for (size_t at = scrape.find(prefix); at != std::string::npos; at = scrape.find(prefix, at + 1)) {
+        size_t start = at + prefix.size();
+        out.push_back(scrape.substr(start, scrape.find('"', start) - start));
+    }
+    return out;
+}
+
+bool has_line(const std::string& scrape, const std::string& line) {
+    return scrape.find(line + "\n") != std::string::npos;
+}
+
+} // namespace
+
+int main() {
+    MetricsRegistry registry;
+    Histogram& sizes = registry.histogram("test_sizes", "Sizes");
+
+    std::vector<std::string> empty = bounds(registry.scrape(), "test_sizes");
+    CHECK(!empty.empty());
+    CHECK(empty.front() == "1");
+    CHECK(empty.back() == "+Inf");
+
+    sizes.record(4);
+    sizes.record(5);
+    std::string first = registry.scrape();
+    CHECK(bounds(first, "test_sizes") == empty);
+    CHECK(has_line(first, "test_sizes_bucket{le=\"1\"} 0"));
+    CHECK(has_line(first, "test_sizes_bucket{le=\"4\"} 1"));
+    CHECK(has_line(first, "test_sizes_bucket{le=\"16\"} 2"));
+
+    sizes.record(1u << 30);
+    std::string second = registry.scrape();
+    CHECK(bounds(second, "test_sizes") == empty);
+    CHECK(has_line(second, "test_sizes_bucket{le=\"16\"} 2"));
+    CHECK(has_line(second, "test_sizes_bucket{le=\"+Inf\"} 3"));
+    CHECK(has_line(second, "test_sizes_count 3"));
+    return 0;
+}
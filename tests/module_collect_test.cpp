@@ -0,0 +1,72 @@
+// A collection requested while the module is running is carried out once
+// the running invoke() finishes, and a module left over budget by a
+// collection is collected again.
+
+#include <memory>
+#include "check.h"
+#include "embed.h"
+
+using namespace rplus;
+
+namespace {
+
+class Source : public CompiledModule::FunctionSource {
+public:
+    Chunk load(size_t index) const override {
+        if (index == 0) {
+            // run() { request_collect(); return 1 }
+            return make_chunk({op(OpCode::OP_CALL_NATIVE), first_host_native(), 0, op(OpCode::OP_POP),
+                               op(OpCode::OP_CONSTANT), 0, op(OpCode::OP_RETURN)},
+                              {Value(1.0)});
+        }
+        // idle() { return 2 }
+        return make_chunk({op(OpCode::OP_CONSTANT), 0, op(OpCode::OP_RETURN)}, {Value(2.0)});
+    }
+};
+
+const CompiledModule* current_module = nullptr;
+bool collect_requested = false;
+size_t flushed_while_running = 0;
+
+Value request_collect(VirtualMachine& /*vm*/, const Value* /*args*/, uint8_t /*argc*/) {
+    if (collect_requested) {
+        flushed_while_running += current_module->collect(1);
+    }
+    return Value();
+}
+
+} // namespace
+
+int main() {
+    auto module = CompiledModule::lazy({"run", "idle"}, std::make_unique<Source>());
+    current_module = module.get();
+    ExecutionContext ctx(module);
+    CHECK(ctx.vm().register_native("request_collect", &request_collect, 0) == first_host_native());
+    FunctionHandle run = ctx.lookup("run");
+    FunctionHandle idle = ctx.lookup("idle");
+
+    CHECK(ctx.invoke(idle).as_number() == 2.0);
+    CHECK(module->collect() == 0);
+    module->set_memory_budget(module->loaded_bytes());
+
+    // Loading run() takes the module over budget. The collection asked for
+    // from inside run() cannot happen then; it runs as invoke() returns
+    // and flushes idle(), which went unused for an epoch.
+    uint64_t epoch = module->epoch();
+    collect_requested = true;
+    CHECK(ctx.invoke(run).as_number() == 1.0);
+    collect_requested = false;
+    CHECK(flushed_while_running == 0);
+    CHECK(module->epoch() == epoch + 1);
+    CHECK(!module->is_loaded(idle));
+    CHECK(module->is_loaded(run));
+
+    // run() has not been idle long enough to flush, so the module stays
+    // over budget and the next invoke() collects again
+    module->set_memory_budget(1);
+    CHECK(module->collect() == 0);
+    epoch = module->epoch();
+    CHECK(ctx.invoke(run).as_number() == 1.0);
+    CHECK(module->epoch() == epoch + 1);
+    return 0;
+}
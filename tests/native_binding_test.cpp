@@ -0,0 +1,67 @@
+// Integer arguments convert exactly or not at all, and vm_call leaves the
+// stack as it found it when an argument fails to convert.
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include "check.h"
+#include "native.h"
+
+using namespace rplus;
+
+namespace {
+
+struct Unconvertible {};
+
+template <typename T>
+bool rejects(double n) {
+    try {
+        ValueTraits<T>::from_value(Value(n));
+    } catch (const VMException&) {
+        return true;
+    }
+    return false;
+}
+
+} // namespace
+
+namespace rplus {
+
+template <>
+struct ValueTraits<Unconvertible> {
+    static Value to_value(Unconvertible) { throw VMException("not convertible"); }
+};
+
+} // namespace rplus
+
+int main() {
+    CHECK(ValueTraits<int32_t>::from_value(Value(-7.0)) == -7);
+    CHECK(ValueTraits<int64_t>::from_value(Value(-9223372036854775808.0)) == INT64_MIN);
+    CHECK(ValueTraits<uint8_t>::from_value(Value(255.0)) == 255);
+
+    CHECK(rejects<int32_t>(std::nan("")));
+    CHECK(rejects<int32_t>(std::numeric_limits<double>::infinity()));
+    CHECK(rejects<int64_t>(-std::numeric_limits<double>::infinity()));
+    CHECK(rejects<int32_t>(1.5));
+    CHECK(rejects<int32_t>(2147483648.0));
+    CHECK(rejects<int64_t>(9223372036854775808.0));
+    CHECK(rejects<uint8_t>(256.0));
+    CHECK(rejects<uint32_t>(-1.0));
+    try {
+        ValueTraits<uint16_t>::from_value(Value(true));
+        CHECK(false);
+    } catch (const VMException& e) {
+        CHECK(std::string(e.what()).find("uint16_t") != std::string::npos);
+    }
+
+    VirtualMachine vm;
+    Chunk unused;
+    vm.push(Value(1.0));
+    try {
+        vm_call(vm, unused, 2.0, 3.0, Unconvertible{});
+        CHECK(false);
+    } catch (const VMException&) {
+    }
+    CHECK(vm.stack_size() == 1);
+    return 0;
+}
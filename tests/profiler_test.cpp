@@ -0,0 +1,81 @@
+// Call counts are exact, inclusive time covers self time, the call graph
+// is written in callgrind format, and unwinding drops abandoned frames.
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include "check.h"
+#include "embed.h"
+#include "profiler.h"
+
+using namespace rplus;
+
+int main() {
+    CompiledModule::Builder builder;
+    // main() { leaf(); leaf(); leaf(); return 0 }
+    builder.add_function("main", make_chunk({op(OpCode::OP_CALL), 1, 0, op(OpCode::OP_POP),
+                                             op(OpCode::OP_CALL), 1, 0, op(OpCode::OP_POP),
+                                             op(OpCode::OP_CALL), 1, 0, op(OpCode::OP_POP),
+                                             op(OpCode::OP_CONSTANT), 0, op(OpCode::OP_RETURN)},
+                                            {Value(0.0)}));
+    // leaf() { return 1 }
+    builder.add_function("leaf", make_chunk({op(OpCode::OP_CONSTANT), 0, op(OpCode::OP_RETURN)},
+                                            {Value(1.0)}));
+    auto module = builder.build();
+    ExecutionContext ctx(module);
+
+    Profiler profiler;
+    profiler.name_functions(*module);
+    CHECK(profiler.start());
+    CHECK(Profiler::current() == &profiler);
+    Profiler other;
+    CHECK(!other.start());
+    for (int i = 0; i < 2; ++i) {
+        CHECK(ctx.invoke(ctx.lookup("main")).as_number() == 0.0);
+    }
+    CHECK(profiler.depth() == 0);
+    profiler.stop();
+    CHECK(Profiler::current() == nullptr);
+
+    uint64_t main_calls = 0;
+    uint64_t leaf_calls = 0;
+    for (const Profiler::FunctionStats& stats : profiler.functions()) {
+        CHECK(stats.inclusive_ns >= stats.self_ns);
+        if (stats.name == "main") {
+            main_calls = stats.calls;
+        } else if (stats.name == "leaf") {
+            leaf_calls = stats.calls;
+        }
+    }
+    CHECK(main_calls == 2);
+    CHECK(leaf_calls == 6);
+
+    char path[] = "/tmp/rplus-callgrind-XXXXXX";
+    int fd = ::mkstemp(path);
+    CHECK(fd >= 0);
+    ::close(fd);
+    CHECK(profiler.write_callgrind(path));
+    std::ifstream in(path);
+    std::stringstream text;
+    text << in.rdbuf();
+    ::unlink(path);
+    CHECK(text.str().find("events: Nanoseconds\n") != std::string::npos);
+    CHECK(text.str().find(" main\n") != std::string::npos);
+    CHECK(text.str().find(" leaf\n") != std::string::npos);
+    CHECK(text.str().find("calls=6 0\n") != std::string::npos);
+
+    // Frames abandoned by an exception are popped back to the saved depth
+    profiler.reset();
+    CHECK(profiler.start());
+    profiler.enter(1);
+    size_t depth = profiler.depth();
+    profiler.enter(2);
+    profiler.enter(3);
+    profiler.unwind(depth);
+    CHECK(profiler.depth() == 1);
+    profiler.leave();
+    profiler.stop();
+    CHECK(profiler.functions().size() == 3);
+    return 0;
+}
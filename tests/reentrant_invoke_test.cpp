@@ -0,0 +1,50 @@
+// A native calling invoke() on the context that is running it gets the
+// callee's result and leaves the running call's stack and frames intact.
+
+#include "check.h"
+#include "embed.h"
+
+using namespace rplus;
+
+namespace {
+
+ExecutionContext* context = nullptr;
+size_t depth_before = 0;
+size_t depth_after = 0;
+
+// reenter(x) { return twice(x * 10) }, through the context
+Value reenter(VirtualMachine& vm, const Value* args, uint8_t /*argc*/) {
+    depth_before = vm.frame_depth();
+    Value result = context->invoke(context->lookup("twice"), args[0].as_number() * 10);
+    depth_after = vm.frame_depth();
+    return result;
+}
+
+} // namespace
+
+int main() {
+    CompiledModule::Builder builder;
+    // outer(x) { return reenter(x) + x }
+    builder.add_function("outer", make_chunk({op(OpCode::OP_GET_LOCAL), 0,
+                                              op(OpCode::OP_CALL_NATIVE), first_host_native(), 1,
+                                              op(OpCode::OP_GET_LOCAL), 0, op(OpCode::OP_ADD),
+                                              op(OpCode::OP_RETURN)}));
+    // twice(y) { return y + y }
+    builder.add_function("twice", make_chunk({op(OpCode::OP_GET_LOCAL), 0, op(OpCode::OP_GET_LOCAL), 0,
+                                              op(OpCode::OP_ADD), op(OpCode::OP_RETURN)}));
+    auto module = builder.build();
+
+    ExecutionContext ctx(module);
+    context = &ctx;
+    CHECK(ctx.vm().register_native("reenter", &reenter, 1) == first_host_native());
+
+    CHECK(ctx.invoke(ctx.lookup("outer"), 2.0).as_number() == 42.0);
+    CHECK(depth_before == 1);
+    CHECK(depth_after == depth_before);
+    CHECK(ctx.vm().stack_size() == 0);
+
+    // The context is still usable from the top level
+    CHECK(ctx.invoke(ctx.lookup("twice"), 4.0).as_number() == 8.0);
+    CHECK(ctx.invoke(ctx.lookup("outer"), 1.0).as_number() == 21.0);
+    return 0;
+}
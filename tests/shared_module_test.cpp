@@ -0,0 +1,93 @@
+// One CompiledModule shared by several threads, each invoking it through
+// its own ExecutionContext. Meant to be run under ThreadSanitizer too
+// (configure with -DRPLUS_TEST_TSAN=ON).
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "check.h"
+#include "embed.h"
+
+using namespace rplus;
+
+namespace {
+
+constexpr int THREADS = 8;
+constexpr int CALLS = 2000;
+
+// square(x) { return x * x }
+Chunk square() {
+    return make_chunk({op(OpCode::OP_GET_LOCAL), 0, op(OpCode::OP_GET_LOCAL), 0,
+                       op(OpCode::OP_MULTIPLY), op(OpCode::OP_RETURN)});
+}
+
+// sum_squares(a, b) { return square(a) + square(b) }
+Chunk sum_squares() {
+    return make_chunk({op(OpCode::OP_GET_LOCAL), 0, op(OpCode::OP_CALL), 0, 1,
+                       op(OpCode::OP_GET_LOCAL), 1, op(OpCode::OP_CALL), 0, 1,
+                       op(OpCode::OP_ADD), op(OpCode::OP_RETURN)});
+}
+
+class Source : public CompiledModule::FunctionSource {
+public:
+    Chunk load(size_t index) const override {
+        loads.fetch_add(1, std::memory_order_relaxed);
+        return index == 0 ? square() : sum_squares();
+    }
+    mutable std::atomic<int> loads{0};
+};
+
+// Every thread gets its own context and checks every result
+void run_contexts(const std::shared_ptr<const CompiledModule>& module) {
+    std::atomic<int> failures{0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREADS; ++t) {
+        threads.emplace_back([&module, &failures, t] {
+            ExecutionContext ctx(module);
+            FunctionHandle fn = ctx.lookup("sum_squares");
+            for (int i = 0; i < CALLS; ++i) {
+                double a = t;
+                double b = i;
+                Value result = ctx.invoke(fn, a, b);
+                if (!result.is_number() || result.as_number() != a * a + b * b) {
+                    failures.fetch_add(1, std::memory_order_relaxed);
+                }
+                // Leave gaps in which a collection can take the module
+                std::this_thread::yield();
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    CHECK(failures.load() == 0);
+}
+
+} // namespace
+
+int main() {
+    CompiledModule::Builder builder;
+    builder.add_function("square", square());
+    builder.add_function("sum_squares", sum_squares());
+    run_contexts(builder.build());
+
+    // Lazily loaded, over budget on every call, with a collector flushing
+    // bodies that the contexts are about to run again
+    auto source = std::make_unique<Source>();
+    const Source& counts = *source;
+    auto lazy = CompiledModule::lazy({"square", "sum_squares"}, std::move(source));
+    lazy->set_memory_budget(1);
+    std::atomic<bool> done{false};
+    std::thread collector([&lazy, &done] {
+        while (!done.load(std::memory_order_relaxed)) {
+            lazy->collect(0);
+            std::this_thread::yield();
+        }
+    });
+    run_contexts(lazy);
+    done.store(true, std::memory_order_relaxed);
+    collector.join();
+    CHECK(counts.loads.load() >= 2);
+    return 0;
+}
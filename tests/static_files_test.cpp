@@ -0,0 +1,125 @@
+// Responses larger than a non-blocking socket's buffer are finished with
+// resume(), the cache evicts the least recently served file, and symbolic
+// links below the root cannot serve files outside it.
+
+#include <fcntl.h>
+#include <poll.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "check.h"
+#include "static_files.h"
+
+using namespace rplus;
+
+namespace {
+
+void write_file(const std::string& path, size_t size, char fill) {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK(fd >= 0);
+    std::string data(size, fill);
+    CHECK(::write(fd, data.data(), data.size()) == static_cast<ssize_t>(data.size()));
+    ::close(fd);
+}
+
+// Serves path on a non-blocking socket pair, reading the other end
+// whenever the handler reports WOULD_BLOCK; returns the bytes received
+size_t serve_nonblocking(StaticFileHandler& handler, const std::string& path,
+                         StaticFileHandler::Status& status) {
+    int fds[2];
+    CHECK(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    int buffer = 4096;
+    ::setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+    ::fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    ::fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+    size_t received = 0;
+    char chunk[65536];
+    auto drain = [&] {
+        ssize_t n;
+        while ((n = ::read(fds[1], chunk, sizeof(chunk))) > 0) {
+            received += static_cast<size_t>(n);
+        }
+    };
+
+    StaticFileHandler::Transfer transfer;
+    status = handler.serve(fds[0], path, "", transfer);
+    int blocked = 0;
+    while (status == StaticFileHandler::Status::WOULD_BLOCK) {
+        CHECK(transfer.pending());
+        ++blocked;
+        drain();
+        struct pollfd writable = {fds[0], POLLOUT, 0};
+        CHECK(::poll(&writable, 1, 1000) == 1);
+        status = handler.resume(fds[0], transfer);
+    }
+    CHECK(!transfer.pending());
+    CHECK(blocked > 0);
+    drain();
+    ::close(fds[0]);
+    ::close(fds[1]);
+    return received;
+}
+
+} // namespace
+
+int main() {
+    char root_template[] = "/tmp/rplus-static-XXXXXX";
+    CHECK(::mkdtemp(root_template) != nullptr);
+    std::string root = root_template;
+    write_file(root + "/large.bin", 1 << 20, 'l');
+    write_file(root + "/small.txt", 60 * 1024, 's');
+    write_file(root + "/a.txt", 100, 'a');
+    write_file(root + "/b.txt", 200, 'b');
+    write_file(root + "/c.txt", 300, 'c');
+
+    StaticFileHandler::Options options;
+    options.max_cache_bytes = 500;
+    StaticFileHandler handler(root, options);
+
+    // Streamed with sendfile, then from the cache with writev
+    StaticFileHandler::Status status;
+    size_t received = serve_nonblocking(handler, "/large.bin", status);
+    CHECK(status == StaticFileHandler::Status::OK);
+    CHECK(received > (1u << 20));
+    received = serve_nonblocking(handler, "/small.txt", status);
+    CHECK(status == StaticFileHandler::Status::OK);
+    CHECK(received > 60 * 1024);
+
+    // a, b, a, c: c needs room, and b is the least recently served
+    int fds[2];
+    CHECK(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    for (const char* path : {"/a.txt", "/b.txt", "/a.txt", "/c.txt"}) {
+        CHECK(handler.serve(fds[0], path, "") == StaticFileHandler::Status::OK);
+        char sink[1024];
+        while (::recv(fds[1], sink, sizeof(sink), MSG_DONTWAIT) > 0) {
+        }
+    }
+    CHECK(handler.cached_bytes() == 400);
+
+    // Links to a file and to a directory outside the root
+    char outside_template[] = "/tmp/rplus-outside-XXXXXX";
+    CHECK(::mkdtemp(outside_template) != nullptr);
+    std::string outside = outside_template;
+    write_file(outside + "/secret.txt", 10, 'x');
+    CHECK(::symlink((outside + "/secret.txt").c_str(), (root + "/secret.txt").c_str()) == 0);
+    CHECK(::symlink(outside.c_str(), (root + "/escape").c_str()) == 0);
+    CHECK(::mkdir((root + "/sub").c_str(), 0755) == 0);
+    write_file(root + "/sub/d.txt", 10, 'd');
+    CHECK(handler.serve(fds[0], "/secret.txt", "") == StaticFileHandler::Status::NOT_FOUND);
+    CHECK(handler.serve(fds[0], "/escape/secret.txt", "") == StaticFileHandler::Status::NOT_FOUND);
+    CHECK(handler.serve(fds[0], "/sub//d.txt", "") == StaticFileHandler::Status::OK);
+    ::close(fds[0]);
+    ::close(fds[1]);
+
+    for (const char* name : {"/large.bin", "/small.txt", "/a.txt", "/b.txt", "/c.txt",
+                             "/secret.txt", "/escape", "/sub/d.txt"}) {
+        ::unlink((root + name).c_str());
+    }
+    ::rmdir((root + "/sub").c_str());
+    ::rmdir(root.c_str());
+    ::unlink((outside + "/secret.txt").c_str());
+    ::rmdir(outside.c_str());
+    return 0;
+}
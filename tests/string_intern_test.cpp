@@ -0,0 +1,67 @@
+// Interned strings are unique per contents while alive and leave the table
+// when released; hashing an empty string never touches its data.
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "check.h"
+#include "rstring.h"
+
+using namespace rplus;
+
+int main() {
+    CHECK(hash_bytes(nullptr, 0) == hash_bytes("", 0));
+
+    StringTable& table = StringTable::global();
+    size_t before = table.size();
+    {
+        auto a = table.intern("key");
+        auto b = table.intern(std::string("k") + "ey");
+        CHECK(a == b);
+        CHECK(a->is_interned());
+        CHECK(table.size() == before + 1);
+
+        // Not interned until passed through the table
+        auto plain = std::make_shared<const StringObject>(std::string("key"));
+        CHECK(!plain->is_interned());
+        CHECK(table.intern(plain) == a);
+        CHECK(table.intern(a) == a);
+
+        // Ill-formed input is interned in its repaired form
+        auto repaired = table.intern("a\xff");
+        CHECK(repaired->view() == "a\xef\xbf\xbd");
+        CHECK(table.intern("a\xef\xbf\xbd") == repaired);
+    }
+    CHECK(table.size() == before);
+
+    // Threads interning the same few strings always agree
+    std::vector<std::shared_ptr<const StringObject>> first(8);
+    std::vector<std::thread> threads;
+    bool agreed[8] = {};
+    for (int t = 0; t < 8; ++t) {
+        threads.emplace_back([&, t] {
+            agreed[t] = true;
+            for (int i = 0; i < 10000; ++i) {
+                std::string name = "s" + std::to_string(i % 16);
+                auto str = table.intern(name);
+                if (str->view() != name) {
+                    agreed[t] = false;
+                }
+                if (i == 0) {
+                    first[t] = str;
+                }
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    for (int t = 0; t < 8; ++t) {
+        CHECK(agreed[t]);
+        CHECK(first[t] == first[0]);
+    }
+    first.clear();
+    CHECK(table.size() == before);
+    return 0;
+}
@@ -0,0 +1,44 @@
+// decodeURIComponent rejects escapes that decode to ill-formed UTF-8
+// instead of repairing them, and a failed decode leaves the output as it
+// was.
+
+#include <string>
+#include "check.h"
+#include "text_codec.h"
+
+using namespace rplus;
+
+namespace {
+
+bool decodes(const char* in, std::string& out) {
+    out.clear();
+    return decode_uri_component(in, out);
+}
+
+} // namespace
+
+int main() {
+    std::string out;
+    CHECK(decodes("a%20b", out) && out == "a b");
+    CHECK(decodes("%E2%82%AC%F0%9F%98%80", out) && out == "\xe2\x82\xac\xf0\x9f\x98\x80");
+
+    CHECK(!decodes("%zz", out));
+    CHECK(!decodes("%4", out));
+    CHECK(!decodes("%C3", out));           // truncated sequence
+    CHECK(!decodes("%E2%82", out));
+    CHECK(!decodes("%80", out));           // lone continuation byte
+    CHECK(!decodes("%C0%AF", out));        // overlong '/'
+    CHECK(!decodes("%ED%A0%80", out));     // surrogate
+    CHECK(!decodes("%F4%90%80%80", out));  // above U+10FFFF
+
+    // Only the decoded bytes are checked, not what out already held
+    out = "\xff";
+    CHECK(decode_uri_component("ok", out) && out == "\xffok");
+
+    // Nothing of a failed decode is left appended
+    out = "kept";
+    CHECK(!decode_uri_component("abc%zz", out) && out == "kept");
+    CHECK(!decode_uri_component("abc%4", out) && out == "kept");
+    CHECK(!decode_uri_component("abc%C3", out) && out == "kept");
+    return 0;
+}
@@ -0,0 +1,98 @@
+// The optimising tier: a hot function is recompiled with its callee
+// inlined and returns what the baseline did, a guard that fails sends the
+// frame back to baseline code, and a single long-running call switches to
+// optimised code mid-loop through on-stack replacement.
+
+#include "check.h"
+#include "feedback.h"
+#include "optimizer.h"
+
+using namespace rplus;
+
+namespace {
+
+// sum(n) { s = 0; for (i = 0; i < n; i = i + 1) s = s + square(i); return s }
+Chunk sum_of_squares() {
+    return make_chunk({op(OpCode::OP_CONSTANT), 0, op(OpCode::OP_CONSTANT), 0,
+                       // 4: loop condition
+                       op(OpCode::OP_GET_LOCAL), 1, op(OpCode::OP_GET_LOCAL), 0, op(OpCode::OP_LESS),
+                       op(OpCode::OP_JUMP_IF_FALSE), 0, 23, op(OpCode::OP_POP),
+                       op(OpCode::OP_GET_LOCAL), 2, op(OpCode::OP_GET_LOCAL), 1,
+                       op(OpCode::OP_CALL), 1, 1, op(OpCode::OP_ADD), op(OpCode::OP_SET_LOCAL), 2,
+                       op(OpCode::OP_POP),
+                       op(OpCode::OP_GET_LOCAL), 1, op(OpCode::OP_CONSTANT), 1, op(OpCode::OP_ADD),
+                       op(OpCode::OP_SET_LOCAL), 1, op(OpCode::OP_POP),
+                       op(OpCode::OP_LOOP), 0, 31,
+                       // 35: exit
+                       op(OpCode::OP_POP), op(OpCode::OP_GET_LOCAL), 2, op(OpCode::OP_RETURN)},
+                      {Value(0.0), Value(1.0)});
+}
+
+double expected_sum(double n) {
+    return (n - 1) * n * (2 * n - 1) / 6;
+}
+
+} // namespace
+
+int main() {
+    Chunk sum = sum_of_squares();
+    // square(x) { return x * x }
+    Chunk square = make_chunk({op(OpCode::OP_GET_LOCAL), 0, op(OpCode::OP_GET_LOCAL), 0,
+                               op(OpCode::OP_MULTIPLY), op(OpCode::OP_RETURN)});
+    // is_one(x) { return x == 1 }
+    Chunk is_one = make_chunk({op(OpCode::OP_GET_LOCAL), 0, op(OpCode::OP_CONSTANT), 0,
+                               op(OpCode::OP_EQUAL), op(OpCode::OP_RETURN)},
+                              {Value(1.0)});
+    // check(x) { return is_one(x) }
+    Chunk check = make_chunk({op(OpCode::OP_GET_LOCAL), 0, op(OpCode::OP_CALL), 2, 1,
+                              op(OpCode::OP_RETURN)});
+
+    // Hot function: optimised after TIER_UP_CALLS calls, with square inlined
+    {
+        VirtualMachine vm;
+        vm.set_function_table({&sum, &square, &is_one, &check});
+        vm.enable_tiering(true);
+        vm.enable_background_compilation(false);
+        for (uint32_t i = 0; i < VirtualMachine::TIER_UP_CALLS + 10; ++i) {
+            vm.push(Value(200.0));
+            CHECK(vm.call_function(sum, 1).as_number() == expected_sum(200));
+        }
+        const OptimizedFunction* optimized = vm.optimized(sum);
+        CHECK(optimized != nullptr);
+        CHECK(optimized->inlined_calls() == 1);
+        CHECK(optimized->guard_count() > 0);
+        CHECK(vm.stack_size() == 0);
+
+        // Specialised for numbers; a boolean fails the guard and the call
+        // finishes in baseline code with the baseline's answer
+        for (uint32_t i = 0; i < VirtualMachine::TIER_UP_CALLS + 10; ++i) {
+            vm.push(Value(1.0));
+            CHECK(vm.call_function(check, 1).as_bool());
+        }
+        CHECK(vm.optimized(check) != nullptr);
+        CHECK(vm.optimized(check)->deopts == 0);
+        vm.push(Value(true));
+        CHECK(!vm.call_function(check, 1).as_bool());
+        CHECK(vm.frame_depth() == 0);
+        CHECK(vm.stack_size() == 0);
+        const OptimizedFunction* after = vm.optimized(check);
+        CHECK(after == nullptr || after->deopts == 1);
+        vm.push(Value(1.0));
+        CHECK(vm.call_function(check, 1).as_bool());
+    }
+
+    // One long call: after OSR_BACK_EDGES iterations the loop carries on
+    // in optimised code, where the baseline's feedback sites no longer run
+    const double n = 4 * VirtualMachine::OSR_BACK_EDGES;
+    VirtualMachine vm;
+    vm.set_function_table({&sum, &square});
+    vm.enable_tiering(true);
+    vm.enable_background_compilation(false);
+    vm.push(Value(n));
+    CHECK(vm.call_function(sum, 1).as_number() == expected_sum(n));
+    CHECK(vm.optimized(sum) != nullptr);
+    const FeedbackSlot* condition = vm.feedback(sum)->slot(8);
+    CHECK(condition != nullptr);
+    CHECK(condition->hits == VirtualMachine::OSR_BACK_EDGES);
+    return 0;
+}
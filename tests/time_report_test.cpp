@@ -0,0 +1,64 @@
+// Nested passes form a tree merged by name, flat passes attach to the
+// innermost nested pass whatever their own depth, and passes outside a
+// started report record nothing.
+
+#include "check.h"
+#include "time_report.h"
+
+using namespace rplus;
+
+namespace {
+
+// A tree walk timing each level as a flat pass
+void walk(int depth) {
+    PassTimer timer("visit", PassTimer::FLAT);
+    detail::count_allocation(8);
+    if (depth > 0) {
+        walk(depth - 1);
+    }
+}
+
+} // namespace
+
+int main() {
+    {
+        PassTimer ignored("before start");
+    }
+
+    TimeReport report;
+    CHECK(report.start());
+    {
+        PassTimer compile("compile");
+        for (int i = 0; i < 2; ++i) {
+            PassTimer codegen("codegen");
+            walk(3);
+        }
+        PassTimer optimize("optimize");
+    }
+    report.stop();
+    CHECK(!report.active());
+
+    const TimeReport::Pass& root = report.root();
+    CHECK(root.children.size() == 1);
+    const TimeReport::Pass& compile = *root.children[0];
+    CHECK(compile.name == "compile");
+    CHECK(compile.children.size() == 2);
+
+    const TimeReport::Pass& codegen = *compile.children[0];
+    CHECK(codegen.name == "codegen");
+    CHECK(codegen.calls == 2);
+    CHECK(codegen.allocations == 8);
+    CHECK(codegen.allocated_bytes == 64);
+    CHECK(codegen.children.size() == 1);
+    const TimeReport::Pass& visit = *codegen.children[0];
+    CHECK(visit.name == "visit");
+    CHECK(visit.calls == 8);
+    CHECK(visit.children.empty());
+    CHECK(visit.allocations == 8);
+    CHECK(visit.total_ns == visit.self_ns);
+
+    CHECK(compile.children[1]->name == "optimize");
+    CHECK(compile.allocations == 8);
+    CHECK(report.format().find("  codegen") != std::string::npos);
+    return 0;
+}
@@ -0,0 +1,61 @@
+// setTimeout accepts only exact integer function indexes and clamps any
+// delay; clearTimeout treats a value that cannot be a timer id as unknown.
+
+#include <cmath>
+#include <limits>
+#include "check.h"
+#include "event_loop.h"
+
+using namespace rplus;
+
+namespace {
+
+VirtualMachine* machine = nullptr;
+
+Value call(const char* name, double a, double b = 0) {
+    const Value args[] = {Value(a), Value(b)};
+    const NativeFunction& native = machine->native(static_cast<uint8_t>(machine->find_native(name)));
+    return native.fn(*machine, args, native.arity);
+}
+
+bool rejects_index(double index) {
+    try {
+        call("setTimeout", index, 0);
+    } catch (const VMException&) {
+        return true;
+    }
+    return false;
+}
+
+} // namespace
+
+int main() {
+    const double nan = std::nan("");
+    const double inf = std::numeric_limits<double>::infinity();
+
+    Chunk callback = make_chunk({op(OpCode::OP_CONSTANT), 0, op(OpCode::OP_RETURN)}, {Value(1.0)});
+    VirtualMachine vm;
+    machine = &vm;
+    vm.set_function_table({&callback});
+    EventLoop loop;
+    vm.set_event_loop(&loop);
+
+    CHECK(rejects_index(nan));
+    CHECK(rejects_index(inf));
+    CHECK(rejects_index(-1.0));
+    CHECK(rejects_index(0.5));
+    CHECK(rejects_index(1e300));
+    CHECK(rejects_index(1.0));
+
+    for (double delay : {nan, inf, -inf, -5.0, 0.25, 1e300}) {
+        CHECK(call("setTimeout", 0.0, delay).as_number() > 0);
+    }
+
+    for (double id : {nan, inf, -1.0, 0.0, 1.5, 1e300}) {
+        CHECK(!call("clearTimeout", id).as_bool());
+    }
+    double id = call("setTimeout", 0.0, 1e300).as_number();
+    CHECK(call("clearTimeout", id).as_bool());
+    CHECK(!call("clearTimeout", id).as_bool());
+    return 0;
+}
@@ -0,0 +1,69 @@
+// A setTimeout callback whose body is flushed before the timer fires runs
+// the reloaded body.
+
+#include <atomic>
+#include <memory>
+#include "check.h"
+#include "embed.h"
+#include "event_loop.h"
+
+using namespace rplus;
+
+namespace {
+
+// Native indexes, set before anything is loaded
+uint8_t set_timeout = 0;
+uint8_t record_native = 0;
+
+class Source : public CompiledModule::FunctionSource {
+public:
+    Chunk load(size_t index) const override {
+        if (index == 0) {
+            // start() { return setTimeout(tick, 0) }
+            return make_chunk({op(OpCode::OP_CONSTANT), 0, op(OpCode::OP_CONSTANT), 1,
+                               op(OpCode::OP_CALL_NATIVE), set_timeout, 2, op(OpCode::OP_RETURN)},
+                              {Value(1.0), Value(0.0)});
+        }
+        tick_loads.fetch_add(1, std::memory_order_relaxed);
+        // tick() { return record(5) }
+        return make_chunk({op(OpCode::OP_CONSTANT), 0, op(OpCode::OP_CALL_NATIVE), record_native, 1,
+                           op(OpCode::OP_RETURN)},
+                          {Value(5.0)});
+    }
+    mutable std::atomic<int> tick_loads{0};
+};
+
+double recorded = 0;
+
+Value record(VirtualMachine& /*vm*/, const Value* args, uint8_t /*argc*/) {
+    recorded = args[0].as_number();
+    return Value();
+}
+
+} // namespace
+
+int main() {
+    auto source = std::make_unique<Source>();
+    const Source& counts = *source;
+    auto module = CompiledModule::lazy({"start", "tick"}, std::move(source));
+    ExecutionContext ctx(module);
+    EventLoop loop;
+    ctx.vm().set_event_loop(&loop);
+    CHECK(ctx.vm().find_native("setTimeout") >= 0);
+    set_timeout = static_cast<uint8_t>(ctx.vm().find_native("setTimeout"));
+    record_native = ctx.vm().register_native("record", &record, 1);
+
+    CHECK(ctx.invoke(ctx.lookup("start")).is_number());
+    CHECK(counts.tick_loads.load() == 1);
+
+    // Flush everything before the timer fires
+    module->set_memory_budget(1);
+    CHECK(module->collect(0) == 2);
+    CHECK(!module->is_loaded(ctx.lookup("tick")));
+
+    loop.run();
+    CHECK(!ctx.vm().has_error());
+    CHECK(recorded == 5.0);
+    CHECK(counts.tick_loads.load() == 2);
+    return 0;
+}
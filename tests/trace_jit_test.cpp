@@ -0,0 +1,72 @@
+// A hot loop is recorded and compiled, and with its branch flipping half
+// way through (a side exit, then a side trace) it computes exactly what
+// the interpreter does, leaving the stack as it found it.
+
+#include "check.h"
+#include "trace_jit.h"
+
+using namespace rplus;
+
+namespace {
+
+// f(n) { s = 0; for (i = 0; i < n; i = i + 1) { if (i * 3 < n) s = s + i * i; else s = s - i / 2 } return s }
+Chunk branchy_loop() {
+    return make_chunk({op(OpCode::OP_CONSTANT), 0, op(OpCode::OP_CONSTANT), 0,
+                       // 4: loop condition
+                       op(OpCode::OP_GET_LOCAL), 1, op(OpCode::OP_GET_LOCAL), 0, op(OpCode::OP_LESS),
+                       op(OpCode::OP_JUMP_IF_FALSE), 0, 50, op(OpCode::OP_POP),
+                       // 13: branch condition
+                       op(OpCode::OP_GET_LOCAL), 1, op(OpCode::OP_CONSTANT), 2, op(OpCode::OP_MULTIPLY),
+                       op(OpCode::OP_GET_LOCAL), 0, op(OpCode::OP_LESS),
+                       op(OpCode::OP_JUMP_IF_FALSE), 0, 15, op(OpCode::OP_POP),
+                       op(OpCode::OP_GET_LOCAL), 2, op(OpCode::OP_GET_LOCAL), 1, op(OpCode::OP_GET_LOCAL), 1,
+                       op(OpCode::OP_MULTIPLY), op(OpCode::OP_ADD), op(OpCode::OP_SET_LOCAL), 2,
+                       op(OpCode::OP_POP), op(OpCode::OP_JUMP), 0, 12,
+                       // 39: else
+                       op(OpCode::OP_POP),
+                       op(OpCode::OP_GET_LOCAL), 2, op(OpCode::OP_GET_LOCAL), 1, op(OpCode::OP_CONSTANT), 3,
+                       op(OpCode::OP_DIVIDE), op(OpCode::OP_SUBTRACT), op(OpCode::OP_SET_LOCAL), 2,
+                       op(OpCode::OP_POP),
+                       // 51: increment
+                       op(OpCode::OP_GET_LOCAL), 1, op(OpCode::OP_CONSTANT), 1, op(OpCode::OP_ADD),
+                       op(OpCode::OP_SET_LOCAL), 1, op(OpCode::OP_POP),
+                       op(OpCode::OP_LOOP), 0, 58,
+                       // 62: exit
+                       op(OpCode::OP_POP), op(OpCode::OP_GET_LOCAL), 2, op(OpCode::OP_RETURN)},
+                      {Value(0.0), Value(1.0), Value(3.0), Value(2.0)});
+}
+
+double expected(double n) {
+    double s = 0;
+    for (double i = 0; i < n; i = i + 1) {
+        if (i * 3 < n) {
+            s = s + i * i;
+        } else {
+            s = s - i / 2;
+        }
+    }
+    return s;
+}
+
+} // namespace
+
+int main() {
+    Chunk loop = branchy_loop();
+    VirtualMachine vm;
+    vm.set_function_table({&loop});
+    vm.enable_trace_jit(true);
+    if (!TraceJit::supported()) {
+        CHECK(!vm.is_trace_jit_enabled());
+        return 0;
+    }
+    CHECK(vm.is_trace_jit_enabled());
+
+    for (double n : {10.0, 3000.0, 100000.0, 7.0}) {
+        vm.push(Value(n));
+        CHECK(vm.call_function(loop, 1).as_number() == expected(n));
+        CHECK(vm.stack_size() == 0);
+        CHECK(vm.frame_depth() == 0);
+    }
+    CHECK(vm.trace_jit()->trace_count() >= 2);
+    return 0;
+}
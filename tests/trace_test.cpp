@@ -0,0 +1,71 @@
+// Spans are recorded only while the tracer runs, from every thread under
+// that thread's (escaped) name; invoke() is recorded with the function's
+// name; and flush() hands out each event once.
+
+#include <string>
+#include <thread>
+#include "check.h"
+#include "embed.h"
+#include "trace.h"
+
+using namespace rplus;
+
+namespace {
+
+size_t count(const std::string& text, const std::string& needle) {
+    size_t found = 0;
+    for (size_t at = text.find(needle); at != std::string::npos; at = text.find(needle, at + 1)) {
+        ++found;
+    }
+    return found;
+}
+
+} // namespace
+
+int main() {
+    Tracer& tracer = Tracer::global();
+    {
+        TraceSpan before("vm", "before start");
+        CHECK(!before.active());
+    }
+
+    CompiledModule::Builder builder;
+    builder.add_function("handle", make_chunk({op(OpCode::OP_CONSTANT), 0, op(OpCode::OP_RETURN)},
+                                              {Value(1.0)}));
+    ExecutionContext ctx(builder.build());
+
+    tracer.start();
+    tracer.set_thread_name("main \"isolate\"");
+    {
+        TraceSpan span("compile", "parse");
+        CHECK(span.active());
+    }
+    CHECK(ctx.invoke(ctx.lookup("handle")).as_number() == 1.0);
+    std::thread worker([]() {
+        Tracer::global().set_thread_name("isolate 2");
+        for (int i = 0; i < 3; ++i) {
+            TraceSpan span("event_loop", "iteration");
+        }
+    });
+    worker.join();
+    tracer.stop();
+    {
+        TraceSpan after("vm", "after stop");
+    }
+
+    std::string json = tracer.flush();
+    CHECK(json.rfind("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", 0) == 0);
+    CHECK(json.find("before start") == std::string::npos);
+    CHECK(json.find("after stop") == std::string::npos);
+    CHECK(json.find("\"args\":{\"name\":\"main \\\"isolate\\\"\"}") != std::string::npos);
+    CHECK(json.find("\"args\":{\"name\":\"isolate 2\"}") != std::string::npos);
+    CHECK(count(json, "\"name\":\"parse\",\"cat\":\"compile\",\"ph\":\"X\"") == 1);
+    CHECK(count(json, "\"name\":\"iteration\",\"cat\":\"event_loop\",\"ph\":\"X\"") == 3);
+    CHECK(json.find("\"cat\":\"vm\"") != std::string::npos);
+    CHECK(json.find("\"args\":{\"detail\":\"handle\"}") != std::string::npos);
+
+    // Already handed out; only thread names remain
+    json = tracer.flush();
+    CHECK(json.find("\"ph\":\"X\"") == std::string::npos);
+    return 0;
+}
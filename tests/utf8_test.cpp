@@ -0,0 +1,58 @@
+// repair_utf8 emits one U+FFFD per maximal subpart of an ill-formed
+// sequence, and the vector and scalar validators agree.
+
+#include <string>
+#include "check.h"
+#include "utf8.h"
+
+using namespace rplus;
+
+namespace {
+
+const std::string R = "\xef\xbf\xbd";
+
+std::string repeat(const std::string& s, int count) {
+    std::string out;
+    for (int i = 0; i < count; ++i) {
+        out += s;
+    }
+    return out;
+}
+
+} // namespace
+
+int main() {
+    CHECK(repair_utf8("abc") == "abc");
+    CHECK(repair_utf8("\xf0\x9f\x98\x80") == "\xf0\x9f\x98\x80");
+
+    // A truncated sequence is one subpart
+    CHECK(repair_utf8("\xf0\x9f\x98\x41") == R + "A");
+    CHECK(repair_utf8("\xe2\x82") == R);
+    // Bytes that can never start a sequence are one each
+    CHECK(repair_utf8("\xc0\x80") == repeat(R, 2));
+    CHECK(repair_utf8("\xc1\xbf") == repeat(R, 2));
+    CHECK(repair_utf8("\xf5\x80\x80\x80") == repeat(R, 4));
+    CHECK(repair_utf8("\xff") == R);
+    CHECK(repair_utf8("\x80\x80") == repeat(R, 2));
+    // Second bytes outside the lead byte's range end the subpart at the lead
+    CHECK(repair_utf8("\xe0\x80") == repeat(R, 2));
+    CHECK(repair_utf8("\xe0\x9f\x80") == repeat(R, 3));
+    CHECK(repair_utf8("\xed\xa0\x80") == repeat(R, 3));
+    CHECK(repair_utf8("\xf0\x80\x80\x80") == repeat(R, 4));
+    CHECK(repair_utf8("\xf4\x90\x80\x80") == repeat(R, 4));
+    // ... but are fine at the edges of the range
+    CHECK(repair_utf8("\xe0\xa0\x80\xed\x9f\xbf\xf0\x90\x80\x80\xf4\x8f\xbf\xbf") ==
+          "\xe0\xa0\x80\xed\x9f\xbf\xf0\x90\x80\x80\xf4\x8f\xbf\xbf");
+    // Unicode's example: 61 F1 80 80 E1 80 C2 62 80 63 80 BF 64
+    CHECK(repair_utf8("a\xf1\x80\x80\xe1\x80\xc2" "b\x80" "c\x80\xbf" "d") ==
+          "a" + R + R + R + "b" + R + "c" + R + R + "d");
+
+    // Every repaired string validates, on both the 16-byte and tail paths
+    for (const char* bad : {"\xf0\x9f\x98\x41", "\xc0\x80", "\xe0\x80", "\xed\xa0\x80", "\xff"}) {
+        std::string padded = repeat("x", 15) + bad + repeat("y", 20);
+        CHECK(!validate_utf8(padded.data(), padded.size()));
+        std::string repaired = repair_utf8(padded);
+        CHECK(validate_utf8(repaired.data(), repaired.size()));
+    }
+    return 0;
+}
@@ -0,0 +1,54 @@
+// A native calling back into a function that executes OP_EXIT gets control
+// back with the VM's frames restored, and the exit then stops the caller.
+
+#include "check.h"
+#include "embed.h"
+#include "native.h"
+
+using namespace rplus;
+
+namespace {
+
+const Chunk* exiting = nullptr;
+size_t depth_before = 0;
+size_t depth_after = 0;
+double exit_value = 0;
+
+Value call_exiting(VirtualMachine& vm, const Value* /*args*/, uint8_t /*argc*/) {
+    depth_before = vm.frame_depth();
+    exit_value = vm_call<double>(vm, *exiting);
+    depth_after = vm.frame_depth();
+    return Value(1.0);
+}
+
+} // namespace
+
+int main() {
+    CompiledModule::Builder builder;
+    // exits() { exit 42 }
+    builder.add_function("exits", make_chunk({op(OpCode::OP_CONSTANT), 0, op(OpCode::OP_EXIT)},
+                                             {Value(42.0)}));
+    // main() { call_exiting(); return 7 }  -- the return is never reached
+    builder.add_function("main", make_chunk({op(OpCode::OP_CALL_NATIVE), first_host_native(), 0,
+                                             op(OpCode::OP_CONSTANT), 0, op(OpCode::OP_RETURN)},
+                                            {Value(7.0)}));
+    // identity(x) { return x }
+    builder.add_function("identity", make_chunk({op(OpCode::OP_GET_LOCAL), 0, op(OpCode::OP_RETURN)}));
+    auto module = builder.build();
+
+    ExecutionContext ctx(module);
+    CHECK(ctx.vm().register_native("call_exiting", &call_exiting, 0) == first_host_native());
+    exiting = &module->function(ctx.lookup("exits"));
+
+    Value result = ctx.invoke(ctx.lookup("main"));
+    CHECK(exit_value == 42.0);
+    CHECK(depth_after == depth_before);
+    // The exit propagated: main stopped with the native's result on top
+    CHECK(result.is_number() && result.as_number() == 1.0);
+    CHECK(!ctx.vm().is_running());
+
+    // The VM is intact for the next call
+    CHECK(ctx.invoke(ctx.lookup("identity"), 5.0).as_number() == 5.0);
+    CHECK(ctx.vm().frame_depth() == 0);
+    return 0;
+}